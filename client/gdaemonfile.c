@@ -2671,12 +2671,12 @@ set_metadata_attribute (GFile *file,
                        _("values must be string or list of strings"));
         }
       else if (appended > 0 &&
-               !gvfs_metadata_call_set_sync (proxy,
-                                             metatreefile,
-                                             daemon_file->path,
-                                             g_variant_builder_end (builder),
-                                             cancellable,
-                                             error))
+               !_g_daemon_vfs_set_metadata_sync (proxy,
+                                                 metatreefile,
+                                                 daemon_file->path,
+                                                 g_variant_builder_end (builder),
+                                                 cancellable,
+                                                 error))
         res = FALSE;
 
       g_variant_builder_unref (builder);
@@ -3686,7 +3686,89 @@ g_daemon_file_set_display_name_finish (GFile                      *file,
   return new_file;
 }
 
-#if 0
+typedef struct {
+  GFileInfo *info;
+  GFileQueryInfoFlags flags;
+} AsyncCallSetAttributes;
+
+static void
+async_call_set_attributes_free (AsyncCallSetAttributes *data)
+{
+  g_object_unref (data->info);
+  g_free (data);
+}
+
+static void
+set_attributes_set_status (GFileInfo *info,
+                           GFileAttributeStatus status)
+{
+  char **attributes;
+  int i;
+
+  attributes = g_file_info_list_attributes (info, NULL);
+  for (i = 0; attributes[i] != NULL; i++)
+    g_file_info_set_attribute_status (info, attributes[i], status);
+  g_strfreev (attributes);
+}
+
+static void
+set_attributes_async_thread (GSimpleAsyncResult *res,
+                             GObject *object,
+                             GCancellable *cancellable)
+{
+  AsyncCallSetAttributes *data;
+  GError *error = NULL;
+
+  data = g_simple_async_result_get_op_res_gpointer (res);
+
+  if (!g_file_set_attributes_from_info (G_FILE (object),
+                                        data->info,
+                                        data->flags,
+                                        cancellable,
+                                        &error))
+    g_simple_async_result_take_error (res, error);
+}
+
+static void
+set_attributes_metadata_cb (GObject *source_object,
+                            GAsyncResult *res,
+                            gpointer user_data)
+{
+  GSimpleAsyncResult *result = user_data;
+  AsyncCallSetAttributes *data;
+  GError *error = NULL;
+
+  data = g_simple_async_result_get_op_res_gpointer (result);
+
+  if (_g_daemon_vfs_set_metadata_finish (res, &error))
+    set_attributes_set_status (data->info, G_FILE_ATTRIBUTE_STATUS_SET);
+  else
+    {
+      set_attributes_set_status (data->info, G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING);
+      g_dbus_error_strip_remote_error (error);
+      g_simple_async_result_take_error (result, error);
+    }
+
+  g_simple_async_result_complete (result);
+  g_object_unref (result);
+}
+
+/* Returns TRUE if all the attributes in info are metadata */
+static gboolean
+set_attributes_only_metadata (GFileInfo *info)
+{
+  char **attributes;
+  gboolean res;
+  int i;
+
+  res = TRUE;
+  attributes = g_file_info_list_attributes (info, NULL);
+  for (i = 0; res && attributes[i] != NULL; i++)
+    res = g_str_has_prefix (attributes[i], "metadata::");
+  g_strfreev (attributes);
+
+  return res;
+}
 
 static void
 g_daemon_file_set_attributes_async (GFile                      *file,
@@ -3697,7 +3779,78 @@ g_daemon_file_set_attributes_async (GFile                      *file,
                                     GAsyncReadyCallback         callback,
                                     gpointer                    user_data)
 {
-  /* TODO */
+  GDaemonFile *daemon_file = G_DAEMON_FILE (file);
+  GSimpleAsyncResult *res;
+  AsyncCallSetAttributes *data;
+  GVariantBuilder *builder;
+  GFileAttributeType type;
+  gpointer value;
+  char **attributes;
+  char *treename;
+  MetaTree *tree;
+  int appended, i;
+
+  data = g_new0 (AsyncCallSetAttributes, 1);
+  data->info = g_file_info_dup (info);
+  data->flags = flags;
+
+  res = g_simple_async_result_new (G_OBJECT (file), callback, user_data,
+                                   g_daemon_file_set_attributes_async);
+  g_simple_async_result_set_op_res_gpointer (res, data,
+                                             (GDestroyNotify) async_call_set_attributes_free);
+
+  if (!set_attributes_only_metadata (info))
+    {
+      g_simple_async_result_run_in_thread (res, set_attributes_async_thread,
+                                           io_priority, cancellable);
+      g_object_unref (res);
+      return;
+    }
+
+  /* Only metadata, queue it so that it's sent together with other sets */
+  treename = g_mount_spec_to_string (daemon_file->mount_spec);
+  tree = meta_tree_lookup_by_name (treename, FALSE);
+  g_free (treename);
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
+
+  appended = 0;
+  attributes = g_file_info_list_attributes (info, NULL);
+  for (i = 0; appended != -1 && attributes[i] != NULL; i++)
+    {
+      if (!g_file_info_get_attribute_data (info, attributes[i], &type, &value, NULL))
+        continue;
+
+      appended = _g_daemon_vfs_append_metadata_for_set (builder,
+                                                        tree,
+                                                        daemon_file->path,
+                                                        attributes[i],
+                                                        type,
+                                                        value);
+    }
+  g_strfreev (attributes);
+
+  if (appended == -1)
+    {
+      set_attributes_set_status (data->info, G_FILE_ATTRIBUTE_STATUS_ERROR_SETTING);
+      g_simple_async_result_set_error (res, G_IO_ERROR,
+                                       G_IO_ERROR_INVALID_ARGUMENT,
+                                       _("Error setting file metadata: %s"),
+                                       _("values must be string or list of strings"));
+      g_simple_async_result_complete_in_idle (res);
+      g_object_unref (res);
+    }
+  else
+    _g_daemon_vfs_set_metadata_async (meta_tree_get_filename (tree),
+                                      daemon_file->path,
+                                      g_variant_builder_end (builder),
+                                      io_priority,
+                                      cancellable,
+                                      set_attributes_metadata_cb,
+                                      res);
+
+  g_variant_builder_unref (builder);
+  meta_tree_unref (tree);
 }
 
 static gboolean
@@ -3706,10 +3859,15 @@ g_daemon_file_set_attributes_finish (GFile                      *file,
                                      GFileInfo                 **info,
                                      GError                    **error)
 {
-  /* TODO */
-}
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
+  AsyncCallSetAttributes *data;
 
-#endif
+  data = g_simple_async_result_get_op_res_gpointer (simple);
+  if (info)
+    *info = g_object_ref (data->info);
+
+  return !g_simple_async_result_propagate_error (simple, error);
+}
 
 static void
 g_daemon_file_file_iface_init (GFileIface *iface)
@@ -3788,8 +3946,6 @@ g_daemon_file_file_iface_init (GFileIface *iface)
   iface->replace_finish = g_daemon_file_replace_finish;
   iface->set_display_name_async = g_daemon_file_set_display_name_async;
   iface->set_display_name_finish = g_daemon_file_set_display_name_finish;
-#if 0
   iface->set_attributes_async = g_daemon_file_set_attributes_async;
   iface->set_attributes_finish = g_daemon_file_set_attributes_finish;
-#endif
 }
@@ -66,6 +66,7 @@ struct _GDaemonFileEnumerator
 
   GFileAttributeMatcher *matcher;
   MetaTree *metadata_tree;
+  GHashTable *metadata; /* name -> GFileInfo, loaded on first use */
 };
 
 G_DEFINE_TYPE (GDaemonFileEnumerator, g_daemon_file_enumerator, G_TYPE_FILE_ENUMERATOR)
@@ -139,6 +140,8 @@ g_daemon_file_enumerator_finalize (GObject *object)
   g_file_attribute_matcher_unref (daemon->matcher);
   if (daemon->metadata_tree)
     meta_tree_unref (daemon->metadata_tree);
+  if (daemon->metadata)
+    g_hash_table_destroy (daemon->metadata);
 
   g_clear_object (&daemon->sync_connection);
 
@@ -318,48 +321,35 @@ g_daemon_file_enumerator_new (GFile *file,
   return daemon;
 }
 
-static gboolean
-enumerate_keys_callback (const char *key,
-			 MetaKeyType type,
-			 gpointer value,
-			 gpointer user_data)
-{
-  GFileInfo *info = G_FILE_INFO (user_data);
-  char *attr;
-
-  attr = g_strconcat ("metadata::", key, NULL);
-
-  if (type == META_KEY_TYPE_STRING)
-    g_file_info_set_attribute_string (info, attr, (char *)value);
-  else
-    g_file_info_set_attribute_stringv (info, attr, (char **)value);
-
-  g_free (attr);
-
-  return TRUE;
-}
-
 static void
 add_metadata (GFileInfo *info,
 	      GDaemonFileEnumerator *daemon)
 {
   GFile *container;
-  const char *name;
-  char *path;
+  GFileInfo *metadata;
 
   if (!daemon->metadata_tree)
     return;
 
-  name = g_file_info_get_name (info);
-  container = g_file_enumerator_get_container (G_FILE_ENUMERATOR (daemon));
-  path = g_build_filename (G_DAEMON_FILE (container)->path, name, NULL);
+  /* Load the metadata for the whole directory at once, rather
+     than doing a tree lookup for each file */
+  if (daemon->metadata == NULL)
+    {
+      container = g_file_enumerator_get_container (G_FILE_ENUMERATOR (daemon));
+      daemon->metadata = _g_daemon_vfs_get_dir_metadata (daemon->metadata_tree,
+							 G_DAEMON_FILE (container)->path);
+    }
+
+  metadata = g_hash_table_lookup (daemon->metadata,
+				  g_file_info_get_name (info));
+  if (metadata == NULL)
+    return;
 
   g_file_info_set_attribute_mask (info, daemon->matcher);
-  meta_tree_enumerate_keys (daemon->metadata_tree, path,
-			    enumerate_keys_callback, info);
-  g_file_info_unset_attribute_mask (info);
 
-  g_free (path);
+  _g_daemon_vfs_copy_metadata (metadata, info);
+
+  g_file_info_unset_attribute_mask (info);
 }
 
 static GCancellable *
@@ -1058,6 +1058,126 @@ enumerate_keys_callback (const char *key,
   return TRUE;
 }
 
+static gboolean
+enumerate_dir_keys_callback (const char *entry,
+			     const char *key,
+			     MetaKeyType type,
+			     gpointer value,
+			     gpointer user_data)
+{
+  GHashTable *metadata = user_data;
+  GFileInfo *info;
+
+  info = g_hash_table_lookup (metadata, entry);
+  if (info == NULL)
+    {
+      info = g_file_info_new ();
+      g_hash_table_insert (metadata, g_strdup (entry), info);
+    }
+
+  return enumerate_keys_callback (key, type, value, info);
+}
+
+/* Returns a hash table mapping the names of the children of dir_path
+   to a GFileInfo holding their metadata attributes */
+GHashTable *
+_g_daemon_vfs_get_dir_metadata (MetaTree *tree,
+				const char *dir_path)
+{
+  GHashTable *metadata;
+
+  metadata = g_hash_table_new_full (g_str_hash, g_str_equal,
+				    g_free, g_object_unref);
+  meta_tree_enumerate_dir_keys (tree, dir_path,
+				enumerate_dir_keys_callback,
+				metadata);
+
+  return metadata;
+}
+
+void
+_g_daemon_vfs_copy_metadata (GFileInfo *metadata,
+			     GFileInfo *info)
+{
+  GFileAttributeType type;
+  gpointer value;
+  char **attributes;
+  int i;
+
+  attributes = g_file_info_list_attributes (metadata, "metadata");
+  for (i = 0; attributes[i] != NULL; i++)
+    {
+      if (g_file_info_get_attribute_data (metadata, attributes[i],
+					  &type, &value, NULL))
+	g_file_info_set_attribute (info, attributes[i], type, value);
+    }
+  g_strfreev (attributes);
+}
+
+/* Kept between add_info calls of a local file enumeration */
+typedef struct {
+  /* Metadata for all files in the directory of the last looked up
+     file, loaded when a second file in the same directory is seen */
+  MetaTree *dir_tree;
+  char *dir_path;
+  GHashTable *dir_metadata; /* name -> GFileInfo */
+} LocalMetadataData;
+
+static void
+local_metadata_data_free (LocalMetadataData *data)
+{
+  if (data->dir_tree)
+    meta_tree_unref (data->dir_tree);
+  g_free (data->dir_path);
+  if (data->dir_metadata)
+    g_hash_table_destroy (data->dir_metadata);
+  g_free (data);
+}
+
+/* Returns FALSE if the file has to be looked up on its own */
+static gboolean
+local_metadata_data_add_info (LocalMetadataData *data,
+			      MetaTree *tree,
+			      const char *tree_path,
+			      GFileInfo *info)
+{
+  GFileInfo *metadata;
+  char *dir_path, *name;
+
+  dir_path = g_path_get_dirname (tree_path);
+
+  if (data->dir_tree != tree ||
+      g_strcmp0 (data->dir_path, dir_path) != 0)
+    {
+      /* A query for a single file also ends up here, so don't
+	 load the whole directory until we see another file in it */
+      if (data->dir_tree)
+	meta_tree_unref (data->dir_tree);
+      data->dir_tree = meta_tree_ref (tree);
+      g_free (data->dir_path);
+      data->dir_path = dir_path;
+      if (data->dir_metadata)
+	g_hash_table_destroy (data->dir_metadata);
+      data->dir_metadata = NULL;
+
+      return FALSE;
+    }
+
+  g_free (dir_path);
+
+  if (data->dir_metadata == NULL)
+    data->dir_metadata = _g_daemon_vfs_get_dir_metadata (tree, data->dir_path);
+
+  name = g_path_get_basename (tree_path);
+  metadata = g_hash_table_lookup (data->dir_metadata, name);
+  g_free (name);
+
+  if (metadata != NULL)
+    _g_daemon_vfs_copy_metadata (metadata, info);
+
+  return TRUE;
+}
+
 static void
 g_daemon_vfs_local_file_add_info (GVfs       *vfs,
 				  const char *filename,
@@ -1068,7 +1188,7 @@ g_daemon_vfs_local_file_add_info (GVfs       *vfs,
 				  gpointer    *extra_data,
 				  GDestroyNotify *extra_data_free)
 {
-  MetaLookupCache *cache;
+  LocalMetadataData *data;
   const char *first;
   char *tree_path;
   gboolean all;
@@ -1090,12 +1210,13 @@ g_daemon_vfs_local_file_add_info (GVfs       *vfs,
 
   if (*extra_data == NULL)
     {
-      *extra_data = meta_lookup_cache_new ();
-      *extra_data_free = (GDestroyNotify)meta_lookup_cache_free;
+      data = g_new0 (LocalMetadataData, 1);
+      *extra_data = data;
+      *extra_data_free = (GDestroyNotify)local_metadata_data_free;
     }
-  cache = (MetaLookupCache *)*extra_data;
+  data = (LocalMetadataData *)*extra_data;
 
-  tree = meta_lookup_cache_lookup_path (cache,
+  tree = meta_lookup_cache_lookup_path (meta_lookup_cache_get_default (),
 					filename,
 					device,
 					FALSE,
@@ -1103,8 +1224,9 @@ g_daemon_vfs_local_file_add_info (GVfs       *vfs,
 
   if (tree)
     {
-      meta_tree_enumerate_keys (tree, tree_path,
-				enumerate_keys_callback, info);
+      if (!local_metadata_data_add_info (data, tree, tree_path, info))
+	meta_tree_enumerate_keys (tree, tree_path,
+				  enumerate_keys_callback, info);
       meta_tree_unref (tree);
       g_free (tree_path);
     }
@@ -1218,6 +1340,453 @@ _g_daemon_vfs_get_metadata_proxy (GCancellable *cancellable, GError **error)
   return proxy;
 }
 
+/* Metadata sets are sent to the metadata daemon in SetBatch calls.
+   Synchronous sets that arrive while another one is in progress are
+   sent together once it is done, and asynchronous sets are collected
+   until the main context they were started from is idle. */
+
+typedef struct {
+  char *treefile;
+  char *path;
+  GVariant *data;
+  GError *error;
+  /* For async sets */
+  GSimpleAsyncResult *result;
+  GCancellable *cancellable;
+} MetadataSet;
+
+typedef struct {
+  volatile gint ref_count;
+  GList *sets;
+  gboolean done;
+  GSource *source; /* For async batches */
+} MetadataBatch;
+
+static GMutex metadata_batch_lock;
+static GCond metadata_batch_cond;
+static MetadataBatch *metadata_batch_pending = NULL;
+static gboolean metadata_batch_sending = FALSE;
+static GHashTable *metadata_batch_async = NULL; /* GMainContext -> MetadataBatch */
+
+static MetadataSet *
+metadata_set_new (const char *treefile,
+                  const char *path,
+                  GVariant *data)
+{
+  MetadataSet *set;
+
+  set = g_new0 (MetadataSet, 1);
+  set->treefile = g_strdup (treefile);
+  set->path = g_strdup (path);
+  set->data = g_variant_ref_sink (data);
+
+  return set;
+}
+
+static void
+metadata_set_free (MetadataSet *set)
+{
+  g_free (set->treefile);
+  g_free (set->path);
+  g_variant_unref (set->data);
+  if (set->error)
+    g_error_free (set->error);
+  g_clear_object (&set->result);
+  g_clear_object (&set->cancellable);
+  g_free (set);
+}
+
+static MetadataBatch *
+metadata_batch_new (void)
+{
+  MetadataBatch *batch;
+
+  batch = g_new0 (MetadataBatch, 1);
+  batch->ref_count = 1;
+
+  return batch;
+}
+
+static MetadataBatch *
+metadata_batch_ref (MetadataBatch *batch)
+{
+  g_atomic_int_inc (&batch->ref_count);
+  return batch;
+}
+
+static void
+metadata_batch_unref (MetadataBatch *batch)
+{
+  if (g_atomic_int_dec_and_test (&batch->ref_count))
+    {
+      g_list_free_full (batch->sets, (GDestroyNotify)metadata_set_free);
+      if (batch->source)
+        g_source_unref (batch->source);
+      g_free (batch);
+    }
+}
+
+/* Removes the sets for the treefile of the first set from *sets,
+   moves them to *taken and returns the SetBatch argument for them */
+static GVariant *
+metadata_sets_take_for_treefile (GList **sets,
+                                 GList **taken,
+                                 char **treefile)
+{
+  GVariantBuilder builder;
+  MetadataSet *set;
+  GList *l, *next;
+
+  *treefile = g_strdup (((MetadataSet *)(*sets)->data)->treefile);
+  *taken = NULL;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(aya{sv})"));
+  for (l = *sets; l != NULL; l = next)
+    {
+      next = l->next;
+      set = l->data;
+
+      if (strcmp (set->treefile, *treefile) != 0)
+        continue;
+
+      g_variant_builder_add (&builder, "(^ay@a{sv})", set->path, set->data);
+      *sets = g_list_remove_link (*sets, l);
+      *taken = g_list_concat (*taken, l);
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+/* The daemon applies a SetBatch call as a whole, so if a call with
+   several sets fails, each of them is retried on its own to give every
+   caller the error for its own set */
+static void
+metadata_batch_send_sync (MetadataBatch *batch,
+                          GVfsMetadata *proxy,
+                          GCancellable *cancellable)
+{
+  MetadataSet *set;
+  GList *sets, *taken, *l;
+  GError *error;
+  char *treefile;
+
+  sets = g_list_copy (batch->sets);
+
+  while (sets != NULL)
+    {
+      GVariant *entries;
+
+      entries = metadata_sets_take_for_treefile (&sets, &taken, &treefile);
+      error = NULL;
+      if (!gvfs_metadata_call_set_batch_sync (proxy,
+                                              treefile,
+                                              entries,
+                                              cancellable,
+                                              &error))
+        {
+          if (taken->next == NULL)
+            {
+              set = taken->data;
+              set->error = error;
+            }
+          else
+            {
+              g_error_free (error);
+              for (l = taken; l != NULL; l = l->next)
+                {
+                  set = l->data;
+                  gvfs_metadata_call_set_sync (proxy,
+                                               set->treefile,
+                                               set->path,
+                                               set->data,
+                                               NULL,
+                                               &set->error);
+                }
+            }
+        }
+      g_list_free (taken);
+      g_free (treefile);
+    }
+}
+
+gboolean
+_g_daemon_vfs_set_metadata_sync (GVfsMetadata *proxy,
+                                 const char *treefile,
+                                 const char *path,
+                                 GVariant *data,
+                                 GCancellable *cancellable,
+                                 GError **error)
+{
+  MetadataBatch *batch;
+  MetadataSet *set;
+  gboolean res;
+
+  g_mutex_lock (&metadata_batch_lock);
+
+  if (metadata_batch_pending == NULL)
+    metadata_batch_pending = metadata_batch_new ();
+  batch = metadata_batch_ref (metadata_batch_pending);
+  set = metadata_set_new (treefile, path, data);
+  batch->sets = g_list_append (batch->sets, set);
+
+  while (metadata_batch_sending && !batch->done)
+    g_cond_wait (&metadata_batch_cond, &metadata_batch_lock);
+
+  if (!batch->done)
+    {
+      /* Nothing in progress, send everything that is pending */
+      metadata_batch_pending = NULL;
+      metadata_batch_sending = TRUE;
+      g_mutex_unlock (&metadata_batch_lock);
+
+      /* Only the caller that sends is allowed to cancel the set */
+      metadata_batch_send_sync (batch, proxy,
+                                batch->sets->next == NULL ? cancellable : NULL);
+
+      g_mutex_lock (&metadata_batch_lock);
+      batch->done = TRUE;
+      metadata_batch_sending = FALSE;
+      g_cond_broadcast (&metadata_batch_cond);
+      metadata_batch_unref (batch); /* The pending ref */
+    }
+
+  res = set->error == NULL;
+  if (!res)
+    g_propagate_error (error, g_error_copy (set->error));
+
+  metadata_batch_unref (batch);
+  g_mutex_unlock (&metadata_batch_lock);
+
+  return res;
+}
+
+typedef struct {
+  MetadataBatch *batch;
+  int outstanding;
+} AsyncMetadataBatch;
+
+/* One SetBatch or Set call of an async batch */
+typedef struct {
+  AsyncMetadataBatch *data;
+  GList *sets;
+} AsyncMetadataCall;
+
+static void
+async_metadata_batch_done (AsyncMetadataBatch *data)
+{
+  MetadataSet *set;
+  GList *l;
+
+  for (l = data->batch->sets; l != NULL; l = l->next)
+    {
+      set = l->data;
+
+      if (set->error)
+        g_simple_async_result_set_from_error (set->result, set->error);
+      g_simple_async_result_complete (set->result);
+    }
+
+  metadata_batch_unref (data->batch);
+  g_free (data);
+}
+
+static void
+async_metadata_call_done (AsyncMetadataCall *call)
+{
+  AsyncMetadataBatch *data = call->data;
+
+  g_list_free (call->sets);
+  g_free (call);
+
+  if (--data->outstanding == 0)
+    async_metadata_batch_done (data);
+}
+
+static void
+set_async_cb (GVfsMetadata *proxy,
+              GAsyncResult *res,
+              AsyncMetadataCall *call)
+{
+  MetadataSet *set = call->sets->data;
+
+  gvfs_metadata_call_set_finish (proxy, res, &set->error);
+  async_metadata_call_done (call);
+}
+
+static void
+set_batch_async_cb (GVfsMetadata *proxy,
+                    GAsyncResult *res,
+                    AsyncMetadataCall *call)
+{
+  AsyncMetadataCall *single;
+  MetadataSet *set;
+  GError *error = NULL;
+  GList *l;
+
+  if (!gvfs_metadata_call_set_batch_finish (proxy, res, &error))
+    {
+      if (call->sets->next == NULL)
+        {
+          set = call->sets->data;
+          set->error = error;
+        }
+      else
+        {
+          /* Retry each set on its own, as in metadata_batch_send_sync() */
+          g_error_free (error);
+          for (l = call->sets; l != NULL; l = l->next)
+            {
+              set = l->data;
+
+              single = g_new0 (AsyncMetadataCall, 1);
+              single->data = call->data;
+              single->sets = g_list_prepend (NULL, set);
+              call->data->outstanding++;
+              gvfs_metadata_call_set (proxy,
+                                      set->treefile,
+                                      set->path,
+                                      set->data,
+                                      NULL,
+                                      (GAsyncReadyCallback) set_async_cb,
+                                      single);
+            }
+        }
+    }
+
+  async_metadata_call_done (call);
+}
+
+static gboolean
+send_async_metadata_batch (gpointer user_data)
+{
+  GMainContext *context = user_data;
+  AsyncMetadataBatch *data;
+  AsyncMetadataCall *call;
+  MetadataSet *set;
+  GVfsMetadata *proxy;
+  GVariant *entries;
+  GList *sets, *l;
+  GError *error;
+  char *treefile;
+
+  data = g_new0 (AsyncMetadataBatch, 1);
+
+  g_mutex_lock (&metadata_batch_lock);
+  data->batch = g_hash_table_lookup (metadata_batch_async, context);
+  g_hash_table_steal (metadata_batch_async, context);
+  g_mutex_unlock (&metadata_batch_lock);
+
+  /* Sets cancelled before they were sent are not sent at all */
+  sets = NULL;
+  for (l = data->batch->sets; l != NULL; l = l->next)
+    {
+      set = l->data;
+      if (!g_cancellable_set_error_if_cancelled (set->cancellable, &set->error))
+        sets = g_list_append (sets, set);
+    }
+
+  if (sets == NULL)
+    {
+      async_metadata_batch_done (data);
+      return FALSE;
+    }
+
+  error = NULL;
+  proxy = _g_daemon_vfs_get_metadata_proxy (NULL, &error);
+  if (proxy == NULL)
+    {
+      for (l = sets; l != NULL; l = l->next)
+        {
+          set = l->data;
+          set->error = g_error_copy (error);
+        }
+      g_error_free (error);
+      g_list_free (sets);
+      async_metadata_batch_done (data);
+      return FALSE;
+    }
+
+  /* Hold a reference while calls are started, as they may complete
+     right away */
+  data->outstanding++;
+  while (sets != NULL)
+    {
+      call = g_new0 (AsyncMetadataCall, 1);
+      call->data = data;
+      entries = metadata_sets_take_for_treefile (&sets, &call->sets, &treefile);
+      set = call->sets->data;
+      data->outstanding++;
+      gvfs_metadata_call_set_batch (proxy,
+                                    treefile,
+                                    entries,
+                                    call->sets->next == NULL ? set->cancellable : NULL,
+                                    (GAsyncReadyCallback) set_batch_async_cb,
+                                    call);
+      g_free (treefile);
+    }
+  if (--data->outstanding == 0)
+    async_metadata_batch_done (data);
+
+  return FALSE;
+}
+
+void
+_g_daemon_vfs_set_metadata_async (const char *treefile,
+                                  const char *path,
+                                  GVariant *data,
+                                  int io_priority,
+                                  GCancellable *cancellable,
+                                  GAsyncReadyCallback callback,
+                                  gpointer user_data)
+{
+  MetadataBatch *batch;
+  MetadataSet *set;
+  GMainContext *context;
+
+  set = metadata_set_new (treefile, path, data);
+  set->result = g_simple_async_result_new (NULL, callback, user_data,
+                                           _g_daemon_vfs_set_metadata_async);
+  if (cancellable)
+    set->cancellable = g_object_ref (cancellable);
+
+  context = g_main_context_get_thread_default ();
+  if (context == NULL)
+    context = g_main_context_default ();
+
+  g_mutex_lock (&metadata_batch_lock);
+
+  if (metadata_batch_async == NULL)
+    metadata_batch_async = g_hash_table_new (NULL, NULL);
+
+  batch = g_hash_table_lookup (metadata_batch_async, context);
+  if (batch == NULL)
+    {
+      batch = metadata_batch_new ();
+      g_hash_table_insert (metadata_batch_async, context, batch);
+
+      batch->source = g_idle_source_new ();
+      g_source_set_priority (batch->source, io_priority);
+      g_source_set_callback (batch->source, send_async_metadata_batch, context, NULL);
+      g_source_attach (batch->source, context);
+    }
+  else if (io_priority < g_source_get_priority (batch->source))
+    {
+      /* The batch is sent with the most urgent priority of its sets */
+      g_source_set_priority (batch->source, io_priority);
+    }
+  batch->sets = g_list_append (batch->sets, set);
+
+  g_mutex_unlock (&metadata_batch_lock);
+}
+
+gboolean
+_g_daemon_vfs_set_metadata_finish (GAsyncResult *res,
+                                   GError **error)
+{
+  return !g_simple_async_result_propagate_error (G_SIMPLE_ASYNC_RESULT (res),
+                                                 error);
+}
+
 static gboolean
 g_daemon_vfs_local_file_set_attributes (GVfs       *vfs,
 					const char *filename,
@@ -1227,7 +1796,6 @@ g_daemon_vfs_local_file_set_attributes (GVfs       *vfs,
 					GError    **error)
 {
   GFileAttributeType type;
-  MetaLookupCache *cache;
   const char *metatreefile;
   struct stat statbuf;
   char **attributes;
@@ -1263,8 +1831,7 @@ g_daemon_vfs_local_file_set_attributes (GVfs       *vfs,
 	}
       else
 	{
-	  cache = meta_lookup_cache_new ();
-	  tree = meta_lookup_cache_lookup_path (cache,
+	  tree = meta_lookup_cache_lookup_path (meta_lookup_cache_get_default (),
 						filename,
 						statbuf.st_dev,
 						FALSE,
@@ -1313,12 +1880,12 @@ g_daemon_vfs_local_file_set_attributes (GVfs       *vfs,
                 }
 	      
 	      if (num_set > 0 &&
-	          ! gvfs_metadata_call_set_sync (proxy,
-	                                         metatreefile,
-	                                         tree_path,
-	                                         g_variant_builder_end (builder),
-	                                         NULL,
-	                                         error))
+	          ! _g_daemon_vfs_set_metadata_sync (proxy,
+	                                             metatreefile,
+	                                             tree_path,
+	                                             g_variant_builder_end (builder),
+	                                             NULL,
+	                                             error))
                 {
 	          res = FALSE;
                   error = NULL; /* Don't set further errors */
@@ -1329,7 +1896,6 @@ g_daemon_vfs_local_file_set_attributes (GVfs       *vfs,
 
 	      g_variant_builder_unref (builder);
 	      
-              meta_lookup_cache_free (cache);
               meta_tree_unref (tree);
               g_free (tree_path);
 	    }
@@ -1345,14 +1911,12 @@ static void
 g_daemon_vfs_local_file_removed (GVfs       *vfs,
 				 const char *filename)
 {
-  MetaLookupCache *cache;
   const char *metatreefile;
   MetaTree *tree;
   char *tree_path;
   GVfsMetadata *proxy;
 
-  cache = meta_lookup_cache_new ();
-  tree = meta_lookup_cache_lookup_path (cache,
+  tree = meta_lookup_cache_lookup_path (meta_lookup_cache_get_default (),
 					filename,
 					0,
 					FALSE,
@@ -1378,8 +1942,6 @@ g_daemon_vfs_local_file_removed (GVfs       *vfs,
       meta_tree_unref (tree);
       g_free (tree_path);
     }
-
-  meta_lookup_cache_free (cache);
 }
 
 static void
@@ -1393,7 +1955,7 @@ g_daemon_vfs_local_file_moved (GVfs       *vfs,
   char *tree_path1, *tree_path2;
   GVfsMetadata *proxy;
 
-  cache = meta_lookup_cache_new ();
+  cache = meta_lookup_cache_get_default ();
   tree1 = meta_lookup_cache_lookup_path (cache,
 					 source,
 					 0,
@@ -1435,8 +1997,6 @@ g_daemon_vfs_local_file_moved (GVfs       *vfs,
       meta_tree_unref (tree2);
       g_free (tree_path2);
     }
-
-  meta_lookup_cache_free (cache);
 }
 
 static GIcon *
@@ -75,9 +75,28 @@ int             _g_daemon_vfs_append_metadata_for_set  (GVariantBuilder *builder
 							const char *attribute,
 							GFileAttributeType type,
 							gpointer   value);
+GHashTable *    _g_daemon_vfs_get_dir_metadata         (MetaTree                 *tree,
+							const char               *dir_path);
+void            _g_daemon_vfs_copy_metadata            (GFileInfo                *metadata,
+							GFileInfo                *info);
 
 GVfsMetadata *  _g_daemon_vfs_get_metadata_proxy       (GCancellable             *cancellable,
                                                         GError                  **error);
+gboolean        _g_daemon_vfs_set_metadata_sync        (GVfsMetadata             *proxy,
+                                                        const char               *treefile,
+                                                        const char               *path,
+                                                        GVariant                 *data,
+                                                        GCancellable             *cancellable,
+                                                        GError                  **error);
+void            _g_daemon_vfs_set_metadata_async       (const char               *treefile,
+                                                        const char               *path,
+                                                        GVariant                 *data,
+                                                        int                       io_priority,
+                                                        GCancellable             *cancellable,
+                                                        GAsyncReadyCallback       callback,
+                                                        gpointer                  user_data);
+gboolean        _g_daemon_vfs_set_metadata_finish      (GAsyncResult             *res,
+                                                        GError                  **error);
 
 
 
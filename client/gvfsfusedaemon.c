@@ -50,10 +50,25 @@
 #define GET_FILE_HANDLE(fi)     ((gpointer) (fi)->fh)
 #define SET_FILE_HANDLE(fi, fh) ((fi)->fh = (guint64) (fh))
 
+/* Adjacent writes are coalesced into chunks of up to this size before
+ * they are passed on to the backend */
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+
+/* Filesystem info older than this is refreshed in the background */
+#define FS_INFO_CACHE_TTL_SECS 10
+
+/* Number of directory entries requested from the enumerator at once */
+#define READDIR_BATCH_SIZE 256
+
 typedef struct {
   time_t creation_time;
   char *name;
   GFile *root;
+
+  /* Cached result of the last filesystem info query, see vfs_statfs() */
+  GFileInfo *fs_info;
+  gint64     fs_info_time;
+  gboolean   fs_info_pending;
 } MountRecord;
 
 typedef enum {
@@ -70,8 +85,34 @@ typedef struct {
   FileOp    op;
   gpointer  stream;
   goffset   pos;
+
+  /* Write-back buffer, holds data not yet written to stream */
+  GByteArray *write_buffer;
+  goffset     write_buffer_offset;
+
+  /* Local copy of the file, used for non-sequential writes when
+   * the stream can't seek. Written back on flush. */
+  gint        spill_fd;
+  GFile      *spill_file;
 } FileHandle;
 
+typedef struct {
+  gint             refcount;
+
+  GMutex           mutex;
+  GCond            cond;
+  GFileEnumerator *enumerator;
+  GCancellable    *cancellable;
+  gboolean         opened;
+
+  /* Names of the entries received so far, entry i is at readdir offset i + 2 */
+  GPtrArray       *names;
+  guint            n_consumed;
+  gboolean         pending;
+  gboolean         done;
+  gint             error;
+} DirHandle;
+
 static GThread        *subthread             = NULL;
 static GMainLoop      *subthread_main_loop   = NULL;
 static GVfs           *gvfs                  = NULL;
@@ -93,6 +134,8 @@ static GHashTable     *global_active_fh_map  = NULL;
 static GDBusConnection *dbus_conn            = NULL;
 static guint            daemon_name_watcher;
 
+static void mount_record_invalidate_fs_info (const gchar *path);
+
 /* ------- *
  * Helpers *
  * ------- */
@@ -214,6 +257,7 @@ file_handle_new (const gchar *path)
   g_mutex_init (&file_handle->mutex);
   file_handle->op = FILE_OP_NONE;
   file_handle->path = g_strdup (path);
+  file_handle->spill_fd = -1;
 
   g_hash_table_insert (global_active_fh_map, file_handle, file_handle);
 
@@ -249,10 +293,244 @@ file_handle_unref (FileHandle *file_handle)
     }
 }
 
+static gint
+spill_write (gint fd, const gchar *input_buf, size_t input_buf_size, off_t offset)
+{
+  gsize n_bytes_written = 0;
+
+  while (n_bytes_written < input_buf_size)
+    {
+      gssize res;
+
+      res = pwrite (fd,
+                    input_buf + n_bytes_written,
+                    input_buf_size - n_bytes_written,
+                    offset + n_bytes_written);
+      if (res == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          return -errno;
+        }
+
+      n_bytes_written += res;
+    }
+
+  return n_bytes_written;
+}
+
+static gint
+write_stream_direct (FileHandle *fh, const gchar *input_buf, size_t input_buf_size, off_t offset)
+{
+  GOutputStream *output_stream;
+  gint           n_bytes_written = 0;
+  gint           result          = 0;
+  GError        *error           = NULL;
+
+  debug_print ("write_stream_direct: %d bytes at offset %d.\n", input_buf_size, offset);
+
+  output_stream = fh->stream;
+
+  if (offset != fh->pos)
+    {
+      if (g_seekable_can_seek (G_SEEKABLE (output_stream)))
+        {
+          /* Can seek */
+
+          if (g_seekable_seek (G_SEEKABLE (output_stream), offset, G_SEEK_SET, NULL, &error))
+            {
+              fh->pos = offset;
+            }
+          else
+            {
+              result = -errno_from_error (error);
+              g_error_free (error);
+            }
+        }
+      else
+        {
+          /* Can't seek, and output streams can't skip */
+
+          result = -ENOTSUP;
+        }
+    }
+
+  if (result == 0)
+    {
+      while (n_bytes_written < input_buf_size)
+        {
+          gboolean part_result;
+          gsize    part_bytes_written = 0;
+
+          part_result = g_output_stream_write_all (output_stream,
+                                                   (void *) (input_buf + n_bytes_written),
+                                                   input_buf_size - n_bytes_written,
+                                                   &part_bytes_written,
+                                                   NULL,
+                                                   &error);
+
+          n_bytes_written += part_bytes_written;
+          fh->pos += part_bytes_written;
+
+          if (!part_result)
+            break;
+        }
+
+      result = n_bytes_written;
+
+      if (n_bytes_written < input_buf_size)
+        {
+          if (error)
+            {
+              result = -errno_from_error (error);
+              g_error_free (error);
+            }
+          else
+            {
+              result = -EIO;
+            }
+        }
+      else if (!g_output_stream_flush (output_stream, NULL, &error))
+        {
+          result = -errno_from_error (error);
+          g_error_free (error);
+        }
+    }
+
+  return result;
+}
+
+/* Passes the contents of the write-back buffer on to the stream */
+static gint
+file_handle_write_out_buffer (FileHandle *fh)
+{
+  gint result;
+
+  if (fh->write_buffer == NULL || fh->write_buffer->len == 0)
+    return 0;
+
+  debug_print ("file_handle_write_out_buffer: %d bytes at offset %d.\n",
+               fh->write_buffer->len, fh->write_buffer_offset);
+
+  result = write_stream_direct (fh,
+                                (const gchar *) fh->write_buffer->data,
+                                fh->write_buffer->len,
+                                fh->write_buffer_offset);
+  g_byte_array_set_size (fh->write_buffer, 0);
+
+  return (result < 0 ? result : 0);
+}
+
+/* Replaces the file with the contents of the local copy */
+static gint
+file_handle_write_out_spill (FileHandle *fh)
+{
+  GFileOutputStream *output_stream;
+  GError            *error  = NULL;
+  gchar             *buf;
+  goffset            offset = 0;
+  gint               result = 0;
+
+  if (fh->spill_fd == -1)
+    return 0;
+
+  debug_print ("file_handle_write_out_spill\n");
+
+  output_stream = g_file_replace (fh->spill_file, NULL, FALSE, 0, NULL, &error);
+  if (output_stream == NULL)
+    {
+      result = -errno_from_error (error);
+      g_error_free (error);
+      return result;
+    }
+
+  buf = g_malloc (WRITE_BUFFER_SIZE);
+  while (result == 0)
+    {
+      gssize n_bytes_read;
+
+      n_bytes_read = pread (fh->spill_fd, buf, WRITE_BUFFER_SIZE, offset);
+      if (n_bytes_read == -1)
+        {
+          if (errno != EINTR)
+            result = -errno;
+          continue;
+        }
+      if (n_bytes_read == 0)
+        break;
+
+      if (!g_output_stream_write_all (G_OUTPUT_STREAM (output_stream), buf, n_bytes_read,
+                                      NULL, NULL, &error))
+        {
+          result = -errno_from_error (error);
+          g_clear_error (&error);
+        }
+
+      offset += n_bytes_read;
+    }
+  g_free (buf);
+
+  if (!g_output_stream_close (G_OUTPUT_STREAM (output_stream), NULL, result == 0 ? &error : NULL) &&
+      result == 0)
+    {
+      result = -errno_from_error (error);
+      g_error_free (error);
+    }
+  g_object_unref (output_stream);
+
+  /* Keep the local copy around on failure, so that a later flush can retry */
+  if (result == 0)
+    {
+      close (fh->spill_fd);
+      fh->spill_fd = -1;
+      g_clear_object (&fh->spill_file);
+      fh->op = FILE_OP_NONE;
+
+      mount_record_invalidate_fs_info (fh->path);
+    }
+
+  return result;
+}
+
+static gint
+file_handle_flush_writes (FileHandle *fh)
+{
+  gint result;
+
+  result = file_handle_write_out_buffer (fh);
+  if (result == 0)
+    result = file_handle_write_out_spill (fh);
+
+  return result;
+}
+
+/* Drops writes that haven't reached the backend yet, e.g. because the file
+ * is going away anyway */
 static void
+file_handle_discard_writes (FileHandle *fh)
+{
+  if (fh->write_buffer != NULL)
+    g_byte_array_set_size (fh->write_buffer, 0);
+
+  if (fh->spill_fd != -1)
+    {
+      close (fh->spill_fd);
+      fh->spill_fd = -1;
+      g_clear_object (&fh->spill_file);
+      fh->op = FILE_OP_NONE;
+    }
+}
+
+static gint
 file_handle_close_stream (FileHandle *file_handle)
 {
+  GError *error  = NULL;
+  gint    result;
+
   debug_print ("file_handle_close_stream\n");
+
+  result = file_handle_flush_writes (file_handle);
+
   if (file_handle->stream)
     {
       switch (file_handle->op)
@@ -262,7 +540,13 @@ file_handle_close_stream (FileHandle *file_handle)
           break;
           
         case FILE_OP_WRITE:
-          g_output_stream_close (file_handle->stream, NULL, NULL);
+          if (!g_output_stream_close (file_handle->stream, NULL, &error))
+            {
+              if (result == 0)
+                result = -errno_from_error (error);
+              g_error_free (error);
+            }
+          mount_record_invalidate_fs_info (file_handle->path);
           break;
           
         default:
@@ -273,6 +557,8 @@ file_handle_close_stream (FileHandle *file_handle)
       file_handle->stream = NULL;
       file_handle->op = FILE_OP_NONE;
     }
+
+  return result;
 }
 
 /* Called on hash table removal */
@@ -282,11 +568,99 @@ file_handle_free (FileHandle *file_handle)
   g_hash_table_remove (global_active_fh_map, file_handle);
 
   file_handle_close_stream (file_handle);
+  file_handle_discard_writes (file_handle);
+  if (file_handle->write_buffer != NULL)
+    g_byte_array_free (file_handle->write_buffer, TRUE);
   g_mutex_clear (&file_handle->mutex);
   g_free (file_handle->path);
   g_free (file_handle);
 }
 
+/* Switches the file handle to writing to a local copy of the file. Used
+ * when the stream can't seek to the offset of a write. */
+static gint
+file_handle_start_spill (GFile *file, FileHandle *fh)
+{
+  GFileInputStream *input_stream;
+  GError           *error  = NULL;
+  gchar            *tmp_path;
+  gchar            *buf;
+  goffset           offset = 0;
+  gint              fd;
+  gint              result;
+
+  debug_print ("file_handle_start_spill\n");
+
+  fd = g_file_open_tmp ("gvfsd-fuse-XXXXXX", &tmp_path, &error);
+  if (fd == -1)
+    {
+      debug_print ("file_handle_start_spill: %s\n", error->message);
+      g_error_free (error);
+      return -EIO;
+    }
+  unlink (tmp_path);
+  g_free (tmp_path);
+
+  /* Commit what was written so far, and fetch the result */
+  result = file_handle_close_stream (fh);
+  if (result != 0)
+    {
+      close (fd);
+      return result;
+    }
+
+  input_stream = g_file_read (file, NULL, &error);
+  if (input_stream == NULL)
+    {
+      /* Nothing to copy if the file doesn't exist (yet) */
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        result = -errno_from_error (error);
+      g_error_free (error);
+    }
+  else
+    {
+      buf = g_malloc (WRITE_BUFFER_SIZE);
+      while (result == 0)
+        {
+          gssize n_bytes_read;
+
+          n_bytes_read = g_input_stream_read (G_INPUT_STREAM (input_stream), buf,
+                                              WRITE_BUFFER_SIZE, NULL, &error);
+          if (n_bytes_read < 0)
+            {
+              result = -errno_from_error (error);
+              g_error_free (error);
+              break;
+            }
+          if (n_bytes_read == 0)
+            break;
+
+          result = spill_write (fd, buf, n_bytes_read, offset);
+          if (result > 0)
+            result = 0;
+
+          offset += n_bytes_read;
+        }
+      g_free (buf);
+
+      g_input_stream_close (G_INPUT_STREAM (input_stream), NULL, NULL);
+      g_object_unref (input_stream);
+    }
+
+  if (result != 0)
+    {
+      close (fd);
+      return result;
+    }
+
+  fh->spill_fd = fd;
+  fh->spill_file = g_object_ref (file);
+  fh->op = FILE_OP_WRITE;
+  fh->pos = offset;
+
+  return 0;
+}
+
 static FileHandle *
 get_file_handle_for_path (const gchar *path)
 {
@@ -380,6 +754,9 @@ mount_record_new (GMount *mount)
   mount_record->root = g_mount_get_root (mount);
   mount_record->name = g_strdup (g_object_get_data (G_OBJECT (mount), "g-stable-name"));
   mount_record->creation_time = time (NULL);
+  mount_record->fs_info = NULL;
+  mount_record->fs_info_time = 0;
+  mount_record->fs_info_pending = FALSE;
   
   return mount_record;
 }
@@ -387,6 +764,7 @@ mount_record_new (GMount *mount)
 static void
 mount_record_free (MountRecord *mount_record)
 {
+  g_clear_object (&mount_record->fs_info);
   g_object_unref (mount_record->root);
   g_free (mount_record->name);
   g_free (mount_record);
@@ -444,32 +822,88 @@ mount_record_for_mount_exists (GMount *mount)
   return res;
 }
 
+/* Must be called with the mount list locked */
+static MountRecord *
+mount_record_find_by_mount_name (const gchar *mount_name)
+{
+  GList *l;
+
+  g_assert (mount_name != NULL);
+
+  for (l = mount_list; l != NULL; l = l->next)
+    {
+      MountRecord *mount_record = l->data;
+
+      if (strcmp (mount_name, mount_record->name) == 0)
+        return mount_record;
+    }
+
+  return NULL;
+}
+
 static GFile *
 mount_record_find_root_by_mount_name (const gchar *mount_name)
 {
-  GList       *l;
+  MountRecord *mount_record;
   GFile *root;
 
-  g_assert (mount_name != NULL);
-
   root = NULL;
   
   mount_list_lock ();
 
-  for (l = mount_list; l != NULL; l = l->next)
-    {
-      MountRecord *mount_record = l->data;
+  mount_record = mount_record_find_by_mount_name (mount_name);
+  if (mount_record)
+    root = g_object_ref (mount_record->root);
 
-      if (strcmp (mount_name, mount_record->name) == 0)
+  mount_list_unlock ();
+
+  return root;
+}
+
+static void
+mount_record_set_fs_info (const gchar *mount_name, GFileInfo *fs_info)
+{
+  MountRecord *mount_record;
+
+  mount_list_lock ();
+
+  mount_record = mount_record_find_by_mount_name (mount_name);
+  if (mount_record)
+    {
+      /* On failure, keep serving the old info until the next refresh */
+      if (fs_info)
         {
-          root = g_object_ref (mount_record->root);
-          break;
+          g_clear_object (&mount_record->fs_info);
+          mount_record->fs_info = g_object_ref (fs_info);
         }
+      mount_record->fs_info_time = g_get_monotonic_time ();
+      mount_record->fs_info_pending = FALSE;
     }
 
   mount_list_unlock ();
+}
 
-  return root;
+static void
+fs_info_refresh_cb (GObject      *source_object,
+                    GAsyncResult *res,
+                    gpointer      user_data)
+{
+  gchar     *mount_name = user_data;
+  GFileInfo *fs_info;
+  GError    *error = NULL;
+
+  fs_info = g_file_query_filesystem_info_finish (G_FILE (source_object), res, &error);
+  if (fs_info == NULL)
+    {
+      debug_print ("fs_info_refresh_cb: %s\n", error->message);
+      g_error_free (error);
+    }
+
+  mount_record_set_fs_info (mount_name, fs_info);
+
+  if (fs_info)
+    g_object_unref (fs_info);
+  g_free (mount_name);
 }
 
 static void
@@ -581,35 +1015,52 @@ path_is_mount_list (const gchar *path)
 }
 
 
+/* Returns the mount name part of path, and the rest of it in rel_path */
+static gchar *
+mount_name_from_full_path (const gchar *path, const gchar **rel_path)
+{
+  const gchar *s1, *s2;
+
+  s1 = path;
+  while (*s1 == '/')
+    s1++;
+  
+  if (*s1 == 0)
+    return NULL;
+
+  s2 = strchr (s1, '/');
+  if (s2 == NULL)
+    s2 = s1 + strlen (s1);
+
+  if (rel_path)
+    {
+      *rel_path = s2;
+      while (**rel_path == '/')
+        (*rel_path)++;
+    }
+
+  return g_strndup (s1, s2 - s1);
+}
+
 static GFile *
 file_from_full_path (const gchar *path)
 {
   gchar *mount_name;
   GFile *file = NULL;
-  const gchar *s1, *s2;
+  const gchar *rel_path;
   GFile *root;
 
   file = NULL;
   
-  s1 = path;
-  while (*s1 == '/')
-    s1++;
-  
-  if (*s1)
+  mount_name = mount_name_from_full_path (path, &rel_path);
+  if (mount_name)
     {
-      s2 = strchr (s1, '/');
-      if (s2 == NULL)
-        s2 = s1 + strlen (s1);
-      
-      mount_name = g_strndup (s1, s2 - s1);
       root = mount_record_find_root_by_mount_name (mount_name);
       g_free (mount_name);
       
       if (root)
         {
-          while (*s2 == '/')
-            s2++;
-          file = g_file_resolve_relative_path (root, s2);
+          file = g_file_resolve_relative_path (root, rel_path);
           g_object_unref (root);
         }
     }
@@ -617,16 +1068,52 @@ file_from_full_path (const gchar *path)
   return file;
 }
 
+/* Makes the next vfs_statfs() on the mount of path refresh the cached
+ * filesystem info, e.g. after a write or delete changed the free space */
+static void
+mount_record_invalidate_fs_info (const gchar *path)
+{
+  MountRecord *mount_record;
+  gchar *mount_name;
+
+  mount_name = mount_name_from_full_path (path, NULL);
+  if (mount_name == NULL)
+    return;
+
+  mount_list_lock ();
+
+  mount_record = mount_record_find_by_mount_name (mount_name);
+  if (mount_record)
+    mount_record->fs_info_time = 0;
+
+  mount_list_unlock ();
+
+  g_free (mount_name);
+}
+
 /* ------------- *
  * VFS functions *
  * ------------- */
 
+static void
+statfs_from_fs_info (struct statvfs *stbuf, GFileInfo *file_info)
+{
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_FILESYSTEM_SIZE))
+    stbuf->f_blocks = (g_file_info_get_attribute_uint64 (file_info, G_FILE_ATTRIBUTE_FILESYSTEM_SIZE) + 4096 - 1) / 4096;
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_FILESYSTEM_FREE))
+    stbuf->f_bfree = stbuf->f_bavail = g_file_info_get_attribute_uint64 (file_info, G_FILE_ATTRIBUTE_FILESYSTEM_FREE) / 4096;
+}
+
 static gint
 vfs_statfs (const gchar *path, struct statvfs *stbuf)
 {
+  MountRecord *mount_record;
   GFile  *file;
+  GFile  *refresh_root = NULL;
+  gchar  *mount_name;
   GError *error  = NULL;
   gint    result = 0;
+  gboolean cached = FALSE;
 
   debug_print ("vfs_statfs: %s\n", path);
 
@@ -645,7 +1132,38 @@ vfs_statfs (const gchar *path, struct statvfs *stbuf)
   stbuf->f_flag = 0;  /* Ignored by FUSE */
   stbuf->f_namemax = 1024;
 
-  if ((file = file_from_full_path (path)))
+  mount_name = mount_name_from_full_path (path, NULL);
+  if (mount_name == NULL)
+    goto out;
+
+  /* statfs() is called a lot, so answer from the cache whenever we can,
+   * and only refresh it in the background. */
+  mount_list_lock ();
+
+  mount_record = mount_record_find_by_mount_name (mount_name);
+  if (mount_record && mount_record->fs_info)
+    {
+      statfs_from_fs_info (stbuf, mount_record->fs_info);
+      cached = TRUE;
+
+      if (!mount_record->fs_info_pending &&
+          g_get_monotonic_time () - mount_record->fs_info_time > FS_INFO_CACHE_TTL_SECS * G_USEC_PER_SEC)
+        {
+          mount_record->fs_info_pending = TRUE;
+          refresh_root = g_object_ref (mount_record->root);
+        }
+    }
+
+  mount_list_unlock ();
+
+  if (refresh_root)
+    {
+      g_file_query_filesystem_info_async (refresh_root, "filesystem::*", G_PRIORITY_DEFAULT,
+                                          NULL, fs_info_refresh_cb, g_strdup (mount_name));
+      g_object_unref (refresh_root);
+    }
+
+  if (!cached && (file = file_from_full_path (path)))
     {
       GFileInfo *file_info;
 
@@ -653,10 +1171,8 @@ vfs_statfs (const gchar *path, struct statvfs *stbuf)
 
       if (file_info)
         {
-          if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_FILESYSTEM_SIZE))
-            stbuf->f_blocks = (g_file_info_get_attribute_uint64 (file_info, G_FILE_ATTRIBUTE_FILESYSTEM_SIZE) + 4096 - 1) / 4096;
-          if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_FILESYSTEM_FREE))
-            stbuf->f_bfree = stbuf->f_bavail = g_file_info_get_attribute_uint64 (file_info, G_FILE_ATTRIBUTE_FILESYSTEM_FREE) / 4096;
+          statfs_from_fs_info (stbuf, file_info);
+          mount_record_set_fs_info (mount_name, file_info);
 
           g_object_unref (file_info);
         }
@@ -673,6 +1189,9 @@ vfs_statfs (const gchar *path, struct statvfs *stbuf)
       g_object_unref (file);
     }
 
+  g_free (mount_name);
+
+ out:
   debug_print ("vfs_statfs: -> %s\n", g_strerror (-result));
 
   return result;
@@ -801,6 +1320,15 @@ getattr_for_file_handle (FileHandle *fh, struct stat *sbuf)
   sbuf->st_gid = daemon_gid;
   sbuf->st_nlink = 1;
   sbuf->st_size = fh->pos;
+  if (fh->write_buffer != NULL && fh->write_buffer->len > 0)
+    sbuf->st_size = MAX (sbuf->st_size, fh->write_buffer_offset + fh->write_buffer->len);
+  if (fh->spill_fd != -1)
+    {
+      struct stat spill_sbuf;
+
+      if (fstat (fh->spill_fd, &spill_sbuf) == 0)
+        sbuf->st_size = spill_sbuf.st_size;
+    }
   sbuf->st_blksize = 512;
   sbuf->st_blocks = (sbuf->st_size + 511) / 512;
 }
@@ -895,7 +1423,7 @@ setup_input_stream (GFile *file, FileHandle *fh)
   GError *error  = NULL;
   gint    result = 0;
 
-  if (fh->stream)
+  if (fh->stream || fh->op == FILE_OP_WRITE)
     {
       debug_print ("setup_input_stream: have stream\n");
 
@@ -907,9 +1435,10 @@ setup_input_stream (GFile *file, FileHandle *fh)
         {
           debug_print ("setup_input_stream: doing write\n");
 
-          g_output_stream_close (fh->stream, NULL, NULL);
-          g_object_unref (fh->stream);
-          fh->stream = NULL;
+          /* Pending writes have to reach the backend before we can read them back */
+          result = file_handle_close_stream (fh);
+          if (result != 0)
+            return result;
         }
     }
 
@@ -941,6 +1470,14 @@ setup_output_stream (GFile *file, FileHandle *fh, int flags)
   GError *error  = NULL;
   gint    result = 0;
 
+  /* Writes go to the local copy until it's written back */
+  if (fh->spill_fd != -1)
+    {
+      if ((flags & O_TRUNC) && ftruncate (fh->spill_fd, 0) == -1)
+        result = -errno;
+      return result;
+    }
+
   if (fh->stream)
     {
       if (fh->op == FILE_OP_WRITE)
@@ -998,7 +1535,9 @@ open_common (const gchar *path, struct fuse_file_info *fi, GFile *file, int outp
   else
     result = setup_input_stream (file, fh);
 
-  if (fh->stream)
+  /* Non-sequential writes are handled by write_stream() even if the
+   * stream can't seek */
+  if (fh->stream && fh->op == FILE_OP_READ)
     fi->nonseekable = !g_seekable_can_seek (G_SEEKABLE (fh->stream));
 
   g_mutex_unlock (&fh->mutex);
@@ -1117,6 +1656,10 @@ vfs_create (const gchar *path, mode_t mode, struct fuse_file_info *fi)
 
               SET_FILE_HANDLE (fi, fh);
 
+              /* Pending writes to a reused handle were for the file that
+               * g_file_create() just replaced, so drop them rather than
+               * writing them over the new file */
+              file_handle_discard_writes (fh);
               file_handle_close_stream (fh);
               fh->stream = file_output_stream;
               fh->op = FILE_OP_WRITE;
@@ -1153,6 +1696,12 @@ vfs_release (const gchar *path, struct fuse_file_info *fi)
 
   if (fh)
     {
+      /* The handle may outlive this release if the path is open elsewhere,
+       * so don't keep buffered writes around until then. */
+      g_mutex_lock (&fh->mutex);
+      file_handle_flush_writes (fh);
+      g_mutex_unlock (&fh->mutex);
+
       /* get_file_handle_from_info () adds a "working ref", so unref twice. */
       file_handle_unref (fh);
       file_handle_unref (fh);
@@ -1279,15 +1828,28 @@ vfs_read (const gchar *path, gchar *buf, size_t size,
         {
           g_mutex_lock (&fh->mutex);
 
-          result = setup_input_stream (file, fh);
-
-          if (result == 0)
+          if (fh->spill_fd != -1)
             {
-              result = read_stream (fh, buf, size, offset);
+              /* Serve reads from the local copy while it's in use */
+              do
+                result = pread (fh->spill_fd, buf, size, offset);
+              while (result == -1 && errno == EINTR);
+
+              if (result == -1)
+                result = -errno;
             }
           else
             {
-              debug_print ("vfs_read: failed to setup input_stream!\n");
+              result = setup_input_stream (file, fh);
+
+              if (result == 0)
+                {
+                  result = read_stream (fh, buf, size, offset);
+                }
+              else
+                {
+                  debug_print ("vfs_read: failed to setup input_stream!\n");
+                }
             }
 
           g_mutex_unlock (&fh->mutex);
@@ -1314,80 +1876,50 @@ vfs_read (const gchar *path, gchar *buf, size_t size,
 }
 
 static gint
-write_stream (FileHandle *fh, const gchar *input_buf, size_t input_buf_size, off_t offset)
+write_stream (GFile *file, FileHandle *fh, const gchar *input_buf, size_t input_buf_size, off_t offset)
 {
-  GOutputStream *output_stream;
-  gint           n_bytes_written = 0;
-  gint           result          = 0;
-  GError        *error           = NULL;
+  gint result;
 
   debug_print ("write_stream: %d bytes at offset %d.\n", input_buf_size, offset);
 
-  output_stream = fh->stream;
+  if (fh->spill_fd != -1)
+    return spill_write (fh->spill_fd, input_buf, input_buf_size, offset);
 
-  if (offset != fh->pos)
+  if (fh->write_buffer != NULL && fh->write_buffer->len > 0)
     {
-      if (g_seekable_can_seek (G_SEEKABLE (output_stream)))
+      if (offset == fh->write_buffer_offset + fh->write_buffer->len &&
+          fh->write_buffer->len + input_buf_size <= WRITE_BUFFER_SIZE)
         {
-          /* Can seek */
-
-          if (g_seekable_seek (G_SEEKABLE (output_stream), offset, G_SEEK_SET, NULL, &error))
-            {
-              fh->pos = offset;
-            }
-          else
-            {
-              result = -errno_from_error (error);
-              g_error_free (error);
-            }
+          g_byte_array_append (fh->write_buffer, (const guint8 *) input_buf, input_buf_size);
+          return input_buf_size;
         }
-      else
-        {
-          /* Can't seek, and output streams can't skip */
 
-          result = -ENOTSUP;
-        }
+      result = file_handle_write_out_buffer (fh);
+      if (result < 0)
+        return result;
     }
 
-  if (result == 0)
+  if (offset != fh->pos && !g_seekable_can_seek (G_SEEKABLE (fh->stream)))
     {
-      while (n_bytes_written < input_buf_size)
-        {
-          gboolean part_result;
-          gsize    part_bytes_written = 0;
+      /* Can't seek, and output streams can't skip, so continue on a local copy */
 
-          part_result = g_output_stream_write_all (output_stream,
-                                                   (void *) (input_buf + n_bytes_written),
-                                                   input_buf_size - n_bytes_written,
-                                                   &part_bytes_written,
-                                                   NULL,
-                                                   &error);
+      result = file_handle_start_spill (file, fh);
+      if (result < 0)
+        return result;
 
-          n_bytes_written += part_bytes_written;
-          fh->pos += part_bytes_written;
+      return spill_write (fh->spill_fd, input_buf, input_buf_size, offset);
+    }
 
-          if (!part_result)
-            break;
-        }
+  if (input_buf_size >= WRITE_BUFFER_SIZE)
+    return write_stream_direct (fh, input_buf, input_buf_size, offset);
 
-      result = n_bytes_written;
+  if (fh->write_buffer == NULL)
+    fh->write_buffer = g_byte_array_sized_new (WRITE_BUFFER_SIZE);
 
-      if (n_bytes_written < input_buf_size)
-        {
-          if (error)
-            {
-              result = -errno_from_error (error);
-              g_error_free (error);
-            }
-        }
-      else if (!g_output_stream_flush (output_stream, NULL, &error))
-        {
-          result = -errno_from_error (error);
-          g_error_free (error);
-        }
-    }
+  fh->write_buffer_offset = offset;
+  g_byte_array_append (fh->write_buffer, (const guint8 *) input_buf, input_buf_size);
 
-  return result;
+  return input_buf_size;
 }
 
 static gint
@@ -1410,7 +1942,7 @@ vfs_write (const gchar *path, const gchar *buf, size_t len, off_t offset,
           result = setup_output_stream (file, fh, 0);
           if (result == 0)
             {
-              result = write_stream (fh, buf, len, offset);
+              result = write_stream (file, fh, buf, len, offset);
             }
 
           g_mutex_unlock (&fh->mutex);
@@ -1440,42 +1972,167 @@ static gint
 vfs_flush (const gchar *path, struct fuse_file_info *fi)
 {
   FileHandle *fh = get_file_handle_from_info (fi);
+  gint        result = 0;
 
   debug_print ("vfs_flush: %s\n", path);
 
   if (fh)
     {
       g_mutex_lock (&fh->mutex);
-      file_handle_close_stream (fh);
+      result = file_handle_close_stream (fh);
       g_mutex_unlock (&fh->mutex);
 
       /* get_file_handle_from_info () adds a "working ref", so release that. */
       file_handle_unref (fh);
     }
 
-  /* TODO: Error handling. */
-  return 0;
+  return result;
 }
 
 static gint
 vfs_fsync (const gchar *path, gint sync_data_only, struct fuse_file_info *fi)
 {
   FileHandle *fh = get_file_handle_from_info (fi);
+  gint        result = 0;
 
   debug_print ("vfs_flush: %s\n", path);
 
   if (fh)
     {
       g_mutex_lock (&fh->mutex);
-      file_handle_close_stream (fh);
+      result = file_handle_close_stream (fh);
       g_mutex_unlock (&fh->mutex);
 
       /* get_file_handle_from_info () adds a "working ref", so release that. */
       file_handle_unref (fh);
     }
 
-  /* TODO: Error handling. */
-  return 0;
+  return result;
+}
+
+static DirHandle *
+dir_handle_new (void)
+{
+  DirHandle *dir_handle;
+
+  dir_handle = g_new0 (DirHandle, 1);
+  dir_handle->refcount = 1;
+  g_mutex_init (&dir_handle->mutex);
+  g_cond_init (&dir_handle->cond);
+  dir_handle->cancellable = g_cancellable_new ();
+  dir_handle->names = g_ptr_array_new_with_free_func (g_free);
+
+  return dir_handle;
+}
+
+static DirHandle *
+dir_handle_ref (DirHandle *dir_handle)
+{
+  g_atomic_int_inc (&dir_handle->refcount);
+  return dir_handle;
+}
+
+static void
+dir_handle_unref (DirHandle *dir_handle)
+{
+  if (g_atomic_int_dec_and_test (&dir_handle->refcount))
+    {
+      g_clear_object (&dir_handle->enumerator);
+      g_object_unref (dir_handle->cancellable);
+      g_ptr_array_free (dir_handle->names, TRUE);
+      g_cond_clear (&dir_handle->cond);
+      g_mutex_clear (&dir_handle->mutex);
+      g_free (dir_handle);
+    }
+}
+
+static void dir_handle_fetch_more_locked (DirHandle *dh);
+
+/* Runs on the subthread main loop */
+static void
+dir_handle_next_files_cb (GObject      *source_object,
+                          GAsyncResult *res,
+                          gpointer      user_data)
+{
+  DirHandle *dh = user_data;
+  GList     *infos, *l;
+  GError    *error = NULL;
+
+  infos = g_file_enumerator_next_files_finish (G_FILE_ENUMERATOR (source_object), res, &error);
+
+  g_mutex_lock (&dh->mutex);
+
+  dh->pending = FALSE;
+
+  if (error)
+    {
+      debug_print ("dir_handle_next_files_cb: %s\n", error->message);
+      dh->error = -errno_from_error (error);
+      g_error_free (error);
+    }
+  else if (infos == NULL)
+    {
+      dh->done = TRUE;
+    }
+
+  for (l = infos; l != NULL; l = l->next)
+    g_ptr_array_add (dh->names, g_strdup (g_file_info_get_name (l->data)));
+  g_list_free_full (infos, g_object_unref);
+
+  /* Keep one batch ahead of what the kernel has consumed */
+  dir_handle_fetch_more_locked (dh);
+
+  g_cond_broadcast (&dh->cond);
+  g_mutex_unlock (&dh->mutex);
+
+  dir_handle_unref (dh);
+}
+
+static void
+dir_handle_fetch_more_locked (DirHandle *dh)
+{
+  if (dh->pending || dh->done || dh->error != 0 || dh->enumerator == NULL)
+    return;
+
+  if (dh->names->len >= dh->n_consumed + READDIR_BATCH_SIZE)
+    return;
+
+  dh->pending = TRUE;
+  g_file_enumerator_next_files_async (dh->enumerator,
+                                      READDIR_BATCH_SIZE,
+                                      G_PRIORITY_DEFAULT,
+                                      dh->cancellable,
+                                      dir_handle_next_files_cb,
+                                      dir_handle_ref (dh));
+}
+
+/* Runs on the subthread main loop */
+static void
+dir_handle_enumerate_cb (GObject      *source_object,
+                         GAsyncResult *res,
+                         gpointer      user_data)
+{
+  DirHandle *dh = user_data;
+  GError    *error = NULL;
+
+  g_mutex_lock (&dh->mutex);
+
+  dh->enumerator = g_file_enumerate_children_finish (G_FILE (source_object), res, &error);
+  if (dh->enumerator == NULL)
+    {
+      debug_print ("Error from GVFS: %s\n", error->message);
+      dh->error = -errno_from_error (error);
+      g_error_free (error);
+    }
+  dh->opened = TRUE;
+
+  /* Start fetching entries right away, the first readdir will follow shortly */
+  dir_handle_fetch_more_locked (dh);
+
+  g_cond_broadcast (&dh->cond);
+  g_mutex_unlock (&dh->mutex);
+
+  dir_handle_unref (dh);
 }
 
 static gint
@@ -1486,15 +2143,36 @@ vfs_opendir (const gchar *path, struct fuse_file_info *fi)
 
   debug_print ("vfs_opendir: %s\n", path);
 
+  SET_FILE_HANDLE (fi, NULL);
+
   if (path_is_mount_list (path))
     {
       /* Mount list */
     }
   else if ((file = file_from_full_path (path)) != NULL)
     {
+      DirHandle *dh;
+
       /* Submount */
 
-      /* TODO: Check that path exists */
+      /* The enumerator is created asynchronously, so that its results are
+       * delivered on the subthread main loop. That lets us prefetch entries
+       * while the kernel is still consuming earlier ones. */
+      dh = dir_handle_new ();
+      g_file_enumerate_children_async (file, G_FILE_ATTRIBUTE_STANDARD_NAME, 0,
+                                       G_PRIORITY_DEFAULT, dh->cancellable,
+                                       dir_handle_enumerate_cb, dir_handle_ref (dh));
+
+      g_mutex_lock (&dh->mutex);
+      while (!dh->opened)
+        g_cond_wait (&dh->cond, &dh->mutex);
+      result = dh->enumerator ? 0 : dh->error;
+      g_mutex_unlock (&dh->mutex);
+
+      if (result == 0)
+        SET_FILE_HANDLE (fi, dh);
+      else
+        dir_handle_unref (dh);
 
       g_object_unref (file);
     }
@@ -1509,53 +2187,81 @@ vfs_opendir (const gchar *path, struct fuse_file_info *fi)
 }
 
 static gint
-readdir_for_file (GFile *base_file, gpointer buf, fuse_fill_dir_t filler)
+vfs_releasedir (const gchar *path, struct fuse_file_info *fi)
 {
-  GFileEnumerator *enumerator;
-  GFileInfo       *file_info;
-  GError          *error = NULL;
+  DirHandle *dh = GET_FILE_HANDLE (fi);
 
-  g_assert (base_file != NULL);
+  debug_print ("vfs_releasedir: %s\n", path);
 
-  enumerator = g_file_enumerate_children (base_file, G_FILE_ATTRIBUTE_STANDARD_NAME, 0, NULL, &error);
-  if (!enumerator)
+  if (dh)
     {
-      gint result;
+      /* A pending prefetch holds its own reference */
+      g_cancellable_cancel (dh->cancellable);
+      dir_handle_unref (dh);
+    }
 
-      if (error)
-        {
-          debug_print ("Error from GVFS: %s\n", error->message);
-          result = -errno_from_error (error);
-          g_error_free (error);
-        }
-      else
-        {
-          debug_print ("No file info, but no error from GVFS.\n");
-          result = -EIO;
-        }
+  return 0;
+}
 
-      return result;
+static gint
+readdir_for_dir_handle (DirHandle *dh, gpointer buf, fuse_fill_dir_t filler, off_t offset)
+{
+  gboolean filled = FALSE;
+  gint     result = 0;
+  off_t    i = offset;
+
+  g_mutex_lock (&dh->mutex);
+
+  if (i == 0)
+    {
+      if (filler (buf, ".", NULL, ++i))
+        goto out;
+      filled = TRUE;
+    }
+  if (i == 1)
+    {
+      if (filler (buf, "..", NULL, ++i))
+        goto out;
+      filled = TRUE;
     }
 
-  filler (buf, ".", NULL, 0);
-  filler (buf, "..", NULL, 0);
+  if (i - 2 > dh->n_consumed)
+    dh->n_consumed = i - 2;
 
-  while ((file_info = g_file_enumerator_next_file (enumerator, NULL, &error)) != NULL)
+  /* Only wait if there's nothing to return yet, as an empty result
+   * means the end of the directory to the kernel */
+  while (!filled && i - 2 >= dh->names->len && !dh->done && dh->error == 0)
     {
-      filler (buf, g_file_info_get_name (file_info), NULL, 0);
-      g_object_unref (file_info);
+      dir_handle_fetch_more_locked (dh);
+      g_cond_wait (&dh->cond, &dh->mutex);
     }
 
-  g_object_unref (enumerator);
+  if (!filled && i - 2 >= dh->names->len && dh->error != 0)
+    result = dh->error;
 
-  return 0;
+  for (; i - 2 < dh->names->len; i++)
+    {
+      if (filler (buf, g_ptr_array_index (dh->names, i - 2), NULL, i + 1))
+        break;
+    }
+
+ out:
+  if (i - 2 > dh->n_consumed)
+    dh->n_consumed = i - 2;
+
+  /* Fetch the next batch while the kernel consumes this one */
+  dir_handle_fetch_more_locked (dh);
+
+  g_mutex_unlock (&dh->mutex);
+
+  return result;
 }
 
 static gint
 vfs_readdir (const gchar *path, gpointer buf, fuse_fill_dir_t filler, off_t offset,
              struct fuse_file_info *fi)
 {
-  GFile       *base_file;
+  DirHandle   *dh;
   gint         result = 0;
 
   debug_print ("vfs_readdir: %s\n", path);
@@ -1580,13 +2286,11 @@ vfs_readdir (const gchar *path, gpointer buf, fuse_fill_dir_t filler, off_t offs
 
       mount_list_unlock ();
     }
-  else if ((base_file = file_from_full_path (path)))
+  else if ((dh = GET_FILE_HANDLE (fi)) != NULL)
     {
       /* Submount */
 
-      result = readdir_for_file (base_file, buf, filler);
-
-      g_object_unref (base_file);
+      result = readdir_for_dir_handle (dh, buf, filler, offset);
     }
   else
     {
@@ -1680,6 +2384,7 @@ vfs_unlink (const gchar *path)
       if (fh)
         {
           g_mutex_lock (&fh->mutex);
+          file_handle_discard_writes (fh);
           file_handle_close_stream (fh);
         }
 
@@ -1698,6 +2403,10 @@ vfs_unlink (const gchar *path)
           result = -errno_from_error (error);
           g_error_free (error);
         }
+      else
+        {
+          mount_record_invalidate_fs_info (path);
+        }
 
       g_object_unref (file);
     }
@@ -1776,6 +2485,10 @@ vfs_rmdir (const gchar *path)
                   result = -errno_from_error (error);
                   g_error_free (error);
                 }
+              else
+                {
+                  mount_record_invalidate_fs_info (path);
+                }
             }
           else
             {
@@ -1841,7 +2554,7 @@ file_handle_get_size (FileHandle *fh,
 #define PAD_BLOCK_SIZE 65536
 
 static gint
-pad_file (FileHandle *fh, gsize num, goffset current_size)
+pad_file (GFile *file, FileHandle *fh, gsize num, goffset current_size)
 {
   gpointer buf;
   gsize written;
@@ -1851,7 +2564,7 @@ pad_file (FileHandle *fh, gsize num, goffset current_size)
   buf = g_malloc0 (PAD_BLOCK_SIZE);
   for (written = 0; written < num; written += PAD_BLOCK_SIZE)
     {
-      res = write_stream (fh, buf, MIN (num - written, PAD_BLOCK_SIZE), current_size + written);
+      res = write_stream (file, fh, buf, MIN (num - written, PAD_BLOCK_SIZE), current_size + written);
       if (res < 0)
         break;
     }
@@ -1882,9 +2595,21 @@ vfs_ftruncate (const gchar *path, off_t size, struct fuse_file_info *fi)
 
           result = setup_output_stream (file, fh, 0);
 
+          /* Buffered data past the new end is cut off anyway, the rest has
+           * to be accounted for by the size checks below */
+          if (result == 0 && size == 0 && fh->write_buffer != NULL)
+            g_byte_array_set_size (fh->write_buffer, 0);
+          if (result == 0)
+            result = file_handle_write_out_buffer (fh);
+
           if (result == 0)
             {
-              if (g_seekable_can_truncate (G_SEEKABLE (fh->stream)))
+              if (fh->spill_fd != -1)
+                {
+                  if (ftruncate (fh->spill_fd, size) == -1)
+                    result = -errno;
+                }
+              else if (g_seekable_can_truncate (G_SEEKABLE (fh->stream)))
                 {
                   g_seekable_truncate (fh->stream, size, NULL, &error);
                 }
@@ -1906,25 +2631,30 @@ vfs_ftruncate (const gchar *path, off_t size, struct fuse_file_info *fi)
                       fh->stream = NULL;
                     }
                 }
-              else if (file_handle_get_size (fh, &current_size))
+              else if (file_handle_get_size (fh, &current_size) &&
+                       (current_size == size ||
+                        (current_size < size && g_seekable_can_seek (G_SEEKABLE (fh->stream)))))
                 {
-                  if (current_size == size)
-                    {
-                      /* Don't have to do anything to succeed */
-                    }
-                  else if ((current_size < size) && g_seekable_can_seek (G_SEEKABLE (fh->stream)))
+                  if (current_size < size)
                     {
                       /* If the truncated size is larger than the current size
                        * then we need to pad out the difference with 0's */
                       goffset orig_pos = g_seekable_tell (G_SEEKABLE (fh->stream));
-                      result = pad_file (fh, size - current_size, current_size);
+                      result = pad_file (file, fh, size - current_size, current_size);
                       if (result == 0)
-                        g_seekable_seek (G_SEEKABLE (fh->stream), orig_pos, G_SEEK_SET, NULL, &error);
+                        result = file_handle_write_out_buffer (fh);
+                      if (result == 0 &&
+                          g_seekable_seek (G_SEEKABLE (fh->stream), orig_pos, G_SEEK_SET, NULL, &error))
+                        fh->pos = orig_pos;
                     }
 		}
 	      else
 		{
-		  result = -ENOTSUP;
+                  /* The stream can't do it, so truncate a local copy of the
+                   * file instead. It's written back on flush. */
+                  result = file_handle_start_spill (file, fh);
+                  if (result == 0 && ftruncate (fh->spill_fd, size) == -1)
+                    result = -errno;
                 }
 
               if (error)
@@ -2428,6 +3158,7 @@ static struct fuse_operations vfs_oper =
 
   .opendir     = vfs_opendir,
   .readdir     = vfs_readdir,
+  .releasedir  = vfs_releasedir,
   .readlink    = vfs_readlink,
 
   .open        = vfs_open,
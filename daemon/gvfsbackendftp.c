@@ -104,8 +104,10 @@ gvfs_backend_ftp_determine_features (GVfsFtpTask *task)
     { "UTF8", G_VFS_FTP_FEATURE_UTF8 },
     { "AUTH TLS", G_VFS_FTP_FEATURE_AUTH_TLS },
     { "AUTH SSL", G_VFS_FTP_FEATURE_AUTH_SSL },
+    { "MLST", G_VFS_FTP_FEATURE_MLST },
   };
   guint i, j;
+  gsize len;
   char **reply;
 
   if (!g_vfs_ftp_task_send_and_check (task, 0, NULL, NULL, &reply, "FEAT"))
@@ -126,9 +128,14 @@ gvfs_backend_ftp_determine_features (GVfsFtpTask *task)
       while (g_ascii_isspace (feature[0]))
         feature++;
 
+      /* Some features are followed by parameters, like the list of
+       * facts for MLST, so only compare the feature name itself.
+       */
       for (j = 0; j < G_N_ELEMENTS (features); j++)
         {
-          if (g_ascii_strcasecmp (feature, features[j].name) == 0)
+          len = strlen (features[j].name);
+          if (g_ascii_strncasecmp (feature, features[j].name, len) == 0 &&
+              (feature[len] == '\0' || g_ascii_isspace (feature[len])))
             {
               g_debug ("# feature %s supported\n", features[j].name);
               task->backend->features |= 1 << features[j].enable;
@@ -240,7 +247,15 @@ gvfs_backend_ftp_determine_system (GVfsFtpTask *task)
 static void
 gvfs_backend_ftp_setup_directory_cache (GVfsBackendFtp *ftp)
 {
-  if (ftp->system == G_VFS_FTP_SYSTEM_UNIX)
+  /* MLSD output is machine-readable, so prefer it over parsing LIST */
+  if (g_vfs_backend_ftp_has_feature (ftp, G_VFS_FTP_FEATURE_MLST))
+    {
+      if (ftp->system == G_VFS_FTP_SYSTEM_UNIX)
+        ftp->dir_funcs = &g_vfs_ftp_dir_cache_funcs_mlsd_unix;
+      else
+        ftp->dir_funcs = &g_vfs_ftp_dir_cache_funcs_mlsd_default;
+    }
+  else if (ftp->system == G_VFS_FTP_SYSTEM_UNIX)
     ftp->dir_funcs = &g_vfs_ftp_dir_cache_funcs_unix;
   else
     ftp->dir_funcs = &g_vfs_ftp_dir_cache_funcs_default;
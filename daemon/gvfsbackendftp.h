@@ -39,6 +39,7 @@ typedef enum {
   G_VFS_FTP_FEATURE_UTF8,
   G_VFS_FTP_FEATURE_AUTH_TLS,
   G_VFS_FTP_FEATURE_AUTH_SSL,
+  G_VFS_FTP_FEATURE_MLST,
   G_VFS_FTP_FEATURE_CHMOD,
   G_VFS_FTP_FEATURE_CHGRP
 } GVfsFtpFeature;
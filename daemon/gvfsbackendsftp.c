@@ -23,6 +23,7 @@
 
 #include <config.h>
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/poll.h>
 #include <sys/types.h>
@@ -57,11 +58,14 @@
 #include "gvfsjobqueryinforead.h"
 #include "gvfsjobqueryinfowrite.h"
 #include "gvfsjobmove.h"
+#include "gvfsjobcopy.h"
 #include "gvfsjobdelete.h"
 #include "gvfsjobqueryfsinfo.h"
 #include "gvfsjobqueryattributes.h"
 #include "gvfsjobenumerate.h"
 #include "gvfsjobmakedirectory.h"
+#include "gvfsjobmakesymlink.h"
+#include "gvfsjobsetattribute.h"
 #include "gvfsjobprogress.h"
 #include "gvfsjobpush.h"
 #include "gvfsjobpull.h"
@@ -69,6 +73,9 @@
 #include "gvfskeyring.h"
 #include "sftp.h"
 #include "pty_open.h"
+#ifdef HAVE_LIBSSH
+#include "gvfslibsshstream.h"
+#endif
 
 /* TODO for sftp:
  * Implement can_delete & can_rename
@@ -82,10 +89,53 @@
 
 #define SFTP_READ_TIMEOUT 40   /* seconds */
 
-static GQuark id_q;
+/* Number of ssh connections used at most, can be changed with
+   GVFS_SFTP_CONNECTIONS. Additional connections are only opened when
+   all existing ones have at least CONNECTION_BUSY_REQUESTS replies
+   outstanding. */
+#define DEFAULT_MAX_CONNECTIONS 4
+#define CONNECTION_BUSY_REQUESTS 8
+
+/* Initial size of the buffer replies are received in, it grows to fit
+   the largest reply seen */
+#define RECV_BUFFER_SIZE (64 * 1024)
+
+/* Initial size of the array commands are built in, enough for all but
+   long paths and the data of writes */
+#define COMMAND_SIZE 256
+
+/* Number of WRITEs on a handle that can be outstanding before a write
+   job has to wait for the server */
+#define WRITE_MAX_REQUESTS 16
+
+/* Data size of READ and WRITE requests unless the server tells us its
+   limits, and the largest size used even if it allows more */
+#define DEFAULT_BLOCKSIZE 32768
+#define MAX_BLOCKSIZE (256 * 1024)
+
+/* How long the attributes of an enumerated directory are used to
+   answer query_info without asking the server */
+#define DIR_CACHE_TIMEOUT (10 * G_USEC_PER_SEC)
+
+/* How long the uid, gid and home directory saved for a server are
+   used without asking it again */
+#define SERVER_INFO_TTL (24 * 60 * 60) /* seconds */
+
+/* With GVFS_SFTP_RESUME set, failed pulls and pushes leave a partial
+   file that a retry continues from. The state is saved at least every
+   RESUME_SAVE_INTERVAL bytes in case the daemon goes away. */
+#define RESUME_PARTIAL_SUFFIX ".gvfs-partial"
+#define RESUME_SAVE_INTERVAL (32 * 1024 * 1024)
+#define RESUME_VERIFY_BUFFER_SIZE (64 * 1024)
+
+static GQuark connection_q;
 
 typedef enum {
   SFTP_EXT_OPENSSH_STATVFS,
+  SFTP_EXT_COPY_DATA,
+  SFTP_EXT_OPENSSH_POSIX_RENAME,
+  SFTP_EXT_OPENSSH_LIMITS,
+  SFTP_EXT_CHECK_FILE,
 } SFTPServerExtensions;
 
 typedef enum {
@@ -96,9 +146,17 @@ typedef enum {
 
 typedef struct _MultiReply MultiReply;
 
+/* A reply packet being parsed. The replies handed to a ReplyCallback
+   are read in place from the receive buffer, after their type and id. */
+typedef struct {
+  guint8 *data;
+  gsize size;
+  gsize pos;
+} SftpReply;
+
 typedef void (*ReplyCallback) (GVfsBackendSftp *backend,
                                int reply_type,
-                               GDataInputStream *reply,
+                               SftpReply *reply,
                                guint32 len,
                                GVfsJob *job,
                                gpointer user_data);
@@ -120,7 +178,7 @@ typedef struct {
 
 struct _MultiReply {
   int type;
-  GDataInputStream *data;
+  SftpReply *data;
   guint32 data_len;
 
   MultiRequest *request;
@@ -133,7 +191,10 @@ typedef struct {
   gsize size;
 } DataBuffer;
 
+typedef struct _SftpConnection SftpConnection;
+
 typedef struct {
+  SftpConnection *connection;
   DataBuffer *raw_handle;
   goffset offset;
   char *filename;
@@ -141,6 +202,12 @@ typedef struct {
   guint32 permissions;
   gboolean set_permissions;
   gboolean make_backup;
+
+  /* Writes succeed as soon as they are queued, the first error the
+     server reports is returned by the following writes and the close */
+  int outstanding_writes;
+  GError *write_error;
+  GVfsJob *waiting_job; /* Write waiting for the window, or the close */
 } SftpHandle;
 
 
@@ -148,19 +215,76 @@ typedef struct {
   ReplyCallback callback;
   GVfsJob *job;
   gpointer user_data;
+
+  /* Set for READs, the data of a DATA reply is read into it and the
+     callback gets a NULL reply and the data size as len */
+  guint8 *data_buffer;
+  gsize data_buffer_size;
 } ExpectedReply;
 
+/* One ssh process speaking sftp. Handles are only valid on the
+   connection that opened them. */
+struct _SftpConnection
+{
+  GVfsBackendSftp *backend;
+
+  GOutputStream *command_stream;
+  GInputStream *reply_stream;
+  GDataInputStream *error_stream;
+
+  GCancellable *reply_stream_cancellable;
+
+  /* Output Queue */
+  
+  gsize command_bytes_written;
+  GQueue command_queue;
+  
+  /* Reply reading: replies are parsed in place in recv_buffer, which
+     holds the unparsed bytes between recv_start and recv_end */
+  GHashTable *expected_replies;
+  guint8 *recv_buffer;
+  gsize recv_buffer_size;
+  gsize recv_start;
+  gsize recv_end;
+
+  /* DATA reply currently being read straight into its data buffer */
+  ExpectedReply *direct_reply;
+  guint32 direct_id;
+  gsize direct_size;
+  gsize direct_read;
+
+  /* Set when the ssh process of an additional connection died. It is
+     then only kept for the jobs and handles still pointing to it, whose
+     requests fail from an idle. */
+  gboolean dead;
+  guint fail_replies_id;
+};
+
+/* The entries of an enumerated directory, as returned for the
+   attributes and flags the enumeration asked for */
+typedef struct {
+  GHashTable *infos;
+  GFileAttributeMatcher *matcher;
+  GFileQueryInfoFlags flags;
+  gint64 stamp;
+} SftpDirCacheEntry;
+
 struct _GVfsBackendSftp
 {
   GVfsBackend parent_instance;
 
   SFTPClientVendor client_vendor;
+  gboolean use_control_master;
+#ifdef HAVE_LIBSSH
+  gboolean use_libssh;
+#endif
   char *host;
   int port;
   gboolean user_specified;
   gboolean user_specified_in_uri;
   char *user;
   char *tmp_password;
+  char *login_password;
   GPasswordSave password_save;
 
   guint32 my_uid;
@@ -168,25 +292,26 @@ struct _GVfsBackendSftp
   
   int protocol_version;
   SFTPServerExtensions extensions;
+
+  /* From limits@openssh.com, if supported */
+  guint32 max_read_size;
+  guint32 max_write_size;
   
-  GOutputStream *command_stream;
-  GInputStream *reply_stream;
-  GDataInputStream *error_stream;
+  guint32 current_id;
 
-  GCancellable *reply_stream_cancellable;
+  /* The first connection is the one set up when mounting, the others
+     are opened on demand and log in with the same credentials. */
+  GPtrArray *connections;
+  GPtrArray *dead_connections;
+  guint max_connections;
+  gboolean resume_transfers;
+  gboolean opening_connection;
+  gboolean connection_failed;
 
-  guint32 current_id;
-  
-  /* Output Queue */
-  
-  gsize command_bytes_written;
-  GList *command_queue;
-  
-  /* Reply reading: */
-  GHashTable *expected_replies;
-  guint32 reply_size;
-  guint32 reply_size_read;
-  guint8 *reply;
+  /* Directory name -> SftpDirCacheEntry, the generation is bumped
+     whenever an entry is purged */
+  GHashTable *dir_cache;
+  guint dir_cache_generation;
   
   GMountSource *mount_source; /* Only used/set during mount */
   int mount_try;
@@ -196,7 +321,7 @@ struct _GVfsBackendSftp
 static void parse_attributes (GVfsBackendSftp *backend,
                               GFileInfo *info,
                               const char *basename,
-                              GDataInputStream *reply,
+                              SftpReply *reply,
                               GFileAttributeMatcher *attribute_matcher);
 
 G_DEFINE_TYPE (GVfsBackendSftp, g_vfs_backend_sftp, G_VFS_TYPE_BACKEND)
@@ -217,13 +342,34 @@ make_fd_nonblocking (int fd)
   fcntl (fd, F_SETFL, O_NONBLOCK | fcntl (fd, F_GETFL));
 }
 
+/* ControlPath tokens like %C and ControlPersist are needed to share
+   connections between mounts, %C appeared last in OpenSSH 6.7 */
+static gboolean
+openssh_supports_control_master (const char *ssh_stderr)
+{
+  const char *version;
+  int major, minor;
+
+  if (g_getenv ("GVFS_SFTP_NO_CONTROL_MASTER") != NULL)
+    return FALSE;
+
+  version = strstr (ssh_stderr, "OpenSSH_");
+  if (version == NULL ||
+      sscanf (version, "OpenSSH_%d.%d", &major, &minor) != 2)
+    return FALSE;
+
+  return major > 6 || (major == 6 && minor >= 7);
+}
+
 static SFTPClientVendor
-get_sftp_client_vendor (void)
+get_sftp_client_vendor (gboolean *use_control_master)
 {
   char *ssh_stderr;
   char *args[3];
   gint ssh_exitcode;
   SFTPClientVendor res = SFTP_VENDOR_INVALID;
+
+  *use_control_master = FALSE;
   
   args[0] = g_strdup (SSH_PROGRAM);
   args[1] = g_strdup ("-V");
@@ -238,7 +384,10 @@ get_sftp_client_vendor (void)
 	res = SFTP_VENDOR_INVALID;
       else if ((strstr (ssh_stderr, "OpenSSH") != NULL) ||
 	       (strstr (ssh_stderr, "Sun_SSH") != NULL))
-	res = SFTP_VENDOR_OPENSSH;
+	{
+	  res = SFTP_VENDOR_OPENSSH;
+	  *use_control_master = openssh_supports_control_master (ssh_stderr);
+	}
       else if (strstr (ssh_stderr, "SSH Secure Shell") != NULL)
 	res = SFTP_VENDOR_SSH;
       else
@@ -258,26 +407,149 @@ has_extension (GVfsBackendSftp *backend, SFTPServerExtensions extension)
   return (backend->extensions & (1 << extension)) != 0;
 }
 
+static SftpDirCacheEntry *
+dir_cache_entry_new (GFileAttributeMatcher *matcher,
+                     GFileQueryInfoFlags flags)
+{
+  SftpDirCacheEntry *entry;
+
+  entry = g_slice_new0 (SftpDirCacheEntry);
+  entry->infos = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+  entry->matcher = g_file_attribute_matcher_ref (matcher);
+  entry->flags = flags;
+
+  return entry;
+}
+
 static void
-g_vfs_backend_sftp_finalize (GObject *object)
+dir_cache_entry_free (SftpDirCacheEntry *entry)
 {
-  GVfsBackendSftp *backend;
+  if (entry)
+    {
+      g_hash_table_destroy (entry->infos);
+      g_file_attribute_matcher_unref (entry->matcher);
+      g_slice_free (SftpDirCacheEntry, entry);
+    }
+}
 
-  backend = G_VFS_BACKEND_SFTP (object);
+static gboolean
+dir_cache_entry_expired (gpointer key,
+                         gpointer value,
+                         gpointer user_data)
+{
+  SftpDirCacheEntry *entry = value;
+  gint64 *now = user_data;
+
+  return *now - entry->stamp > DIR_CACHE_TIMEOUT;
+}
+
+static void
+dir_cache_insert (GVfsBackendSftp *backend,
+                  const char *dirname,
+                  SftpDirCacheEntry *entry)
+{
+  entry->stamp = g_get_monotonic_time ();
+
+  g_hash_table_foreach_remove (backend->dir_cache, dir_cache_entry_expired, &entry->stamp);
+  g_hash_table_replace (backend->dir_cache, g_strdup (dirname), entry);
+}
+
+/* Returns the cached info for filename if its directory was enumerated
+   recently with all the attributes in matcher, or NULL */
+static GFileInfo *
+dir_cache_lookup (GVfsBackendSftp *backend,
+                  const char *filename,
+                  GFileQueryInfoFlags flags,
+                  GFileAttributeMatcher *matcher)
+{
+  SftpDirCacheEntry *entry;
+  GFileAttributeMatcher *missing;
+  GFileInfo *info;
+  char *dirname, *basename;
+  gint64 now;
 
-  g_hash_table_destroy (backend->expected_replies);
+  if (strcmp (filename, "/") == 0)
+    return NULL;
   
-  if (backend->command_stream)
-    g_object_unref (backend->command_stream);
+  dirname = g_path_get_dirname (filename);
+  entry = g_hash_table_lookup (backend->dir_cache, dirname);
+
+  info = NULL;
+  now = g_get_monotonic_time ();
+  if (entry != NULL && dir_cache_entry_expired (NULL, entry, &now))
+    g_hash_table_remove (backend->dir_cache, dirname);
+  else if (entry != NULL &&
+           (entry->flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS) ==
+           (flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS))
+    {
+      missing = g_file_attribute_matcher_subtract (matcher, entry->matcher);
+      if (missing == NULL)
+        {
+          basename = g_path_get_basename (filename);
+          info = g_hash_table_lookup (entry->infos, basename);
+          g_free (basename);
+        }
+      else
+        g_file_attribute_matcher_unref (missing);
+    }
   
-  if (backend->reply_stream_cancellable)
-    g_object_unref (backend->reply_stream_cancellable);
+  g_free (dirname);
+
+  return info;
+}
+
+static gboolean
+dir_cache_entry_is_below (gpointer key,
+                          gpointer value,
+                          gpointer user_data)
+{
+  const char *dirname = key;
+  const char *filename = user_data;
+  gsize len;
+
+  len = strlen (filename);
+  return strncmp (dirname, filename, len) == 0 &&
+    (dirname[len] == 0 || dirname[len] == '/');
+}
 
-  if (backend->reply_stream)
-    g_object_unref (backend->reply_stream);
+/* Called whenever filename may have been changed on the server. Drops
+   its directory, and filename itself and everything below it in case
+   it is a directory. */
+static void
+dir_cache_purge (GVfsBackendSftp *backend,
+                 const char *filename)
+{
+  char *dirname;
+
+  backend->dir_cache_generation++;
+
+  if (g_hash_table_size (backend->dir_cache) == 0)
+    return;
   
-  if (backend->error_stream)
-    g_object_unref (backend->error_stream);
+  dirname = g_path_get_dirname (filename);
+  g_hash_table_remove (backend->dir_cache, dirname);
+  g_free (dirname);
+
+  g_hash_table_foreach_remove (backend->dir_cache, dir_cache_entry_is_below, (gpointer)filename);
+}
+
+static void
+g_vfs_backend_sftp_finalize (GObject *object)
+{
+  GVfsBackendSftp *backend;
+
+  backend = G_VFS_BACKEND_SFTP (object);
+
+  g_ptr_array_foreach (backend->connections, (GFunc)connection_free, NULL);
+  g_ptr_array_free (backend->connections, TRUE);
+  g_ptr_array_free (backend->dead_connections, TRUE);
+  g_hash_table_destroy (backend->dir_cache);
+
+  if (backend->login_password)
+    {
+      memset (backend->login_password, 0, strlen (backend->login_password));
+      g_free (backend->login_password);
+    }
   
   if (G_OBJECT_CLASS (g_vfs_backend_sftp_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_backend_sftp_parent_class)->finalize) (object);
@@ -290,21 +562,85 @@ expected_reply_free (ExpectedReply *reply)
   g_slice_free (ExpectedReply, reply);
 }
 
+static SftpConnection *
+connection_new (GVfsBackendSftp *backend)
+{
+  SftpConnection *connection;
+
+  connection = g_slice_new0 (SftpConnection);
+  connection->backend = backend;
+  connection->expected_replies = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)expected_reply_free);
+  connection->recv_buffer_size = RECV_BUFFER_SIZE;
+  connection->recv_buffer = g_malloc (connection->recv_buffer_size);
+
+  return connection;
+}
+
+static void
+connection_free (SftpConnection *connection)
+{
+  g_hash_table_destroy (connection->expected_replies);
+  g_queue_foreach (&connection->command_queue, (GFunc)data_buffer_free, NULL);
+  g_queue_clear (&connection->command_queue);
+  g_free (connection->recv_buffer);
+
+  if (connection->command_stream)
+    g_object_unref (connection->command_stream);
+  
+  if (connection->reply_stream_cancellable)
+    g_object_unref (connection->reply_stream_cancellable);
+
+  if (connection->reply_stream)
+    g_object_unref (connection->reply_stream);
+  
+  if (connection->error_stream)
+    g_object_unref (connection->error_stream);
+
+  g_slice_free (SftpConnection, connection);
+}
+
 static void
 g_vfs_backend_sftp_init (GVfsBackendSftp *backend)
 {
-  backend->expected_replies = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)expected_reply_free);
+  const char *max_connections;
+
+  backend->connections = g_ptr_array_new ();
+  backend->dead_connections = g_ptr_array_new_with_free_func ((GDestroyNotify)connection_free);
+  backend->dir_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify)dir_cache_entry_free);
+
+  backend->max_read_size = DEFAULT_BLOCKSIZE;
+  backend->max_write_size = DEFAULT_BLOCKSIZE;
+
+  backend->max_connections = DEFAULT_MAX_CONNECTIONS;
+  max_connections = g_getenv ("GVFS_SFTP_CONNECTIONS");
+  if (max_connections != NULL && atoi (max_connections) > 0)
+    backend->max_connections = atoi (max_connections);
+
+  backend->resume_transfers = g_getenv ("GVFS_SFTP_RESUME") != NULL;
+
+#ifdef HAVE_LIBSSH
+  backend->use_libssh = g_getenv ("GVFS_SFTP_NO_LIBSSH") == NULL;
+#endif
 }
 
 static void
-look_for_stderr_errors (GVfsBackend *backend, GError **error)
+look_for_stderr_errors (SftpConnection *connection, GError **error)
 {
-  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   char *line;
 
+  /* No ssh program to complain with libssh */
+  if (connection->error_stream == NULL)
+    {
+      g_set_error_literal (error,
+                           G_IO_ERROR, G_IO_ERROR_FAILED,
+                           _("Protocol error"));
+      return;
+    }
+
   while (1)
     {
-      line = g_data_input_stream_read_line (op_backend->error_stream, NULL, NULL, NULL);
+      line = g_data_input_stream_read_line (connection->error_stream, NULL, NULL, NULL);
       
       if (line == NULL)
         {
@@ -432,14 +768,35 @@ setup_ssh_environment (void)
   g_object_unref (conn);
 }
 
+/* Directory for the ssh control sockets and the server info cache. It
+   is in the runtime dir, so it is private and goes away on logout. */
+static char *
+get_runtime_dir (void)
+{
+  char *dir;
+
+  dir = g_build_filename (g_get_user_runtime_dir (), "gvfs-sftp", NULL);
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    {
+      g_free (dir);
+      return NULL;
+    }
+
+  return dir;
+}
+
+/* The first connection of a mount shares the control master with other
+   mounts of the same user and host. The further connections of the pool
+   exist to run in parallel with it, so they never multiplex over it. */
 static char **
-setup_ssh_commandline (GVfsBackend *backend)
+setup_ssh_commandline (GVfsBackend *backend,
+                       gboolean first_connection)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   guint last_arg;
   gchar **args;
 
-  args = g_new0 (gchar *, 20); /* 20 is enought for now, bump size if code below changes */
+  args = g_new0 (gchar *, 24); /* 24 is enought for now, bump size if code below changes */
 
   /* Fill in the first few args */
   last_arg = 0;
@@ -456,7 +813,28 @@ setup_ssh_commandline (GVfsBackend *backend)
 #ifndef USE_PTY
       args[last_arg++] = g_strdup ("-oBatchMode yes");
 #endif
-    
+
+      if (op_backend->use_control_master && first_connection)
+        {
+          char *dir;
+
+          /* Share one ssh connection between all mounts of the same
+             user and host, later mounts skip the key exchange and
+             authentication */
+          dir = get_runtime_dir ();
+          if (dir != NULL)
+            {
+              args[last_arg++] = g_strdup ("-oControlMaster auto");
+              args[last_arg++] = g_strdup_printf ("-oControlPath %s/%%C", dir);
+              args[last_arg++] = g_strdup ("-oControlPersist 60");
+              g_free (dir);
+            }
+        }
+      else if (op_backend->use_control_master)
+        {
+          args[last_arg++] = g_strdup ("-oControlMaster no");
+          args[last_arg++] = g_strdup ("-oControlPath none");
+        }
     }
   else if (op_backend->client_vendor == SFTP_VENDOR_SSH)
     args[last_arg++] = g_strdup ("-x");
@@ -543,60 +921,91 @@ get_new_id (GVfsBackendSftp *backend)
   return backend->current_id++;
 }
 
-static GDataOutputStream *
-new_command_stream (GVfsBackendSftp *backend, int type)
+static void
+put_byte (GByteArray *command, guint8 v)
 {
-  GOutputStream *mem_stream;
-  GDataOutputStream *data_stream;
-  guint32 id;
+  g_byte_array_append (command, &v, 1);
+}
+
+static void
+put_uint32 (GByteArray *command, guint32 v)
+{
+  v = GUINT32_TO_BE (v);
+  g_byte_array_append (command, (guint8 *)&v, 4);
+}
 
-  mem_stream = g_memory_output_stream_new (NULL, 0, (GReallocFunc)g_realloc, NULL);
-  data_stream = g_data_output_stream_new (mem_stream);
-  g_object_unref (mem_stream);
+static void
+put_uint64 (GByteArray *command, guint64 v)
+{
+  v = GUINT64_TO_BE (v);
+  g_byte_array_append (command, (guint8 *)&v, 8);
+}
+
+static void
+put_data (GByteArray *command, gconstpointer data, gsize len)
+{
+  g_byte_array_append (command, data, len);
+}
+
+/* Commands are built in a byte array, starting with room for the
+ * length that get_data_from_command() fills in. size is what the whole
+ * command is expected to take. */
+static GByteArray *
+new_command_sized (GVfsBackendSftp *backend, int type, gsize size)
+{
+  GByteArray *command;
+
+  command = g_byte_array_sized_new (size);
 
-  g_data_output_stream_put_int32 (data_stream, 0, NULL, NULL); /* LEN */
-  g_data_output_stream_put_byte (data_stream, type, NULL, NULL);
+  put_uint32 (command, 0); /* LEN */
+  put_byte (command, type);
   if (type != SSH_FXP_INIT)
-    {
-      id = get_new_id (backend);
-      g_data_output_stream_put_uint32 (data_stream, id, NULL, NULL);
-      g_object_set_qdata (G_OBJECT (data_stream), id_q, GUINT_TO_POINTER (id));
-    }
+    put_uint32 (command, get_new_id (backend));
   
-  return data_stream;
+  return command;
+}
+
+static GByteArray *
+new_command (GVfsBackendSftp *backend, int type)
+{
+  return new_command_sized (backend, type, COMMAND_SIZE);
+}
+
+static guint32
+get_command_id (GByteArray *command)
+{
+  guint32 id;
+
+  memcpy (&id, command->data + 5, 4);
+  return GUINT32_FROM_BE (id);
 }
 
 static gpointer
-get_data_from_command_stream (GDataOutputStream *command_stream, gsize *len)
+get_data_from_command (GByteArray *command, gsize *len)
 {
-  GOutputStream *mem_stream;
-  gpointer data;
-  guint32 *len_ptr;
-  
-  mem_stream = g_filter_output_stream_get_base_stream (G_FILTER_OUTPUT_STREAM (command_stream));
-  *len = g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (mem_stream));
-  data = g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (mem_stream));
+  guint32 len_be;
 
-  len_ptr = (guint32 *)data;
-  *len_ptr = GUINT32_TO_BE (*len - 4);
-  
-  return data;
+  *len = command->len;
+  len_be = GUINT32_TO_BE (*len - 4);
+  memcpy (command->data, &len_be, 4);
+
+  return g_byte_array_free (command, FALSE);
 }
 
 static gboolean
-send_command_sync_and_unref_command (GVfsBackendSftp *backend,
-                                     GDataOutputStream *command_stream,
-                                     GCancellable *cancellable,
-                                     GError **error)
+send_command_sync_and_free (SftpConnection *connection,
+                            GByteArray *command,
+                            GCancellable *cancellable,
+                            GError **error)
 {
   gpointer data;
   gsize len;
   gsize bytes_written;
   gboolean res;
   
-  data = get_data_from_command_stream (command_stream, &len);
+  data = get_data_from_command (command, &len);
 
-  res = g_output_stream_write_all (backend->command_stream,
+  res = g_output_stream_write_all (connection->command_stream,
                                    data, len,
                                    &bytes_written,
                                    cancellable, error);
@@ -605,7 +1014,6 @@ send_command_sync_and_unref_command (GVfsBackendSftp *backend,
     g_warning ("Ignored send_command error\n");
 
   g_free (data);
-  g_object_unref (command_stream);
 
   return res;
 }
@@ -635,28 +1043,73 @@ wait_for_reply (GVfsBackend *backend, int stdout_fd, GError **error)
   return TRUE;
 }
 
-static GDataInputStream *
-make_reply_stream (guint8 *data, gsize len)
+/* Returns a reply with its own copy of len bytes of data, or with
+ * room for them if data is NULL. Free it with g_free(). */
+static SftpReply *
+reply_new (const guint8 *data, gsize len)
 {
-  GInputStream *mem_stream;
-  GDataInputStream *data_stream;
-  
-  mem_stream = g_memory_input_stream_new_from_data (data, len, g_free);
-  data_stream = g_data_input_stream_new (mem_stream);
-  g_object_unref (mem_stream);
-  
-  return data_stream;
+  SftpReply *reply;
+
+  reply = g_malloc (sizeof (SftpReply) + len);
+  reply->data = (guint8 *)(reply + 1);
+  reply->size = len;
+  reply->pos = 0;
+  if (data)
+    memcpy (reply->data, data, len);
+
+  return reply;
+}
+
+static gboolean
+reply_read_data (SftpReply *reply, gpointer data, gsize len)
+{
+  if (len > reply->size - reply->pos)
+    {
+      reply->pos = reply->size;
+      return FALSE;
+    }
+
+  memcpy (data, reply->data + reply->pos, len);
+  reply->pos += len;
+  return TRUE;
+}
+
+/* Reading past the end of the reply gives 0 */
+static guint8
+reply_read_byte (SftpReply *reply)
+{
+  guint8 v = 0;
+
+  reply_read_data (reply, &v, 1);
+  return v;
+}
+
+static guint32
+reply_read_uint32 (SftpReply *reply)
+{
+  guint32 v = 0;
+
+  reply_read_data (reply, &v, 4);
+  return GUINT32_FROM_BE (v);
 }
 
-static GDataInputStream *
-read_reply_sync (GVfsBackendSftp *backend, gsize *len_out, GError **error)
+static guint64
+reply_read_uint64 (SftpReply *reply)
+{
+  guint64 v = 0;
+
+  reply_read_data (reply, &v, 8);
+  return GUINT64_FROM_BE (v);
+}
+
+static SftpReply *
+read_reply_sync (SftpConnection *connection, gsize *len_out, GError **error)
 {
   guint32 len;
   gsize bytes_read;
-  GByteArray *array;
-  guint8 *data;
+  SftpReply *reply;
   
-  if (!g_input_stream_read_all (backend->reply_stream,
+  if (!g_input_stream_read_all (connection->reply_stream,
 				&len, 4,
 				&bytes_read, NULL, error))
     return NULL;
@@ -673,65 +1126,56 @@ read_reply_sync (GVfsBackendSftp *backend, gsize *len_out, GError **error)
   
   len = GUINT32_FROM_BE (len);
   
-  array = g_byte_array_sized_new (len);
+  reply = reply_new (NULL, len);
 
-  if (!g_input_stream_read_all (backend->reply_stream,
-				array->data, len,
+  if (!g_input_stream_read_all (connection->reply_stream,
+				reply->data, len,
 				&bytes_read, NULL, error))
     {
-      g_byte_array_free (array, TRUE);
+      g_free (reply);
       return NULL;
     }
+  reply->size = bytes_read;
 
   if (len_out)
     *len_out = len;
 
-  data = array->data;
-  g_byte_array_free (array, FALSE);
-  
-  return make_reply_stream (data, len);
+  return reply;
 }
 
 static void
-put_string (GDataOutputStream *stream, const char *str)
+put_string (GByteArray *command, const char *str)
 {
-  g_data_output_stream_put_uint32 (stream, strlen (str), NULL, NULL);
-  g_data_output_stream_put_string (stream, str, NULL, NULL);
+  put_uint32 (command, strlen (str));
+  put_data (command, str, strlen (str));
 }
 
 static void
-put_data_buffer (GDataOutputStream *stream, DataBuffer *buffer)
+put_data_buffer (GByteArray *command, DataBuffer *buffer)
 {
-  g_data_output_stream_put_uint32 (stream, buffer->size, NULL, NULL);
-  g_output_stream_write_all (G_OUTPUT_STREAM (stream),
-                             buffer->data, buffer->size,
-                             NULL,
-                             NULL, NULL);
+  put_uint32 (command, buffer->size);
+  put_data (command, buffer->data, buffer->size);
 }
 
 static char *
-read_string (GDataInputStream *stream, gsize *len_out)
+read_string (SftpReply *reply, gsize *len_out)
 {
   guint32 len;
   char *data;
-  GError *error;
 
-  error = NULL;
-  len = g_data_input_stream_read_uint32 (stream, NULL, &error);
-  if (error)
-    {
-      g_error_free (error);
-      return NULL;
-    }
-  
-  data = g_malloc (len + 1);
+  if (reply->size - reply->pos < 4)
+    return NULL;
+  len = reply_read_uint32 (reply);
 
-  if (!g_input_stream_read_all (G_INPUT_STREAM (stream), data, len, NULL, NULL, NULL))
+  /* A broken length must not make us allocate more than the reply has */
+  if (len > reply->size - reply->pos)
     {
-      g_free (data);
+      reply->pos = reply->size;
       return NULL;
     }
   
+  data = g_malloc (len + 1);
+  reply_read_data (reply, data, len);
   data[len] = 0;
 
   if (len_out)
@@ -741,12 +1185,12 @@ read_string (GDataInputStream *stream, gsize *len_out)
 }
 
 static DataBuffer *
-read_data_buffer (GDataInputStream *stream)
+read_data_buffer (SftpReply *reply)
 {
   DataBuffer *buffer;
 
-  buffer = g_slice_new (DataBuffer);
-  buffer->data = (guchar *)read_string (stream, &buffer->size);
+  buffer = g_slice_new0 (DataBuffer);
+  buffer->data = (guchar *)read_string (reply, &buffer->size);
   
   return buffer;
 }
@@ -841,6 +1285,17 @@ get_object_from_password_line (const char *password_line)
   return object;
 }
 
+static gboolean
+is_password_prompt (const char *buffer)
+{
+  return g_str_has_suffix (buffer, "password: ") ||
+         g_str_has_suffix (buffer, "Password: ") ||
+         g_str_has_suffix (buffer, "Password:")  ||
+         g_str_has_prefix (buffer, "Password for ") ||
+         g_str_has_prefix (buffer, "Enter Kerberos password") ||
+         g_str_has_prefix (buffer, "Enter passphrase for key");
+}
+
 static gboolean
 handle_login (GVfsBackend *backend,
               GMountSource *mount_source,
@@ -928,12 +1383,7 @@ handle_login (GVfsBackend *backend,
        * Otherwise, we "new_password" and "new_user_name" is used, as output variable
        * for user and keyring input.
        */
-      if (g_str_has_suffix (buffer, "password: ") ||
-          g_str_has_suffix (buffer, "Password: ") ||
-          g_str_has_suffix (buffer, "Password:")  ||
-          g_str_has_prefix (buffer, "Password for ") ||
-          g_str_has_prefix (buffer, "Enter Kerberos password") ||
-          g_str_has_prefix (buffer, "Enter passphrase for key"))
+      if (is_password_prompt (buffer))
         {
 	  authtype = get_authtype_from_password_line (buffer);
 	  object = get_object_from_password_line (buffer);
@@ -1135,6 +1585,13 @@ handle_login (GVfsBackend *backend,
 				   0, 
                                    new_password,
                                    op_backend->password_save);
+
+      /* Kept for logging in additional connections */
+      if (new_password)
+        {
+          g_free (op_backend->login_password);
+          op_backend->login_password = g_strdup (new_password);
+        }
     }
 
   g_free (object);
@@ -1144,17 +1601,123 @@ handle_login (GVfsBackend *backend,
   return ret_val;
 }
 
-static void
-fail_jobs_and_die (GVfsBackendSftp *backend, GError *error)
+/* Logs in an additional connection. A password prompt is answered with
+ * the password the mount was authenticated with, anything else fails as
+ * nobody can be asked at this point. */
+static gboolean
+handle_login_again (GVfsBackend *backend,
+                    int tty_fd, int stdout_fd, int stderr_fd,
+                    GError **error)
 {
-  GHashTableIter iter;
-  gpointer key, value;
-
-  g_hash_table_iter_init (&iter, backend->expected_replies);
-  while (g_hash_table_iter_next (&iter, &key, &value))
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GInputStream *prompt_stream;
+  GOutputStream *reply_stream;
+  int ret;
+  int prompt_fd;
+  struct pollfd fds[2];
+  char buffer[1024];
+  gssize len;
+  gboolean ret_val;
+  gboolean password_sent = FALSE;
+  gsize bytes_written;
+
+  if (op_backend->client_vendor == SFTP_VENDOR_SSH) 
+    prompt_fd = stderr_fd;
+  else
+    prompt_fd = tty_fd;
+
+  prompt_stream = g_unix_input_stream_new (prompt_fd, FALSE);
+  reply_stream = g_unix_output_stream_new (tty_fd, FALSE);
+
+  ret_val = TRUE;
+  while (1)
+    {
+      fds[0].fd = stdout_fd;
+      fds[0].events = POLLIN;
+      fds[1].fd = prompt_fd;
+      fds[1].events = POLLIN;
+      
+      ret = poll(fds, 2, SFTP_READ_TIMEOUT * 1000);
+      
+      if (ret <= 0)
+        {
+          g_set_error_literal (error,
+	                       G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+        	               _("Timed out when logging in"));
+          ret_val = FALSE;
+          break;
+        }
+      
+      if (fds[0].revents)
+        break; /* Got reply to initial INIT request */
+      
+      if (!(fds[1].revents & POLLIN))
+        continue;
+      
+      len = g_input_stream_read (prompt_stream,
+                                 buffer, sizeof (buffer) - 1,
+                                 NULL, error);
+      
+      if (len == -1)
+        {
+          ret_val = FALSE;
+          break;
+        }
+      
+      buffer[len] = 0;
+
+      if (!is_password_prompt (buffer) ||
+          op_backend->login_password == NULL ||
+          password_sent)
+        {
+          g_set_error_literal (error,
+	                       G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED,
+        	               _("Permission denied"));
+          ret_val = FALSE;
+          break;
+        }
+
+      if (!g_output_stream_write_all (reply_stream,
+                                      op_backend->login_password,
+                                      strlen (op_backend->login_password),
+                                      &bytes_written,
+                                      NULL, NULL) ||
+          !g_output_stream_write_all (reply_stream,
+                                      "\n", 1,
+                                      &bytes_written,
+                                      NULL, NULL))
+        {
+          g_set_error_literal (error,
+	                       G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED,
+        	               _("Can't send password"));
+          ret_val = FALSE;
+          break;
+        }
+      password_sent = TRUE;
+    }
+
+  g_object_unref (prompt_stream);
+  g_object_unref (reply_stream);
+  return ret_val;
+}
+
+static void
+fail_jobs_and_die (GVfsBackendSftp *backend, GError *error)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  SftpConnection *connection;
+  guint i;
+
+  for (i = 0; i < backend->connections->len; i++)
     {
-      ExpectedReply *expected_reply = (ExpectedReply *) value;
-      g_vfs_job_failed_from_error (expected_reply->job, error);
+      connection = g_ptr_array_index (backend->connections, i);
+      g_hash_table_iter_init (&iter, connection->expected_replies);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          ExpectedReply *expected_reply = (ExpectedReply *) value;
+          g_vfs_job_failed_from_error (expected_reply->job, error);
+        }
     }
 
   g_error_free (error);
@@ -1162,8 +1725,128 @@ fail_jobs_and_die (GVfsBackendSftp *backend, GError *error)
   g_vfs_backend_force_unmount ((GVfsBackend*)backend);
 }
 
+static guint32
+get_be32 (const guint8 *data)
+{
+  guint32 v;
+
+  memcpy (&v, data, 4);
+  return GUINT32_FROM_BE (v);
+}
+
+static guint8 *
+put_be32 (guint8 *data, guint32 v)
+{
+  v = GUINT32_TO_BE (v);
+  memcpy (data, &v, 4);
+  return data + 4;
+}
+
+/* Answers the outstanding requests of a dead connection with a
+   CONNECTION_LOST status, so that their jobs fail and clean up like
+   on any other error. Requests queued by the callbacks are answered
+   the same way. */
+static gboolean
+connection_fail_replies (gpointer user_data)
+{
+  SftpConnection *connection = user_data;
+  GHashTable *expected_replies;
+  GHashTableIter iter;
+  gpointer key, value;
+  ExpectedReply *expected_reply;
+  SftpReply reply;
+  guint8 data[1 + 4 + 4 + 4 + 4];
+
+  connection->fail_replies_id = 0;
+
+  while (g_hash_table_size (connection->expected_replies) > 0)
+    {
+      expected_replies = connection->expected_replies;
+      connection->expected_replies = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)expected_reply_free);
+
+      g_hash_table_iter_init (&iter, expected_replies);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          expected_reply = value;
+          if (expected_reply->callback == NULL)
+            continue;
+
+          /* Type, id, code and an empty message and language tag */
+          memset (data, 0, sizeof (data));
+          data[0] = SSH_FXP_STATUS;
+          put_be32 (data + 1, GPOINTER_TO_UINT (key));
+          put_be32 (data + 5, SSH_FX_CONNECTION_LOST);
+
+          reply.data = data;
+          reply.size = sizeof (data);
+          reply.pos = 5;
+          (expected_reply->callback) (connection->backend, SSH_FXP_STATUS, &reply, sizeof (data),
+                                      expected_reply->job, expected_reply->user_data);
+        }
+
+      g_hash_table_destroy (expected_replies);
+    }
+
+  return FALSE;
+}
+
+static void
+connection_fail_replies_done (gpointer user_data)
+{
+  SftpConnection *connection = user_data;
+
+  g_object_unref (connection->backend);
+}
+
+static void
+connection_schedule_fail_replies (SftpConnection *connection)
+{
+  if (connection->fail_replies_id != 0)
+    return;
+
+  g_object_ref (connection->backend);
+  connection->fail_replies_id = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+                                                 connection_fail_replies,
+                                                 connection,
+                                                 connection_fail_replies_done);
+}
+
+/* Losing the first connection, or the only one left, unmounts. Any
+   other connection is dropped from the pool and only fails the jobs
+   that use it. */
+static void
+connection_died (SftpConnection *connection, GError *error)
+{
+  GVfsBackendSftp *backend = connection->backend;
+
+  if (connection->dead)
+    {
+      g_error_free (error);
+      return;
+    }
+
+  if (backend->connections->len == 1 ||
+      g_ptr_array_index (backend->connections, 0) == connection)
+    {
+      fail_jobs_and_die (backend, error);
+      return;
+    }
+
+  g_debug ("sftp: Dropping connection: %s\n", error->message);
+  g_error_free (error);
+
+  connection->dead = TRUE;
+  connection->direct_reply = NULL;
+  g_cancellable_cancel (connection->reply_stream_cancellable);
+
+  g_ptr_array_remove (backend->connections, connection);
+  g_ptr_array_add (backend->dead_connections, connection);
+
+  connection_schedule_fail_replies (connection);
+}
+
 static void
-check_input_stream_read_result (GVfsBackendSftp *backend, gssize res, GError *error)
+check_input_stream_read_result (SftpConnection *connection, gssize res, GError *error)
 {
   if (G_UNLIKELY (res <= 0))
     {
@@ -1175,69 +1858,145 @@ check_input_stream_read_result (GVfsBackendSftp *backend, gssize res, GError *er
                        res == 0 ? "The underlying SSH process died" : "Unkown Error");
         }
 
-      fail_jobs_and_die (backend, error);
+      connection_died (connection, error);
     }
 }
 
-static void read_reply_async (GVfsBackendSftp *backend);
+static void read_reply_async (SftpConnection *connection);
 
+/* The reply only borrows the receive buffer, callbacks must not keep
+   it around */
 static void
-read_reply_async_got_data  (GObject *source_object,
-                            GAsyncResult *result,
-                            gpointer user_data)
+dispatch_reply (SftpConnection *connection,
+                guint8 *data,
+                guint32 len)
 {
-  GVfsBackendSftp *backend = user_data;
-  gssize res;
-  GDataInputStream *reply;
+  GVfsBackendSftp *backend = connection->backend;
+  SftpReply reply;
   ExpectedReply *expected_reply;
   guint32 id;
   int type;
-  GError *error;
-
-  error = NULL;
-  res = g_input_stream_read_finish (G_INPUT_STREAM (source_object), result, &error);
 
-  check_input_stream_read_result (backend, res, error);
+  reply.data = data;
+  reply.size = len;
+  reply.pos = 0;
 
-  backend->reply_size_read += res;
+  type = reply_read_byte (&reply);
+  id = reply_read_uint32 (&reply);
 
-  if (backend->reply_size_read < backend->reply_size)
+  expected_reply = g_hash_table_lookup (connection->expected_replies, GINT_TO_POINTER (id));
+  if (expected_reply)
     {
-      g_input_stream_read_async (backend->reply_stream,
-				 backend->reply + backend->reply_size_read, backend->reply_size - backend->reply_size_read,
-				 0, NULL, read_reply_async_got_data, backend);
-      return;
+      if (expected_reply->callback != NULL)
+        (expected_reply->callback) (backend, type, &reply, len,
+                                    expected_reply->job, expected_reply->user_data);
+      g_hash_table_remove (connection->expected_replies, GINT_TO_POINTER (id));
     }
+  else
+    g_warning ("Got unhandled reply of size %"G_GUINT32_FORMAT" for id %"G_GUINT32_FORMAT"\n", len, id);
+}
 
-  reply = make_reply_stream (backend->reply, backend->reply_size);
-  backend->reply = NULL;
+static void
+dispatch_direct_reply (SftpConnection *connection,
+                       guint32 id,
+                       ExpectedReply *expected_reply,
+                       gsize size)
+{
+  if (expected_reply->callback != NULL)
+    (expected_reply->callback) (connection->backend, SSH_FXP_DATA, NULL, size,
+                                expected_reply->job, expected_reply->user_data);
+  g_hash_table_remove (connection->expected_replies, GINT_TO_POINTER (id));
+}
 
-  type = g_data_input_stream_read_byte (reply, NULL, NULL);
-  id = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+/* Dispatches all complete replies in the receive buffer, or starts
+   reading the rest of a DATA reply straight into its data buffer */
+static void
+process_replies (SftpConnection *connection)
+{
+  ExpectedReply *expected_reply;
+  guint8 *data;
+  gsize avail, have, need;
+  guint32 len, id, count;
 
-  expected_reply = g_hash_table_lookup (backend->expected_replies, GINT_TO_POINTER (id));
-  if (expected_reply)
+  len = 0;
+  while (TRUE)
     {
-      if (expected_reply->callback != NULL)
-        (expected_reply->callback) (backend, type, reply, backend->reply_size,
-                                    expected_reply->job, expected_reply->user_data);
-      g_hash_table_remove (backend->expected_replies, GINT_TO_POINTER (id));
+      data = connection->recv_buffer + connection->recv_start;
+      avail = connection->recv_end - connection->recv_start;
+
+      if (avail < 4)
+        break;
+      len = get_be32 (data);
+
+      /* len, type, id and count of a DATA reply */
+      if (avail >= 13 && data[4] == SSH_FXP_DATA)
+        {
+          id = get_be32 (data + 5);
+          count = get_be32 (data + 9);
+          expected_reply = g_hash_table_lookup (connection->expected_replies, GINT_TO_POINTER (id));
+
+          if (expected_reply != NULL &&
+              expected_reply->data_buffer != NULL &&
+              count <= expected_reply->data_buffer_size &&
+              len == 9 + count)
+            {
+              have = MIN (avail - 13, count);
+              memcpy (expected_reply->data_buffer, data + 13, have);
+              connection->recv_start += 13 + have;
+
+              if (have < count)
+                {
+                  connection->direct_reply = expected_reply;
+                  connection->direct_id = id;
+                  connection->direct_size = count;
+                  connection->direct_read = have;
+                  return;
+                }
+
+              dispatch_direct_reply (connection, id, expected_reply, count);
+              continue;
+            }
+        }
+
+      if (avail - 4 < len)
+        break;
+
+      dispatch_reply (connection, data + 4, len);
+      connection->recv_start += 4 + len;
     }
-  else
-    g_warning ("Got unhandled reply of size %"G_GUINT32_FORMAT" for id %"G_GUINT32_FORMAT"\n", backend->reply_size, id);
 
-  g_object_unref (reply);
+  if (connection->recv_start == connection->recv_end)
+    {
+      connection->recv_start = connection->recv_end = 0;
+      return;
+    }
 
-  read_reply_async (backend);
-  
+  /* Make room for the rest of the partial reply */
+  avail = connection->recv_end - connection->recv_start;
+  need = avail < 4 ? 4 : 4 + (gsize)len;
+  if (need > connection->recv_buffer_size - connection->recv_start)
+    {
+      memmove (connection->recv_buffer,
+               connection->recv_buffer + connection->recv_start,
+               avail);
+      connection->recv_start = 0;
+      connection->recv_end = avail;
+    }
+  if (need > connection->recv_buffer_size)
+    {
+      connection->recv_buffer_size = MAX (need, connection->recv_buffer_size * 2);
+      connection->recv_buffer = g_realloc (connection->recv_buffer, connection->recv_buffer_size);
+    }
 }
 
 static void
-read_reply_async_got_len  (GObject *source_object,
-                           GAsyncResult *result,
-                           gpointer user_data)
+read_reply_async_got_data  (GObject *source_object,
+                            GAsyncResult *result,
+                            gpointer user_data)
 {
-  GVfsBackendSftp *backend = user_data;
+  SftpConnection *connection = user_data;
+  GVfsBackendSftp *backend = connection->backend;
+  ExpectedReply *expected_reply;
   gssize res;
   GError *error;
 
@@ -1252,101 +2011,128 @@ read_reply_async_got_len  (GObject *source_object,
       return;
     }
 
-  check_input_stream_read_result (backend, res, error);
-
-  backend->reply_size_read += res;
-
-  if (backend->reply_size_read < 4)
+  if (res <= 0)
     {
-      g_input_stream_read_async (backend->reply_stream,
-				 (char *)&backend->reply_size + backend->reply_size_read, 4 - backend->reply_size_read,
-				 0, backend->reply_stream_cancellable, read_reply_async_got_len,
-				 backend);
+      check_input_stream_read_result (connection, res, error);
+      g_object_unref (backend);
       return;
     }
-  backend->reply_size = GUINT32_FROM_BE (backend->reply_size);
 
-  backend->reply_size_read = 0;
-  backend->reply = g_malloc (backend->reply_size);
-  g_input_stream_read_async (backend->reply_stream,
-			     backend->reply, backend->reply_size,
-			     0, NULL, read_reply_async_got_data, backend);
+  if (connection->direct_reply != NULL)
+    {
+      connection->direct_read += res;
+      if (connection->direct_read < connection->direct_size)
+        {
+          read_reply_async (connection);
+          return;
+        }
+
+      expected_reply = connection->direct_reply;
+      connection->direct_reply = NULL;
+      dispatch_direct_reply (connection, connection->direct_id, expected_reply,
+                             connection->direct_size);
+    }
+  else
+    connection->recv_end += res;
+
+  process_replies (connection);
+  read_reply_async (connection);
 }
 
+/* Each connection reading replies holds a reference on the backend.
+   Reads are as large as the free space of the receive buffer, so one
+   read usually brings in many replies. */
 static void
-read_reply_async (GVfsBackendSftp *backend)
-{
-  backend->reply_size_read = 0;
-  g_input_stream_read_async (backend->reply_stream,
-                             &backend->reply_size, 4,
-                             0, backend->reply_stream_cancellable,
-                             read_reply_async_got_len,
-                             backend);
+read_reply_async (SftpConnection *connection)
+{
+  if (connection->direct_reply != NULL)
+    g_input_stream_read_async (connection->reply_stream,
+                               connection->direct_reply->data_buffer + connection->direct_read,
+                               connection->direct_size - connection->direct_read,
+                               0, connection->reply_stream_cancellable,
+                               read_reply_async_got_data,
+                               connection);
+  else
+    g_input_stream_read_async (connection->reply_stream,
+                               connection->recv_buffer + connection->recv_end,
+                               connection->recv_buffer_size - connection->recv_end,
+                               0, connection->reply_stream_cancellable,
+                               read_reply_async_got_data,
+                               connection);
 }
 
-static void send_command (GVfsBackendSftp *backend);
+static void send_command (SftpConnection *connection);
 
 static void
 send_command_data (GObject *source_object,
                    GAsyncResult *result,
                    gpointer user_data)
 {
-  GVfsBackendSftp *backend = user_data;
+  SftpConnection *connection = user_data;
   gssize res;
   DataBuffer *buffer;
+  GError *error;
+
+  error = NULL;
+  res = g_output_stream_write_finish (G_OUTPUT_STREAM (source_object), result, &error);
 
-  res = g_output_stream_write_finish (G_OUTPUT_STREAM (source_object), result, NULL);
+  if (connection->dead)
+    {
+      g_clear_error (&error);
+      return;
+    }
 
   if (res <= 0)
     {
       g_warning ("Error sending command");
-      g_vfs_backend_force_unmount ((GVfsBackend*)backend);
+      if (error == NULL)
+        g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("Internal error: Error sending command"));
+      connection_died (connection, error);
       return;
     }
 
-  buffer = backend->command_queue->data;
+  buffer = g_queue_peek_head (&connection->command_queue);
   
-  backend->command_bytes_written += res;
+  connection->command_bytes_written += res;
 
-  if (backend->command_bytes_written < buffer->size)
+  if (connection->command_bytes_written < buffer->size)
     {
-      g_output_stream_write_async (backend->command_stream,
-                                   buffer->data + backend->command_bytes_written,
-                                   buffer->size - backend->command_bytes_written,
+      g_output_stream_write_async (connection->command_stream,
+                                   buffer->data + connection->command_bytes_written,
+                                   buffer->size - connection->command_bytes_written,
                                    0,
                                    NULL,
                                    send_command_data,
-                                   backend);
+                                   connection);
       return;
     }
 
-  data_buffer_free (buffer);
+  data_buffer_free (g_queue_pop_head (&connection->command_queue));
 
-  backend->command_queue = g_list_delete_link (backend->command_queue, backend->command_queue);
-
-  if (backend->command_queue != NULL)
-    send_command (backend);
+  if (!g_queue_is_empty (&connection->command_queue))
+    send_command (connection);
 }
 
 static void
-send_command (GVfsBackendSftp *backend)
+send_command (SftpConnection *connection)
 {
   DataBuffer *buffer;
 
-  buffer = backend->command_queue->data;
+  buffer = g_queue_peek_head (&connection->command_queue);
   
-  backend->command_bytes_written = 0;
-  g_output_stream_write_async (backend->command_stream,
+  connection->command_bytes_written = 0;
+  g_output_stream_write_async (connection->command_stream,
                                buffer->data,
                                buffer->size,
                                0,
                                NULL,
                                send_command_data,
-                               backend);
+                               connection);
 }
 
-static void
-expect_reply (GVfsBackendSftp *backend,
+static ExpectedReply *
+expect_reply (SftpConnection *connection,
               guint32 id,
               ReplyCallback callback,
               GVfsJob *job,
@@ -1354,12 +2140,14 @@ expect_reply (GVfsBackendSftp *backend,
 {
   ExpectedReply *expected;
 
-  expected = g_slice_new (ExpectedReply);
+  expected = g_slice_new0 (ExpectedReply);
   expected->callback = callback;
   expected->job = g_object_ref (job);
   expected->user_data = user_data;
 
-  g_hash_table_replace (backend->expected_replies, GINT_TO_POINTER (id), expected);
+  g_hash_table_replace (connection->expected_replies, GINT_TO_POINTER (id), expected);
+
+  return expected;
 }
 
 static DataBuffer *
@@ -1375,62 +2163,412 @@ data_buffer_new (guchar *data, gsize len)
 }
 
 static void
-queue_command_buffer (GVfsBackendSftp *backend,
+queue_command_buffer (SftpConnection *connection,
                       DataBuffer *buffer)
 {
   gboolean first;
-  
-  first = backend->command_queue == NULL;
 
-  backend->command_queue = g_list_append (backend->command_queue, buffer);
+  if (connection->dead)
+    {
+      /* The reply expected for it is failed from an idle */
+      data_buffer_free (buffer);
+      connection_schedule_fail_replies (connection);
+      return;
+    }
+
+  first = g_queue_is_empty (&connection->command_queue);
+
+  g_queue_push_tail (&connection->command_queue, buffer);
   
   if (first)
-    send_command (backend);
+    send_command (connection);
 }
 
-static void
-queue_command_stream_and_free (GVfsBackendSftp *backend,
-                               GDataOutputStream *command_stream,
-                               ReplyCallback callback,
-                               GVfsJob *job,
-                               gpointer user_data)
+/* Reads the version reply following the INIT command, frees the
+ * connection on failure */
+static SftpConnection *
+connection_read_version (SftpConnection *connection,
+                         SftpReply **version_reply,
+                         GError **error)
 {
-  gpointer data;
-  gsize len;
-  DataBuffer *buffer;
-  guint32 id;
+  SftpReply *reply;
 
-  id = GPOINTER_TO_UINT (g_object_get_qdata (G_OBJECT (command_stream), id_q));
-  data = get_data_from_command_stream (command_stream, &len);
+  reply = read_reply_sync (connection, NULL, NULL);
+  if (reply == NULL)
+    {
+      look_for_stderr_errors (connection, error);
+      connection_free (connection);
+      return NULL;
+    }
   
-  buffer = data_buffer_new (data, len);
-  g_object_unref (command_stream);
+  if (reply_read_byte (reply) != SSH_FXP_VERSION)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, _("Protocol error"));
+      g_free (reply);
+      connection_free (connection);
+      return NULL;
+    }
 
-  expect_reply (backend, id, callback, job, user_data);
-  queue_command_buffer (backend, buffer);
-}
+  *version_reply = reply;
 
+  return connection;
+}
 
-static void
-multi_request_cb (GVfsBackendSftp *backend,
-                  int reply_type,
-                  GDataInputStream *reply_stream,
-                  guint32 len,
-                  GVfsJob *job,
-                  gpointer user_data)
+#ifdef HAVE_LIBSSH
+/* Connects with libssh instead of running ssh. This only works if
+ * nothing has to be asked: the host key must be known and the login must
+ * succeed with the agent, the default keys or the password of an earlier
+ * login. If that fails fall_back is set to use ssh, which can ask. Other
+ * errors, like not being able to connect at all, are returned. */
+static SftpConnection *
+connection_open_libssh (GVfsBackendSftp *backend,
+                        gboolean *fall_back,
+                        GError **error)
 {
-  MultiReply *reply;
-  MultiRequest *request;
-  int i;
-
-  reply = user_data;
-  request = reply->request;
-
-  reply->type = reply_type;
-  reply->data = g_object_ref (reply_stream);
-  reply->data_len = len;
+  SftpConnection *connection;
+  GInputStream *input;
+  GOutputStream *output;
+  GByteArray *command;
+  GError *my_error = NULL;
 
-  if (--request->n_outstanding == 0)
+  if (!g_vfs_libssh_stream_open (backend->host, backend->port,
+                                 backend->user_specified ? backend->user : NULL,
+                                 backend->login_password,
+                                 SFTP_READ_TIMEOUT,
+                                 &input, &output, fall_back, &my_error))
+    {
+      if (*fall_back)
+        {
+          g_debug ("sftp: Falling back to ssh: %s\n", my_error->message);
+          g_error_free (my_error);
+        }
+      else
+        g_propagate_error (error, my_error);
+      return NULL;
+    }
+
+  connection = connection_new (backend);
+  connection->command_stream = output;
+  connection->reply_stream = input;
+  connection->reply_stream_cancellable = g_cancellable_new ();
+
+  command = new_command (backend, SSH_FXP_INIT);
+  put_uint32 (command, SSH_FILEXFER_VERSION);
+  send_command_sync_and_free (connection, command, NULL, NULL);
+
+  return connection;
+}
+#endif
+
+/* Spawns ssh and runs the sftp handshake. Without a mount source the
+ * login can't ask anything and reuses the password of the first login.
+ * On success the version reply is returned with its type already read. */
+static SftpConnection *
+connection_open (GVfsBackendSftp *backend,
+                 GMountSource *mount_source,
+                 SftpReply **version_reply,
+                 GError **error)
+{
+  SftpConnection *connection;
+  gchar **args;
+  pid_t pid;
+  int tty_fd, stdout_fd, stdin_fd, stderr_fd;
+  GInputStream *is;
+  GByteArray *command;
+  gboolean res;
+#ifdef HAVE_LIBSSH
+  gboolean fall_back;
+
+  if (backend->use_libssh)
+    {
+      connection = connection_open_libssh (backend, &fall_back, error);
+      if (connection != NULL)
+        return connection_read_version (connection, version_reply, error);
+      if (!fall_back)
+        return NULL;
+    }
+#endif
+
+  /* Only the mount itself has a mount source */
+  args = setup_ssh_commandline (G_VFS_BACKEND (backend), mount_source != NULL);
+  res = spawn_ssh (G_VFS_BACKEND (backend),
+                   args, &pid,
+                   &tty_fd, &stdin_fd, &stdout_fd, &stderr_fd,
+                   error);
+  g_strfreev (args);
+
+  if (!res)
+    return NULL;
+
+  connection = connection_new (backend);
+  connection->command_stream = g_unix_output_stream_new (stdin_fd, TRUE);
+
+  command = new_command (backend, SSH_FXP_INIT);
+  put_uint32 (command, SSH_FILEXFER_VERSION);
+  send_command_sync_and_free (connection, command, NULL, NULL);
+
+  if (tty_fd == -1)
+    res = wait_for_reply (G_VFS_BACKEND (backend), stdout_fd, error);
+  else if (mount_source == NULL)
+    res = handle_login_again (G_VFS_BACKEND (backend), tty_fd, stdout_fd, stderr_fd, error);
+  else
+    res = handle_login (G_VFS_BACKEND (backend), mount_source, tty_fd, stdout_fd, stderr_fd, error);
+  
+  if (!res)
+    {
+      /* Closing stdin makes ssh exit */
+      connection_free (connection);
+      close (stdout_fd);
+      close (stderr_fd);
+      if (tty_fd != -1)
+        close (tty_fd);
+      return NULL;
+    }
+
+  connection->reply_stream = g_unix_input_stream_new (stdout_fd, TRUE);
+  connection->reply_stream_cancellable = g_cancellable_new ();
+
+  make_fd_nonblocking (stderr_fd);
+  is = g_unix_input_stream_new (stderr_fd, TRUE);
+  connection->error_stream = g_data_input_stream_new (is);
+  g_object_unref (is);
+
+  return connection_read_version (connection, version_reply, error);
+}
+
+static void
+open_connection_thread (GTask *task,
+                        gpointer source_object,
+                        gpointer task_data,
+                        GCancellable *cancellable)
+{
+  GVfsBackendSftp *backend = G_VFS_BACKEND_SFTP (source_object);
+  SftpConnection *connection;
+  SftpReply *reply;
+  GError *error = NULL;
+
+  connection = connection_open (backend, NULL, &reply, &error);
+  if (connection == NULL)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  g_free (reply);
+  g_task_return_pointer (task, connection, (GDestroyNotify)connection_free);
+}
+
+static void
+open_connection_cb (GObject *source_object,
+                    GAsyncResult *result,
+                    gpointer user_data)
+{
+  GVfsBackendSftp *backend = G_VFS_BACKEND_SFTP (source_object);
+  SftpConnection *connection, *first;
+  GError *error = NULL;
+
+  backend->opening_connection = FALSE;
+
+  connection = g_task_propagate_pointer (G_TASK (result), &error);
+  if (connection == NULL)
+    {
+      /* Don't retry, the server probably limits the number of sessions
+         or wants more than a password */
+      g_debug ("sftp: Can't open additional connection: %s\n", error->message);
+      g_error_free (error);
+      backend->connection_failed = TRUE;
+      return;
+    }
+
+  first = g_ptr_array_index (backend->connections, 0);
+  if (g_cancellable_is_cancelled (first->reply_stream_cancellable))
+    {
+      /* Unmounted meanwhile */
+      connection_free (connection);
+      return;
+    }
+
+  g_ptr_array_add (backend->connections, connection);
+
+  g_object_ref (backend);
+  read_reply_async (connection);
+}
+
+/* Picks the connection with the fewest outstanding requests. When all
+ * of them are busy another one is opened for the jobs to come. */
+static SftpConnection *
+pick_connection (GVfsBackendSftp *backend)
+{
+  SftpConnection *connection, *best;
+  guint i, load, best_load;
+  GTask *task;
+
+  best = NULL;
+  best_load = G_MAXUINT;
+  for (i = 0; i < backend->connections->len; i++)
+    {
+      connection = g_ptr_array_index (backend->connections, i);
+      load = g_hash_table_size (connection->expected_replies);
+      if (load < best_load)
+        {
+          best = connection;
+          best_load = load;
+        }
+    }
+
+  if (best_load >= CONNECTION_BUSY_REQUESTS &&
+      backend->connections->len < backend->max_connections &&
+      !backend->opening_connection &&
+      !backend->connection_failed)
+    {
+      backend->opening_connection = TRUE;
+      task = g_task_new (backend, NULL, open_connection_cb, NULL);
+      g_task_run_in_thread (task, open_connection_thread);
+      g_object_unref (task);
+    }
+
+  return best;
+}
+
+/* All commands of a job go to the same connection, so that the handles
+   it gets are valid for its later commands. Push and pull open their
+   file on the other connections as well, see TransferStripe. */
+static SftpConnection *
+job_get_connection (GVfsBackendSftp *backend, GVfsJob *job)
+{
+  SftpConnection *connection;
+
+  connection = g_object_get_qdata (G_OBJECT (job), connection_q);
+  if (connection == NULL)
+    {
+      connection = pick_connection (backend);
+      g_object_set_qdata (G_OBJECT (job), connection_q, connection);
+    }
+
+  return connection;
+}
+
+static void
+job_set_connection (GVfsJob *job, SftpConnection *connection)
+{
+  g_object_set_qdata (G_OBJECT (job), connection_q, connection);
+}
+
+static void
+connection_queue_command_and_free (SftpConnection *connection,
+                                   GByteArray *command,
+                                   ReplyCallback callback,
+                                   GVfsJob *job,
+                                   gpointer user_data)
+{
+  gpointer data;
+  gsize len;
+  DataBuffer *buffer;
+  guint32 id;
+
+  id = get_command_id (command);
+  data = get_data_from_command (command, &len);
+  
+  buffer = data_buffer_new (data, len);
+
+  expect_reply (connection, id, callback, job, user_data);
+  queue_command_buffer (connection, buffer);
+}
+
+static void
+queue_command_and_free (GVfsBackendSftp *backend,
+                        GByteArray *command,
+                        ReplyCallback callback,
+                        GVfsJob *job,
+                        gpointer user_data)
+{
+  connection_queue_command_and_free (job_get_connection (backend, job),
+                                     command, callback, job, user_data);
+}
+
+/* READs are by far the most frequent command, so their packet is
+ * allocated once at its final size instead of growing in new_command().
+ * The data of a DATA reply is read straight into data_buffer, see
+ * process_replies(). */
+static void
+connection_queue_read_command (SftpConnection *connection,
+                               DataBuffer *raw_handle,
+                               guint64 offset,
+                               guint32 size,
+                               guint8 *data_buffer,
+                               ReplyCallback callback,
+                               GVfsJob *job,
+                               gpointer user_data)
+{
+  ExpectedReply *expected;
+  guint8 *data, *p;
+  gsize len;
+  guint32 id;
+
+  id = get_new_id (connection->backend);
+
+  len = 4 + 1 + 4 + 4 + raw_handle->size + 8 + 4;
+  data = g_malloc (len);
+
+  p = put_be32 (data, len - 4);
+  *p++ = SSH_FXP_READ;
+  p = put_be32 (p, id);
+  p = put_be32 (p, raw_handle->size);
+  memcpy (p, raw_handle->data, raw_handle->size);
+  p += raw_handle->size;
+  p = put_be32 (p, offset >> 32);
+  p = put_be32 (p, offset & 0xffffffff);
+  put_be32 (p, size);
+
+  expected = expect_reply (connection, id, callback, job, user_data);
+  expected->data_buffer = data_buffer;
+  expected->data_buffer_size = size;
+
+  queue_command_buffer (connection, data_buffer_new (data, len));
+}
+
+static void
+queue_read_command (GVfsBackendSftp *backend,
+                    DataBuffer *raw_handle,
+                    guint64 offset,
+                    guint32 size,
+                    guint8 *data_buffer,
+                    ReplyCallback callback,
+                    GVfsJob *job,
+                    gpointer user_data)
+{
+  connection_queue_read_command (job_get_connection (backend, job),
+                                 raw_handle, offset, size, data_buffer,
+                                 callback, job, user_data);
+}
+
+
+static void
+multi_request_cb (GVfsBackendSftp *backend,
+                  int reply_type,
+                  SftpReply *reply_data,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
+{
+  MultiReply *reply;
+  MultiRequest *request;
+  int i;
+
+  reply = user_data;
+  request = reply->request;
+
+  /* The reply is only valid during the callback, keep a copy of the
+     rest of it until all of them are in */
+  reply->type = reply_type;
+  if (reply_data)
+    reply->data = reply_new (reply_data->data + reply_data->pos,
+                             reply_data->size - reply_data->pos);
+  else
+    reply->data = reply_new (NULL, 0);
+  reply->data_len = len;
+
+  if (--request->n_outstanding == 0)
     {
       /* Call callback */
       if (request->callback != NULL)
@@ -1445,8 +2583,7 @@ multi_request_cb (GVfsBackendSftp *backend,
       for (i = 0; i < request->n_replies; i++)
         {
           reply = &request->replies[i];
-          if (reply->data)
-            g_object_unref (reply->data);
+          g_free (reply->data);
         }
       g_free (request->replies);
       
@@ -1456,12 +2593,12 @@ multi_request_cb (GVfsBackendSftp *backend,
 }
 
 static void
-queue_command_streams_and_free (GVfsBackendSftp *backend,
-                                GDataOutputStream **commands,
-                                int n_commands,
-                                MultiReplyCallback callback,
-                                GVfsJob *job,
-                                gpointer user_data)
+queue_commands_and_free (GVfsBackendSftp *backend,
+                         GByteArray **commands,
+                         int n_commands,
+                         MultiReplyCallback callback,
+                         GVfsJob *job,
+                         gpointer user_data)
 {
   MultiRequest *data;
   MultiReply *reply;
@@ -1480,36 +2617,23 @@ queue_command_streams_and_free (GVfsBackendSftp *backend,
     {
       reply = &data->replies[i];
       reply->request = data;
-      queue_command_stream_and_free (backend,
-                                     commands[i],
-                                     multi_request_cb,
-                                     job,
-                                     reply);
+      queue_command_and_free (backend,
+                              commands[i],
+                              multi_request_cb,
+                              job,
+                              reply);
     }
 }
 
-static gboolean
-get_uid_sync (GVfsBackendSftp *backend)
+static void
+uid_reply (GVfsBackendSftp *backend,
+           int reply_type,
+           SftpReply *reply)
 {
-  GDataOutputStream *command;
-  GDataInputStream *reply;
-  int type;
-  
-  command = new_command_stream (backend, SSH_FXP_STAT);
-  put_string (command, ".");
-  send_command_sync_and_unref_command (backend, command, NULL, NULL);
-
-  reply = read_reply_sync (backend, NULL, NULL);
-  if (reply == NULL)
-    return FALSE;
-  
-  type = g_data_input_stream_read_byte (reply, NULL, NULL);
-  /*id =*/ (void) g_data_input_stream_read_uint32 (reply, NULL, NULL);
-
   /* On error, set uid to -1 and ignore */
   backend->my_uid = (guint32)-1;
   backend->my_gid = (guint32)-1;
-  if (type == SSH_FXP_ATTRS)
+  if (reply_type == SSH_FXP_ATTRS)
     {
       GFileInfo *info;
 
@@ -1526,44 +2650,210 @@ get_uid_sync (GVfsBackendSftp *backend)
 
       g_object_unref (info);
     }
+}
 
-  g_object_unref (reply);
+static void
+home_reply (GVfsBackendSftp *backend,
+            int reply_type,
+            SftpReply *reply)
+{
+  char *home_path;
 
-  return TRUE;
+  /* On error, set home to NULL and ignore */
+  if (reply_type == SSH_FXP_NAME)
+    {
+    /* count = */ (void) reply_read_uint32 (reply);
+
+      home_path = read_string (reply, NULL);
+      g_vfs_backend_set_default_location (G_VFS_BACKEND (backend), home_path);
+      g_free (home_path);
+    }
+}
+
+static guint32
+limit_to_block_size (guint64 limit)
+{
+  /* 0 means the server has no limit */
+  if (limit == 0)
+    return DEFAULT_BLOCKSIZE;
+
+  return MIN (limit, MAX_BLOCKSIZE);
+}
+
+static void
+limits_reply (GVfsBackendSftp *backend,
+              int reply_type,
+              SftpReply *reply)
+{
+  /* On error, keep the defaults */
+  if (reply_type == SSH_FXP_EXTENDED_REPLY)
+    {
+      /* max packet length = */ (void) reply_read_uint64 (reply);
+      backend->max_read_size = limit_to_block_size (reply_read_uint64 (reply));
+      backend->max_write_size = limit_to_block_size (reply_read_uint64 (reply));
+      /* max open handles = */ (void) reply_read_uint64 (reply);
+    }
 }
 
+typedef void (*SyncReplyHandler) (GVfsBackendSftp *backend,
+                                  int reply_type,
+                                  SftpReply *reply);
+
+/* Asks for what we need to know about the server when mounting. All
+ * requests are sent before reading the replies, so this takes a single
+ * round trip. The uid and home directory are skipped when they were
+ * cached by an earlier mount. */
 static gboolean
-get_home_sync (GVfsBackendSftp *backend)
+query_server_sync (GVfsBackendSftp *backend,
+                   SftpConnection *connection,
+                   gboolean query_uid_and_home)
+{
+  GByteArray *command;
+  SftpReply *reply;
+  SyncReplyHandler handlers[3];
+  guint32 ids[3];
+  guint32 id;
+  int n_commands, type, i, j;
+
+  n_commands = 0;
+
+  if (query_uid_and_home)
+    {
+      command = new_command (backend, SSH_FXP_STAT);
+      put_string (command, ".");
+      ids[n_commands] = get_command_id (command);
+      handlers[n_commands++] = uid_reply;
+      send_command_sync_and_free (connection, command, NULL, NULL);
+
+      command = new_command (backend, SSH_FXP_REALPATH);
+      put_string (command, ".");
+      ids[n_commands] = get_command_id (command);
+      handlers[n_commands++] = home_reply;
+      send_command_sync_and_free (connection, command, NULL, NULL);
+    }
+
+  if (has_extension (backend, SFTP_EXT_OPENSSH_LIMITS))
+    {
+      command = new_command (backend, SSH_FXP_EXTENDED);
+      put_string (command, "limits@openssh.com");
+      ids[n_commands] = get_command_id (command);
+      handlers[n_commands++] = limits_reply;
+      send_command_sync_and_free (connection, command, NULL, NULL);
+    }
+
+  for (i = 0; i < n_commands; i++)
+    {
+      reply = read_reply_sync (connection, NULL, NULL);
+      if (reply == NULL)
+        return FALSE;
+
+      type = reply_read_byte (reply);
+      id = reply_read_uint32 (reply);
+
+      for (j = 0; j < n_commands; j++)
+        {
+          if (ids[j] == id)
+            (handlers[j]) (backend, type, reply);
+        }
+
+      g_free (reply);
+    }
+
+  return TRUE;
+}
+
+static char *
+get_server_info_filename (GVfsBackendSftp *backend)
 {
-  GDataOutputStream *command;
-  GDataInputStream *reply;
-  char *home_path;
-  int type;
+  char *dir, *key, *hash, *name, *filename;
 
-  command = new_command_stream (backend, SSH_FXP_REALPATH);
-  put_string (command, ".");
-  send_command_sync_and_unref_command (backend, command, NULL, NULL);
+  dir = get_runtime_dir ();
+  if (dir == NULL)
+    return NULL;
 
-  reply = read_reply_sync (backend, NULL, NULL);
-  if (reply == NULL)
+  key = g_strdup_printf ("%s@%s:%d", backend->user ? backend->user : "",
+                         backend->host, backend->port);
+  hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+  name = g_strconcat (hash, ".info", NULL);
+  filename = g_build_filename (dir, name, NULL);
+
+  g_free (name);
+  g_free (hash);
+  g_free (key);
+  g_free (dir);
+
+  return filename;
+}
+
+static gboolean
+load_server_info (GVfsBackendSftp *backend)
+{
+  GKeyFile *key_file;
+  char *filename, *home;
+  gint64 saved, now;
+  gboolean res;
+
+  filename = get_server_info_filename (backend);
+  if (filename == NULL)
     return FALSE;
 
-  type = g_data_input_stream_read_byte (reply, NULL, NULL);
-  /*id =*/ (void) g_data_input_stream_read_uint32 (reply, NULL, NULL);
+  key_file = g_key_file_new ();
+  res = g_key_file_load_from_file (key_file, filename, G_KEY_FILE_NONE, NULL) &&
+    g_key_file_has_key (key_file, "server", "uid", NULL) &&
+    g_key_file_has_key (key_file, "server", "gid", NULL);
 
-  /* On error, set home to NULL and ignore */
-  if (type == SSH_FXP_NAME)
+  /* Accounts change, so look them up again once in a while */
+  if (res)
     {
-    /* count = */ (void) g_data_input_stream_read_uint32 (reply, NULL, NULL);
+      saved = g_key_file_get_int64 (key_file, "server", "saved", NULL);
+      now = g_get_real_time () / G_USEC_PER_SEC;
+      res = saved <= now && now - saved < SERVER_INFO_TTL;
+    }
 
-      home_path = read_string (reply, NULL);
-      g_vfs_backend_set_default_location (G_VFS_BACKEND (backend), home_path);
-      g_free (home_path);
+  if (res)
+    {
+      backend->my_uid = g_key_file_get_uint64 (key_file, "server", "uid", NULL);
+      backend->my_gid = g_key_file_get_uint64 (key_file, "server", "gid", NULL);
+
+      home = g_key_file_get_string (key_file, "server", "home", NULL);
+      if (home != NULL)
+        g_vfs_backend_set_default_location (G_VFS_BACKEND (backend), home);
+      g_free (home);
     }
 
-  g_object_unref (reply);
+  g_key_file_free (key_file);
+  g_free (filename);
 
-  return TRUE;
+  return res;
+}
+
+static void
+save_server_info (GVfsBackendSftp *backend)
+{
+  GKeyFile *key_file;
+  char *filename, *data;
+  const char *home;
+  gsize len;
+
+  filename = get_server_info_filename (backend);
+  if (filename == NULL)
+    return;
+
+  key_file = g_key_file_new ();
+  g_key_file_set_uint64 (key_file, "server", "uid", backend->my_uid);
+  g_key_file_set_uint64 (key_file, "server", "gid", backend->my_gid);
+  g_key_file_set_int64 (key_file, "server", "saved",
+                        g_get_real_time () / G_USEC_PER_SEC);
+  home = g_vfs_backend_get_default_location (G_VFS_BACKEND (backend));
+  if (home != NULL)
+    g_key_file_set_string (key_file, "server", "home", home);
+
+  data = g_key_file_to_data (key_file, &len, NULL);
+  g_file_set_contents (filename, data, len, NULL);
+
+  g_free (data);
+  g_key_file_free (key_file);
+  g_free (filename);
 }
 
 static void
@@ -1575,55 +2865,29 @@ do_mount (GVfsBackend *backend,
 {
   const struct {
     const char *name;               /* extension_name field */
-    const char *data;               /* extension_data field */
+    const char *data;               /* extension_data field, NULL for any */
     SFTPServerExtensions enable;    /* flag to enable this extension */
   } extensions[] = {
     { "statvfs@openssh.com", "2", SFTP_EXT_OPENSSH_STATVFS },
+    { "copy-data", "1", SFTP_EXT_COPY_DATA },
+    { "posix-rename@openssh.com", "1", SFTP_EXT_OPENSSH_POSIX_RENAME },
+    { "limits@openssh.com", "1", SFTP_EXT_OPENSSH_LIMITS },
+    { "check-file", NULL, SFTP_EXT_CHECK_FILE }, /* data lists the hashes */
   };
 
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  gchar **args; /* Enough for now, extend if you add more args */
-  pid_t pid;
-  int tty_fd, stdout_fd, stdin_fd, stderr_fd;
+  SftpConnection *connection;
   GError *error;
-  GInputStream *is;
-  GDataOutputStream *command;
-  GDataInputStream *reply;
-  gboolean res;
+  SftpReply *reply;
   GMountSpec *sftp_mount_spec;
   char *extension_name, *extension_data;
   char *display_name;
+  gboolean have_server_info;
   int i;
 
-  args = setup_ssh_commandline (backend);
-
   error = NULL;
-  if (!spawn_ssh (backend,
-		  args, &pid,
-		  &tty_fd, &stdin_fd, &stdout_fd, &stderr_fd,
-		  &error))
-    {
-      g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
-      g_error_free (error);
-      g_strfreev (args);
-      return;
-    }
-
-  g_strfreev (args);
-
-  op_backend->command_stream = g_unix_output_stream_new (stdin_fd, TRUE);
-
-  command = new_command_stream (op_backend, SSH_FXP_INIT);
-  g_data_output_stream_put_int32 (command,
-                                  SSH_FILEXFER_VERSION, NULL, NULL);
-  send_command_sync_and_unref_command (op_backend, command, NULL, NULL);
-
-  if (tty_fd == -1)
-    res = wait_for_reply (backend, stdout_fd, &error);
-  else
-    res = handle_login (backend, mount_source, tty_fd, stdout_fd, stderr_fd, &error);
-  
-  if (!res)
+  connection = connection_open (op_backend, mount_source, &reply, &error);
+  if (connection == NULL)
     {
       if (error->code == G_IO_ERROR_INVALID_ARGUMENT)
         {
@@ -1642,32 +2906,9 @@ do_mount (GVfsBackend *backend,
       return;
     }
 
-  op_backend->reply_stream = g_unix_input_stream_new (stdout_fd, TRUE);
-  op_backend->reply_stream_cancellable = g_cancellable_new ();
-
-  make_fd_nonblocking (stderr_fd);
-  is = g_unix_input_stream_new (stderr_fd, TRUE);
-  op_backend->error_stream = g_data_input_stream_new (is);
-  g_object_unref (is);
-  
-  reply = read_reply_sync (op_backend, NULL, NULL);
-  if (reply == NULL)
-    {
-      look_for_stderr_errors (backend, &error);
-      g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
-      g_error_free (error);
-      return;
-    }
-  
-  if (g_data_input_stream_read_byte (reply, NULL, NULL) != SSH_FXP_VERSION)
-    {
-      g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED, _("Protocol error"));
-      g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
-      g_error_free (error);
-      return;
-    }
+  g_ptr_array_add (op_backend->connections, connection);
   
-  op_backend->protocol_version = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+  op_backend->protocol_version = reply_read_uint32 (reply);
 
   while ((extension_name = read_string (reply, NULL)) != NULL)
     {
@@ -1677,7 +2918,8 @@ do_mount (GVfsBackend *backend,
           for (i = 0; i < G_N_ELEMENTS (extensions); i++)
             {
               if (!strcmp (extension_name, extensions[i].name) &&
-                  !strcmp (extension_data, extensions[i].data))
+                  (extensions[i].data == NULL ||
+                   !strcmp (extension_data, extensions[i].data)))
                 op_backend->extensions |= 1 << extensions[i].enable;
             }
         }
@@ -1685,9 +2927,11 @@ do_mount (GVfsBackend *backend,
       g_free (extension_data);
     }
 
-  g_object_unref (reply);
+  g_free (reply);
+
+  have_server_info = load_server_info (op_backend);
 
-  if (!get_uid_sync (op_backend) || !get_home_sync (op_backend))
+  if (!query_server_sync (op_backend, connection, !have_server_info))
     {
       g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED, _("Protocol error"));
       g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
@@ -1695,7 +2939,12 @@ do_mount (GVfsBackend *backend,
       return;
     }
 
-  read_reply_async (g_object_ref (op_backend));
+  /* Don't remember failed lookups */
+  if (!have_server_info && op_backend->my_uid != (guint32)-1)
+    save_server_info (op_backend);
+
+  g_object_ref (op_backend);
+  read_reply_async (connection);
 
   sftp_mount_spec = g_mount_spec_new ("sftp");
   if (op_backend->user_specified_in_uri)
@@ -1750,7 +2999,7 @@ try_mount (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   const char *user, *host, *port;
 
-  op_backend->client_vendor = get_sftp_client_vendor ();
+  op_backend->client_vendor = get_sftp_client_vendor (&op_backend->use_control_master);
 
   if (op_backend->client_vendor == SFTP_VENDOR_INVALID)
     {
@@ -1800,9 +3049,15 @@ try_unmount (GVfsBackend *backend,
              GMountSource *mount_source)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  SftpConnection *connection;
+  guint i;
 
-  if (op_backend->reply_stream && op_backend->reply_stream_cancellable)
-    g_cancellable_cancel (op_backend->reply_stream_cancellable);
+  for (i = 0; i < op_backend->connections->len; i++)
+    {
+      connection = g_ptr_array_index (op_backend->connections, i);
+      if (connection->reply_stream && connection->reply_stream_cancellable)
+        g_cancellable_cancel (connection->reply_stream_cancellable);
+    }
   g_vfs_job_succeeded (G_VFS_JOB (job));
 
   return TRUE;
@@ -1927,14 +3182,14 @@ result_from_status_code (GVfsJob *job,
 }
 
 static guint32
-read_status_code (GDataInputStream *status_reply)
+read_status_code (SftpReply *status_reply)
 {
-  return g_data_input_stream_read_uint32 (status_reply, NULL, NULL);
+  return reply_read_uint32 (status_reply);
 }
 
 static gboolean
 error_from_status (GVfsJob *job,
-                   GDataInputStream *reply,
+                   SftpReply *reply,
                    int failure_error,
                    int allowed_sftp_error,
                    GError **error)
@@ -1950,7 +3205,7 @@ error_from_status (GVfsJob *job,
 
 static gboolean
 failure_from_status (GVfsJob *job,
-                     GDataInputStream *reply,
+                     SftpReply *reply,
                      int failure_error,
                      int allowed_sftp_error)
 {
@@ -1969,7 +3224,7 @@ failure_from_status (GVfsJob *job,
 
 static gboolean
 result_from_status (GVfsJob *job,
-                    GDataInputStream *reply,
+                    SftpReply *reply,
                     int failure_error,
                     int allowed_sftp_error)
 {
@@ -2005,7 +3260,7 @@ struct _ErrorFromStatData {
 static void
 error_from_lstat_reply (GVfsBackendSftp *backend,
 			int reply_type,
-			GDataInputStream *reply,
+			SftpReply *reply,
 			guint32 len,
 			GVfsJob *job,
 			gpointer user_data)
@@ -2053,17 +3308,17 @@ error_from_lstat (GVfsBackendSftp *backend,
 		  gpointer user_data)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
   ErrorFromStatData *data;
   
-  command = new_command_stream (op_backend, SSH_FXP_LSTAT);
+  command = new_command (op_backend, SSH_FXP_LSTAT);
   put_string (command, path);
 
   data = g_slice_new (ErrorFromStatData);
   data->original_error = original_error;
   data->callback = callback;
   data->user_data = user_data;
-  queue_command_stream_and_free (op_backend, command, error_from_lstat_reply,
+  queue_command_and_free (op_backend, command, error_from_lstat_reply,
 				 G_VFS_JOB (job), data);
 }
 
@@ -2102,7 +3357,7 @@ static void
 parse_attributes (GVfsBackendSftp *backend,
                   GFileInfo *info,
                   const char *basename,
-                  GDataInputStream *reply,
+                  SftpReply *reply,
                   GFileAttributeMatcher *matcher)
 {
   guint32 flags;
@@ -2112,7 +3367,7 @@ parse_attributes (GVfsBackendSftp *backend,
   gboolean has_uid, free_mimetype;
   char *mimetype;
   
-  flags = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+  flags = reply_read_uint32 (reply);
 
   if (basename != NULL && basename[0] == '.')
     g_file_info_set_is_hidden (info, TRUE);
@@ -2127,7 +3382,7 @@ parse_attributes (GVfsBackendSftp *backend,
 
   if (flags & SSH_FILEXFER_ATTR_SIZE)
     {
-      guint64 size = g_data_input_stream_read_uint64 (reply, NULL, NULL);
+      guint64 size = reply_read_uint64 (reply);
       g_file_info_set_size (info, size);
     }
 
@@ -2136,9 +3391,9 @@ parse_attributes (GVfsBackendSftp *backend,
   if (flags & SSH_FILEXFER_ATTR_UIDGID)
     {
       has_uid = TRUE;
-      uid = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+      uid = reply_read_uint32 (reply);
       g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_UID, uid);
-      gid = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+      gid = reply_read_uint32 (reply);
       g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_GID, gid);
     }
 
@@ -2146,7 +3401,7 @@ parse_attributes (GVfsBackendSftp *backend,
 
   if (flags & SSH_FILEXFER_ATTR_PERMISSIONS)
     {
-      mode = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+      mode = reply_read_uint32 (reply);
       g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_MODE, mode);
 
       mimetype = NULL;
@@ -2252,9 +3507,9 @@ parse_attributes (GVfsBackendSftp *backend,
       guint32 v;
       char *etag;
       
-      v = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+      v = reply_read_uint32 (reply);
       g_file_info_set_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_ACCESS, v);
-      v = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+      v = reply_read_uint32 (reply);
       g_file_info_set_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED, v);
 
       etag = g_strdup_printf ("%lu", (long unsigned int)v);
@@ -2266,7 +3521,7 @@ parse_attributes (GVfsBackendSftp *backend,
     {
       guint32 count, i;
       char *name, *val;
-      count = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+      count = reply_read_uint32 (reply);
       for (i = 0; i < count; i++)
         {
           name = read_string (reply, NULL);
@@ -2320,11 +3575,12 @@ parse_attributes (GVfsBackendSftp *backend,
 }
 
 static SftpHandle *
-sftp_handle_new (GDataInputStream *reply)
+sftp_handle_new (GVfsJob *job, SftpReply *reply)
 {
   SftpHandle *handle;
 
   handle = g_slice_new0 (SftpHandle);
+  handle->connection = g_object_get_qdata (G_OBJECT (job), connection_q);
   handle->raw_handle = read_data_buffer (reply);
   handle->offset = 0;
 
@@ -2337,13 +3593,14 @@ sftp_handle_free (SftpHandle *handle)
   data_buffer_free (handle->raw_handle);
   g_free (handle->filename);
   g_free (handle->tempname);
+  g_clear_error (&handle->write_error);
   g_slice_free (SftpHandle, handle);
 }
 
 static void
 open_stat_reply (GVfsBackendSftp *backend,
                  int reply_type,
-                 GDataInputStream *reply,
+                 SftpReply *reply,
                  guint32 len,
                  GVfsJob *job,
                  gpointer user_data)
@@ -2383,7 +3640,7 @@ open_stat_reply (GVfsBackendSftp *backend,
 static void
 open_for_read_reply (GVfsBackendSftp *backend,
                      int reply_type,
-                     GDataInputStream *reply,
+                     SftpReply *reply,
                      guint32 len,
                      GVfsJob *job,
                      gpointer user_data)
@@ -2399,14 +3656,14 @@ open_for_read_reply (GVfsBackendSftp *backend,
          race */
       if (reply_type == SSH_FXP_HANDLE)
         {
-          GDataOutputStream *command;
+          GByteArray *command;
           DataBuffer *bhandle;
 
           bhandle = read_data_buffer (reply);
           
-          command = new_command_stream (backend, SSH_FXP_CLOSE);
+          command = new_command (backend, SSH_FXP_CLOSE);
           put_data_buffer (command, bhandle);
-          queue_command_stream_and_free (backend, command, NULL, G_VFS_JOB (job), NULL);
+          queue_command_and_free (backend, command, NULL, G_VFS_JOB (job), NULL);
 
           data_buffer_free (bhandle);
         }
@@ -2436,7 +3693,7 @@ open_for_read_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (job, reply);
   
   g_vfs_job_open_for_read_set_handle (G_VFS_JOB_OPEN_FOR_READ (job), handle);
   g_vfs_job_open_for_read_set_can_seek (G_VFS_JOB_OPEN_FOR_READ (job), TRUE);
@@ -2449,22 +3706,22 @@ try_open_for_read (GVfsBackend *backend,
                    const char *filename)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
 
   G_VFS_JOB(job)->backend_data = GINT_TO_POINTER (0);
   
-  command = new_command_stream (op_backend,
-                                SSH_FXP_STAT);
+  command = new_command (op_backend,
+                         SSH_FXP_STAT);
   put_string (command, filename);
-  queue_command_stream_and_free (op_backend, command, open_stat_reply, G_VFS_JOB (job), NULL);
+  queue_command_and_free (op_backend, command, open_stat_reply, G_VFS_JOB (job), NULL);
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_OPEN);
+  command = new_command (op_backend,
+                         SSH_FXP_OPEN);
   put_string (command, filename);
-  g_data_output_stream_put_uint32 (command, SSH_FXF_READ, NULL, NULL); /* open flags */
-  g_data_output_stream_put_uint32 (command, 0, NULL, NULL); /* Attr flags */
+  put_uint32 (command, SSH_FXF_READ); /* open flags */
+  put_uint32 (command, 0); /* Attr flags */
   
-  queue_command_stream_and_free (op_backend, command, open_for_read_reply, G_VFS_JOB (job), NULL);
+  queue_command_and_free (op_backend, command, open_for_read_reply, G_VFS_JOB (job), NULL);
 
   return TRUE;
 }
@@ -2472,7 +3729,7 @@ try_open_for_read (GVfsBackend *backend,
 static void
 read_reply (GVfsBackendSftp *backend,
             int reply_type,
-            GDataInputStream *reply,
+            SftpReply *reply,
             guint32 len,
             GVfsJob *job,
             gpointer user_data)
@@ -2495,15 +3752,22 @@ read_reply (GVfsBackendSftp *backend,
       return;
     }
   
-  count = g_data_input_stream_read_uint32 (reply, NULL, NULL);
-
-  if (!g_input_stream_read_all (G_INPUT_STREAM (reply),
-                                G_VFS_JOB_READ (job)->buffer, count,
-                                NULL, NULL, NULL))
+  if (reply == NULL)
     {
-      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                        _("Invalid reply received"));
-      return;
+      /* Already in the job's buffer */
+      count = len;
+    }
+  else
+    {
+      count = reply_read_uint32 (reply);
+
+      if (count > G_VFS_JOB_READ (job)->bytes_requested ||
+          !reply_read_data (reply, G_VFS_JOB_READ (job)->buffer, count))
+        {
+          g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                            _("Invalid reply received"));
+          return;
+        }
     }
   
   handle->offset += count;
@@ -2521,15 +3785,12 @@ try_read (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_READ);
-  put_data_buffer (command, handle->raw_handle);
-  g_data_output_stream_put_uint64 (command, handle->offset, NULL, NULL);
-  g_data_output_stream_put_uint32 (command, bytes_requested, NULL, NULL);
-  
-  queue_command_stream_and_free (op_backend, command, read_reply, G_VFS_JOB (job), handle);
+  job_set_connection (G_VFS_JOB (job), handle->connection);
+
+  queue_read_command (op_backend, handle->raw_handle,
+                      handle->offset, MIN (bytes_requested, op_backend->max_read_size),
+                      (guint8 *)buffer, read_reply, G_VFS_JOB (job), handle);
 
   return TRUE;
 }
@@ -2537,7 +3798,7 @@ try_read (GVfsBackend *backend,
 static void
 seek_read_fstat_reply (GVfsBackendSftp *backend,
                        int reply_type,
-                       GDataInputStream *reply,
+                       SftpReply *reply,
                        guint32 len,
                        GVfsJob *job,
                        gpointer user_data)
@@ -2588,7 +3849,9 @@ try_seek_on_read (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
+
+  job_set_connection (G_VFS_JOB (job), handle->connection);
 
   switch (job->seek_type)
     {
@@ -2599,10 +3862,10 @@ try_seek_on_read (GVfsBackend *backend,
       handle->offset = job->requested_offset;
       break;
     case G_SEEK_END:
-      command = new_command_stream (op_backend,
-                                    SSH_FXP_FSTAT);
+      command = new_command (op_backend,
+                             SSH_FXP_FSTAT);
       put_data_buffer (command, handle->raw_handle);
-      queue_command_stream_and_free (op_backend, command, seek_read_fstat_reply, G_VFS_JOB (job), handle);
+      queue_command_and_free (op_backend, command, seek_read_fstat_reply, G_VFS_JOB (job), handle);
       return TRUE;
     }
 
@@ -2620,21 +3883,21 @@ delete_temp_file (GVfsBackendSftp *backend,
                   SftpHandle *handle,
                   GVfsJob *job)
 {
-  GDataOutputStream *command;
+  GByteArray *command;
   
   if (handle->tempname)
     {
-      command = new_command_stream (backend,
-                                    SSH_FXP_REMOVE);
+      command = new_command (backend,
+                             SSH_FXP_REMOVE);
       put_string (command, handle->tempname);
-      queue_command_stream_and_free (backend, command, NULL, job, NULL);
+      queue_command_and_free (backend, command, NULL, job, NULL);
     }
 }
 
 static void
 close_moved_tempfile (GVfsBackendSftp *backend,
                       int reply_type,
-                      GDataInputStream *reply,
+                      SftpReply *reply,
                       guint32 len,
                       GVfsJob *job,
                       gpointer user_data)
@@ -2643,6 +3906,8 @@ close_moved_tempfile (GVfsBackendSftp *backend,
   
   handle = user_data;
 
+  dir_cache_purge (backend, handle->filename);
+
   if (reply_type == SSH_FXP_STATUS)
     result_from_status (job, reply, -1, -1);
   else
@@ -2656,12 +3921,12 @@ close_moved_tempfile (GVfsBackendSftp *backend,
 static void
 close_restore_permissions (GVfsBackendSftp *backend,
                            int reply_type,
-                           GDataInputStream *reply,
+                           SftpReply *reply,
                            guint32 len,
                            GVfsJob *job,
                            gpointer user_data)
 {
-  GDataOutputStream *command;
+  GByteArray *command;
   SftpHandle *handle;
 
   handle = user_data;
@@ -2669,22 +3934,22 @@ close_restore_permissions (GVfsBackendSftp *backend,
   /* Here we don't really care whether or not setting the permissions succeeded
      or not. We just take the last step and rename the temp file to the
      actual file */
-  command = new_command_stream (backend,
-                                SSH_FXP_RENAME);
+  command = new_command (backend,
+                         SSH_FXP_RENAME);
   put_string (command, handle->tempname);
   put_string (command, handle->filename);
-  queue_command_stream_and_free (backend, command, close_moved_tempfile, G_VFS_JOB (job), handle);
+  queue_command_and_free (backend, command, close_moved_tempfile, G_VFS_JOB (job), handle);
 }
 
 static void
 close_deleted_file (GVfsBackendSftp *backend,
                     int reply_type,
-                    GDataInputStream *reply,
+                    SftpReply *reply,
                     guint32 len,
                     GVfsJob *job,
                     gpointer user_data)
 {
-  GDataOutputStream *command;
+  GByteArray *command;
   GError *error;
   gboolean res;
   SftpHandle *handle;
@@ -2704,11 +3969,11 @@ close_deleted_file (GVfsBackendSftp *backend,
       /* Removed original file, now first try to restore permissions */
       if (handle->set_permissions)
         {
-          command = new_command_stream (backend, SSH_FXP_SETSTAT);
+          command = new_command (backend, SSH_FXP_SETSTAT);
           put_string (command, handle->tempname);
-          g_data_output_stream_put_uint32 (command, SSH_FILEXFER_ATTR_PERMISSIONS, NULL, NULL);
-          g_data_output_stream_put_uint32 (command, handle->permissions, NULL, NULL);
-          queue_command_stream_and_free (backend, command, close_restore_permissions, G_VFS_JOB (job), handle);
+          put_uint32 (command, SSH_FILEXFER_ATTR_PERMISSIONS);
+          put_uint32 (command, handle->permissions);
+          queue_command_and_free (backend, command, close_restore_permissions, G_VFS_JOB (job), handle);
         }
       else
         {
@@ -2732,12 +3997,12 @@ close_deleted_file (GVfsBackendSftp *backend,
 static void
 close_moved_file (GVfsBackendSftp *backend,
                   int reply_type,
-                  GDataInputStream *reply,
+                  SftpReply *reply,
                   guint32 len,
                   GVfsJob *job,
                   gpointer user_data)
 {
-  GDataOutputStream *command;
+  GByteArray *command;
   GError *error;
   gboolean res;
   SftpHandle *handle;
@@ -2756,11 +4021,11 @@ close_moved_file (GVfsBackendSftp *backend,
     {
       /* moved original file to backup, now move new file in place */
 
-      command = new_command_stream (backend,
-                                    SSH_FXP_RENAME);
+      command = new_command (backend,
+                             SSH_FXP_RENAME);
       put_string (command, handle->tempname);
       put_string (command, handle->filename);
-      queue_command_stream_and_free (backend, command, close_moved_tempfile, G_VFS_JOB (job), handle);
+      queue_command_and_free (backend, command, close_moved_tempfile, G_VFS_JOB (job), handle);
     }
   else
     {
@@ -2779,13 +4044,13 @@ close_moved_file (GVfsBackendSftp *backend,
 static void
 close_deleted_backup (GVfsBackendSftp *backend,
                       int reply_type,
-                      GDataInputStream *reply,
+                      SftpReply *reply,
                       guint32 len,
                       GVfsJob *job,
                       gpointer user_data)
 {
   SftpHandle *handle;
-  GDataOutputStream *command;
+  GByteArray *command;
   char *backup_name;
 
   /* Ignore result here, if it failed we'll just get a new error when moving over it
@@ -2794,24 +4059,24 @@ close_deleted_backup (GVfsBackendSftp *backend,
   
   handle = user_data;
   
-  command = new_command_stream (backend,
-                                SSH_FXP_RENAME);
+  command = new_command (backend,
+                         SSH_FXP_RENAME);
   backup_name = g_strconcat (handle->filename, "~", NULL);
   put_string (command, handle->filename);
   put_string (command, backup_name);
   g_free (backup_name);
-  queue_command_stream_and_free (backend, command, close_moved_file, G_VFS_JOB (job), handle);
+  queue_command_and_free (backend, command, close_moved_file, G_VFS_JOB (job), handle);
 }
 
 static void
 close_write_reply (GVfsBackendSftp *backend,
                    int reply_type,
-                   GDataInputStream *reply,
+                   SftpReply *reply,
                    guint32 len,
                    GVfsJob *job,
                    gpointer user_data)
 {
-  GDataOutputStream *command;
+  GByteArray *command;
   GError *error;
   gboolean res;
   char *backup_name;
@@ -2819,6 +4084,8 @@ close_write_reply (GVfsBackendSftp *backend,
 
   handle = user_data;
 
+  dir_cache_purge (backend, handle->filename);
+
   error = NULL;
   res = FALSE;
   if (reply_type == SSH_FXP_STATUS)
@@ -2827,25 +4094,32 @@ close_write_reply (GVfsBackendSftp *backend,
     g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
 	                 _("Invalid reply received"));
 
+  if (res && handle->write_error != NULL)
+    {
+      /* Don't put a file in place that is missing some writes */
+      res = FALSE;
+      error = g_error_copy (handle->write_error);
+    }
+
   if (res)
     {
       if (handle->tempname)
         {
           if (handle->make_backup)
             {
-              command = new_command_stream (backend,
-                                            SSH_FXP_REMOVE);
+              command = new_command (backend,
+                                     SSH_FXP_REMOVE);
               backup_name = g_strconcat (handle->filename, "~", NULL);
               put_string (command, backup_name);
               g_free (backup_name);
-              queue_command_stream_and_free (backend, command, close_deleted_backup, G_VFS_JOB (job), handle);
+              queue_command_and_free (backend, command, close_deleted_backup, G_VFS_JOB (job), handle);
             }
           else
             {
-              command = new_command_stream (backend,
-                                            SSH_FXP_REMOVE);
+              command = new_command (backend,
+                                     SSH_FXP_REMOVE);
               put_string (command, handle->filename);
-              queue_command_stream_and_free (backend, command, close_deleted_file, G_VFS_JOB (job), handle);
+              queue_command_and_free (backend, command, close_deleted_file, G_VFS_JOB (job), handle);
             }
         }
       else
@@ -2871,13 +4145,13 @@ close_write_reply (GVfsBackendSftp *backend,
 static void
 close_write_fstat_reply (GVfsBackendSftp *backend,
                         int reply_type,
-                        GDataInputStream *reply,
+                        SftpReply *reply,
                         guint32 len,
                         GVfsJob *job,
                         gpointer user_data)
 {
   SftpHandle *handle = user_data;
-  GDataOutputStream *command;
+  GByteArray *command;
   GFileInfo *info;
   const char *etag;
   
@@ -2892,10 +4166,23 @@ close_write_fstat_reply (GVfsBackendSftp *backend,
       g_object_unref (info);
     }
   
-  command = new_command_stream (backend, SSH_FXP_CLOSE);
+  command = new_command (backend, SSH_FXP_CLOSE);
+  put_data_buffer (command, handle->raw_handle);
+
+  queue_command_and_free (backend, command, close_write_reply, G_VFS_JOB (job), handle);
+}
+
+static void
+close_write_start (GVfsBackendSftp *backend,
+                   GVfsJob *job,
+                   SftpHandle *handle)
+{
+  GByteArray *command;
+
+  command = new_command (backend, SSH_FXP_FSTAT);
   put_data_buffer (command, handle->raw_handle);
 
-  queue_command_stream_and_free (backend, command, close_write_reply, G_VFS_JOB (job), handle);
+  queue_command_and_free (backend, command, close_write_fstat_reply, job, handle);
 }
 
 static gboolean
@@ -2905,12 +4192,14 @@ try_close_write (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
 
-  command = new_command_stream (op_backend, SSH_FXP_FSTAT);
-  put_data_buffer (command, handle->raw_handle);
+  job_set_connection (G_VFS_JOB (job), handle->connection);
 
-  queue_command_stream_and_free (op_backend, command, close_write_fstat_reply, G_VFS_JOB (job), handle);
+  /* Wait for the outstanding writes, see write_reply() */
+  if (handle->outstanding_writes > 0)
+    handle->waiting_job = g_object_ref (job);
+  else
+    close_write_start (op_backend, G_VFS_JOB (job), handle);
 
   return TRUE;
 }
@@ -2919,7 +4208,7 @@ try_close_write (GVfsBackend *backend,
 static void
 close_read_reply (GVfsBackendSftp *backend,
                   int reply_type,
-                  GDataInputStream *reply,
+                  SftpReply *reply,
                   guint32 len,
                   GVfsJob *job,
                   gpointer user_data)
@@ -2943,27 +4232,29 @@ try_close_read (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
 
-  command = new_command_stream (op_backend, SSH_FXP_CLOSE);
+  job_set_connection (G_VFS_JOB (job), handle->connection);
+
+  command = new_command (op_backend, SSH_FXP_CLOSE);
   put_data_buffer (command, handle->raw_handle);
 
-  queue_command_stream_and_free (op_backend, command, close_read_reply, G_VFS_JOB (job), handle);
+  queue_command_and_free (op_backend, command, close_read_reply, G_VFS_JOB (job), handle);
 
   return TRUE;
 }
 
 static void
-put_mode (GDataOutputStream *command, GFileCreateFlags flags)
+put_mode (GByteArray *command, GFileCreateFlags flags)
 {
   if (flags & G_FILE_CREATE_PRIVATE)
     {
-      g_data_output_stream_put_uint32 (command, SSH_FILEXFER_ATTR_PERMISSIONS, NULL, NULL);
-      g_data_output_stream_put_uint32 (command, 0600, NULL, NULL);
+      put_uint32 (command, SSH_FILEXFER_ATTR_PERMISSIONS);
+      put_uint32 (command, 0600);
     }
   else
     {
-      g_data_output_stream_put_uint32 (command, 0, NULL, NULL);
+      put_uint32 (command, 0);
     }
 }
 
@@ -3035,7 +4326,7 @@ not_dir_or_not_exist_error (GVfsBackendSftp *backend,
 static void
 create_reply (GVfsBackendSftp *backend,
               int reply_type,
-              GDataInputStream *reply,
+              SftpReply *reply,
               guint32 len,
               GVfsJob *job,
               gpointer user_data)
@@ -3067,7 +4358,10 @@ create_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  dir_cache_purge (backend, G_VFS_JOB_OPEN_FOR_WRITE (job)->filename);
+
+  handle = sftp_handle_new (job, reply);
+  handle->filename = g_strdup (G_VFS_JOB_OPEN_FOR_WRITE (job)->filename);
   
   g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), handle);
   g_vfs_job_open_for_write_set_can_seek (G_VFS_JOB_OPEN_FOR_WRITE (job), TRUE);
@@ -3082,15 +4376,15 @@ try_create (GVfsBackend *backend,
             GFileCreateFlags flags)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_OPEN);
+  command = new_command (op_backend,
+                         SSH_FXP_OPEN);
   put_string (command, filename);
-  g_data_output_stream_put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL,  NULL, NULL); /* open flags */
+  put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL); /* open flags */
   put_mode (command, flags);
   
-  queue_command_stream_and_free (op_backend, command, create_reply, G_VFS_JOB (job), NULL);
+  queue_command_and_free (op_backend, command, create_reply, G_VFS_JOB (job), NULL);
 
   return TRUE;
 }
@@ -3126,7 +4420,7 @@ append_to_error (GVfsBackendSftp *backend,
 static void
 append_to_reply (GVfsBackendSftp *backend,
                  int reply_type,
-                 GDataInputStream *reply,
+                 SftpReply *reply,
                  guint32 len,
                  GVfsJob *job,
                  gpointer user_data)
@@ -3149,7 +4443,10 @@ append_to_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  dir_cache_purge (backend, G_VFS_JOB_OPEN_FOR_WRITE (job)->filename);
+
+  handle = sftp_handle_new (job, reply);
+  handle->filename = g_strdup (G_VFS_JOB_OPEN_FOR_WRITE (job)->filename);
   
   g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), handle);
   g_vfs_job_open_for_write_set_can_seek (G_VFS_JOB_OPEN_FOR_WRITE (job), TRUE);
@@ -3164,15 +4461,15 @@ try_append_to (GVfsBackend *backend,
                GFileCreateFlags flags)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_OPEN);
+  command = new_command (op_backend,
+                         SSH_FXP_OPEN);
   put_string (command, filename);
-  g_data_output_stream_put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_APPEND,  NULL, NULL); /* open flags */
+  put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_APPEND); /* open flags */
   put_mode (command, flags);
   
-  queue_command_stream_and_free (op_backend, command, append_to_reply, G_VFS_JOB (job), NULL);
+  queue_command_and_free (op_backend, command, append_to_reply, G_VFS_JOB (job), NULL);
 
   return TRUE;
 }
@@ -3200,7 +4497,7 @@ static void replace_create_temp (GVfsBackendSftp *backend,
 static void
 replace_truncate_original_reply (GVfsBackendSftp *backend,
                                  int reply_type,
-                                 GDataInputStream *reply,
+                                 SftpReply *reply,
                                  guint32 len,
                                  GVfsJob *job,
                                  gpointer user_data)
@@ -3235,7 +4532,9 @@ replace_truncate_original_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  dir_cache_purge (backend, op_job->filename);
+
+  handle = sftp_handle_new (job, reply);
   handle->filename = g_strdup (op_job->filename);
   handle->tempname = NULL;
   handle->permissions = data->permissions;
@@ -3254,23 +4553,23 @@ replace_truncate_original (GVfsBackendSftp *backend,
                            GVfsJob *job)
 {
   GVfsJobOpenForWrite *op_job;
-  GDataOutputStream *command;
+  GByteArray *command;
 
   op_job = G_VFS_JOB_OPEN_FOR_WRITE (job);
   
-  command = new_command_stream (backend,
-                                SSH_FXP_OPEN);
+  command = new_command (backend,
+                         SSH_FXP_OPEN);
   put_string (command, op_job->filename);
-  g_data_output_stream_put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_TRUNC,  NULL, NULL); /* open flags */
+  put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_TRUNC); /* open flags */
   put_mode (command, op_job->flags);
   
-  queue_command_stream_and_free (backend, command, replace_truncate_original_reply, job, NULL);
+  queue_command_and_free (backend, command, replace_truncate_original_reply, job, NULL);
 }
 
 static void
 replace_create_temp_reply (GVfsBackendSftp *backend,
                            int reply_type,
-                           GDataInputStream *reply,
+                           SftpReply *reply,
                            guint32 len,
                            GVfsJob *job,
                            gpointer user_data)
@@ -3335,7 +4634,9 @@ replace_create_temp_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  dir_cache_purge (backend, op_job->filename);
+
+  handle = sftp_handle_new (job, reply);
   handle->filename = g_strdup (op_job->filename);
   handle->tempname = g_strdup (data->tempname);
   handle->permissions = data->permissions;
@@ -3382,7 +4683,7 @@ replace_create_temp (GVfsBackendSftp *backend,
                      GVfsJobOpenForWrite *job)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
   char *dirname;
   ReplaceData *data;
   char basename[] = ".giosaveXXXXXX";
@@ -3406,28 +4707,28 @@ replace_create_temp (GVfsBackendSftp *backend,
   data->tempname = g_build_filename (dirname, basename, NULL);
   g_free (dirname);
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_OPEN);
+  command = new_command (op_backend,
+                         SSH_FXP_OPEN);
   put_string (command, data->tempname);
-  g_data_output_stream_put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL,  NULL, NULL); /* open flags */
-  g_data_output_stream_put_uint32 (command, (data->set_permissions ? SSH_FILEXFER_ATTR_PERMISSIONS : 0) |
-                                            (data->set_ownership ? SSH_FILEXFER_ATTR_UIDGID : 0), NULL, NULL); /* Attr flags */
+  put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL); /* open flags */
+  put_uint32 (command, (data->set_permissions ? SSH_FILEXFER_ATTR_PERMISSIONS : 0) |
+                       (data->set_ownership ? SSH_FILEXFER_ATTR_UIDGID : 0)); /* Attr flags */
   
   if (data->set_ownership)
   {
-    g_data_output_stream_put_uint32 (command, data->uid, NULL, NULL);
-    g_data_output_stream_put_uint32 (command, data->gid, NULL, NULL);
+    put_uint32 (command, data->uid);
+    put_uint32 (command, data->gid);
   }
   
   if (data->set_permissions)
-    g_data_output_stream_put_uint32 (command, data->permissions, NULL, NULL);
-  queue_command_stream_and_free (op_backend, command, replace_create_temp_reply, G_VFS_JOB (job), NULL);
+    put_uint32 (command, data->permissions);
+  queue_command_and_free (op_backend, command, replace_create_temp_reply, G_VFS_JOB (job), NULL);
 }
 
 static void
 replace_stat_reply (GVfsBackendSftp *backend,
                     int reply_type,
-                    GDataInputStream *reply,
+                    SftpReply *reply,
                     guint32 len,
                     GVfsJob *job,
                     gpointer user_data)
@@ -3528,13 +4829,13 @@ replace_stat_reply (GVfsBackendSftp *backend,
 static void
 replace_exclusive_reply (GVfsBackendSftp *backend,
                          int reply_type,
-                         GDataInputStream *reply,
+                         SftpReply *reply,
                          guint32 len,
                          GVfsJob *job,
                          gpointer user_data)
 {
   GVfsJobOpenForWrite *op_job;
-  GDataOutputStream *command;
+  GByteArray *command;
   SftpHandle *handle;
   GError *error;
 
@@ -3561,10 +4862,10 @@ replace_exclusive_reply (GVfsBackendSftp *backend,
           
           /* Replace existing file code: */
           
-          command = new_command_stream (backend,
-                                        SSH_FXP_LSTAT);
+          command = new_command (backend,
+                                 SSH_FXP_LSTAT);
           put_string (command, op_job->filename);
-          queue_command_stream_and_free (backend, command, replace_stat_reply, G_VFS_JOB (job), NULL);
+          queue_command_and_free (backend, command, replace_stat_reply, G_VFS_JOB (job), NULL);
         }
       else
         {
@@ -3581,7 +4882,10 @@ replace_exclusive_reply (GVfsBackendSftp *backend,
       return;
     }
   
-  handle = sftp_handle_new (reply);
+  dir_cache_purge (backend, op_job->filename);
+
+  handle = sftp_handle_new (job, reply);
+  handle->filename = g_strdup (op_job->filename);
   
   g_vfs_job_open_for_write_set_handle (op_job, handle);
   g_vfs_job_open_for_write_set_can_seek (op_job, TRUE);
@@ -3599,15 +4903,15 @@ try_replace (GVfsBackend *backend,
              GFileCreateFlags flags)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_OPEN);
+  command = new_command (op_backend,
+                         SSH_FXP_OPEN);
   put_string (command, filename);
-  g_data_output_stream_put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL,  NULL, NULL); /* open flags */
+  put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL); /* open flags */
   put_mode (command, flags);
   
-  queue_command_stream_and_free (op_backend, command, replace_exclusive_reply, G_VFS_JOB (job), NULL);
+  queue_command_and_free (op_backend, command, replace_exclusive_reply, G_VFS_JOB (job), NULL);
 
   return TRUE;
 }
@@ -3615,25 +4919,59 @@ try_replace (GVfsBackend *backend,
 static void
 write_reply (GVfsBackendSftp *backend,
              int reply_type,
-             GDataInputStream *reply,
+             SftpReply *reply,
              guint32 len,
              GVfsJob *job,
              gpointer user_data)
 {
   SftpHandle *handle;
+  GVfsJob *waiting_job;
+  GError *error;
   
   handle = user_data;
 
+  dir_cache_purge (backend, handle->filename);
+
+  /* The job that queued this write has already succeeded */
+  handle->outstanding_writes--;
+
+  error = NULL;
   if (reply_type == SSH_FXP_STATUS)
+    error_from_status (job, reply, -1, -1, &error);
+  else
+    g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         _("Invalid reply received"));
+
+  if (error != NULL)
     {
-      if (result_from_status (job, reply, -1, -1))
+      if (handle->write_error == NULL)
+        handle->write_error = error;
+      else
+        g_error_free (error);
+    }
+
+  waiting_job = handle->waiting_job;
+  if (waiting_job == NULL)
+    return;
+
+  if (G_VFS_IS_JOB_CLOSE_WRITE (waiting_job))
+    {
+      if (handle->outstanding_writes == 0)
         {
-          handle->offset += G_VFS_JOB_WRITE (job)->data_size;
+          handle->waiting_job = NULL;
+          close_write_start (backend, waiting_job, handle);
+          g_object_unref (waiting_job);
         }
     }
   else
-    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                      _("Invalid reply received"));
+    {
+      handle->waiting_job = NULL;
+      if (handle->write_error != NULL)
+        g_vfs_job_failed_from_error (waiting_job, handle->write_error);
+      else
+        g_vfs_job_succeeded (waiting_job);
+      g_object_unref (waiting_job);
+    }
 }
 
 static gboolean
@@ -3645,31 +4983,48 @@ try_write (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_WRITE);
+  job_set_connection (G_VFS_JOB (job), handle->connection);
+
+  if (handle->write_error != NULL)
+    {
+      g_vfs_job_failed_from_error (G_VFS_JOB (job), handle->write_error);
+      return TRUE;
+    }
+
+  /* Short writes are fine, the rest comes in the next one */
+  buffer_size = MIN (buffer_size, op_backend->max_write_size);
+
+  command = new_command_sized (op_backend, SSH_FXP_WRITE,
+                               COMMAND_SIZE + handle->raw_handle->size + buffer_size);
   put_data_buffer (command, handle->raw_handle);
-  g_data_output_stream_put_uint64 (command, handle->offset, NULL, NULL);
-  g_data_output_stream_put_uint32 (command, buffer_size, NULL, NULL);
+  put_uint64 (command, handle->offset);
+  put_uint32 (command, buffer_size);
   /* Ideally we shouldn't do this copy, but doing the writes as multiple writes
      caused problems on the read side in openssh */
-  g_output_stream_write_all (G_OUTPUT_STREAM (command),
-                             buffer, buffer_size,
-                             NULL, NULL, NULL);
+  put_data (command, buffer, buffer_size);
   
-  queue_command_stream_and_free (op_backend, command, write_reply, G_VFS_JOB (job), handle);
+  queue_command_and_free (op_backend, command, write_reply, G_VFS_JOB (job), handle);
+  handle->outstanding_writes++;
+  handle->offset += buffer_size;
 
   /* We always write the full size (on success) */
   g_vfs_job_write_set_written_size (job, buffer_size);
 
+  /* Don't wait for the server unless the window is full */
+  if (handle->outstanding_writes < WRITE_MAX_REQUESTS)
+    g_vfs_job_succeeded (G_VFS_JOB (job));
+  else
+    handle->waiting_job = g_object_ref (job);
+
   return TRUE;
 }
 
 static void
 seek_write_fstat_reply (GVfsBackendSftp *backend,
                         int reply_type,
-                        GDataInputStream *reply,
+                        SftpReply *reply,
                         guint32 len,
                         GVfsJob *job,
                         gpointer user_data)
@@ -3720,7 +5075,9 @@ try_seek_on_write (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
+
+  job_set_connection (G_VFS_JOB (job), handle->connection);
 
   switch (job->seek_type)
     {
@@ -3731,10 +5088,10 @@ try_seek_on_write (GVfsBackend *backend,
       handle->offset = job->requested_offset;
       break;
     case G_SEEK_END:
-      command = new_command_stream (op_backend,
-                                    SSH_FXP_FSTAT);
+      command = new_command (op_backend,
+                             SSH_FXP_FSTAT);
       put_data_buffer (command, handle->raw_handle);
-      queue_command_stream_and_free (op_backend, command, seek_write_fstat_reply, G_VFS_JOB (job), handle);
+      queue_command_and_free (op_backend, command, seek_write_fstat_reply, G_VFS_JOB (job), handle);
       return TRUE;
     }
 
@@ -3750,11 +5107,15 @@ try_seek_on_write (GVfsBackend *backend,
 static void
 truncate_reply (GVfsBackendSftp *backend,
                 int reply_type,
-                GDataInputStream *reply,
+                SftpReply *reply,
                 guint32 len,
                 GVfsJob *job,
                 gpointer user_data)
 {
+  SftpHandle *handle = user_data;
+
+  dir_cache_purge (backend, handle->filename);
+
   if (reply_type == SSH_FXP_STATUS)
     result_from_status (job, reply, -1, -1);
   else
@@ -3770,20 +5131,32 @@ try_truncate (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
+
+  job_set_connection (G_VFS_JOB (job), handle->connection);
 
-  command = new_command_stream (op_backend, SSH_FXP_FSETSTAT);
+  command = new_command (op_backend, SSH_FXP_FSETSTAT);
   put_data_buffer (command, handle->raw_handle);
-  g_data_output_stream_put_uint32 (command, SSH_FILEXFER_ATTR_SIZE, NULL, NULL);
-  g_data_output_stream_put_uint64 (command, size, NULL, NULL);
-  queue_command_stream_and_free (op_backend, command, truncate_reply, G_VFS_JOB (job), NULL);
+  put_uint32 (command, SSH_FILEXFER_ATTR_SIZE);
+  put_uint64 (command, size);
+  queue_command_and_free (op_backend, command, truncate_reply, G_VFS_JOB (job), handle);
 
   return TRUE;
 }
 
+/* Number of READDIR requests kept in flight while enumerating. The server
+   answers them in order, so the entries still come in directory order. */
+#define READDIR_PIPELINE 3
+
 typedef struct {
   DataBuffer *handle;
   int outstanding_requests;
+  gboolean eof;
+
+  /* Filled while enumerating, put in the directory cache when done
+     unless something was purged in the meantime */
+  SftpDirCacheEntry *cache_entry;
+  guint cache_generation;
 } ReadDirData;
 
 static
@@ -3791,26 +5164,53 @@ void
 read_dir_data_free (ReadDirData *data)
 {
   data_buffer_free (data->handle);
+  dir_cache_entry_free (data->cache_entry);
   g_slice_free (ReadDirData, data);
 }
 
 static void
-read_dir_readlink_reply (GVfsBackendSftp *backend,
-                         int reply_type,
-                         GDataInputStream *reply,
-                         guint32 len,
-                         GVfsJob *job,
-                         gpointer user_data)
+read_dir_add_info (GVfsJob *job,
+                   GFileInfo *info)
+{
+  ReadDirData *data;
+
+  data = job->backend_data;
+
+  /* Copy it, the job adds its own attributes to the info */
+  g_hash_table_replace (data->cache_entry->infos,
+                        g_strdup (g_file_info_get_name (info)),
+                        g_file_info_dup (info));
+  
+  g_vfs_job_enumerate_add_info (G_VFS_JOB_ENUMERATE (job), info);
+}
+
+static void
+read_dir_done (GVfsBackendSftp *backend,
+               GVfsJob *job)
 {
   ReadDirData *data;
-  GFileInfo *info = user_data;
-  char *target;
 
   data = job->backend_data;
 
+  if (data->cache_generation == backend->dir_cache_generation)
+    {
+      dir_cache_insert (backend, G_VFS_JOB_ENUMERATE (job)->filename, data->cache_entry);
+      data->cache_entry = NULL;
+    }
+  
+  g_vfs_job_enumerate_done (G_VFS_JOB_ENUMERATE (job));
+}
+
+static void
+read_dir_set_symlink_target (GFileInfo *info,
+                             int reply_type,
+                             SftpReply *reply)
+{
+  char *target;
+
   if (reply_type == SSH_FXP_NAME)
     {
-      /* count = */ (void) g_data_input_stream_read_uint32 (reply, NULL, NULL);
+      /* count = */ (void) reply_read_uint32 (reply);
       
       target = read_string (reply, NULL);
       if (target)
@@ -3819,12 +5219,28 @@ read_dir_readlink_reply (GVfsBackendSftp *backend,
           g_free (target);
         }
     }
+}
 
-  g_vfs_job_enumerate_add_info (G_VFS_JOB_ENUMERATE (job), info);
+static void
+read_dir_readlink_reply (GVfsBackendSftp *backend,
+                         int reply_type,
+                         SftpReply *reply,
+                         guint32 len,
+                         GVfsJob *job,
+                         gpointer user_data)
+{
+  ReadDirData *data;
+  GFileInfo *info = user_data;
+
+  data = job->backend_data;
+
+  read_dir_set_symlink_target (info, reply_type, reply);
+
+  read_dir_add_info (job, info);
   g_object_unref (info);
   
   if (--data->outstanding_requests == 0)
-    g_vfs_job_enumerate_done (G_VFS_JOB_ENUMERATE (job));
+    read_dir_done (backend, job);
 }
 
 static void
@@ -3833,7 +5249,7 @@ read_dir_got_stat_info (GVfsBackendSftp *backend,
                         GFileInfo *info)
 {
   GVfsJobEnumerate *enum_job;
-  GDataOutputStream *command;
+  GByteArray *command;
   ReadDirData *data;
   char *abs_name;
   
@@ -3841,27 +5257,30 @@ read_dir_got_stat_info (GVfsBackendSftp *backend,
   
   enum_job = G_VFS_JOB_ENUMERATE (job);
 
-  if (g_file_attribute_matcher_matches (enum_job->attribute_matcher,
+  /* Only symlinks have a target, don't ask for the others */
+  if (g_file_info_get_is_symlink (info) &&
+      g_file_attribute_matcher_matches (enum_job->attribute_matcher,
                                         G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET))
     {
       data->outstanding_requests++;
-      command = new_command_stream (backend,
-                                    SSH_FXP_READLINK);
+      command = new_command (backend,
+                             SSH_FXP_READLINK);
       abs_name = g_build_filename (enum_job->filename, g_file_info_get_name (info), NULL);
       put_string (command, abs_name);
       g_free (abs_name);
-      queue_command_stream_and_free (backend, command, read_dir_readlink_reply, G_VFS_JOB (job), g_object_ref (info));
+      queue_command_and_free (backend, command, read_dir_readlink_reply, G_VFS_JOB (job), g_object_ref (info));
     }
   else
-    g_vfs_job_enumerate_add_info (enum_job, info);
+    read_dir_add_info (job, info);
 }
 
 
+/* Replies to a STAT of a symlink, followed by its READLINK when the
+   target was requested */
 static void
 read_dir_symlink_reply (GVfsBackendSftp *backend,
-                        int reply_type,
-                        GDataInputStream *reply,
-                        guint32 len,
+                        MultiReply *replies,
+                        int n_replies,
                         GVfsJob *job,
                         gpointer user_data)
 {
@@ -3874,31 +5293,57 @@ read_dir_symlink_reply (GVfsBackendSftp *backend,
   name = g_file_info_get_name (lstat_info);
   data = job->backend_data;
   
-  if (reply_type == SSH_FXP_ATTRS)
+  if (replies[0].type == SSH_FXP_ATTRS)
     {
       info = g_file_info_new ();
       g_file_info_set_name (info, name);
       g_file_info_set_is_symlink (info, TRUE);
       
-      parse_attributes (backend, info, name, reply, G_VFS_JOB_ENUMERATE (job)->attribute_matcher);
-
-      read_dir_got_stat_info (backend, job, info);
-      
-      g_object_unref (info);
+      parse_attributes (backend, info, name, replies[0].data, G_VFS_JOB_ENUMERATE (job)->attribute_matcher);
     }
   else
-    read_dir_got_stat_info (backend, job, lstat_info);
+    info = g_object_ref (lstat_info);
 
+  if (n_replies > 1)
+    read_dir_set_symlink_target (info, replies[1].type, replies[1].data);
+
+  read_dir_add_info (job, info);
+
+  g_object_unref (info);
   g_object_unref (lstat_info);
   
   if (--data->outstanding_requests == 0)
-    g_vfs_job_enumerate_done (G_VFS_JOB_ENUMERATE (job));
+    read_dir_done (backend, job);
+}
+
+static void read_dir_reply (GVfsBackendSftp *backend,
+                            int reply_type,
+                            SftpReply *reply,
+                            guint32 len,
+                            GVfsJob *job,
+                            gpointer user_data);
+
+static void
+queue_read_dir (GVfsBackendSftp *backend,
+                GVfsJob *job)
+{
+  GByteArray *command;
+  ReadDirData *data;
+
+  data = job->backend_data;
+
+  command = new_command (backend,
+                         SSH_FXP_READDIR);
+  put_data_buffer (command, data->handle);
+  queue_command_and_free (backend, command, read_dir_reply, job, NULL);
+
+  data->outstanding_requests++;
 }
 
 static void
 read_dir_reply (GVfsBackendSftp *backend,
                 int reply_type,
-                GDataInputStream *reply,
+                SftpReply *reply,
                 guint32 len,
                 GVfsJob *job,
                 gpointer user_data)
@@ -3906,7 +5351,9 @@ read_dir_reply (GVfsBackendSftp *backend,
   GVfsJobEnumerate *enum_job;
   guint32 count;
   int i;
-  GDataOutputStream *command;
+  GByteArray *command;
+  GByteArray *commands[2];
+  int n_commands;
   ReadDirData *data;
 
   data = job->backend_data;
@@ -3917,20 +5364,29 @@ read_dir_reply (GVfsBackendSftp *backend,
       /* Ignore all error, including the expected END OF FILE.
        * Real errors are expected in open_dir anyway */
 
-      /* Close handle */
+      /* Close handle, the READDIRs still in flight are answered
+       * before the close */
 
-      command = new_command_stream (backend,
-                                    SSH_FXP_CLOSE);
-      put_data_buffer (command, data->handle);
-      queue_command_stream_and_free (backend, command, NULL, G_VFS_JOB (job), NULL);
+      if (!data->eof)
+        {
+          data->eof = TRUE;
+          command = new_command (backend,
+                                 SSH_FXP_CLOSE);
+          put_data_buffer (command, data->handle);
+          queue_command_and_free (backend, command, NULL, G_VFS_JOB (job), NULL);
+        }
   
       if (--data->outstanding_requests == 0)
-        g_vfs_job_enumerate_done (enum_job);
+        read_dir_done (backend, job);
       
       return;
     }
 
-  count = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+  /* Keep the pipeline full while this batch is processed */
+  if (!data->eof)
+    queue_read_dir (backend, job);
+
+  count = reply_read_uint32 (reply);
   for (i = 0; i < count; i++)
     {
       GFileInfo *info;
@@ -3951,14 +5407,26 @@ read_dir_reply (GVfsBackendSftp *backend,
           ! (enum_job->flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS))
         {
           /* Default (at least for openssh) is for readdir to not follow symlinks.
-             This was a symlink, and follow links was requested, so we need to manually follow it */
-          command = new_command_stream (backend,
-                                        SSH_FXP_STAT);
+             This was a symlink, and follow links was requested, so we need to manually follow it.
+             The target is read at the same time if requested. */
           abs_name = g_build_filename (enum_job->filename, name, NULL);
-          put_string (command, abs_name);
+
+          commands[0] = new_command (backend,
+                                     SSH_FXP_STAT);
+          put_string (commands[0], abs_name);
+          n_commands = 1;
+
+          if (g_file_attribute_matcher_matches (enum_job->attribute_matcher,
+                                                G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET))
+            {
+              commands[1] = new_command (backend,
+                                         SSH_FXP_READLINK);
+              put_string (commands[1], abs_name);
+              n_commands = 2;
+            }
           g_free (abs_name);
           
-          queue_command_stream_and_free (backend, command, read_dir_symlink_reply, G_VFS_JOB (job), g_object_ref (info));
+          queue_commands_and_free (backend, commands, n_commands, read_dir_symlink_reply, G_VFS_JOB (job), g_object_ref (info));
           data->outstanding_requests ++;
         }
       else if (strcmp (".", name) != 0 &&
@@ -3969,10 +5437,8 @@ read_dir_reply (GVfsBackendSftp *backend,
       g_free (name);
     }
 
-  command = new_command_stream (backend,
-                                SSH_FXP_READDIR);
-  put_data_buffer (command, data->handle);
-  queue_command_stream_and_free (backend, command, read_dir_reply, G_VFS_JOB (job), NULL);
+  if (--data->outstanding_requests == 0)
+    read_dir_done (backend, job);
 }
 
 static void
@@ -4001,14 +5467,14 @@ open_dir_error (GVfsBackendSftp *backend,
 static void
 open_dir_reply (GVfsBackendSftp *backend,
                 int reply_type,
-                GDataInputStream *reply,
+                SftpReply *reply,
                 guint32 len,
                 GVfsJob *job,
                 gpointer user_data)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
   ReadDirData *data;
+  int i;
 
   data = job->backend_data;
   
@@ -4031,14 +5497,9 @@ open_dir_reply (GVfsBackendSftp *backend,
   g_vfs_job_succeeded (G_VFS_JOB (job));
   
   data->handle = read_data_buffer (reply);
-  
-  command = new_command_stream (op_backend,
-                                SSH_FXP_READDIR);
-  put_data_buffer (command, data->handle);
 
-  data->outstanding_requests = 1;
-  
-  queue_command_stream_and_free (op_backend, command, read_dir_reply, G_VFS_JOB (job), NULL);
+  for (i = 0; i < READDIR_PIPELINE; i++)
+    queue_read_dir (op_backend, job);
 }
 
 static gboolean
@@ -4049,17 +5510,19 @@ try_enumerate (GVfsBackend *backend,
                GFileQueryInfoFlags flags)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
   ReadDirData *data;
 
   data = g_slice_new0 (ReadDirData);
+  data->cache_entry = dir_cache_entry_new (attribute_matcher, flags);
+  data->cache_generation = op_backend->dir_cache_generation;
 
   g_vfs_job_set_backend_data (G_VFS_JOB (job), data, (GDestroyNotify)read_dir_data_free);
-  command = new_command_stream (op_backend,
-                                SSH_FXP_OPENDIR);
+  command = new_command (op_backend,
+                         SSH_FXP_OPENDIR);
   put_string (command, filename);
   
-  queue_command_stream_and_free (op_backend, command, open_dir_reply, G_VFS_JOB (job), NULL);
+  queue_command_and_free (op_backend, command, open_dir_reply, G_VFS_JOB (job), NULL);
 
   return TRUE;
 }
@@ -4144,7 +5607,7 @@ query_info_reply (GVfsBackendSftp *backend,
           char *symlink_target;
           
           /* Skip count (always 1 for replies to SSH_FXP_READLINK) */
-          g_data_input_stream_read_uint32 (reply->data, NULL, NULL);
+          reply_read_uint32 (reply->data);
           symlink_target = read_string (reply->data, NULL);
           g_file_info_set_symlink_target (op_job->file_info, symlink_target);
           g_free (symlink_target);
@@ -4163,22 +5626,31 @@ try_query_info (GVfsBackend *backend,
                 GFileAttributeMatcher *matcher)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *commands[3];
-  GDataOutputStream *command;
+  GByteArray *commands[3];
+  GByteArray *command;
+  GFileInfo *cached_info;
   int n_commands;
 
+  cached_info = dir_cache_lookup (op_backend, filename, job->flags, job->attribute_matcher);
+  if (cached_info != NULL)
+    {
+      g_file_info_copy_into (cached_info, info);
+      g_vfs_job_succeeded (G_VFS_JOB (job));
+      return TRUE;
+    }
+
   n_commands = 0;
   
   command = commands[n_commands++] =
-    new_command_stream (op_backend,
-                        SSH_FXP_LSTAT);
+    new_command (op_backend,
+                 SSH_FXP_LSTAT);
   put_string (command, filename);
   
   if (! (job->flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS))
     {
       command = commands[n_commands++] =
-        new_command_stream (op_backend,
-                            SSH_FXP_STAT);
+        new_command (op_backend,
+                     SSH_FXP_STAT);
       put_string (command, filename);
     }
 
@@ -4186,12 +5658,12 @@ try_query_info (GVfsBackend *backend,
                                         G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET))
     {
       command = commands[n_commands++] =
-        new_command_stream (op_backend,
-                            SSH_FXP_READLINK);
+        new_command (op_backend,
+                     SSH_FXP_READLINK);
       put_string (command, filename);
     }
 
-  queue_command_streams_and_free (op_backend, commands, n_commands, query_info_reply, G_VFS_JOB (job), NULL);
+  queue_commands_and_free (op_backend, commands, n_commands, query_info_reply, G_VFS_JOB (job), NULL);
   
   return TRUE;
 }
@@ -4199,7 +5671,7 @@ try_query_info (GVfsBackend *backend,
 static void
 query_fs_info_reply (GVfsBackendSftp *backend,
                      int reply_type,
-                     GDataInputStream *reply,
+                     SftpReply *reply,
                      guint32 len,
                      GVfsJob *job,
                      gpointer user_data)
@@ -4225,17 +5697,17 @@ query_fs_info_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  g_data_input_stream_read_uint64 (reply, NULL, NULL); /* bsize */
-  frsize = g_data_input_stream_read_uint64 (reply, NULL, NULL);
-  blocks = g_data_input_stream_read_uint64 (reply, NULL, NULL);
-  bfree = g_data_input_stream_read_uint64 (reply, NULL, NULL);
-  bavail = g_data_input_stream_read_uint64 (reply, NULL, NULL);
-  g_data_input_stream_read_uint64 (reply, NULL, NULL); /* files */
-  g_data_input_stream_read_uint64 (reply, NULL, NULL); /* ffree */
-  g_data_input_stream_read_uint64 (reply, NULL, NULL); /* favail */
-  g_data_input_stream_read_uint64 (reply, NULL, NULL); /* fsid */
-  flags = g_data_input_stream_read_uint64 (reply, NULL, NULL);
-  g_data_input_stream_read_uint64 (reply, NULL, NULL); /* namemax */
+  reply_read_uint64 (reply); /* bsize */
+  frsize = reply_read_uint64 (reply);
+  blocks = reply_read_uint64 (reply);
+  bfree = reply_read_uint64 (reply);
+  bavail = reply_read_uint64 (reply);
+  reply_read_uint64 (reply); /* files */
+  reply_read_uint64 (reply); /* ffree */
+  reply_read_uint64 (reply); /* favail */
+  reply_read_uint64 (reply); /* fsid */
+  flags = reply_read_uint64 (reply);
+  reply_read_uint64 (reply); /* namemax */
 
   /* If free and available are both 0, treat it like the size information is
    * missing.
@@ -4270,7 +5742,7 @@ try_query_fs_info (GVfsBackend *backend,
                    GFileAttributeMatcher *matcher)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
 
   g_file_info_set_attribute_string (info,
                                     G_FILE_ATTRIBUTE_FILESYSTEM_TYPE, "sftp");
@@ -4285,12 +5757,12 @@ try_query_fs_info (GVfsBackend *backend,
        g_file_attribute_matcher_matches (matcher,
                                          G_FILE_ATTRIBUTE_FILESYSTEM_READONLY)))
     {
-      command = new_command_stream (op_backend, SSH_FXP_EXTENDED);
+      command = new_command (op_backend, SSH_FXP_EXTENDED);
       put_string (command, "statvfs@openssh.com");
       put_string (command, filename);
 
-      queue_command_stream_and_free (op_backend, command, query_fs_info_reply,
-                                     G_VFS_JOB (job), info);
+      queue_command_and_free (op_backend, command, query_fs_info_reply,
+                              G_VFS_JOB (job), info);
     }
   else
     g_vfs_job_succeeded (G_VFS_JOB (job));
@@ -4306,7 +5778,7 @@ typedef struct {
 static void
 query_info_fstat_reply (GVfsBackendSftp *backend,
                         int reply_type,
-                        GDataInputStream *reply,
+                        SftpReply *reply,
                         guint32 len,
                         GVfsJob *job,
                         gpointer user_data)
@@ -4350,16 +5822,18 @@ try_query_info_fstat (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
   QueryInfoFStatData *data;
 
-  command = new_command_stream (op_backend, SSH_FXP_FSTAT);
+  job_set_connection (G_VFS_JOB (job), handle->connection);
+
+  command = new_command (op_backend, SSH_FXP_FSTAT);
   put_data_buffer (command, handle->raw_handle);
 
   data = g_slice_new (QueryInfoFStatData);
   data->info = info;
   data->attribute_matcher = attribute_matcher;
-  queue_command_stream_and_free (op_backend, command, query_info_fstat_reply, G_VFS_JOB (job), data);
+  queue_command_and_free (op_backend, command, query_info_fstat_reply, G_VFS_JOB (job), data);
 
   return TRUE;
 }
@@ -4367,13 +5841,16 @@ try_query_info_fstat (GVfsBackend *backend,
 static void
 move_reply (GVfsBackendSftp *backend,
             int reply_type,
-            GDataInputStream *reply,
+            SftpReply *reply,
             guint32 len,
             GVfsJob *job,
             gpointer user_data)
 {
   goffset *file_size;
 
+  dir_cache_purge (backend, G_VFS_JOB_MOVE (job)->source);
+  dir_cache_purge (backend, G_VFS_JOB_MOVE (job)->destination);
+
   /* on any unknown error, return NOT_SUPPORTED to get the fallback implementation */
   if (reply_type == SSH_FXP_STATUS)
     {
@@ -4396,26 +5873,28 @@ move_do_rename (GVfsBackendSftp *backend,
                 GVfsJob *job)
 {
   GVfsJobMove *op_job;
-  GDataOutputStream *command;
+  GByteArray *command;
 
   op_job = G_VFS_JOB_MOVE (job);
 
-  command = new_command_stream (backend,
-                                SSH_FXP_RENAME);
+  command = new_command (backend,
+                         SSH_FXP_RENAME);
   put_string (command, op_job->source);
   put_string (command, op_job->destination);
 
-  queue_command_stream_and_free (backend, command, move_reply, G_VFS_JOB (job), NULL);
+  queue_command_and_free (backend, command, move_reply, G_VFS_JOB (job), NULL);
 }
 
 static void
 move_delete_target_reply (GVfsBackendSftp *backend,
                           int reply_type,
-                          GDataInputStream *reply,
+                          SftpReply *reply,
                           guint32 len,
                           GVfsJob *job,
                           gpointer user_data)
 {
+  dir_cache_purge (backend, G_VFS_JOB_MOVE (job)->destination);
+
   if (reply_type == SSH_FXP_STATUS)
     {
       if (failure_from_status (job, reply, -1, -1))
@@ -4436,7 +5915,7 @@ move_lstat_reply (GVfsBackendSftp *backend,
 {
   GVfsJobMove *op_job;
   gboolean destination_exist, source_is_dir, dest_is_dir;
-  GDataOutputStream *command;
+  GByteArray *command;
   GFileInfo *info;
   goffset *file_size;
 
@@ -4508,92 +5987,212 @@ move_lstat_reply (GVfsBackendSftp *backend,
 
   if (destination_exist && (op_job->flags & G_FILE_COPY_OVERWRITE))
     {
-      command = new_command_stream (backend,
-                                    SSH_FXP_REMOVE);
+      command = new_command (backend,
+                             SSH_FXP_REMOVE);
       put_string (command, op_job->destination);
-      queue_command_stream_and_free (backend, command, move_delete_target_reply, G_VFS_JOB (job), NULL);
+      queue_command_and_free (backend, command, move_delete_target_reply, G_VFS_JOB (job), NULL);
       return;
     }
 
   move_do_rename (backend, job);
 }
 
-
-static gboolean
-try_move (GVfsBackend *backend,
-          GVfsJobMove *job,
-          const char *source,
-          const char *destination,
-          GFileCopyFlags flags,
-          GFileProgressCallback progress_callback,
-          gpointer progress_callback_data)
+static void
+move_lstat (GVfsBackendSftp *backend,
+            GVfsJobMove *job)
 {
-  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
-  GDataOutputStream *commands[2];
+  GByteArray *command;
+  GByteArray *commands[2];
 
   command = commands[0] =
-    new_command_stream (op_backend,
-                        SSH_FXP_LSTAT);
-  put_string (command, source);
+    new_command (backend,
+                 SSH_FXP_LSTAT);
+  put_string (command, job->source);
 
   command = commands[1] =
-    new_command_stream (op_backend,
-                        SSH_FXP_LSTAT);
-  put_string (command, destination);
+    new_command (backend,
+                 SSH_FXP_LSTAT);
+  put_string (command, job->destination);
 
-  queue_command_streams_and_free (op_backend, commands, 2, move_lstat_reply, G_VFS_JOB (job), NULL);
-  
-  return TRUE;
+  queue_commands_and_free (backend, commands, 2, move_lstat_reply, G_VFS_JOB (job), NULL);
 }
 
 static void
-set_display_name_reply (GVfsBackendSftp *backend,
-                        int reply_type,
-                        GDataInputStream *reply,
-                        guint32 len,
-                        GVfsJob *job,
-                        gpointer user_data)
+move_posix_rename_reply (GVfsBackendSftp *backend,
+                         int reply_type,
+                         SftpReply *reply,
+                         guint32 len,
+                         GVfsJob *job,
+                         gpointer user_data)
 {
-  if (reply_type == SSH_FXP_STATUS)
-    result_from_status (job, reply, -1, -1);
-  else
-    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                      _("Invalid reply received"));
+  goffset *file_size;
+
+  dir_cache_purge (backend, G_VFS_JOB_MOVE (job)->source);
+  dir_cache_purge (backend, G_VFS_JOB_MOVE (job)->destination);
+
+  if (reply_type != SSH_FXP_STATUS ||
+      read_status_code (reply) != SSH_FX_OK)
+    {
+      /* Go the long way to find out why it failed and report that
+         properly, or to fall back to the default implementation */
+      move_lstat (backend, G_VFS_JOB_MOVE (job));
+      return;
+    }
+
+  file_size = job->backend_data;
+  if (file_size != NULL)
+    g_vfs_job_progress_callback (*file_size, *file_size, job);
+  g_vfs_job_succeeded (job);
 }
 
-static gboolean
-try_set_display_name (GVfsBackend *backend,
-                      GVfsJobSetDisplayName *job,
-                      const char *filename,
-                      const char *display_name)
+/* An overwriting move of a file is a single atomic rename(2) on the
+   server. Only used once the source is known not to be a directory,
+   as a directory would replace an empty directory instead of failing
+   with G_IO_ERROR_WOULD_MERGE. */
+static void
+move_posix_rename (GVfsBackendSftp *backend,
+                   GVfsJobMove *job,
+                   GFileInfo *source_info)
 {
-  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
-  char *dirname, *basename, *new_name;
+  GByteArray *command;
+  goffset *file_size;
 
-  /* We use the same setting as for local files. Can't really
-   * do better, since there is no way in this version of sftp to find out
-   * the remote charset encoding
-   */
-  
-  dirname = g_path_get_dirname (filename);
-  basename = g_filename_from_utf8 (display_name, -1, NULL, NULL, NULL);
-  if (basename == NULL)
-    basename = g_strdup (display_name);
-  new_name = g_build_filename (dirname, basename, NULL);
-  g_free (dirname);
-  g_free (basename);
+  if (g_file_info_has_attribute (source_info, G_FILE_ATTRIBUTE_STANDARD_SIZE))
+    {
+      file_size = g_new (goffset, 1);
+      *file_size = g_file_info_get_size (source_info);
+      g_vfs_job_set_backend_data (G_VFS_JOB (job), file_size, g_free);
+    }
 
-  g_vfs_job_set_display_name_set_new_path (job,
-                                           new_name);
+  command = new_command (backend, SSH_FXP_EXTENDED);
+  put_string (command, "posix-rename@openssh.com");
+  put_string (command, job->source);
+  put_string (command, job->destination);
+
+  queue_command_and_free (backend, command, move_posix_rename_reply, G_VFS_JOB (job), NULL);
+}
+
+static void
+move_posix_rename_lstat_reply (GVfsBackendSftp *backend,
+                               int reply_type,
+                               SftpReply *reply,
+                               guint32 len,
+                               GVfsJob *job,
+                               gpointer user_data)
+{
+  GFileInfo *info;
+
+  if (reply_type != SSH_FXP_ATTRS)
+    {
+      move_lstat (backend, G_VFS_JOB_MOVE (job));
+      return;
+    }
+
+  info = g_file_info_new ();
+  parse_attributes (backend, info, NULL, reply, NULL);
+
+  if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY)
+    move_lstat (backend, G_VFS_JOB_MOVE (job));
+  else
+    move_posix_rename (backend, G_VFS_JOB_MOVE (job), info);
+
+  g_object_unref (info);
+}
+
+static gboolean
+try_move (GVfsBackend *backend,
+          GVfsJobMove *job,
+          const char *source,
+          const char *destination,
+          GFileCopyFlags flags,
+          GFileProgressCallback progress_callback,
+          gpointer progress_callback_data)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GByteArray *command;
+  GFileAttributeMatcher *matcher;
+  GFileInfo *info;
+
+  if ((flags & G_FILE_COPY_OVERWRITE) &&
+      !(flags & G_FILE_COPY_BACKUP) &&
+      has_extension (op_backend, SFTP_EXT_OPENSSH_POSIX_RENAME))
+    {
+      /* Skip the lstat if a recent enumeration saw the source */
+      matcher = g_file_attribute_matcher_new (G_FILE_ATTRIBUTE_STANDARD_TYPE);
+      info = dir_cache_lookup (op_backend, source,
+                               G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, matcher);
+      g_file_attribute_matcher_unref (matcher);
+
+      if (info != NULL &&
+          g_file_info_get_file_type (info) != G_FILE_TYPE_DIRECTORY)
+        {
+          move_posix_rename (op_backend, job, info);
+          return TRUE;
+        }
+
+      if (info == NULL)
+        {
+          command = new_command (op_backend, SSH_FXP_LSTAT);
+          put_string (command, source);
+          queue_command_and_free (op_backend, command, move_posix_rename_lstat_reply, G_VFS_JOB (job), NULL);
+          return TRUE;
+        }
+    }
+
+  move_lstat (op_backend, job);
+  
+  return TRUE;
+}
+
+static void
+set_display_name_reply (GVfsBackendSftp *backend,
+                        int reply_type,
+                        SftpReply *reply,
+                        guint32 len,
+                        GVfsJob *job,
+                        gpointer user_data)
+{
+  dir_cache_purge (backend, G_VFS_JOB_SET_DISPLAY_NAME (job)->filename);
+
+  if (reply_type == SSH_FXP_STATUS)
+    result_from_status (job, reply, -1, -1);
+  else
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+}
+
+static gboolean
+try_set_display_name (GVfsBackend *backend,
+                      GVfsJobSetDisplayName *job,
+                      const char *filename,
+                      const char *display_name)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GByteArray *command;
+  char *dirname, *basename, *new_name;
+
+  /* We use the same setting as for local files. Can't really
+   * do better, since there is no way in this version of sftp to find out
+   * the remote charset encoding
+   */
+  
+  dirname = g_path_get_dirname (filename);
+  basename = g_filename_from_utf8 (display_name, -1, NULL, NULL, NULL);
+  if (basename == NULL)
+    basename = g_strdup (display_name);
+  new_name = g_build_filename (dirname, basename, NULL);
+  g_free (dirname);
+  g_free (basename);
+
+  g_vfs_job_set_display_name_set_new_path (job,
+                                           new_name);
   
-  command = new_command_stream (op_backend,
-                                SSH_FXP_RENAME);
+  command = new_command (op_backend,
+                         SSH_FXP_RENAME);
   put_string (command, filename);
   put_string (command, new_name);
   
-  queue_command_stream_and_free (op_backend, command, set_display_name_reply, G_VFS_JOB (job), NULL);
+  queue_command_and_free (op_backend, command, set_display_name_reply, G_VFS_JOB (job), NULL);
 
   g_free (new_name);
 
@@ -4604,11 +6203,13 @@ try_set_display_name (GVfsBackend *backend,
 static void
 make_symlink_reply (GVfsBackendSftp *backend,
                     int reply_type,
-                    GDataInputStream *reply,
+                    SftpReply *reply,
                     guint32 len,
                     GVfsJob *job,
                     gpointer user_data)
 {
+  dir_cache_purge (backend, G_VFS_JOB_MAKE_SYMLINK (job)->filename);
+
   if (reply_type == SSH_FXP_STATUS)
     result_from_status (job, reply, G_IO_ERROR_EXISTS, -1);
   else
@@ -4623,16 +6224,16 @@ try_make_symlink (GVfsBackend *backend,
                   const char *symlink_value)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
   
-  command = new_command_stream (op_backend,
-                                SSH_FXP_SYMLINK);
+  command = new_command (op_backend,
+                         SSH_FXP_SYMLINK);
   /* Note: This is the reverse order of how this is documented in
      draft-ietf-secsh-filexfer-02.txt, but its how openssh does it. */
   put_string (command, symlink_value);
   put_string (command, filename);
   
-  queue_command_stream_and_free (op_backend, command, make_symlink_reply, G_VFS_JOB (job), NULL);
+  queue_command_and_free (op_backend, command, make_symlink_reply, G_VFS_JOB (job), NULL);
 
   return TRUE;
 }
@@ -4640,7 +6241,7 @@ try_make_symlink (GVfsBackend *backend,
 static void
 mkdir_stat_reply (GVfsBackendSftp *backend,
                   int reply_type,
-                  GDataInputStream *reply,
+                  SftpReply *reply,
                   guint32 len,
                   GVfsJob *job,
                   gpointer user_data)
@@ -4661,11 +6262,13 @@ mkdir_stat_reply (GVfsBackendSftp *backend,
 static void
 make_directory_reply (GVfsBackendSftp *backend,
                       int reply_type,
-                      GDataInputStream *reply,
+                      SftpReply *reply,
                       guint32 len,
                       GVfsJob *job,
                       gpointer user_data)
 {
+  dir_cache_purge (backend, G_VFS_JOB_MAKE_DIRECTORY (job)->filename);
+
   if (reply_type == SSH_FXP_STATUS)
     {
       gint stat_error;
@@ -4674,12 +6277,12 @@ make_directory_reply (GVfsBackendSftp *backend,
       if (stat_error == SSH_FX_FAILURE)
         {
           /* Generic SFTP error, let's stat the target */
-          GDataOutputStream *command;
+          GByteArray *command;
 
-          command = new_command_stream (backend,
-                                        SSH_FXP_LSTAT);
+          command = new_command (backend,
+                                 SSH_FXP_LSTAT);
           put_string (command, G_VFS_JOB_MAKE_DIRECTORY (job)->filename);
-          queue_command_stream_and_free (backend, command, mkdir_stat_reply, G_VFS_JOB (job), NULL);
+          queue_command_and_free (backend, command, mkdir_stat_reply, G_VFS_JOB (job), NULL);
         }
       else
         result_from_status_code (job, stat_error, -1, -1);
@@ -4695,15 +6298,15 @@ try_make_directory (GVfsBackend *backend,
                     const char *filename)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_MKDIR);
+  command = new_command (op_backend,
+                         SSH_FXP_MKDIR);
   put_string (command, filename);
   /* No file info - flag 0 */
-  g_data_output_stream_put_uint32 (command, 0, NULL, NULL);
+  put_uint32 (command, 0);
 
-  queue_command_stream_and_free (op_backend, command, make_directory_reply, G_VFS_JOB (job), NULL);
+  queue_command_and_free (op_backend, command, make_directory_reply, G_VFS_JOB (job), NULL);
 
   return TRUE;
 }
@@ -4711,11 +6314,13 @@ try_make_directory (GVfsBackend *backend,
 static void
 delete_remove_reply (GVfsBackendSftp *backend,
                      int reply_type,
-                     GDataInputStream *reply,
+                     SftpReply *reply,
                      guint32 len,
                      GVfsJob *job,
                      gpointer user_data)
 {
+  dir_cache_purge (backend, G_VFS_JOB_DELETE (job)->filename);
+
   if (reply_type == SSH_FXP_STATUS)
     result_from_status (job, reply, -1, -1); 
   else
@@ -4726,11 +6331,13 @@ delete_remove_reply (GVfsBackendSftp *backend,
 static void
 delete_rmdir_reply (GVfsBackendSftp *backend,
                     int reply_type,
-                    GDataInputStream *reply,
+                    SftpReply *reply,
                     guint32 len,
                     GVfsJob *job,
                     gpointer user_data)
 {
+  dir_cache_purge (backend, G_VFS_JOB_DELETE (job)->filename);
+
   if (reply_type == SSH_FXP_STATUS)
     result_from_status (job, reply, G_IO_ERROR_NOT_EMPTY, -1); 
   else
@@ -4741,7 +6348,7 @@ delete_rmdir_reply (GVfsBackendSftp *backend,
 static void
 delete_lstat_reply (GVfsBackendSftp *backend,
                     int reply_type,
-                    GDataInputStream *reply,
+                    SftpReply *reply,
                     guint32 len,
                     GVfsJob *job,
                     gpointer user_data)
@@ -4754,24 +6361,24 @@ delete_lstat_reply (GVfsBackendSftp *backend,
   else
     {
       GFileInfo *info;
-      GDataOutputStream *command;
+      GByteArray *command;
 
       info = g_file_info_new ();
       parse_attributes (backend, info, NULL, reply, NULL);
 
       if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY)
         {
-          command = new_command_stream (backend,
-                                        SSH_FXP_RMDIR);
+          command = new_command (backend,
+                                 SSH_FXP_RMDIR);
           put_string (command, G_VFS_JOB_DELETE (job)->filename);
-          queue_command_stream_and_free (backend, command, delete_rmdir_reply, G_VFS_JOB (job), NULL);
+          queue_command_and_free (backend, command, delete_rmdir_reply, G_VFS_JOB (job), NULL);
         }
       else
         {
-          command = new_command_stream (backend,
-                                        SSH_FXP_REMOVE);
+          command = new_command (backend,
+                                 SSH_FXP_REMOVE);
           put_string (command, G_VFS_JOB_DELETE (job)->filename);
-          queue_command_stream_and_free (backend, command, delete_remove_reply, G_VFS_JOB (job), NULL);
+          queue_command_and_free (backend, command, delete_remove_reply, G_VFS_JOB (job), NULL);
         }
 
       g_object_unref (info);
@@ -4784,12 +6391,12 @@ try_delete (GVfsBackend *backend,
             const char *filename)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
   
-  command = new_command_stream (op_backend,
-                                SSH_FXP_LSTAT);
+  command = new_command (op_backend,
+                         SSH_FXP_LSTAT);
   put_string (command, filename);
-  queue_command_stream_and_free (op_backend, command, delete_lstat_reply, G_VFS_JOB (job), NULL);
+  queue_command_and_free (op_backend, command, delete_lstat_reply, G_VFS_JOB (job), NULL);
 
   return TRUE;
 }
@@ -4819,11 +6426,13 @@ try_query_settable_attributes (GVfsBackend *backend,
 static void
 set_attribute_reply (GVfsBackendSftp *backend,
 		     int reply_type,
-		     GDataInputStream *reply,
+		     SftpReply *reply,
 		     guint32 len,
 		     GVfsJob *job,
 		     gpointer user_data)
 {
+  dir_cache_purge (backend, G_VFS_JOB_SET_ATTRIBUTE (job)->filename);
+
   if (reply_type == SSH_FXP_STATUS)
     result_from_status (job, reply, -1, -1);
   else 
@@ -4841,7 +6450,7 @@ try_set_attribute (GVfsBackend *backend,
 		   GFileQueryInfoFlags flags)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
+  GByteArray *command;
 
   if (strcmp (attribute, G_FILE_ATTRIBUTE_UNIX_MODE) != 0)
     {
@@ -4860,404 +6469,683 @@ try_set_attribute (GVfsBackend *backend,
                         _("Invalid attribute type (uint32 expected)"));
     }
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_SETSTAT);
+  command = new_command (op_backend,
+                         SSH_FXP_SETSTAT);
   put_string (command, filename);
-  g_data_output_stream_put_uint32 (command, SSH_FILEXFER_ATTR_PERMISSIONS, NULL, NULL);
-  g_data_output_stream_put_uint32 (command, (*(guint32 *)value_p) & 0777, NULL, NULL);
-  queue_command_stream_and_free (op_backend, command, set_attribute_reply, G_VFS_JOB (job), NULL);
+  put_uint32 (command, SSH_FILEXFER_ATTR_PERMISSIONS);
+  put_uint32 (command, (*(guint32 *)value_p) & 0777);
+  queue_command_and_free (op_backend, command, set_attribute_reply, G_VFS_JOB (job), NULL);
   
   return TRUE;
 }
 
-/* The push sliding window mechanism is based on the one in the OpenSSH sftp
- * client. */
+/* Push and pull size their window from the bandwidth-delay product of
+ * the link. The window grows by one request per reply, like in the
+ * OpenSSH sftp client, up to a limit recomputed every TRANSFER_PERIOD:
+ * twice the throughput of the last period times the lowest round trip
+ * time seen in it. The lowest one is used since queueing on a slow link
+ * inflates the others. The block size doubles, up to what the server
+ * allows, when that needs more than TRANSFER_MAX_REQUESTS requests. */
 
-#define PUSH_BLOCKSIZE 32768
-#define PUSH_MAX_REQUESTS 64
+#define TRANSFER_MAX_REQUESTS 64
+#define TRANSFER_MIN_REQUESTS 2
+#define TRANSFER_PERIOD (G_USEC_PER_SEC / 4)
 
 typedef struct {
-  /* Job context */
-  GVfsBackendSftp *backend;
-  GVfsJobPush *op_job;
-  GVfsJob *job;
-
-  /* Open files */
-  DataBuffer *raw_handle;
-  GInputStream *in;
-
-  /* fstat information */
-  goffset size;
-  guint32 permissions;
-
-  /* state */
-  goffset offset;
-  goffset n_written;
-  int num_req;
-
-  /* replace data */
-  char *tempname;
-  int temp_count;
+  guint32 block_size;
+  guint32 max_block_size;
+  int max_req;
+  int limit;
 
-  char buffer[PUSH_BLOCKSIZE];
-} SftpPushHandle;
+  gint64 period_start;
+  guint64 period_bytes;
+  gint64 min_rtt;
+} TransferWindow;
 
-typedef struct {
-  SftpPushHandle *handle;
-  gssize count;
-} PushWriteRequest;
+static void
+transfer_window_init (TransferWindow *window,
+                      guint32 max_block_size)
+{
+  window->max_block_size = max_block_size;
+  window->block_size = MIN (DEFAULT_BLOCKSIZE, max_block_size);
+  window->max_req = 1;
+  window->limit = TRANSFER_MAX_REQUESTS;
+  window->period_start = g_get_monotonic_time ();
+  window->period_bytes = 0;
+  window->min_rtt = G_MAXINT64;
+}
 
+/* Called for every reply, with the time since its request was sent */
 static void
-sftp_push_handle_free (SftpPushHandle *handle)
+transfer_window_update (TransferWindow *window,
+                        gint64 sent_time,
+                        gsize bytes)
 {
-  GDataOutputStream *command;
+  gint64 now, elapsed;
+  guint64 rate, target;
 
-  /* Only free the handle if there are no write requests outstanding and no
-   * asynchronous reads pending. */
-  if (handle->num_req == 0 && (!handle->in || !g_input_stream_has_pending (handle->in)))
-    {
-      if (handle->in)
-        {
-          g_input_stream_close_async (handle->in, 0, NULL, NULL, NULL);
-          g_object_unref (handle->in);
-        }
+  now = g_get_monotonic_time ();
+  window->min_rtt = MIN (window->min_rtt, now - sent_time);
+  window->period_bytes += bytes;
 
-      /* If raw_handle is non-NULL, it means destination is still open. Close
-       * it. */
-      if (handle->raw_handle)
-        {
-          command = new_command_stream (handle->backend, SSH_FXP_CLOSE);
-          put_data_buffer (command, handle->raw_handle);
-          queue_command_stream_and_free (handle->backend, command, NULL, handle->job, NULL);
-          data_buffer_free (handle->raw_handle);
-        }
+  if (window->max_req < window->limit)
+    window->max_req++;
 
-      /* If tempname is non-NULL, it means we failed and should delete the temp
-       * file. */
-      if (handle->tempname)
-        {
-          command = new_command_stream (handle->backend, SSH_FXP_REMOVE);
-          put_string (command, handle->tempname);
-          queue_command_stream_and_free (handle->backend, command, NULL, handle->job, NULL);
+  elapsed = now - window->period_start;
+  if (elapsed < TRANSFER_PERIOD)
+    return;
 
-          g_free (handle->tempname);
-        }
+  rate = window->period_bytes * G_USEC_PER_SEC / elapsed;
+  target = 2 * rate * window->min_rtt / G_USEC_PER_SEC;
 
-      g_object_unref (handle->backend);
-      g_object_unref (handle->job);
-      g_slice_free (SftpPushHandle, handle);
-    }
+  while (target > (guint64)TRANSFER_MAX_REQUESTS * window->block_size &&
+         window->block_size < window->max_block_size)
+    window->block_size = MIN (window->block_size * 2, window->max_block_size);
+
+  window->limit = CLAMP (target / window->block_size + 1,
+                         TRANSFER_MIN_REQUESTS, TRANSFER_MAX_REQUESTS);
+  window->max_req = MIN (window->max_req, window->limit);
+
+  window->period_start = now;
+  window->period_bytes = 0;
+  window->min_rtt = G_MAXINT64;
 }
 
-static void
-push_read_cb (GObject *source, GAsyncResult *res, gpointer user_data);
+/* A push or pull keeps its file open on every connection of the pool,
+ * not just the one of its job, and sends each block request to the
+ * least loaded of them. The file is opened on connections added to the
+ * pool while the transfer runs too. The handle of the job's own
+ * connection stays in the transfer handle, a stripe is kept for each
+ * other connection. */
+typedef struct {
+  SftpConnection *connection;
+  DataBuffer *raw_handle; /* NULL until the OPEN succeeded */
+  gpointer handle;        /* The SftpPullHandle or SftpPushHandle */
+} TransferStripe;
 
 static void
-push_enqueue_request (SftpPushHandle *handle)
+transfer_stripe_free (TransferStripe *stripe)
 {
-  g_input_stream_read_async (handle->in,
-                             handle->buffer,
-                             PUSH_BLOCKSIZE,
-                             G_PRIORITY_DEFAULT,
-                             NULL,
-                             push_read_cb, handle);
-  handle->num_req++;
+  if (stripe->raw_handle)
+    data_buffer_free (stripe->raw_handle);
+  g_slice_free (TransferStripe, stripe);
 }
 
-static void
-push_close_moved_file (GVfsBackendSftp *backend,
-                       int reply_type,
-                       GDataInputStream *reply,
-                       guint32 len,
+/* Opens the file on the connections of the pool that don't have a
+ * stripe yet, returns the number of OPENs sent */
+static int
+transfer_open_stripes (GVfsBackendSftp *backend,
                        GVfsJob *job,
-                       gpointer user_data)
+                       GPtrArray *stripes,
+                       const char *path,
+                       guint32 pflags,
+                       ReplyCallback callback,
+                       gpointer handle)
+{
+  SftpConnection *own, *connection;
+  TransferStripe *stripe;
+  GByteArray *command;
+  guint i, j;
+  int n_opened;
+
+  /* Let the pool grow while the transfer keeps its connections busy */
+  pick_connection (backend);
+
+  if (stripes->len + 1 >= backend->connections->len)
+    return 0;
+
+  own = job_get_connection (backend, job);
+  n_opened = 0;
+  for (i = 0; i < backend->connections->len; i++)
+    {
+      connection = g_ptr_array_index (backend->connections, i);
+      if (connection == own)
+        continue;
+
+      for (j = 0; j < stripes->len; j++)
+        if (((TransferStripe *)g_ptr_array_index (stripes, j))->connection == connection)
+          break;
+      if (j < stripes->len)
+        continue;
+
+      stripe = g_slice_new0 (TransferStripe);
+      stripe->connection = connection;
+      stripe->handle = handle;
+      g_ptr_array_add (stripes, stripe);
+
+      command = new_command (backend, SSH_FXP_OPEN);
+      put_string (command, path);
+      put_uint32 (command, pflags);
+      put_uint32 (command, 0);
+      connection_queue_command_and_free (connection, command, callback, job, stripe);
+      n_opened++;
+    }
+
+  return n_opened;
+}
+
+/* Returns the open stripe whose connection has the fewest outstanding
+ * requests, or NULL if that is the job's own connection */
+static TransferStripe *
+transfer_pick_stripe (GVfsBackendSftp *backend,
+                      GVfsJob *job,
+                      GPtrArray *stripes)
 {
-  SftpPushHandle *handle = user_data;
+  TransferStripe *stripe, *best;
+  guint i, load, best_load;
 
-  if (reply_type == SSH_FXP_STATUS)
+  best = NULL;
+  best_load = g_hash_table_size (job_get_connection (backend, job)->expected_replies);
+  for (i = 0; i < stripes->len; i++)
     {
-      guint32 code = read_status_code (reply);
-      if (code == SSH_FX_OK)
-        {
-          if (handle->op_job->remove_source)
-            g_unlink (handle->op_job->local_path);
+      stripe = g_ptr_array_index (stripes, i);
+      if (stripe->raw_handle == NULL || stripe->connection->dead)
+        continue;
 
-          g_vfs_job_succeeded (job);
+      load = g_hash_table_size (stripe->connection->expected_replies);
+      if (load < best_load)
+        {
+          best = stripe;
+          best_load = load;
         }
-      else
-        result_from_status_code (job, code, -1, -1);
     }
-  else
-    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                      _("Invalid reply received"));
 
-  sftp_push_handle_free (handle);
+  return best;
 }
 
-static void
-push_close_deleted_file (GVfsBackendSftp *backend,
-                        int reply_type,
-                        GDataInputStream *reply,
-                        guint32 len,
+/* Closes the open stripes, returns the number of CLOSEs sent */
+static int
+transfer_close_stripes (GVfsBackendSftp *backend,
                         GVfsJob *job,
-                        gpointer user_data)
+                        GPtrArray *stripes,
+                        ReplyCallback callback,
+                        gpointer handle)
 {
-  SftpPushHandle *handle = user_data;
+  TransferStripe *stripe;
+  GByteArray *command;
+  guint i;
+  int n_closed;
 
-  if (reply_type == SSH_FXP_STATUS)
+  n_closed = 0;
+  for (i = 0; i < stripes->len; i++)
     {
-      guint32 code = read_status_code (reply);
-      if (code == SSH_FX_OK)
-        {
-          /* The delete completed successfully, now rename. */
-          GDataOutputStream *command = new_command_stream (backend, SSH_FXP_RENAME);
-          put_string (command, handle->tempname);
-          put_string (command, handle->op_job->destination);
-          queue_command_stream_and_free (backend, command, push_close_moved_file, job, handle);
+      stripe = g_ptr_array_index (stripes, i);
+      if (stripe->raw_handle == NULL)
+        continue;
 
-          g_free (handle->tempname);
-          handle->tempname = NULL;
-          return;
-        }
-      else
-        result_from_status_code (job, code, -1, -1);
+      command = new_command (backend, SSH_FXP_CLOSE);
+      put_data_buffer (command, stripe->raw_handle);
+      connection_queue_command_and_free (stripe->connection, command, callback, job, handle);
+      data_buffer_free (stripe->raw_handle);
+      stripe->raw_handle = NULL;
+      n_closed++;
     }
-  else
-    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                      _("Invalid reply received"));
 
-  sftp_push_handle_free (handle);
+  return n_closed;
+}
+
+/* State of a resumable transfer, see RESUME_PARTIAL_SUFFIX */
+typedef struct {
+  char *filename;     /* key file the state is saved in */
+  guint64 size;       /* size and mtime identify the source */
+  guint64 mtime;
+  goffset committed;  /* bytes in the partial file when last saved */
+  GArray *pending;    /* offsets of requests not written yet */
+} ResumeState;
+
+static ResumeState *
+resume_state_new (GVfsBackendSftp *backend,
+                  const char *kind,
+                  const char *source,
+                  const char *destination,
+                  guint64 size,
+                  guint64 mtime)
+{
+  ResumeState *state;
+  GKeyFile *key_file;
+  char *dir, *key, *hash, *name;
+
+  state = g_slice_new0 (ResumeState);
+  state->size = size;
+  state->mtime = mtime;
+  state->pending = g_array_new (FALSE, FALSE, sizeof (goffset));
+
+  dir = get_runtime_dir ();
+  if (dir == NULL)
+    return state;
+
+  key = g_strdup_printf ("%s:%s@%s:%d:%s:%s", kind,
+                         backend->user ? backend->user : "",
+                         backend->host, backend->port,
+                         source, destination);
+  hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+  name = g_strconcat (hash, ".transfer", NULL);
+  state->filename = g_build_filename (dir, name, NULL);
+
+  g_free (name);
+  g_free (hash);
+  g_free (key);
+  g_free (dir);
+
+  /* Only continue if the source didn't change since */
+  key_file = g_key_file_new ();
+  if (g_key_file_load_from_file (key_file, state->filename, G_KEY_FILE_NONE, NULL) &&
+      g_key_file_get_uint64 (key_file, "transfer", "size", NULL) == size &&
+      g_key_file_get_uint64 (key_file, "transfer", "mtime", NULL) == mtime)
+    state->committed = MIN (g_key_file_get_uint64 (key_file, "transfer", "committed", NULL),
+                            size);
+  g_key_file_free (key_file);
+
+  return state;
 }
 
 static void
-push_close_delete_or_succeed (SftpPushHandle *handle)
+resume_state_save (ResumeState *state, goffset committed)
 {
-  if (handle->tempname)
-    {
-      /* If we wrote to a temp file, do delete then rename. */
-      GDataOutputStream *command = new_command_stream (handle->backend, SSH_FXP_REMOVE);
-      put_string (command, handle->op_job->destination);
-      queue_command_stream_and_free (handle->backend, command, push_close_deleted_file, handle->job, handle);
-    }
-  else
-    {
-      if (handle->op_job->remove_source)
-        g_unlink (handle->op_job->local_path);
+  GKeyFile *key_file;
+  char *data;
+  gsize len;
 
-      g_vfs_job_succeeded (handle->job);
-      sftp_push_handle_free (handle);
-    }
+  state->committed = committed;
+
+  if (state->filename == NULL)
+    return;
+
+  key_file = g_key_file_new ();
+  g_key_file_set_uint64 (key_file, "transfer", "size", state->size);
+  g_key_file_set_uint64 (key_file, "transfer", "mtime", state->mtime);
+  g_key_file_set_uint64 (key_file, "transfer", "committed", committed);
+
+  data = g_key_file_to_data (key_file, &len, NULL);
+  g_file_set_contents (state->filename, data, len, NULL);
+
+  g_free (data);
+  g_key_file_free (key_file);
 }
 
+/* Called when the transfer completed, there is nothing to resume */
 static void
-push_close_restore_permissions (GVfsBackendSftp *backend,
-                                int reply_type,
-                                GDataInputStream *reply,
-                                guint32 len,
-                                GVfsJob *job,
-                                gpointer user_data)
+resume_state_forget (ResumeState *state)
 {
-  /* We don't care if setting the permissions succeeded or not. */
-  push_close_delete_or_succeed (user_data);
+  if (state->filename)
+    g_unlink (state->filename);
 }
 
 static void
-push_close_write_reply (GVfsBackendSftp *backend,
-                        int reply_type,
-                        GDataInputStream *reply,
-                        guint32 len,
-                        GVfsJob *job,
-                        gpointer user_data)
+resume_state_free (ResumeState *state)
 {
-  SftpPushHandle *handle = user_data;
-
-  if (reply_type == SSH_FXP_STATUS)
-    {
-      guint32 code = read_status_code (reply);
-      if (code == SSH_FX_OK)
-        {
-          if (handle->op_job->flags & G_FILE_COPY_TARGET_DEFAULT_PERMS)
-            push_close_delete_or_succeed (handle);
-          else
-            {
-              /* Restore the source file's permissions. */
-              GDataOutputStream *command = new_command_stream (backend, SSH_FXP_SETSTAT);
-              put_string (command, handle->tempname ? handle->tempname : handle->op_job->destination);
-              g_data_output_stream_put_uint32 (command, SSH_FILEXFER_ATTR_PERMISSIONS, NULL, NULL);
-              g_data_output_stream_put_uint32 (command, handle->permissions, NULL, NULL);
-              queue_command_stream_and_free (backend, command, push_close_restore_permissions, job, handle);
-            }
-          return;
-        }
-      else
-        result_from_status_code (job, code, -1, -1);
-    }
-  else
-    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                      _("Invalid reply received"));
-
-  sftp_push_handle_free (handle);
+  g_array_free (state->pending, TRUE);
+  g_free (state->filename);
+  g_slice_free (ResumeState, state);
 }
 
 static void
-push_finish (SftpPushHandle *handle)
+resume_state_add_pending (ResumeState *state, goffset offset)
 {
-  GDataOutputStream *command = new_command_stream (handle->backend, SSH_FXP_CLOSE);
-  put_data_buffer (command, handle->raw_handle);
-  queue_command_stream_and_free (handle->backend, command, push_close_write_reply, handle->job, handle);
+  g_array_append_val (state->pending, offset);
+}
 
-  data_buffer_free (handle->raw_handle);
-  handle->raw_handle = NULL;
+/* Everything before the first pending request is in the destination,
+   next_offset is where the next request would start */
+static goffset
+resume_state_get_committed (ResumeState *state, goffset next_offset)
+{
+  goffset committed;
+  guint i;
+
+  committed = next_offset;
+  for (i = 0; i < state->pending->len; i++)
+    committed = MIN (committed, g_array_index (state->pending, goffset, i));
+
+  return MIN (committed, (goffset)state->size);
 }
 
 static void
-push_source_close_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+resume_state_written (ResumeState *state, goffset offset, goffset next_offset)
 {
-  SftpPushHandle *handle = user_data;
-
-  g_input_stream_close_finish (handle->in, res, NULL);
-  g_clear_object (&handle->in);
+  goffset committed;
+  guint i;
 
-  if (g_vfs_job_is_finished (handle->job) || g_vfs_job_is_cancelled (handle->job))
+  for (i = 0; i < state->pending->len; i++)
     {
-      sftp_push_handle_free (handle);
-      return;
+      if (g_array_index (state->pending, goffset, i) == offset)
+        {
+          g_array_remove_index_fast (state->pending, i);
+          break;
+        }
     }
 
-  /* If there are no write requests outstanding, we are done. */
-  if (handle->num_req == 0)
-    push_finish(handle);
+  committed = resume_state_get_committed (state, next_offset);
+  if (committed - state->committed >= RESUME_SAVE_INTERVAL)
+    resume_state_save (state, committed);
 }
 
+/* Checks that the first length bytes of a remote and a local file are
+ * the same with the check-file extension. Without it, or if the server
+ * uses a hash we don't know, the size and mtime check has to do. */
+
+typedef void (*ResumeVerifyCallback) (gboolean verified, gpointer user_data);
+
+typedef struct {
+  char *local_path;
+  goffset length;
+  GChecksumType checksum_type;
+  guint8 *remote_digest;
+  gsize remote_digest_len;
+  ResumeVerifyCallback callback;
+  gpointer user_data;
+} ResumeVerifyData;
+
 static void
-push_write_reply (GVfsBackendSftp *backend,
-                  int reply_type,
-                  GDataInputStream *reply,
-                  guint32 len,
-                  GVfsJob *job,
-                  gpointer user_data)
+resume_verify_data_free (ResumeVerifyData *data)
 {
-  PushWriteRequest *request = user_data;
-  SftpPushHandle *handle = request->handle;
-  gssize count = request->count;
-
-  g_slice_free (PushWriteRequest, request);
+  g_free (data->local_path);
+  g_free (data->remote_digest);
+  g_slice_free (ResumeVerifyData, data);
+}
 
-  handle->num_req--;
+static void
+resume_verify_thread (GTask *task,
+                      gpointer source_object,
+                      gpointer task_data,
+                      GCancellable *cancellable)
+{
+  ResumeVerifyData *data = task_data;
+  GFile *file;
+  GInputStream *in;
+  GChecksum *checksum;
+  guint8 *buffer, *digest;
+  gsize digest_len;
+  goffset remaining;
+  gssize n;
+  gboolean res;
 
-  if (g_vfs_job_is_finished (job) || g_vfs_job_is_cancelled (job))
+  file = g_file_new_for_path (data->local_path);
+  in = G_INPUT_STREAM (g_file_read (file, cancellable, NULL));
+  g_object_unref (file);
+  if (in == NULL)
     {
-      sftp_push_handle_free (handle);
+      g_task_return_boolean (task, FALSE);
       return;
     }
 
-  if (reply_type == SSH_FXP_STATUS)
+  checksum = g_checksum_new (data->checksum_type);
+  buffer = g_malloc (RESUME_VERIFY_BUFFER_SIZE);
+
+  remaining = data->length;
+  while (remaining > 0)
     {
-      guint32 code = read_status_code (reply);
+      n = g_input_stream_read (in, buffer, MIN (remaining, RESUME_VERIFY_BUFFER_SIZE),
+                               cancellable, NULL);
+      if (n <= 0)
+        break;
 
-      if (code == SSH_FX_OK)
-        {
-          handle->n_written += count;
-          g_vfs_job_progress_callback (handle->n_written, handle->size, job);
+      g_checksum_update (checksum, buffer, n);
+      remaining -= n;
+    }
 
-          /* Enqueue a read op if the file is still open, and there isn't
-           * already one pending. */
-          if (handle->in && !g_input_stream_has_pending (handle->in))
-            push_enqueue_request (handle);
+  digest_len = data->remote_digest_len;
+  digest = g_malloc (digest_len);
+  g_checksum_get_digest (checksum, digest, &digest_len);
 
-          /* We are done if the file is closed and there are no write requests
-           * oustanding. */
-          if (!handle->in && handle->num_req == 0)
-            {
-              push_finish (handle);
-              return;
-            }
-        }
-      else
-        result_from_status_code (handle->job, code, -1, -1);
-    }
-  else
-    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                      _("Invalid reply received"));
+  res = remaining == 0 &&
+    digest_len == data->remote_digest_len &&
+    memcmp (digest, data->remote_digest, digest_len) == 0;
 
-  sftp_push_handle_free (handle);
+  g_free (digest);
+  g_free (buffer);
+  g_checksum_free (checksum);
+  g_object_unref (in);
+
+  g_task_return_boolean (task, res);
 }
 
 static void
-push_read_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+resume_verify_done (GObject *source, GAsyncResult *result, gpointer user_data)
 {
-  PushWriteRequest *request;
-  GDataOutputStream *command;
-  gssize count;
+  ResumeVerifyData *data = g_task_get_task_data (G_TASK (result));
 
-  SftpPushHandle *handle = user_data;
-  GError *error = NULL;
+  data->callback (g_task_propagate_boolean (G_TASK (result), NULL), data->user_data);
+}
 
-  count = g_input_stream_read_finish (handle->in, res, &error);
+static void
+resume_verify_reply (GVfsBackendSftp *backend,
+                     int reply_type,
+                     SftpReply *reply,
+                     guint32 len,
+                     GVfsJob *job,
+                     gpointer user_data)
+{
+  ResumeVerifyData *data = user_data;
+  GTask *task;
+  char *algorithm;
+  gsize digest_len;
 
-  if (g_vfs_job_is_finished (handle->job) || g_vfs_job_is_cancelled (handle->job))
+  if (reply_type != SSH_FXP_EXTENDED_REPLY)
     {
-      g_clear_error (&error);
-      sftp_push_handle_free (handle);
+      data->callback (TRUE, data->user_data);
+      resume_verify_data_free (data);
       return;
     }
 
-  if (error)
+  /* Some servers put the extension name before the algorithm */
+  algorithm = read_string (reply, NULL);
+  if (g_strcmp0 (algorithm, "check-file") == 0)
     {
-      g_vfs_job_failed_from_error (handle->job, error);
-      g_error_free (error);
+      g_free (algorithm);
+      algorithm = read_string (reply, NULL);
+    }
 
-      sftp_push_handle_free (handle);
+  if (g_strcmp0 (algorithm, "sha256") == 0)
+    data->checksum_type = G_CHECKSUM_SHA256;
+  else if (g_strcmp0 (algorithm, "sha1") == 0)
+    data->checksum_type = G_CHECKSUM_SHA1;
+  else if (g_strcmp0 (algorithm, "md5") == 0)
+    data->checksum_type = G_CHECKSUM_MD5;
+  else
+    {
+      g_free (algorithm);
+      data->callback (TRUE, data->user_data);
+      resume_verify_data_free (data);
       return;
     }
+  g_free (algorithm);
 
-  if (count == 0)
+  digest_len = g_checksum_type_get_length (data->checksum_type);
+  data->remote_digest_len = digest_len;
+  data->remote_digest = g_malloc (digest_len);
+  if (!reply_read_data (reply, data->remote_digest, digest_len))
     {
-      handle->num_req--;
+      data->callback (FALSE, data->user_data);
+      resume_verify_data_free (data);
+      return;
+    }
 
-      g_input_stream_close_async (handle->in,
-                                  0, NULL,
-                                  push_source_close_cb, handle);
+  task = g_task_new (backend, NULL, resume_verify_done, NULL);
+  g_task_set_task_data (task, data, (GDestroyNotify)resume_verify_data_free);
+  g_task_run_in_thread (task, resume_verify_thread);
+  g_object_unref (task);
+}
+
+static void
+resume_verify (GVfsBackendSftp *backend,
+               GVfsJob *job,
+               const char *remote_path,
+               const char *local_path,
+               goffset length,
+               ResumeVerifyCallback callback,
+               gpointer user_data)
+{
+  ResumeVerifyData *data;
+  GByteArray *command;
+
+  if (!has_extension (backend, SFTP_EXT_CHECK_FILE))
+    {
+      callback (TRUE, user_data);
       return;
     }
 
-  request = g_slice_new (PushWriteRequest);
-  request->handle = handle;
-  request->count = count;
+  data = g_slice_new0 (ResumeVerifyData);
+  data->local_path = g_strdup (local_path);
+  data->length = length;
+  data->callback = callback;
+  data->user_data = user_data;
 
-  command = new_command_stream (handle->backend, SSH_FXP_WRITE);
-  put_data_buffer (command, handle->raw_handle);
-  g_data_output_stream_put_uint64 (command, handle->offset, NULL, NULL);
-  g_data_output_stream_put_uint32 (command, count, NULL, NULL);
-  g_output_stream_write_all (G_OUTPUT_STREAM (command),
-                             handle->buffer, count,
-                             NULL, NULL, NULL);
-  queue_command_stream_and_free (handle->backend, command, push_write_reply, handle->job, request);
-  handle->offset += count;
+  command = new_command (backend, SSH_FXP_EXTENDED);
+  put_string (command, "check-file-name");
+  put_string (command, remote_path);
+  put_string (command, "sha256,sha1,md5");
+  put_uint64 (command, 0);
+  put_uint64 (command, length);
+  put_uint32 (command, 0); /* one hash for all */
+  queue_command_and_free (backend, command, resume_verify_reply, job, data);
+}
 
-  if (handle->num_req < PUSH_MAX_REQUESTS)
-    push_enqueue_request (handle);
+/* The push sliding window mechanism is based on the one in the OpenSSH sftp
+ * client. */
+
+typedef struct {
+  /* Job context */
+  GVfsBackendSftp *backend;
+  GVfsJobPush *op_job;
+  GVfsJob *job;
+
+  /* Open files */
+  DataBuffer *raw_handle;
+  GInputStream *in;
+
+  /* fstat information */
+  goffset size;
+  guint32 permissions;
+  guint64 mtime;
+
+  /* state */
+  goffset offset;
+  goffset n_written;
+  int num_req;
+  TransferWindow window;
+
+  /* The destination opened on the other connections */
+  GPtrArray *stripes;
+  int num_opening;
+
+  /* replace data */
+  char *tempname;
+  int temp_count;
+
+  /* resume data, the partial file is used as tempname */
+  ResumeState *resume;
+  char *partial;
+
+  char *buffer; /* window.max_block_size bytes */
+} SftpPushHandle;
+
+typedef struct {
+  SftpPushHandle *handle;
+  goffset offset;
+  gssize count;
+  gint64 sent_time;
+} PushWriteRequest;
+
+static void
+sftp_push_handle_free (SftpPushHandle *handle)
+{
+  GByteArray *command;
+
+  /* Only free the handle if there are no write requests outstanding and no
+   * asynchronous reads pending. */
+  if (handle->num_req == 0 && handle->num_opening == 0 &&
+      (!handle->in || !g_input_stream_has_pending (handle->in)))
+    {
+      if (handle->in)
+        {
+          g_input_stream_close_async (handle->in, 0, NULL, NULL, NULL);
+          g_object_unref (handle->in);
+        }
+
+      /* If raw_handle is non-NULL, it means destination is still open. Close
+       * it. */
+      if (handle->raw_handle)
+        {
+          command = new_command (handle->backend, SSH_FXP_CLOSE);
+          put_data_buffer (command, handle->raw_handle);
+          queue_command_and_free (handle->backend, command, NULL, handle->job, NULL);
+          data_buffer_free (handle->raw_handle);
+        }
+      transfer_close_stripes (handle->backend, handle->job, handle->stripes, NULL, NULL);
+      g_ptr_array_free (handle->stripes, TRUE);
+
+      /* If tempname is non-NULL, it means we failed and should delete the temp
+       * file, unless it is kept to resume the transfer. */
+      if (handle->tempname && !handle->resume)
+        {
+          command = new_command (handle->backend, SSH_FXP_REMOVE);
+          put_string (command, handle->tempname);
+          queue_command_and_free (handle->backend, command, NULL, handle->job, NULL);
+        }
+
+      /* A failed push leaves the state for the next try, a push that
+       * failed before the partial file was opened leaves it alone. */
+      if (handle->resume)
+        {
+          if (handle->tempname)
+            resume_state_save (handle->resume,
+                               resume_state_get_committed (handle->resume, handle->offset));
+          else if (!handle->job->failed && !handle->job->cancelled)
+            resume_state_forget (handle->resume);
+          resume_state_free (handle->resume);
+        }
+
+      g_free (handle->tempname);
+      g_free (handle->partial);
+
+      g_object_unref (handle->backend);
+      g_object_unref (handle->job);
+      g_free (handle->buffer);
+      g_slice_free (SftpPushHandle, handle);
+    }
 }
 
-static void push_create_temp (SftpPushHandle *handle);
+static void
+push_read_cb (GObject *source, GAsyncResult *res, gpointer user_data);
 
 static void
-push_truncate_original_reply (GVfsBackendSftp *backend,
-                              int reply_type,
-                              GDataInputStream *reply,
-                              guint32 len,
-                              GVfsJob *job,
-                              gpointer user_data)
+push_enqueue_request (SftpPushHandle *handle)
+{
+  g_input_stream_read_async (handle->in,
+                             handle->buffer,
+                             handle->window.block_size,
+                             G_PRIORITY_DEFAULT,
+                             NULL,
+                             push_read_cb, handle);
+  handle->num_req++;
+}
+
+static void
+push_close_moved_file (GVfsBackendSftp *backend,
+                       int reply_type,
+                       SftpReply *reply,
+                       guint32 len,
+                       GVfsJob *job,
+                       gpointer user_data)
 {
   SftpPushHandle *handle = user_data;
 
-  if (reply_type == SSH_FXP_HANDLE)
+  dir_cache_purge (backend, handle->op_job->destination);
+
+  if (reply_type == SSH_FXP_STATUS)
     {
-      handle->raw_handle = read_data_buffer (reply);
-      push_enqueue_request (handle);
+      guint32 code = read_status_code (reply);
+      if (code == SSH_FX_OK)
+        {
+          if (handle->op_job->remove_source)
+            g_unlink (handle->op_job->local_path);
+
+          g_vfs_job_succeeded (job);
+        }
+      else
+        result_from_status_code (job, code, -1, -1);
     }
-  else if (reply_type == SSH_FXP_STATUS)
-    result_from_status (job, reply, -1, -1);
   else
     g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
                       _("Invalid reply received"));
@@ -5266,270 +7154,1644 @@ push_truncate_original_reply (GVfsBackendSftp *backend,
 }
 
 static void
-push_create_temp_reply (GVfsBackendSftp *backend,
+push_close_deleted_file (GVfsBackendSftp *backend,
                         int reply_type,
-                        GDataInputStream *reply,
+                        SftpReply *reply,
                         guint32 len,
                         GVfsJob *job,
                         gpointer user_data)
 {
   SftpPushHandle *handle = user_data;
 
+  dir_cache_purge (backend, handle->op_job->destination);
+
   if (reply_type == SSH_FXP_STATUS)
     {
       guint32 code = read_status_code (reply);
-      if (code == SSH_FX_PERMISSION_DENIED)
+
+      /* A resumed push writes to its partial file even if the
+       * destination doesn't exist */
+      if (code == SSH_FX_OK || (handle->resume && code == SSH_FX_NO_SUCH_FILE))
         {
-          /* The temp file creation failed. Try truncating the existing file. */
-          GDataOutputStream *command;
+          /* The delete completed successfully, now rename. */
+          GByteArray *command = new_command (backend, SSH_FXP_RENAME);
+          put_string (command, handle->tempname);
+          put_string (command, handle->op_job->destination);
+          queue_command_and_free (backend, command, push_close_moved_file, job, handle);
 
           g_free (handle->tempname);
           handle->tempname = NULL;
-
-          command = new_command_stream (backend, SSH_FXP_OPEN);
-          put_string (command, handle->op_job->destination);
-          g_data_output_stream_put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_TRUNC,  NULL, NULL);
-          g_data_output_stream_put_uint32 (command, 0, NULL, NULL);
-          queue_command_stream_and_free (backend, command, push_truncate_original_reply, job, handle);
-
-          return;
-        }
-      else if (code == SSH_FX_FAILURE)
-        {
-          push_create_temp (handle);
           return;
         }
       else
-        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                          _("Invalid reply received"));
+        result_from_status_code (job, code, -1, -1);
     }
-  else if (reply_type != SSH_FXP_HANDLE)
+  else
     g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
                       _("Invalid reply received"));
-  else
-    {
-      handle->raw_handle = read_data_buffer (reply);
-      push_enqueue_request (handle);
-    }
 
   sftp_push_handle_free (handle);
 }
 
 static void
-push_create_temp (SftpPushHandle *handle)
+push_close_delete_or_succeed (SftpPushHandle *handle)
 {
-  GDataOutputStream *command;
-  char *dirname;
-  char basename[] = ".giosaveXXXXXX";
-
-  /* Write to a temp file and then rename to replace. */
-
-  handle->temp_count++;
-
-  if (handle->temp_count == 100)
+  if (handle->tempname)
     {
-      g_vfs_job_failed (handle->job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                        _("Unable to create temporary file"));
-      sftp_push_handle_free (handle);
-      return;
+      /* If we wrote to a temp file, do delete then rename. */
+      GByteArray *command = new_command (handle->backend, SSH_FXP_REMOVE);
+      put_string (command, handle->op_job->destination);
+      queue_command_and_free (handle->backend, command, push_close_deleted_file, handle->job, handle);
     }
+  else
+    {
+      if (handle->op_job->remove_source)
+        g_unlink (handle->op_job->local_path);
 
-  g_free (handle->tempname);
-  dirname = g_path_get_dirname (handle->op_job->destination);
-  random_text (basename + 8);
-  handle->tempname = g_build_filename (dirname, basename, NULL);
-  g_free (dirname);
+      g_vfs_job_succeeded (handle->job);
+      sftp_push_handle_free (handle);
+    }
+}
 
-  command = new_command_stream (handle->backend, SSH_FXP_OPEN);
-  put_string (command, handle->tempname);
-  g_data_output_stream_put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL,  NULL, NULL);
-  g_data_output_stream_put_uint32 (command, 0, NULL, NULL);
-  queue_command_stream_and_free (handle->backend, command, push_create_temp_reply, handle->job, handle);
+static void
+push_close_restore_permissions (GVfsBackendSftp *backend,
+                                int reply_type,
+                                SftpReply *reply,
+                                guint32 len,
+                                GVfsJob *job,
+                                gpointer user_data)
+{
+  /* We don't care if setting the permissions succeeded or not. */
+  push_close_delete_or_succeed (user_data);
 }
 
 static void
-push_open_stat_reply (GVfsBackendSftp *backend,
-                      int reply_type,
-                      GDataInputStream *reply,
-                      guint32 len,
-                      GVfsJob *job,
-                      gpointer user_data)
+push_close_write_reply (GVfsBackendSftp *backend,
+                        int reply_type,
+                        SftpReply *reply,
+                        guint32 len,
+                        GVfsJob *job,
+                        gpointer user_data)
 {
   SftpPushHandle *handle = user_data;
 
-  if (reply_type == SSH_FXP_ATTRS)
-    {
-      GFileInfo *info;
-      GFileType type;
-
-      info = g_file_info_new ();
-      parse_attributes (backend, info, NULL, reply, NULL);
-      type = g_file_info_get_file_type (info);
-      g_object_unref (info);
+  dir_cache_purge (backend, handle->op_job->destination);
 
-      if (type == G_FILE_TYPE_DIRECTORY)
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      guint32 code = read_status_code (reply);
+      if (code == SSH_FX_OK)
         {
-          /* We cannot overwrite a directory. */
-          if (handle->op_job->flags & G_FILE_COPY_OVERWRITE)
-            g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_IS_DIRECTORY,
-                              _("File is directory"));
-
-          sftp_push_handle_free (handle);
+          if (handle->op_job->flags & G_FILE_COPY_TARGET_DEFAULT_PERMS)
+            push_close_delete_or_succeed (handle);
+          else
+            {
+              /* Restore the source file's permissions. */
+              GByteArray *command = new_command (backend, SSH_FXP_SETSTAT);
+              put_string (command, handle->tempname ? handle->tempname : handle->op_job->destination);
+              put_uint32 (command, SSH_FILEXFER_ATTR_PERMISSIONS);
+              put_uint32 (command, handle->permissions);
+              queue_command_and_free (backend, command, push_close_restore_permissions, job, handle);
+            }
           return;
         }
-
-      push_create_temp (handle);
+      else
+        result_from_status_code (job, code, -1, -1);
     }
   else
-    {
-      result_from_status (job, reply, -1, -1);
-      sftp_push_handle_free (handle);
-    }
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+
+  sftp_push_handle_free (handle);
 }
 
+static void push_finish (SftpPushHandle *handle);
+
 static void
-push_open_reply (GVfsBackendSftp *backend,
-                 int reply_type,
-                 GDataInputStream *reply,
-                 guint32 len,
-                 GVfsJob *job,
-                 gpointer user_data)
+push_close_stripe_reply (GVfsBackendSftp *backend,
+                         int reply_type,
+                         SftpReply *reply,
+                         guint32 len,
+                         GVfsJob *job,
+                         gpointer user_data)
 {
   SftpPushHandle *handle = user_data;
 
+  handle->num_req--;
+
+  if (g_vfs_job_is_finished (job) || g_vfs_job_is_cancelled (job) || job->failed)
+    {
+      sftp_push_handle_free (handle);
+      return;
+    }
+
   if (reply_type == SSH_FXP_STATUS)
     {
-      guint32 code = read_status_code (reply);
-      if (code == SSH_FX_NO_SUCH_FILE)
-        not_dir_or_not_exist_error (backend, job, handle->op_job->destination);
-      else if (code == SSH_FX_FAILURE)
+      if (failure_from_status (job, reply, -1, -1))
         {
-          if (handle->op_job->flags & G_FILE_COPY_OVERWRITE)
-            {
-              /* The destination probably exists. Let's see if we can overwrite
-               * it. */
-              GDataOutputStream *command = new_command_stream (backend, SSH_FXP_LSTAT);
-              put_string (command, handle->op_job->destination);
-              queue_command_stream_and_free (backend, command, push_open_stat_reply, job, handle);
-              return;
-            }
-          else
-            result_from_status_code (job, code, G_IO_ERROR_EXISTS, -1);
+          if (handle->num_req == 0)
+            push_finish (handle);
+          return;
         }
-      else
-        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                          _("Invalid reply received"));
     }
-  else if (reply_type != SSH_FXP_HANDLE)
+  else
     g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
                       _("Invalid reply received"));
-  else
-    {
-      handle->raw_handle = read_data_buffer (reply);
-      push_enqueue_request (handle);
-    }
 
   sftp_push_handle_free (handle);
 }
 
+/* The stripes are closed first, so that the result of the last close
+ * covers all of the writes */
 static void
-push_source_fstat_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+push_finish (SftpPushHandle *handle)
+{
+  GByteArray *command;
+
+  handle->num_req += transfer_close_stripes (handle->backend, handle->job, handle->stripes,
+                                             push_close_stripe_reply, handle);
+  if (handle->num_req > 0)
+    return;
+
+  command = new_command (handle->backend, SSH_FXP_CLOSE);
+  put_data_buffer (command, handle->raw_handle);
+  queue_command_and_free (handle->backend, command, push_close_write_reply, handle->job, handle);
+
+  data_buffer_free (handle->raw_handle);
+  handle->raw_handle = NULL;
+}
+
+static void
+push_source_close_cb (GObject *source, GAsyncResult *res, gpointer user_data)
 {
-  GFileInputStream *fin = G_FILE_INPUT_STREAM (source);
   SftpPushHandle *handle = user_data;
-  GError *error = NULL;
-  GFileInfo *info;
-  GDataOutputStream *command;
 
-  info = g_file_input_stream_query_info_finish (fin, res, &error);
-  if (info)
-    {
-      handle->permissions = g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_MODE) & 0777;
-      handle->size = g_file_info_get_size (info);
+  g_input_stream_close_finish (handle->in, res, NULL);
+  g_clear_object (&handle->in);
 
-      command = new_command_stream (handle->backend, SSH_FXP_OPEN);
-      put_string (command, handle->op_job->destination);
-      g_data_output_stream_put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL, NULL, NULL);
-      g_data_output_stream_put_uint32 (command, 0, NULL, NULL);
-      queue_command_stream_and_free (handle->backend, command, push_open_reply, handle->job, handle);
-    }
-  else
+  if (g_vfs_job_is_finished (handle->job) || g_vfs_job_is_cancelled (handle->job))
     {
-      g_vfs_job_failed_from_error (handle->job, error);
-      g_error_free (error);
       sftp_push_handle_free (handle);
+      return;
     }
+
+  /* If there are no write requests outstanding, we are done. */
+  if (handle->num_req == 0)
+    push_finish(handle);
 }
 
 static void
-push_source_open_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+push_write_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  SftpReply *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
 {
-  GFile *source_file = G_FILE (source);
-  SftpPushHandle *handle = user_data;
-  GError *error = NULL;
-  GFileInputStream *fin;
+  PushWriteRequest *request = user_data;
+  SftpPushHandle *handle = request->handle;
+  goffset offset = request->offset;
+  gssize count = request->count;
+  gint64 sent_time = request->sent_time;
 
-  fin = g_file_read_finish (source_file, res, &error);
-  if (fin)
-    {
-      handle->in = G_INPUT_STREAM (fin);
+  g_slice_free (PushWriteRequest, request);
 
-      g_file_input_stream_query_info_async (fin,
-                                            G_FILE_ATTRIBUTE_STANDARD_SIZE ","
-                                            G_FILE_ATTRIBUTE_UNIX_MODE,
-                                            0, NULL,
-                                            push_source_fstat_cb, handle);
+  handle->num_req--;
+
+  if (g_vfs_job_is_finished (job) || g_vfs_job_is_cancelled (job))
+    {
+      sftp_push_handle_free (handle);
+      return;
     }
-  else
+
+  if (reply_type == SSH_FXP_STATUS)
     {
-      if (error->domain == G_IO_ERROR && error->code == G_IO_ERROR_IS_DIRECTORY)
+      guint32 code = read_status_code (reply);
+
+      if (code == SSH_FX_OK)
         {
-          /* Fall back to default implementation to improve the error message */
-          g_vfs_job_failed (handle->job, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
-                            _("Not supported"));
+          handle->n_written += count;
+          g_vfs_job_progress_callback (handle->n_written, handle->size, job);
+
+          transfer_window_update (&handle->window, sent_time, count);
+
+          if (handle->resume)
+            resume_state_written (handle->resume, offset, handle->offset);
+
+          /* Enqueue a read op if the file is still open, and there isn't
+           * already one pending. */
+          if (handle->in && !g_input_stream_has_pending (handle->in))
+            push_enqueue_request (handle);
+
+          /* We are done if the file is closed and there are no write requests
+           * oustanding. */
+          if (!handle->in && handle->num_req == 0)
+            {
+              push_finish (handle);
+              return;
+            }
         }
       else
-        g_vfs_job_failed_from_error (handle->job, error);
-
-      g_error_free (error);
-      sftp_push_handle_free (handle);
+        result_from_status_code (handle->job, code, -1, -1);
     }
+  else
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+
+  sftp_push_handle_free (handle);
 }
 
 static void
-push_source_lstat_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+push_stripe_open_reply (GVfsBackendSftp *backend,
+                        int reply_type,
+                        SftpReply *reply,
+                        guint32 len,
+                        GVfsJob *job,
+                        gpointer user_data)
 {
-  GFile *source_file = G_FILE (source);
+  TransferStripe *stripe = user_data;
+  SftpPushHandle *handle = stripe->handle;
+
+  handle->num_opening--;
+
+  /* Failing to open a stripe only leaves the connection unused */
+  if (reply_type == SSH_FXP_HANDLE)
+    stripe->raw_handle = read_data_buffer (reply);
+
+  if (job->failed || g_vfs_job_is_finished (job) || g_vfs_job_is_cancelled (job))
+    sftp_push_handle_free (handle);
+}
+
+static void
+push_read_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  PushWriteRequest *request;
+  TransferStripe *stripe;
+  DataBuffer *raw_handle;
+  GByteArray *command;
+  gssize count;
+
   SftpPushHandle *handle = user_data;
   GError *error = NULL;
-  GFileInfo *info;
 
-  info = g_file_query_info_finish (source_file, res, &error);
-  if (!info)
+  count = g_input_stream_read_finish (handle->in, res, &error);
+
+  if (g_vfs_job_is_finished (handle->job) || g_vfs_job_is_cancelled (handle->job))
+    {
+      g_clear_error (&error);
+      sftp_push_handle_free (handle);
+      return;
+    }
+
+  if (error)
     {
       g_vfs_job_failed_from_error (handle->job, error);
       g_error_free (error);
+
+      sftp_push_handle_free (handle);
+      return;
+    }
+
+  if (count == 0)
+    {
+      handle->num_req--;
+
+      g_input_stream_close_async (handle->in,
+                                  0, NULL,
+                                  push_source_close_cb, handle);
+      return;
+    }
+
+  handle->num_opening += transfer_open_stripes (handle->backend, handle->job, handle->stripes,
+                                                handle->tempname ? handle->tempname : handle->op_job->destination,
+                                                SSH_FXF_WRITE, push_stripe_open_reply, handle);
+  stripe = transfer_pick_stripe (handle->backend, handle->job, handle->stripes);
+
+  request = g_slice_new (PushWriteRequest);
+  request->handle = handle;
+  request->offset = handle->offset;
+  request->count = count;
+  request->sent_time = g_get_monotonic_time ();
+
+  if (handle->resume)
+    resume_state_add_pending (handle->resume, handle->offset);
+
+  raw_handle = stripe ? stripe->raw_handle : handle->raw_handle;
+  command = new_command_sized (handle->backend, SSH_FXP_WRITE,
+                               COMMAND_SIZE + raw_handle->size + count);
+  put_data_buffer (command, raw_handle);
+  put_uint64 (command, handle->offset);
+  put_uint32 (command, count);
+  put_data (command, handle->buffer, count);
+  if (stripe)
+    connection_queue_command_and_free (stripe->connection, command, push_write_reply, handle->job, request);
+  else
+    queue_command_and_free (handle->backend, command, push_write_reply, handle->job, request);
+  handle->offset += count;
+
+  if (handle->num_req < handle->window.max_req)
+    push_enqueue_request (handle);
+}
+
+static void push_create_temp (SftpPushHandle *handle);
+
+static void
+push_truncate_original_reply (GVfsBackendSftp *backend,
+                              int reply_type,
+                              SftpReply *reply,
+                              guint32 len,
+                              GVfsJob *job,
+                              gpointer user_data)
+{
+  SftpPushHandle *handle = user_data;
+
+  dir_cache_purge (backend, handle->op_job->destination);
+
+  if (reply_type == SSH_FXP_HANDLE)
+    {
+      handle->raw_handle = read_data_buffer (reply);
+      push_enqueue_request (handle);
+    }
+  else if (reply_type == SSH_FXP_STATUS)
+    result_from_status (job, reply, -1, -1);
+  else
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+
+  sftp_push_handle_free (handle);
+}
+
+static void
+push_create_temp_reply (GVfsBackendSftp *backend,
+                        int reply_type,
+                        SftpReply *reply,
+                        guint32 len,
+                        GVfsJob *job,
+                        gpointer user_data)
+{
+  SftpPushHandle *handle = user_data;
+
+  dir_cache_purge (backend, handle->op_job->destination);
+
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      guint32 code = read_status_code (reply);
+      if (code == SSH_FX_PERMISSION_DENIED)
+        {
+          /* The temp file creation failed. Try truncating the existing file. */
+          GByteArray *command;
+
+          g_free (handle->tempname);
+          handle->tempname = NULL;
+
+          command = new_command (backend, SSH_FXP_OPEN);
+          put_string (command, handle->op_job->destination);
+          put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_TRUNC);
+          put_uint32 (command, 0);
+          queue_command_and_free (backend, command, push_truncate_original_reply, job, handle);
+
+          return;
+        }
+      else if (code == SSH_FX_FAILURE)
+        {
+          push_create_temp (handle);
+          return;
+        }
+      else
+        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                          _("Invalid reply received"));
+    }
+  else if (reply_type != SSH_FXP_HANDLE)
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+  else
+    {
+      handle->raw_handle = read_data_buffer (reply);
+      push_enqueue_request (handle);
+    }
+
+  sftp_push_handle_free (handle);
+}
+
+static void
+push_create_temp (SftpPushHandle *handle)
+{
+  GByteArray *command;
+  char *dirname;
+  char basename[] = ".giosaveXXXXXX";
+
+  /* Write to a temp file and then rename to replace. */
+
+  handle->temp_count++;
+
+  if (handle->temp_count == 100)
+    {
+      g_vfs_job_failed (handle->job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        _("Unable to create temporary file"));
       sftp_push_handle_free (handle);
       return;
     }
 
-  if ((handle->op_job->flags & G_FILE_COPY_NOFOLLOW_SYMLINKS) &&
-      g_file_info_get_file_type (info) == G_FILE_TYPE_SYMBOLIC_LINK)
-    {
-      /* Fall back to default implementation to copy symlink */
-      g_vfs_job_failed (handle->job, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
-                        _("Not supported"));
-      sftp_push_handle_free (handle);
-      return;
-    }
+  g_free (handle->tempname);
+  dirname = g_path_get_dirname (handle->op_job->destination);
+  random_text (basename + 8);
+  handle->tempname = g_build_filename (dirname, basename, NULL);
+  g_free (dirname);
+
+  command = new_command (handle->backend, SSH_FXP_OPEN);
+  put_string (command, handle->tempname);
+  put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL);
+  put_uint32 (command, 0);
+  queue_command_and_free (handle->backend, command, push_create_temp_reply, handle->job, handle);
+}
+
+static void
+push_open_stat_reply (GVfsBackendSftp *backend,
+                      int reply_type,
+                      SftpReply *reply,
+                      guint32 len,
+                      GVfsJob *job,
+                      gpointer user_data)
+{
+  SftpPushHandle *handle = user_data;
+
+  if (reply_type == SSH_FXP_ATTRS)
+    {
+      GFileInfo *info;
+      GFileType type;
+
+      info = g_file_info_new ();
+      parse_attributes (backend, info, NULL, reply, NULL);
+      type = g_file_info_get_file_type (info);
+      g_object_unref (info);
+
+      if (type == G_FILE_TYPE_DIRECTORY)
+        {
+          /* We cannot overwrite a directory. */
+          if (handle->op_job->flags & G_FILE_COPY_OVERWRITE)
+            g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_IS_DIRECTORY,
+                              _("File is directory"));
+
+          sftp_push_handle_free (handle);
+          return;
+        }
+
+      push_create_temp (handle);
+    }
+  else
+    {
+      result_from_status (job, reply, -1, -1);
+      sftp_push_handle_free (handle);
+    }
+}
+
+static void
+push_open_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 SftpReply *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  SftpPushHandle *handle = user_data;
+
+  dir_cache_purge (backend, handle->op_job->destination);
+
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      guint32 code = read_status_code (reply);
+      if (code == SSH_FX_NO_SUCH_FILE)
+        not_dir_or_not_exist_error (backend, job, handle->op_job->destination);
+      else if (code == SSH_FX_FAILURE)
+        {
+          if (handle->op_job->flags & G_FILE_COPY_OVERWRITE)
+            {
+              /* The destination probably exists. Let's see if we can overwrite
+               * it. */
+              GByteArray *command = new_command (backend, SSH_FXP_LSTAT);
+              put_string (command, handle->op_job->destination);
+              queue_command_and_free (backend, command, push_open_stat_reply, job, handle);
+              return;
+            }
+          else
+            result_from_status_code (job, code, G_IO_ERROR_EXISTS, -1);
+        }
+      else
+        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                          _("Invalid reply received"));
+    }
+  else if (reply_type != SSH_FXP_HANDLE)
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+  else
+    {
+      handle->raw_handle = read_data_buffer (reply);
+      push_enqueue_request (handle);
+    }
+
+  sftp_push_handle_free (handle);
+}
+
+static void
+push_resume_open_reply (GVfsBackendSftp *backend,
+                        int reply_type,
+                        SftpReply *reply,
+                        guint32 len,
+                        GVfsJob *job,
+                        gpointer user_data)
+{
+  SftpPushHandle *handle = user_data;
+  GByteArray *command;
+  GError *error = NULL;
+
+  dir_cache_purge (backend, handle->op_job->destination);
+
+  if (reply_type == SSH_FXP_HANDLE)
+    {
+      handle->raw_handle = read_data_buffer (reply);
+      handle->tempname = g_strdup (handle->partial);
+
+      if (handle->offset > 0)
+        {
+          /* Drop whatever is past the part known to be good */
+          command = new_command (backend, SSH_FXP_FSETSTAT);
+          put_data_buffer (command, handle->raw_handle);
+          put_uint32 (command, SSH_FILEXFER_ATTR_SIZE);
+          put_uint64 (command, handle->offset);
+          queue_command_and_free (backend, command, NULL, job, NULL);
+        }
+
+      if (handle->offset > 0 &&
+          !g_seekable_seek (G_SEEKABLE (handle->in), handle->offset, G_SEEK_SET, NULL, &error))
+        {
+          g_vfs_job_failed_from_error (job, error);
+          g_error_free (error);
+        }
+      else
+        push_enqueue_request (handle);
+    }
+  else if (reply_type == SSH_FXP_STATUS)
+    result_from_status (job, reply, -1, -1);
+  else
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+
+  sftp_push_handle_free (handle);
+}
+
+static void
+push_resume_open (SftpPushHandle *handle, goffset offset)
+{
+  GByteArray *command;
+  guint32 pflags;
+
+  handle->offset = offset;
+  handle->n_written = offset;
+
+  pflags = SSH_FXF_WRITE|SSH_FXF_CREAT;
+  if (offset == 0)
+    pflags |= SSH_FXF_TRUNC;
+
+  command = new_command (handle->backend, SSH_FXP_OPEN);
+  put_string (command, handle->partial);
+  put_uint32 (command, pflags);
+  put_uint32 (command, 0);
+  queue_command_and_free (handle->backend, command, push_resume_open_reply, handle->job, handle);
+}
+
+static void
+push_resume_verified (gboolean verified, gpointer user_data)
+{
+  SftpPushHandle *handle = user_data;
+
+  if (g_vfs_job_is_finished (handle->job) || g_vfs_job_is_cancelled (handle->job))
+    {
+      sftp_push_handle_free (handle);
+      return;
+    }
+
+  push_resume_open (handle, verified ? handle->resume->committed : 0);
+}
+
+static void
+push_resume_stat_reply (GVfsBackendSftp *backend,
+                        MultiReply *replies,
+                        int n_replies,
+                        GVfsJob *job,
+                        gpointer user_data)
+{
+  SftpPushHandle *handle = user_data;
+  GFileInfo *info;
+  GFileType type;
+  goffset partial_size;
+
+  if (replies[0].type == SSH_FXP_ATTRS)
+    {
+      info = g_file_info_new ();
+      parse_attributes (backend, info, NULL, replies[0].data, NULL);
+      type = g_file_info_get_file_type (info);
+      g_object_unref (info);
+
+      if (!(handle->op_job->flags & G_FILE_COPY_OVERWRITE))
+        {
+          g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                            _("Target file already exists"));
+          sftp_push_handle_free (handle);
+          return;
+        }
+
+      if (type == G_FILE_TYPE_DIRECTORY)
+        {
+          /* We cannot overwrite a directory. */
+          g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_IS_DIRECTORY,
+                            _("File is directory"));
+          sftp_push_handle_free (handle);
+          return;
+        }
+    }
+
+  /* Never trust more than is in the partial file */
+  partial_size = 0;
+  if (replies[1].type == SSH_FXP_ATTRS)
+    {
+      info = g_file_info_new ();
+      parse_attributes (backend, info, NULL, replies[1].data, NULL);
+      partial_size = g_file_info_get_size (info);
+      g_object_unref (info);
+    }
+  handle->resume->committed = MIN (handle->resume->committed, partial_size);
+
+  if (handle->resume->committed > 0)
+    resume_verify (backend, job,
+                   handle->partial, handle->op_job->local_path,
+                   handle->resume->committed,
+                   push_resume_verified, handle);
+  else
+    push_resume_open (handle, 0);
+}
+
+/* Resumable pushes write to a partial file next to the destination,
+ * which is continued from if an earlier push of the same file failed.
+ * It replaces the destination when complete. */
+static void
+push_resume_start (SftpPushHandle *handle)
+{
+  GByteArray *commands[2];
+
+  handle->resume = resume_state_new (handle->backend, "push",
+                                     handle->op_job->local_path,
+                                     handle->op_job->destination,
+                                     handle->size, handle->mtime);
+  handle->partial = g_strconcat (handle->op_job->destination, RESUME_PARTIAL_SUFFIX, NULL);
+
+  commands[0] = new_command (handle->backend, SSH_FXP_LSTAT);
+  put_string (commands[0], handle->op_job->destination);
+
+  commands[1] = new_command (handle->backend, SSH_FXP_STAT);
+  put_string (commands[1], handle->partial);
+
+  queue_commands_and_free (handle->backend,
+                           commands, 2,
+                           push_resume_stat_reply,
+                           handle->job,
+                           handle);
+}
+
+static void
+push_source_fstat_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  GFileInputStream *fin = G_FILE_INPUT_STREAM (source);
+  SftpPushHandle *handle = user_data;
+  GError *error = NULL;
+  GFileInfo *info;
+  GByteArray *command;
+
+  info = g_file_input_stream_query_info_finish (fin, res, &error);
+  if (info)
+    {
+      handle->permissions = g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_MODE) & 0777;
+      handle->size = g_file_info_get_size (info);
+      handle->mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+
+      if (handle->backend->resume_transfers)
+        push_resume_start (handle);
+      else
+        {
+          command = new_command (handle->backend, SSH_FXP_OPEN);
+          put_string (command, handle->op_job->destination);
+          put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL);
+          put_uint32 (command, 0);
+          queue_command_and_free (handle->backend, command, push_open_reply, handle->job, handle);
+        }
+    }
+  else
+    {
+      g_vfs_job_failed_from_error (handle->job, error);
+      g_error_free (error);
+      sftp_push_handle_free (handle);
+    }
+}
+
+static void
+push_source_open_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  GFile *source_file = G_FILE (source);
+  SftpPushHandle *handle = user_data;
+  GError *error = NULL;
+  GFileInputStream *fin;
+
+  fin = g_file_read_finish (source_file, res, &error);
+  if (fin)
+    {
+      handle->in = G_INPUT_STREAM (fin);
+
+      g_file_input_stream_query_info_async (fin,
+                                            G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                                            G_FILE_ATTRIBUTE_UNIX_MODE ","
+                                            G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                            0, NULL,
+                                            push_source_fstat_cb, handle);
+    }
+  else
+    {
+      if (error->domain == G_IO_ERROR && error->code == G_IO_ERROR_IS_DIRECTORY)
+        {
+          /* Fall back to default implementation to improve the error message */
+          g_vfs_job_failed (handle->job, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                            _("Not supported"));
+        }
+      else
+        g_vfs_job_failed_from_error (handle->job, error);
+
+      g_error_free (error);
+      sftp_push_handle_free (handle);
+    }
+}
+
+static void
+push_source_lstat_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  GFile *source_file = G_FILE (source);
+  SftpPushHandle *handle = user_data;
+  GError *error = NULL;
+  GFileInfo *info;
+
+  info = g_file_query_info_finish (source_file, res, &error);
+  if (!info)
+    {
+      g_vfs_job_failed_from_error (handle->job, error);
+      g_error_free (error);
+      sftp_push_handle_free (handle);
+      return;
+    }
+
+  if ((handle->op_job->flags & G_FILE_COPY_NOFOLLOW_SYMLINKS) &&
+      g_file_info_get_file_type (info) == G_FILE_TYPE_SYMBOLIC_LINK)
+    {
+      /* Fall back to default implementation to copy symlink */
+      g_vfs_job_failed (handle->job, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        _("Not supported"));
+      sftp_push_handle_free (handle);
+      return;
+    }
+
+  g_file_read_async (source_file, 0, NULL, push_source_open_cb, handle);
+}
+
+static gboolean
+try_push (GVfsBackend *backend,
+          GVfsJobPush *op_job,
+          const char *destination,
+          const char *local_path,
+          GFileCopyFlags flags,
+          gboolean remove_source,
+          GFileProgressCallback progress_callback,
+          gpointer progress_callback_data)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GFile *source;
+  SftpPushHandle *handle;
+
+  handle = g_slice_new0 (SftpPushHandle);
+  handle->backend = g_object_ref (op_backend);
+  handle->job = g_object_ref (G_VFS_JOB (op_job));
+  handle->op_job = op_job;
+  transfer_window_init (&handle->window, op_backend->max_write_size);
+  handle->buffer = g_malloc (handle->window.max_block_size);
+  handle->stripes = g_ptr_array_new_with_free_func ((GDestroyNotify)transfer_stripe_free);
+
+  source = g_file_new_for_path (local_path);
+  g_file_query_info_async (source,
+                           G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                           G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                           0, NULL,
+                           push_source_lstat_cb, handle);
+  g_object_unref (source);
+
+  return TRUE;
+}
+
+/* The pull sliding window mechanism is based on the one from the OpenSSH sftp
+ * client. It is complicated because requests can be returned out of order. */
+
+#define PULL_SIZE_INCOMPLETE -1  /* Indicates an incomplete fstat() request */
+#define PULL_SIZE_INVALID -2  /* Indicates that no fstat() request is in progress */
+
+typedef struct {
+  /* initial job information */
+  GVfsBackendSftp *backend;
+  GVfsJob *job;
+  GVfsJobPull *op_job;
+  GFile *dest;
+
+  /* Open files */
+  DataBuffer *raw_handle;
+  GOutputStream *output;
+
+  /* fstat information */
+  goffset size;
+  guint32 mode;
+
+  /* resume data, output is then the output of partial_stream */
+  ResumeState *resume;
+  GFile *partial;
+  GFileIOStream *partial_stream;
+
+  /* state */
+  goffset offset;
+  goffset n_written;
+  int num_req; /* Number of outstanding read requests */
+  int max_req; /* Current maximum number of outstanding read requests */
+  TransferWindow window;
+  GList *queued_writes;
+
+  /* The source opened on the other connections */
+  GPtrArray *stripes;
+  int num_opening;
+} SftpPullHandle;
+
+typedef struct {
+  SftpPullHandle *handle;
+  guint32 request_len;    /* number of bytes requested */
+  guint64 request_offset; /* offset of requested bytes */
+  gssize response_len;     /* number of bytes returned */
+  gssize write_offset;     /* offset in buffer of bytes written so far */
+  gint64 sent_time;
+  char *buffer;
+} PullRequest;
+
+static void
+pull_enqueue_next_request (SftpPullHandle *handle);
+
+static void
+pull_enqueue_request (SftpPullHandle *handle, guint64 offset, guint32 len);
+
+static void
+pull_try_start_write (SftpPullHandle *handle);
+
+static void
+pull_request_free (PullRequest *request)
+{
+  if (request->buffer)
+      g_slice_free1 (request->request_len, request->buffer);
+  g_slice_free (PullRequest, request);
+}
+
+static void
+sftp_pull_handle_free (SftpPullHandle *handle)
+{
+  if (handle->size != PULL_SIZE_INCOMPLETE && /* fstat complete */
+      (!handle->output || !g_output_stream_has_pending (handle->output)) && /* no writes outstanding */
+      handle->num_req == 0 && /* no reads oustanding */
+      handle->num_opening == 0) /* no stripes being opened */
+    {
+      if (handle->raw_handle)
+        {
+          GByteArray *command = new_command (handle->backend, SSH_FXP_CLOSE);
+          put_data_buffer (command, handle->raw_handle);
+          queue_command_and_free (handle->backend, command, NULL, handle->job, NULL);
+          data_buffer_free (handle->raw_handle);
+        }
+      transfer_close_stripes (handle->backend, handle->job, handle->stripes, NULL, NULL);
+      g_ptr_array_free (handle->stripes, TRUE);
+      /* A failed pull cuts the partial file to the part known to be
+       * good and saves the state for the next try. */
+      if (handle->resume)
+        {
+          if (handle->output && !g_output_stream_is_closed (handle->output))
+            {
+              goffset committed = resume_state_get_committed (handle->resume, handle->offset);
+
+              g_seekable_truncate (G_SEEKABLE (handle->output), committed, NULL, NULL);
+              resume_state_save (handle->resume, committed);
+            }
+          else if (!handle->job->failed && !handle->job->cancelled)
+            resume_state_forget (handle->resume);
+          resume_state_free (handle->resume);
+        }
+
+      g_clear_object (&handle->output);
+      g_clear_object (&handle->partial_stream);
+      g_clear_object (&handle->partial);
+      g_object_unref(handle->backend);
+      g_object_unref(handle->op_job);
+      g_object_unref(handle->dest);
+      g_list_free_full (handle->queued_writes, (GDestroyNotify)pull_request_free);
+      g_slice_free (SftpPullHandle, handle);
+    }
+}
+
+static void
+pull_remove_source_reply (GVfsBackendSftp *backend,
+                          int reply_type,
+                          SftpReply *reply,
+                          guint32 len,
+                          GVfsJob *job,
+                          gpointer user_data)
+{
+  dir_cache_purge (backend, G_VFS_JOB_PULL (job)->source);
+
+  if (reply_type == SSH_FXP_STATUS)
+    result_from_status (job, reply, -1, -1);
+  else
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+}
+
+static void
+pull_set_perms_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  SftpPullHandle *handle = user_data;
+
+  if (handle->op_job->remove_source)
+    {
+      GByteArray *command = new_command (handle->backend, SSH_FXP_REMOVE);
+      put_string (command, handle->op_job->source);
+      queue_command_and_free (handle->backend,
+                              command,
+                              pull_remove_source_reply,
+                              handle->job,
+                              NULL);
+    }
+  else
+    g_vfs_job_succeeded (handle->job);
+
+  sftp_pull_handle_free (handle);
+}
+
+/* Moves a completed partial file over the destination. There is no
+   g_file_move_async(), so this runs in a thread. */
+static void
+pull_resume_move_partial_thread (GTask *task,
+                                 gpointer source_object,
+                                 gpointer task_data,
+                                 GCancellable *cancellable)
+{
+  SftpPullHandle *handle = task_data;
+  GError *error = NULL;
+
+  if (!(handle->op_job->flags & G_FILE_COPY_OVERWRITE) &&
+      g_file_query_exists (handle->dest, NULL))
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                             _("Target file already exists"));
+  else if (g_file_move (handle->partial, handle->dest,
+                        G_FILE_COPY_OVERWRITE,
+                        NULL, NULL, NULL, &error))
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_error (task, error);
+}
+
+static void
+pull_done (SftpPullHandle *handle)
+{
+  g_vfs_job_progress_callback (handle->n_written, handle->n_written, handle->job);
+
+  if (handle->size >= 0 && !(handle->op_job->flags & G_FILE_COPY_TARGET_DEFAULT_PERMS))
+    {
+      GFileInfo *info = g_file_info_new ();
+      g_file_info_set_attribute_uint32 (info,
+                                        G_FILE_ATTRIBUTE_UNIX_MODE,
+                                        handle->mode);
+      g_file_set_attributes_async (handle->dest,
+                                   info,
+                                   G_FILE_QUERY_INFO_NONE,
+                                   G_PRIORITY_DEFAULT,
+                                   NULL,
+                                   pull_set_perms_cb, handle);
+      g_object_unref (info);
+      return;
+    }
+
+  if (handle->op_job->remove_source)
+    {
+      GByteArray *command = new_command (handle->backend, SSH_FXP_REMOVE);
+      put_string (command, handle->op_job->source);
+      queue_command_and_free (handle->backend,
+                              command,
+                              pull_remove_source_reply,
+                              handle->job,
+                              NULL);
+    }
+  else
+    g_vfs_job_succeeded (handle->job);
+
+  sftp_pull_handle_free (handle);
+}
+
+static void
+pull_resume_move_partial_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  SftpPullHandle *handle = user_data;
+  GError *error = NULL;
+
+  if (g_task_propagate_boolean (G_TASK (res), &error))
+    pull_done (handle);
+  else
+    {
+      g_vfs_job_failed_from_error (handle->job, error);
+      g_error_free (error);
+      sftp_pull_handle_free (handle);
+    }
+}
+
+static void
+pull_close_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  SftpPullHandle *handle = user_data;
+  GTask *task;
+  GError *error = NULL;
+
+  if (!g_output_stream_close_finish (handle->output, res, &error))
+    {
+      g_vfs_job_failed_from_error (handle->job, error);
+      g_error_free (error);
+      sftp_pull_handle_free (handle);
+      return;
+    }
+
+  if (handle->partial)
+    {
+      task = g_task_new (handle->backend, NULL, pull_resume_move_partial_cb, handle);
+      g_task_set_task_data (task, handle, NULL);
+      g_task_run_in_thread (task, pull_resume_move_partial_thread);
+      g_object_unref (task);
+      return;
+    }
+
+  pull_done (handle);
+}
+
+static void
+pull_try_finish (SftpPullHandle *handle)
+{
+  if (handle->max_req == 0 && /* received EOF */
+      handle->size != PULL_SIZE_INCOMPLETE && /* fstat complete */
+      !g_output_stream_has_pending (handle->output) && /* no writes outstanding */
+      handle->num_req == 0) /* no reads oustanding */
+    {
+      g_output_stream_close_async (handle->output,
+                                   G_PRIORITY_DEFAULT,
+                                   NULL,
+                                   pull_close_cb, handle);
+    }
+}
+
+static void
+pull_write_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  PullRequest *request = user_data;
+  SftpPullHandle *handle = request->handle;
+  GError *error = NULL;
+  gssize n_written;
+
+  n_written = g_output_stream_write_finish (handle->output, res, &error);
+  if (n_written == -1)
+    {
+      g_vfs_job_failed_from_error (handle->job, error);
+      g_error_free (error);
+      pull_request_free (request);
+      sftp_pull_handle_free (handle);
+      return;
+    }
+
+  handle->n_written += n_written;
+  request->write_offset += n_written;
+
+  /* If we didn't write everything, do another write */
+  if (request->write_offset < request->response_len)
+    {
+      g_output_stream_write_async (handle->output,
+                                   request->buffer + request->write_offset,
+                                   request->response_len - request->write_offset,
+                                   G_PRIORITY_DEFAULT,
+                                   NULL,
+                                   pull_write_cb, request);
+      return;
+    }
+
+  if (handle->size >= 0)
+    g_vfs_job_progress_callback (handle->n_written, handle->size, handle->job);
+
+  pull_try_start_write (handle);
+
+  /* If we read short, issue another request for the remaining data. */
+  if (request->response_len < request->request_len)
+    pull_enqueue_request (handle,
+                          request->request_offset + request->response_len,
+                          request->request_len - request->response_len);
+  else if (handle->max_req == 0)
+    pull_try_finish (handle);
+  else
+    {
+      /* Once we have requested past the estimated EOF, request one at a
+       * time.  Otherwise try increase the number of concurrent requests. */
+      if (handle->offset > handle->size)
+        handle->max_req = 1;
+      else
+        handle->max_req = handle->window.max_req;
+
+      while (handle->num_req < handle->max_req)
+        pull_enqueue_next_request (handle);
+    }
+
+  /* After the remainder of a short read was requested */
+  if (handle->resume)
+    resume_state_written (handle->resume, request->request_offset, handle->offset);
+
+  pull_request_free (request);
+}
+
+static void
+pull_try_start_write (SftpPullHandle *handle)
+{
+  GError *error = NULL;
+  PullRequest *request;
+
+  if (g_output_stream_has_pending (handle->output))
+    return;
+
+  if (!handle->queued_writes)
+    return;
+
+  request = handle->queued_writes->data;
+  handle->queued_writes = g_list_delete_link (handle->queued_writes, handle->queued_writes);
+
+  if (!g_seekable_seek (G_SEEKABLE (handle->output),
+                        request->request_offset, G_SEEK_SET,
+                        NULL, &error))
+    {
+      g_vfs_job_failed_from_error (handle->job, error);
+      g_error_free (error);
+      pull_request_free (request);
+      sftp_pull_handle_free (handle);
+      return;
+    }
+
+  g_output_stream_write_async (handle->output,
+                               request->buffer, request->response_len,
+                               G_PRIORITY_DEFAULT,
+                               NULL,
+                               pull_write_cb, request);
+}
+
+static void
+pull_read_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 SftpReply *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  PullRequest *request = user_data;
+  SftpPullHandle *handle = request->handle;
+
+  handle->num_req--;
+
+  if (g_vfs_job_is_finished (job) || g_vfs_job_is_cancelled (job))
+    {
+    }
+  else if (reply_type == SSH_FXP_STATUS)
+    {
+      guint32 code = read_status_code (reply);
+      if (code == SSH_FX_EOF)
+        {
+          if (handle->resume)
+            resume_state_written (handle->resume, request->request_offset, handle->offset);
+          pull_request_free (request);
+          handle->max_req = 0;
+          pull_try_finish (handle);
+          return;
+        }
+      else
+        result_from_status_code (job, code, -1, -1);
+    }
+  else if (reply_type != SSH_FXP_DATA)
+    {
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        _("Invalid reply received"));
+    }
+  else
+    {
+      if (reply == NULL)
+        request->response_len = len; /* Already in the buffer */
+      else
+        request->response_len = reply_read_uint32 (reply);
+
+      if (request->response_len <= request->request_len &&
+          (reply == NULL ||
+           reply_read_data (reply, request->buffer, request->response_len)))
+        {
+          transfer_window_update (&handle->window, request->sent_time, request->response_len);
+          handle->queued_writes = g_list_append (handle->queued_writes, request);
+          pull_try_start_write (handle);
+          return;
+        }
+      else
+        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                          _("Invalid reply received"));
+    }
+
+  pull_request_free (request);
+  sftp_pull_handle_free (handle);
+}
+
+static void
+pull_stripe_open_reply (GVfsBackendSftp *backend,
+                        int reply_type,
+                        SftpReply *reply,
+                        guint32 len,
+                        GVfsJob *job,
+                        gpointer user_data)
+{
+  TransferStripe *stripe = user_data;
+  SftpPullHandle *handle = stripe->handle;
+
+  handle->num_opening--;
+
+  /* Failing to open a stripe only leaves the connection unused */
+  if (reply_type == SSH_FXP_HANDLE)
+    stripe->raw_handle = read_data_buffer (reply);
+
+  if (job->failed || g_vfs_job_is_finished (job) || g_vfs_job_is_cancelled (job))
+    sftp_pull_handle_free (handle);
+}
+
+static void
+pull_enqueue_request (SftpPullHandle *handle, guint64 offset, guint32 len)
+{
+  PullRequest *request;
+  TransferStripe *stripe;
+
+  request = g_slice_new0 (PullRequest);
+  request->handle = handle;
+  request->request_len = len;
+  request->request_offset = offset;
+  request->buffer = g_slice_alloc (len);
+  request->sent_time = g_get_monotonic_time ();
+
+  if (handle->resume)
+    resume_state_add_pending (handle->resume, offset);
+
+  handle->num_opening += transfer_open_stripes (handle->backend, handle->job, handle->stripes,
+                                                handle->op_job->source, SSH_FXF_READ,
+                                                pull_stripe_open_reply, handle);
+
+  stripe = transfer_pick_stripe (handle->backend, handle->job, handle->stripes);
+  if (stripe)
+    connection_queue_read_command (stripe->connection, stripe->raw_handle, offset, len,
+                                   (guint8 *)request->buffer, pull_read_reply, handle->job, request);
+  else
+    queue_read_command (handle->backend, handle->raw_handle, offset, len,
+                        (guint8 *)request->buffer, pull_read_reply, handle->job, request);
+
+  handle->num_req++;
+}
+
+static void
+pull_enqueue_next_request (SftpPullHandle *handle)
+{
+  guint32 block_size = handle->window.block_size;
+
+  pull_enqueue_request (handle, handle->offset, block_size);
+  handle->offset += block_size;
+}
+
+static void
+pull_fstat_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  SftpReply *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
+{
+  SftpPullHandle *handle = user_data;
+
+  if (g_vfs_job_is_finished (job) || g_vfs_job_is_cancelled (job))
+    {
+      handle->size = PULL_SIZE_INVALID;
+      sftp_pull_handle_free (handle);
+      return;
+    }
+
+  if (reply_type == SSH_FXP_ATTRS)
+    {
+      GFileInfo *info = g_file_info_new ();
+      parse_attributes (backend, info, NULL, reply, NULL);
+      handle->size = g_file_info_get_size (info);
+      handle->mode = g_file_info_get_attribute_uint32 (info,
+                                                       G_FILE_ATTRIBUTE_UNIX_MODE);
+      g_object_unref (info);
+    }
+  else
+    handle->size = PULL_SIZE_INVALID;
+
+  pull_try_finish (handle);
+}
+
+static void
+pull_start (SftpPullHandle *handle)
+{
+  /* Do an fstat() to find out the size and mode of the file. */
+  GByteArray *command = new_command (handle->backend,
+                                            SSH_FXP_FSTAT);
+  put_data_buffer (command, handle->raw_handle);
+  queue_command_and_free (handle->backend,
+                          command,
+                          pull_fstat_reply,
+                          handle->job,
+                          handle);
+  handle->size = PULL_SIZE_INCOMPLETE;
+
+  while (handle->num_req < handle->max_req)
+    pull_enqueue_next_request (handle);
+}
+
+static void
+pull_dest_open_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  SftpPullHandle *handle = user_data;
+  GError *error = NULL;
+
+  if (handle->op_job->flags & G_FILE_COPY_OVERWRITE)
+    handle->output = G_OUTPUT_STREAM (g_file_replace_finish (handle->dest,
+                                                             res,
+                                                             &error));
+  else
+    handle->output = G_OUTPUT_STREAM (g_file_create_finish (handle->dest,
+                                                            res,
+                                                            &error));
+  if (handle->output)
+    pull_start (handle);
+  else
+    {
+      g_vfs_job_failed_from_error (handle->job, error);
+      g_error_free (error);
+      sftp_pull_handle_free (handle);
+    }
+}
+
+static void
+pull_partial_open_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  SftpPullHandle *handle = user_data;
+  GError *error = NULL;
+
+  if (handle->offset > 0)
+    handle->partial_stream = g_file_open_readwrite_finish (handle->partial, res, &error);
+  else
+    handle->partial_stream = g_file_create_readwrite_finish (handle->partial, res, &error);
+
+  if (handle->partial_stream)
+    {
+      handle->output = g_object_ref (g_io_stream_get_output_stream (G_IO_STREAM (handle->partial_stream)));
+
+      /* Drop whatever is past the part known to be good */
+      if (g_seekable_truncate (G_SEEKABLE (handle->output), handle->offset, NULL, &error))
+        {
+          pull_start (handle);
+          return;
+        }
+    }
+
+  g_vfs_job_failed_from_error (handle->job, error);
+  g_error_free (error);
+  sftp_pull_handle_free (handle);
+}
+
+static void
+pull_partial_delete_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  SftpPullHandle *handle = user_data;
+
+  /* Usually there is no partial file to delete */
+  g_file_delete_finish (handle->partial, res, NULL);
+
+  g_file_create_readwrite_async (handle->partial,
+                                 G_FILE_CREATE_NONE,
+                                 G_PRIORITY_DEFAULT,
+                                 NULL,
+                                 pull_partial_open_cb, handle);
+}
+
+static void
+pull_resume_open (SftpPullHandle *handle, goffset offset)
+{
+  handle->offset = offset;
+  handle->n_written = offset;
+
+  if (offset > 0)
+    g_file_open_readwrite_async (handle->partial,
+                                 G_PRIORITY_DEFAULT,
+                                 NULL,
+                                 pull_partial_open_cb, handle);
+  else
+    g_file_delete_async (handle->partial,
+                         G_PRIORITY_DEFAULT,
+                         NULL,
+                         pull_partial_delete_cb, handle);
+}
+
+static void
+pull_resume_verified (gboolean verified, gpointer user_data)
+{
+  SftpPullHandle *handle = user_data;
+
+  if (g_vfs_job_is_finished (handle->job) || g_vfs_job_is_cancelled (handle->job))
+    {
+      sftp_pull_handle_free (handle);
+      return;
+    }
+
+  pull_resume_open (handle, verified ? handle->resume->committed : 0);
+}
+
+static void
+pull_resume_partial_info_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  SftpPullHandle *handle = user_data;
+  GFileInfo *info;
+  char *path;
+
+  /* Never trust more than is in the partial file */
+  info = g_file_query_info_finish (handle->partial, res, NULL);
+  if (info)
+    {
+      handle->resume->committed = MIN (handle->resume->committed,
+                                       g_file_info_get_size (info));
+      g_object_unref (info);
+    }
+  else
+    handle->resume->committed = 0;
+
+  if (handle->resume->committed > 0)
+    {
+      path = g_file_get_path (handle->partial);
+      resume_verify (handle->backend, handle->job,
+                     handle->op_job->source, path,
+                     handle->resume->committed,
+                     pull_resume_verified, handle);
+      g_free (path);
+    }
+  else
+    pull_resume_open (handle, 0);
+}
+
+static void
+pull_resume_query_partial (SftpPullHandle *handle)
+{
+  g_file_query_info_async (handle->partial,
+                           G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                           G_FILE_QUERY_INFO_NONE,
+                           G_PRIORITY_DEFAULT,
+                           NULL,
+                           pull_resume_partial_info_cb, handle);
+}
+
+static void
+pull_resume_dest_info_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  SftpPullHandle *handle = user_data;
+  GFileInfo *info;
+
+  info = g_file_query_info_finish (handle->dest, res, NULL);
+  if (info)
+    {
+      g_object_unref (info);
+      g_vfs_job_failed (handle->job, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                        _("Target file already exists"));
+      sftp_pull_handle_free (handle);
+      return;
+    }
+
+  pull_resume_query_partial (handle);
+}
+
+/* Resumable pulls write to a partial file next to the destination,
+ * which is continued from if an earlier pull of the same file failed.
+ * It replaces the destination when complete. */
+static void
+pull_resume_start (SftpPullHandle *handle, goffset size, guint64 mtime)
+{
+  char *path;
+
+  handle->resume = resume_state_new (handle->backend, "pull",
+                                     handle->op_job->source,
+                                     handle->op_job->local_path,
+                                     size, mtime);
+
+  path = g_strconcat (handle->op_job->local_path, RESUME_PARTIAL_SUFFIX, NULL);
+  handle->partial = g_file_new_for_path (path);
+  g_free (path);
+
+  if (!(handle->op_job->flags & G_FILE_COPY_OVERWRITE))
+    g_file_query_info_async (handle->dest,
+                             G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                             G_FILE_QUERY_INFO_NONE,
+                             G_PRIORITY_DEFAULT,
+                             NULL,
+                             pull_resume_dest_info_cb, handle);
+  else
+    pull_resume_query_partial (handle);
+}
+
+static void
+pull_open_reply (GVfsBackendSftp *backend,
+                 MultiReply *replies,
+                 int n_replies,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  SftpPullHandle *handle = user_data;
+
+  if (replies[0].type == SSH_FXP_ATTRS)
+    {
+      GFileType type;
+      goffset size;
+      guint64 mtime;
+      GFileInfo *info = g_file_info_new ();
+
+      parse_attributes (backend, info, NULL, replies[0].data, NULL);
+      type = g_file_info_get_file_type (info);
+      size = g_file_info_get_size (info);
+      mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+      g_object_unref (info);
+
+      if (type != G_FILE_TYPE_REGULAR)
+        {
+          /* Fall back to default implementation to copy non-regular files */
+          g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                            _("Not supported"));
+        }
+      else if (replies[1].type == SSH_FXP_STATUS)
+        result_from_status (job, replies[1].data, -1, -1);
+      else if (replies[1].type != SSH_FXP_HANDLE)
+        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                          _("Invalid reply received"));
+      else
+        {
+          /* We got a valid file handle. */
+          handle->raw_handle = read_data_buffer (replies[1].data);
+
+          if (backend->resume_transfers &&
+              !(handle->op_job->flags & G_FILE_COPY_BACKUP))
+            pull_resume_start (handle, size, mtime);
+          else if (handle->op_job->flags & G_FILE_COPY_OVERWRITE)
+            g_file_replace_async (handle->dest,
+                                  NULL,
+                                  handle->op_job->flags & G_FILE_COPY_BACKUP ? TRUE : FALSE,
+                                  G_FILE_CREATE_REPLACE_DESTINATION,
+                                  G_PRIORITY_DEFAULT,
+                                  NULL,
+                                  pull_dest_open_cb, handle);
+          else
+            g_file_create_async (handle->dest,
+                                 G_FILE_CREATE_NONE,
+                                 G_PRIORITY_DEFAULT,
+                                 NULL,
+                                 pull_dest_open_cb, handle);
+          return;
+        }
+    }
+  else if (replies[0].type == SSH_FXP_STATUS)
+    result_from_status (job, replies[0].data, -1, -1);
+  else
+    g_vfs_job_failed (job,
+                      G_IO_ERROR, G_IO_ERROR_FAILED,
+                      "%s", _("Invalid reply received"));
+
+  /* If we got a file handle, store it.  It will be closed when the
+   * SftpPushHandle is freed. */
+  if (replies[1].type == SSH_FXP_HANDLE && !handle->raw_handle)
+    handle->raw_handle = read_data_buffer (replies[1].data);
 
-  g_file_read_async (source_file, 0, NULL, push_source_open_cb, handle);
+  sftp_pull_handle_free (handle);
 }
 
 static gboolean
-try_push (GVfsBackend *backend,
-          GVfsJobPush *op_job,
-          const char *destination,
+try_pull (GVfsBackend *backend,
+          GVfsJobPull *job,
+          const char *source,
           const char *local_path,
           GFileCopyFlags flags,
           gboolean remove_source,
@@ -5537,553 +8799,539 @@ try_push (GVfsBackend *backend,
           gpointer progress_callback_data)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GFile *source;
-  SftpPushHandle *handle;
+  SftpPullHandle *handle;
+  GByteArray *commands[2];
 
-  handle = g_slice_new0 (SftpPushHandle);
+  handle = g_slice_new0 (SftpPullHandle);
   handle->backend = g_object_ref (op_backend);
-  handle->job = g_object_ref (G_VFS_JOB (op_job));
-  handle->op_job = op_job;
+  handle->op_job = g_object_ref (job);
+  handle->job = G_VFS_JOB (job);
+  handle->dest = g_file_new_for_path (local_path);
+  handle->size = PULL_SIZE_INVALID;
+  handle->stripes = g_ptr_array_new_with_free_func ((GDestroyNotify)transfer_stripe_free);
+  transfer_window_init (&handle->window, op_backend->max_read_size);
+  handle->max_req = handle->window.max_req;
 
-  source = g_file_new_for_path (local_path);
-  g_file_query_info_async (source,
-                           G_FILE_ATTRIBUTE_STANDARD_TYPE,
-                           G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                           0, NULL,
-                           push_source_lstat_cb, handle);
-  g_object_unref (source);
+  commands[0] = new_command (op_backend,
+                             flags & G_FILE_COPY_NOFOLLOW_SYMLINKS ? SSH_FXP_LSTAT : SSH_FXP_STAT);
+  put_string (commands[0], source);
+
+  commands[1] = new_command (op_backend, SSH_FXP_OPEN);
+  put_string (commands[1], source);
+  put_uint32 (commands[1], SSH_FXF_READ);
+  put_uint32 (commands[1], 0);
+
+  queue_commands_and_free (op_backend,
+                           commands, 2,
+                           pull_open_reply,
+                           G_VFS_JOB(job),
+                           handle);
 
   return TRUE;
 }
 
-/* The pull sliding window mechanism is based on the one from the OpenSSH sftp
- * client. It is complicated because requests can be returned out of order. */
+/* Copies within the mount are done on the server with the copy-data
+ * extension, in chunks so that progress can be reported and the job
+ * cancelled. Without the extension the client falls back to reading and
+ * writing the file itself.
+ *
+ * Like replace, the copy goes to a temp file next to the destination
+ * that is only renamed over it when complete, so a failed or cancelled
+ * copy leaves an existing destination alone, and a symlink there is
+ * replaced rather than followed. */
 
-#define PULL_MAX_REQUESTS 64  /* Never have more than this many requests outstanding */
-#define PULL_BLOCKSIZE 32768  /* Request this much data per request */
-#define PULL_SIZE_INCOMPLETE -1  /* Indicates an incomplete fstat() request */
-#define PULL_SIZE_INVALID -2  /* Indicates that no fstat() request is in progress */
+#define COPY_CHUNK_SIZE (64 * 1024 * 1024)
 
 typedef struct {
-  /* initial job information */
+  /* Job context */
   GVfsBackendSftp *backend;
+  GVfsJobCopy *op_job;
   GVfsJob *job;
-  GVfsJobPull *op_job;
-  GFile *dest;
 
   /* Open files */
-  DataBuffer *raw_handle;
-  GOutputStream *output;
+  DataBuffer *src_handle;
+  DataBuffer *dest_handle;
+  char *tempname;     /* removed when the handle is freed */
+  int temp_count;
+  gboolean dest_exists;
 
-  /* fstat information */
+  /* source information */
   goffset size;
-  guint32 mode;
+  guint32 permissions;
+  gboolean has_times;
+  guint32 atime;
+  guint32 mtime;
 
   /* state */
   goffset offset;
-  goffset n_written;
-  int num_req; /* Number of outstanding read requests */
-  int max_req; /* Current maximum number of outstanding read requests */
-  GList *queued_writes;
-} SftpPullHandle;
-
-typedef struct {
-  SftpPullHandle *handle;
-  guint32 request_len;    /* number of bytes requested */
-  guint64 request_offset; /* offset of requested bytes */
-  gssize response_len;     /* number of bytes returned */
-  gssize write_offset;     /* offset in buffer of bytes written so far */
-  char *buffer;
-} PullRequest;
+  guint32 chunk;
+} SftpCopyHandle;
 
 static void
-pull_enqueue_next_request (SftpPullHandle *handle);
+sftp_copy_handle_free (SftpCopyHandle *handle)
+{
+  GByteArray *command;
 
-static void
-pull_enqueue_request (SftpPullHandle *handle, guint64 offset, guint32 len);
+  if (handle->src_handle)
+    {
+      command = new_command (handle->backend, SSH_FXP_CLOSE);
+      put_data_buffer (command, handle->src_handle);
+      queue_command_and_free (handle->backend, command, NULL, handle->job, NULL);
+      data_buffer_free (handle->src_handle);
+    }
 
-static void
-pull_try_start_write (SftpPullHandle *handle);
+  if (handle->dest_handle)
+    {
+      command = new_command (handle->backend, SSH_FXP_CLOSE);
+      put_data_buffer (command, handle->dest_handle);
+      queue_command_and_free (handle->backend, command, NULL, handle->job, NULL);
+      data_buffer_free (handle->dest_handle);
+    }
 
-static void
-pull_request_free (PullRequest *request)
-{
-  if (request->buffer)
-      g_slice_free1 (request->response_len, request->buffer);
-  g_slice_free (PullRequest, request);
+  if (handle->tempname)
+    {
+      command = new_command (handle->backend, SSH_FXP_REMOVE);
+      put_string (command, handle->tempname);
+      queue_command_and_free (handle->backend, command, NULL, handle->job, NULL);
+      g_free (handle->tempname);
+    }
+
+  g_object_unref (handle->backend);
+  g_object_unref (handle->job);
+  g_slice_free (SftpCopyHandle, handle);
 }
 
 static void
-sftp_pull_handle_free (SftpPullHandle *handle)
+copy_rename_reply (GVfsBackendSftp *backend,
+                   int reply_type,
+                   SftpReply *reply,
+                   guint32 len,
+                   GVfsJob *job,
+                   gpointer user_data)
 {
-  if (handle->size != PULL_SIZE_INCOMPLETE && /* fstat complete */
-      (!handle->output || !g_output_stream_has_pending (handle->output)) && /* no writes outstanding */
-      handle->num_req == 0) /* no reads oustanding */
+  SftpCopyHandle *handle = user_data;
+
+  dir_cache_purge (backend, G_VFS_JOB_COPY (job)->destination);
+
+  if (reply_type == SSH_FXP_STATUS)
     {
-      if (handle->raw_handle)
+      if (result_from_status (job, reply, -1, -1))
         {
-          GDataOutputStream *command = new_command_stream (handle->backend, SSH_FXP_CLOSE);
-          put_data_buffer (command, handle->raw_handle);
-          queue_command_stream_and_free (handle->backend, command, NULL, handle->job, NULL);
-          data_buffer_free (handle->raw_handle);
+          /* Nothing left to clean up */
+          g_free (handle->tempname);
+          handle->tempname = NULL;
         }
-      g_clear_object (&handle->output);
-      g_object_unref(handle->backend);
-      g_object_unref(handle->op_job);
-      g_object_unref(handle->dest);
-      g_list_free_full (handle->queued_writes, (GDestroyNotify)pull_request_free);
-      g_slice_free (SftpPullHandle, handle);
     }
-}
-
-static void
-pull_remove_source_reply (GVfsBackendSftp *backend,
-                          int reply_type,
-                          GDataInputStream *reply,
-                          guint32 len,
-                          GVfsJob *job,
-                          gpointer user_data)
-{
-  if (reply_type == SSH_FXP_STATUS)
-    result_from_status (job, reply, -1, -1);
   else
     g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
                       _("Invalid reply received"));
+
+  sftp_copy_handle_free (handle);
 }
 
 static void
-pull_set_perms_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+copy_rename (SftpCopyHandle *handle)
 {
-  SftpPullHandle *handle = user_data;
+  GByteArray *command;
 
-  if (handle->op_job->remove_source)
+  if (handle->dest_exists &&
+      has_extension (handle->backend, SFTP_EXT_OPENSSH_POSIX_RENAME))
     {
-      GDataOutputStream *command = new_command_stream (handle->backend, SSH_FXP_REMOVE);
-      put_string (command, handle->op_job->source);
-      queue_command_stream_and_free (handle->backend,
-                                     command,
-                                     pull_remove_source_reply,
-                                     handle->job,
-                                     NULL);
+      command = new_command (handle->backend, SSH_FXP_EXTENDED);
+      put_string (command, "posix-rename@openssh.com");
     }
   else
-    g_vfs_job_succeeded (handle->job);
-
-  sftp_pull_handle_free (handle);
+    command = new_command (handle->backend, SSH_FXP_RENAME);
+  put_string (command, handle->tempname);
+  put_string (command, handle->op_job->destination);
+  queue_command_and_free (handle->backend, command, copy_rename_reply, handle->job, handle);
 }
 
 static void
-pull_close_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+copy_remove_dest_reply (GVfsBackendSftp *backend,
+                        int reply_type,
+                        SftpReply *reply,
+                        guint32 len,
+                        GVfsJob *job,
+                        gpointer user_data)
 {
-  SftpPullHandle *handle = user_data;
-  GError *error = NULL;
+  SftpCopyHandle *handle = user_data;
 
-  if (g_output_stream_close_finish(handle->output, res, &error))
+  if (reply_type == SSH_FXP_STATUS)
     {
-      g_vfs_job_progress_callback (handle->n_written, handle->n_written, handle->job);
-
-      if (handle->size >= 0 && !(handle->op_job->flags & G_FILE_COPY_TARGET_DEFAULT_PERMS))
+      if (failure_from_status (job, reply, -1, SSH_FX_NO_SUCH_FILE))
         {
-          GFileInfo *info = g_file_info_new ();
-          g_file_info_set_attribute_uint32 (info,
-                                            G_FILE_ATTRIBUTE_UNIX_MODE,
-                                            handle->mode);
-          g_file_set_attributes_async (handle->dest,
-                                       info,
-                                       G_FILE_QUERY_INFO_NONE,
-                                       G_PRIORITY_DEFAULT,
-                                       NULL,
-                                       pull_set_perms_cb, handle);
-          g_object_unref (info);
+          copy_rename (handle);
           return;
         }
-
-      if (handle->op_job->remove_source)
-        {
-          GDataOutputStream *command = new_command_stream (handle->backend, SSH_FXP_REMOVE);
-          put_string (command, handle->op_job->source);
-          queue_command_stream_and_free (handle->backend,
-                                         command,
-                                         pull_remove_source_reply,
-                                         handle->job,
-                                         NULL);
-        }
-      else
-        g_vfs_job_succeeded (handle->job);
     }
   else
-    {
-      g_vfs_job_failed_from_error (handle->job, error);
-      g_error_free (error);
-    }
-
-  sftp_pull_handle_free (handle);
-}
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
 
-static void
-pull_try_finish (SftpPullHandle *handle)
-{
-  if (handle->max_req == 0 && /* received EOF */
-      handle->size != PULL_SIZE_INCOMPLETE && /* fstat complete */
-      !g_output_stream_has_pending (handle->output) && /* no writes outstanding */
-      handle->num_req == 0) /* no reads oustanding */
-    {
-      g_output_stream_close_async (handle->output,
-                                   G_PRIORITY_DEFAULT,
-                                   NULL,
-                                   pull_close_cb, handle);
-    }
+  sftp_copy_handle_free (handle);
 }
 
 static void
-pull_write_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+copy_close_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  SftpReply *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
 {
-  PullRequest *request = user_data;
-  SftpPullHandle *handle = request->handle;
-  GError *error = NULL;
-  gssize n_written;
-
-  n_written = g_output_stream_write_finish (handle->output, res, &error);
-  if (n_written == -1)
-    {
-      g_vfs_job_failed_from_error (handle->job, error);
-      g_error_free (error);
-      pull_request_free (request);
-      sftp_pull_handle_free (handle);
-      return;
-    }
-
-  handle->n_written += n_written;
-  request->write_offset += n_written;
+  SftpCopyHandle *handle = user_data;
+  GByteArray *command;
 
-  /* If we didn't write everything, do another write */
-  if (request->write_offset < request->response_len)
+  if (reply_type == SSH_FXP_STATUS)
     {
-      g_output_stream_write_async (handle->output,
-                                   request->buffer + request->write_offset,
-                                   request->response_len - request->write_offset,
-                                   G_PRIORITY_DEFAULT,
-                                   NULL,
-                                   pull_write_cb, request);
-      return;
+      if (failure_from_status (job, reply, -1, -1))
+        {
+          if (!handle->dest_exists ||
+              has_extension (backend, SFTP_EXT_OPENSSH_POSIX_RENAME))
+            copy_rename (handle);
+          else
+            {
+              /* A plain rename doesn't replace an existing file */
+              command = new_command (backend, SSH_FXP_REMOVE);
+              put_string (command, handle->op_job->destination);
+              queue_command_and_free (backend, command, copy_remove_dest_reply, job, handle);
+            }
+          return;
+        }
     }
-
-  if (handle->size >= 0)
-    g_vfs_job_progress_callback (handle->n_written, handle->size, handle->job);
-
-  pull_try_start_write (handle);
-
-  /* If we read short, issue another request for the remaining data. */
-  if (request->response_len < request->request_len)
-    pull_enqueue_request (handle,
-                          request->request_offset + request->response_len,
-                          request->request_len - request->response_len);
-  else if (handle->max_req == 0)
-    pull_try_finish (handle);
   else
-    {
-      /* Once we have requested past the estimated EOF, request one at a
-       * time.  Otherwise try increase the number of concurrent requests. */
-      if (handle->offset > handle->size)
-        handle->max_req = 1;
-      else if (handle->max_req < PULL_MAX_REQUESTS)
-        handle->max_req++;
-
-      while (handle->num_req < handle->max_req)
-        pull_enqueue_next_request (handle);
-    }
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
 
-  pull_request_free (request);
+  sftp_copy_handle_free (handle);
 }
 
 static void
-pull_try_start_write (SftpPullHandle *handle)
+copy_close_dest (SftpCopyHandle *handle)
 {
-  GError *error = NULL;
-  PullRequest *request;
+  GByteArray *command;
 
-  if (g_output_stream_has_pending (handle->output))
-    return;
+  command = new_command (handle->backend, SSH_FXP_CLOSE);
+  put_data_buffer (command, handle->dest_handle);
+  queue_command_and_free (handle->backend, command, copy_close_reply, handle->job, handle);
 
-  if (!handle->queued_writes)
-    return;
+  data_buffer_free (handle->dest_handle);
+  handle->dest_handle = NULL;
+}
 
-  request = handle->queued_writes->data;
-  handle->queued_writes = g_list_delete_link (handle->queued_writes, handle->queued_writes);
+static void
+copy_set_times_reply (GVfsBackendSftp *backend,
+                      int reply_type,
+                      SftpReply *reply,
+                      guint32 len,
+                      GVfsJob *job,
+                      gpointer user_data)
+{
+  SftpCopyHandle *handle = user_data;
 
-  if (!g_seekable_seek (G_SEEKABLE (handle->output),
-                        request->request_offset, G_SEEK_SET,
-                        NULL, &error))
+  if (reply_type == SSH_FXP_STATUS)
     {
-      g_vfs_job_failed_from_error (handle->job, error);
-      g_error_free (error);
-      pull_request_free (request);
-      sftp_pull_handle_free (handle);
-      return;
+      if (failure_from_status (job, reply, -1, -1))
+        {
+          copy_close_dest (handle);
+          return;
+        }
     }
+  else
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
 
-  g_output_stream_write_async (handle->output,
-                               request->buffer, request->response_len,
-                               G_PRIORITY_DEFAULT,
-                               NULL,
-                               pull_write_cb, request);
+  sftp_copy_handle_free (handle);
 }
 
+static void copy_next_chunk (SftpCopyHandle *handle);
+
 static void
-pull_read_reply (GVfsBackendSftp *backend,
+copy_data_reply (GVfsBackendSftp *backend,
                  int reply_type,
-                 GDataInputStream *reply,
+                 SftpReply *reply,
                  guint32 len,
                  GVfsJob *job,
                  gpointer user_data)
 {
-  PullRequest *request = user_data;
-  SftpPullHandle *handle = request->handle;
-
-  handle->num_req--;
+  SftpCopyHandle *handle = user_data;
 
-  if (g_vfs_job_is_finished (job) || g_vfs_job_is_cancelled (job))
-    {
-    }
-  else if (reply_type == SSH_FXP_STATUS)
+  if (reply_type == SSH_FXP_STATUS)
     {
-      guint32 code = read_status_code (reply);
-      if (code == SSH_FX_EOF)
+      if (failure_from_status (job, reply, -1, -1))
         {
-          pull_request_free (request);
-          handle->max_req = 0;
-          pull_try_finish (handle);
+          handle->offset += handle->chunk;
+          g_vfs_job_progress_callback (handle->offset, handle->size, job);
+          copy_next_chunk (handle);
           return;
         }
-      else
-        result_from_status_code (job, code, -1, -1);
-    }
-  else if (reply_type != SSH_FXP_DATA)
-    {
-      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                        _("Invalid reply received"));
     }
   else
-    {
-      request->response_len = g_data_input_stream_read_uint32 (reply, NULL, NULL);
-      request->buffer = g_slice_alloc (request->response_len);
-
-      if (g_input_stream_read_all (G_INPUT_STREAM (reply),
-                                   request->buffer, request->response_len,
-                                   NULL, NULL, NULL))
-        {
-          handle->queued_writes = g_list_append (handle->queued_writes, request);
-          pull_try_start_write (handle);
-          return;
-        }
-      else
-        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                          _("Invalid reply received"));
-    }
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
 
-  pull_request_free (request);
-  sftp_pull_handle_free (handle);
+  sftp_copy_handle_free (handle);
 }
 
 static void
-pull_enqueue_request (SftpPullHandle *handle, guint64 offset, guint32 len)
+copy_next_chunk (SftpCopyHandle *handle)
 {
-  PullRequest *request;
-  GDataOutputStream *command;
+  GByteArray *command;
 
-  request = g_slice_new0 (PullRequest);
-  request->handle = handle;
-  request->request_len = len;
-  request->request_offset = offset;
+  if (g_vfs_job_is_cancelled (handle->job))
+    {
+      g_vfs_job_failed (handle->job, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                        _("Operation was cancelled"));
+      sftp_copy_handle_free (handle);
+      return;
+    }
 
-  command = new_command_stream (handle->backend, SSH_FXP_READ);
-  put_data_buffer (command, handle->raw_handle);
-  g_data_output_stream_put_uint64 (command, offset, NULL, NULL);
-  g_data_output_stream_put_uint32 (command, len, NULL, NULL);
-  queue_command_stream_and_free (handle->backend, command, pull_read_reply, handle->job, request);
+  if (handle->offset >= handle->size)
+    {
+      if (handle->has_times && (handle->op_job->flags & G_FILE_COPY_ALL_METADATA))
+        {
+          command = new_command (handle->backend, SSH_FXP_FSETSTAT);
+          put_data_buffer (command, handle->dest_handle);
+          put_uint32 (command, SSH_FILEXFER_ATTR_ACMODTIME);
+          put_uint32 (command, handle->atime);
+          put_uint32 (command, handle->mtime);
+          queue_command_and_free (handle->backend, command, copy_set_times_reply, handle->job, handle);
+        }
+      else
+        copy_close_dest (handle);
+      return;
+    }
 
-  handle->num_req++;
-}
+  handle->chunk = MIN (handle->size - handle->offset, COPY_CHUNK_SIZE);
 
-static void
-pull_enqueue_next_request (SftpPullHandle *handle)
-{
-  pull_enqueue_request (handle, handle->offset, PULL_BLOCKSIZE);
-  handle->offset += PULL_BLOCKSIZE;
+  command = new_command (handle->backend, SSH_FXP_EXTENDED);
+  put_string (command, "copy-data");
+  put_data_buffer (command, handle->src_handle);
+  put_uint64 (command, handle->offset);
+  put_uint64 (command, handle->chunk);
+  put_data_buffer (command, handle->dest_handle);
+  put_uint64 (command, handle->offset);
+  queue_command_and_free (handle->backend, command, copy_data_reply, handle->job, handle);
 }
 
+static void copy_create_temp (SftpCopyHandle *handle);
+
 static void
-pull_fstat_reply (GVfsBackendSftp *backend,
-                  int reply_type,
-                  GDataInputStream *reply,
-                  guint32 len,
-                  GVfsJob *job,
-                  gpointer user_data)
+copy_create_temp_reply (GVfsBackendSftp *backend,
+                        int reply_type,
+                        SftpReply *reply,
+                        guint32 len,
+                        GVfsJob *job,
+                        gpointer user_data)
 {
-  SftpPullHandle *handle = user_data;
+  SftpCopyHandle *handle = user_data;
+  guint32 code;
 
-  if (g_vfs_job_is_finished (job) || g_vfs_job_is_cancelled (job))
+  dir_cache_purge (backend, G_VFS_JOB_COPY (job)->destination);
+
+  if (reply_type == SSH_FXP_HANDLE)
     {
-      handle->size = PULL_SIZE_INVALID;
-      sftp_pull_handle_free (handle);
+      handle->dest_handle = read_data_buffer (reply);
+      g_vfs_job_progress_callback (0, handle->size, job);
+      copy_next_chunk (handle);
       return;
     }
 
-  if (reply_type == SSH_FXP_ATTRS)
+  /* The temp file wasn't created, so it must not be removed */
+  g_free (handle->tempname);
+  handle->tempname = NULL;
+
+  if (reply_type == SSH_FXP_STATUS)
     {
-      GFileInfo *info = g_file_info_new ();
-      parse_attributes (backend, info, NULL, reply, NULL);
-      handle->size = g_file_info_get_size (info);
-      handle->mode = g_file_info_get_attribute_uint32 (info,
-                                                       G_FILE_ATTRIBUTE_UNIX_MODE);
-      g_object_unref (info);
+      code = read_status_code (reply);
+      if (code == SSH_FX_FAILURE)
+        {
+          /* Most likely the name is taken */
+          copy_create_temp (handle);
+          return;
+        }
+      result_from_status_code (job, code, -1, -1);
     }
   else
-    handle->size = PULL_SIZE_INVALID;
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
 
-  pull_try_finish (handle);
+  sftp_copy_handle_free (handle);
 }
 
 static void
-pull_dest_open_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+copy_create_temp (SftpCopyHandle *handle)
 {
-  SftpPullHandle *handle = user_data;
-  GError *error = NULL;
+  GByteArray *command;
+  char *dirname;
+  char basename[] = ".giosaveXXXXXX";
 
-  if (handle->op_job->flags & G_FILE_COPY_OVERWRITE)
-    handle->output = G_OUTPUT_STREAM (g_file_replace_finish (handle->dest,
-                                                             res,
-                                                             &error));
-  else
-    handle->output = G_OUTPUT_STREAM (g_file_create_finish (handle->dest,
-                                                            res,
-                                                            &error));
-  if (handle->output)
-    {
-      /* Do an fstat() to find out the size and mode of the file. */
-      GDataOutputStream *command = new_command_stream (handle->backend,
-                                                       SSH_FXP_FSTAT);
-      put_data_buffer (command, handle->raw_handle);
-      queue_command_stream_and_free (handle->backend,
-                                     command,
-                                     pull_fstat_reply,
-                                     handle->job,
-                                     handle);
-      handle->size = PULL_SIZE_INCOMPLETE;
+  handle->temp_count++;
 
-      while (handle->num_req < handle->max_req)
-        pull_enqueue_next_request (handle);
+  if (handle->temp_count == 100)
+    {
+      g_vfs_job_failed (handle->job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        _("Unable to create temporary file"));
+      sftp_copy_handle_free (handle);
+      return;
     }
+
+  dirname = g_path_get_dirname (handle->op_job->destination);
+  random_text (basename + 8);
+  handle->tempname = g_build_filename (dirname, basename, NULL);
+  g_free (dirname);
+
+  command = new_command (handle->backend, SSH_FXP_OPEN);
+  put_string (command, handle->tempname);
+  put_uint32 (command, SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL);
+  if (handle->op_job->flags & G_FILE_COPY_TARGET_DEFAULT_PERMS)
+    put_uint32 (command, 0);
   else
     {
-      g_vfs_job_failed_from_error (handle->job, error);
-      g_error_free (error);
-      sftp_pull_handle_free (handle);
+      put_uint32 (command, SSH_FILEXFER_ATTR_PERMISSIONS);
+      put_uint32 (command, handle->permissions);
     }
+  queue_command_and_free (handle->backend, command, copy_create_temp_reply, handle->job, handle);
 }
 
 static void
-pull_open_reply (GVfsBackendSftp *backend,
+copy_open_reply (GVfsBackendSftp *backend,
                  MultiReply *replies,
                  int n_replies,
                  GVfsJob *job,
                  gpointer user_data)
 {
-  SftpPullHandle *handle = user_data;
+  SftpCopyHandle *handle = user_data;
+  GFileInfo *info;
+  GFileType type;
 
-  if (replies[0].type == SSH_FXP_ATTRS)
+  /* If we got a file handle, store it. It will be closed when the
+   * SftpCopyHandle is freed. */
+  if (replies[1].type == SSH_FXP_HANDLE)
+    handle->src_handle = read_data_buffer (replies[1].data);
+
+  if (replies[0].type == SSH_FXP_STATUS)
     {
-      GFileType type;
-      GFileInfo *info = g_file_info_new ();
+      result_from_status (job, replies[0].data, -1, -1);
+      sftp_copy_handle_free (handle);
+      return;
+    }
+  else if (replies[0].type != SSH_FXP_ATTRS)
+    {
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        _("Invalid reply received"));
+      sftp_copy_handle_free (handle);
+      return;
+    }
 
-      parse_attributes (backend, info, NULL, replies[0].data, NULL);
+  info = g_file_info_new ();
+  parse_attributes (backend, info, NULL, replies[0].data, NULL);
+  type = g_file_info_get_file_type (info);
+  handle->size = g_file_info_get_size (info);
+  handle->permissions = g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_MODE) & 07777;
+  if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_TIME_MODIFIED))
+    {
+      handle->has_times = TRUE;
+      handle->atime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_ACCESS);
+      handle->mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+    }
+  g_object_unref (info);
+
+  if (type != G_FILE_TYPE_REGULAR)
+    {
+      /* Fall back to the default implementation for everything else */
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        _("Not supported"));
+      sftp_copy_handle_free (handle);
+      return;
+    }
+
+  if (replies[1].type == SSH_FXP_STATUS)
+    {
+      result_from_status (job, replies[1].data, -1, -1);
+      sftp_copy_handle_free (handle);
+      return;
+    }
+  else if (replies[1].type != SSH_FXP_HANDLE)
+    {
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        _("Invalid reply received"));
+      sftp_copy_handle_free (handle);
+      return;
+    }
+
+  if (replies[2].type == SSH_FXP_ATTRS)
+    {
+      handle->dest_exists = TRUE;
+
+      info = g_file_info_new ();
+      parse_attributes (backend, info, NULL, replies[2].data, NULL);
       type = g_file_info_get_file_type (info);
       g_object_unref (info);
 
-      if (type != G_FILE_TYPE_REGULAR)
+      if (type == G_FILE_TYPE_DIRECTORY)
         {
-          /* Fall back to default implementation to copy non-regular files */
-          g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
-                            _("Not supported"));
+          g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_IS_DIRECTORY,
+                            _("Can't copy file over directory"));
+          sftp_copy_handle_free (handle);
+          return;
         }
-      else if (replies[1].type == SSH_FXP_STATUS)
-        result_from_status (job, replies[1].data, -1, -1);
-      else if (replies[1].type != SSH_FXP_HANDLE)
-        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                          _("Invalid reply received"));
-      else
+      else if (!(handle->op_job->flags & G_FILE_COPY_OVERWRITE))
         {
-          /* We got a valid file handle. */
-          handle->raw_handle = read_data_buffer (replies[1].data);
-
-          if (handle->op_job->flags & G_FILE_COPY_OVERWRITE)
-            g_file_replace_async (handle->dest,
-                                  NULL,
-                                  handle->op_job->flags & G_FILE_COPY_BACKUP ? TRUE : FALSE,
-                                  G_FILE_CREATE_REPLACE_DESTINATION,
-                                  G_PRIORITY_DEFAULT,
-                                  NULL,
-                                  pull_dest_open_cb, handle);
-          else
-            g_file_create_async (handle->dest,
-                                 G_FILE_CREATE_NONE,
-                                 G_PRIORITY_DEFAULT,
-                                 NULL,
-                                 pull_dest_open_cb, handle);
+          g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                            _("Target file already exists"));
+          sftp_copy_handle_free (handle);
           return;
         }
     }
-  else if (replies[0].type == SSH_FXP_STATUS)
-    result_from_status (job, replies[0].data, -1, -1);
-  else
-    g_vfs_job_failed (job,
-                      G_IO_ERROR, G_IO_ERROR_FAILED,
-                      "%s", _("Invalid reply received"));
-
-  /* If we got a file handle, store it.  It will be closed when the
-   * SftpPushHandle is freed. */
-  if (replies[1].type == SSH_FXP_HANDLE && !handle->raw_handle)
-    handle->raw_handle = read_data_buffer (replies[1].data);
 
-  sftp_pull_handle_free (handle);
+  copy_create_temp (handle);
 }
 
 static gboolean
-try_pull (GVfsBackend *backend,
-          GVfsJobPull *job,
+try_copy (GVfsBackend *backend,
+          GVfsJobCopy *job,
           const char *source,
-          const char *local_path,
+          const char *destination,
           GFileCopyFlags flags,
-          gboolean remove_source,
           GFileProgressCallback progress_callback,
           gpointer progress_callback_data)
 {
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  SftpPullHandle *handle;
-  GDataOutputStream *commands[2];
+  SftpCopyHandle *handle;
+  GByteArray *commands[3];
 
-  handle = g_slice_new0 (SftpPullHandle);
+  if (!has_extension (op_backend, SFTP_EXT_COPY_DATA) ||
+      (flags & G_FILE_COPY_BACKUP))
+    {
+      g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        _("Not supported"));
+      return TRUE;
+    }
+
+  handle = g_slice_new0 (SftpCopyHandle);
   handle->backend = g_object_ref (op_backend);
-  handle->op_job = g_object_ref (job);
-  handle->job = G_VFS_JOB (job);
-  handle->dest = g_file_new_for_path (local_path);
-  handle->size = PULL_SIZE_INVALID;
-  handle->max_req = 1;
+  handle->job = g_object_ref (G_VFS_JOB (job));
+  handle->op_job = job;
 
-  commands[0] = new_command_stream (op_backend,
-                                    flags & G_FILE_COPY_NOFOLLOW_SYMLINKS ? SSH_FXP_LSTAT : SSH_FXP_STAT);
+  commands[0] = new_command (op_backend,
+                             flags & G_FILE_COPY_NOFOLLOW_SYMLINKS ? SSH_FXP_LSTAT : SSH_FXP_STAT);
   put_string (commands[0], source);
 
-  commands[1] = new_command_stream (op_backend, SSH_FXP_OPEN);
+  commands[1] = new_command (op_backend, SSH_FXP_OPEN);
   put_string (commands[1], source);
-  g_data_output_stream_put_uint32 (commands[1], SSH_FXF_READ, NULL, NULL);
-  g_data_output_stream_put_uint32 (commands[1], 0, NULL, NULL);
+  put_uint32 (commands[1], SSH_FXF_READ);
+  put_uint32 (commands[1], 0);
+
+  commands[2] = new_command (op_backend, SSH_FXP_LSTAT);
+  put_string (commands[2], destination);
 
-  queue_command_streams_and_free (op_backend,
-                                  commands, 2,
-                                  pull_open_reply,
-                                  G_VFS_JOB(job),
-                                  handle);
+  queue_commands_and_free (op_backend,
+                           commands, 3,
+                           copy_open_reply,
+                           G_VFS_JOB (job),
+                           handle);
 
   return TRUE;
 }
@@ -6094,7 +9342,7 @@ g_vfs_backend_sftp_class_init (GVfsBackendSftpClass *klass)
   GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
   GVfsBackendClass *backend_class = G_VFS_BACKEND_CLASS (klass);
 
-  id_q = g_quark_from_static_string ("command-id");
+  connection_q = g_quark_from_static_string ("sftp-connection");
   
   gobject_class->finalize = g_vfs_backend_sftp_finalize;
 
@@ -6126,4 +9374,5 @@ g_vfs_backend_sftp_class_init (GVfsBackendSftpClass *klass)
   backend_class->try_set_attribute = try_set_attribute;
   backend_class->try_push = try_push;
   backend_class->try_pull = try_pull;
+  backend_class->try_copy = try_copy;
 }
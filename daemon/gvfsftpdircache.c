@@ -21,6 +21,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 
 #include <config.h>
@@ -131,10 +132,9 @@ g_vfs_ftp_dir_cache_free (GVfsFtpDirCache *cache)
 }
 
 static GVfsFtpDirCacheEntry *
-g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
-                                  GVfsFtpTask *      task,
-                                  const GVfsFtpFile *dir,
-                                  guint              stamp)
+g_vfs_ftp_dir_cache_lookup_cached_entry (GVfsFtpDirCache *  cache,
+                                         const GVfsFtpFile *dir,
+                                         guint              stamp)
 {
   GVfsFtpDirCacheEntry *entry;
 
@@ -144,8 +144,24 @@ g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
     g_vfs_ftp_dir_cache_entry_ref (entry);
   g_mutex_unlock (&cache->lock);
   if (entry && entry->stamp < stamp)
-    g_vfs_ftp_dir_cache_entry_unref (entry);
-  else if (entry)
+    {
+      g_vfs_ftp_dir_cache_entry_unref (entry);
+      return NULL;
+    }
+
+  return entry;
+}
+
+static GVfsFtpDirCacheEntry *
+g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
+                                  GVfsFtpTask *      task,
+                                  const GVfsFtpFile *dir,
+                                  guint              stamp)
+{
+  GVfsFtpDirCacheEntry *entry;
+
+  entry = g_vfs_ftp_dir_cache_lookup_cached_entry (cache, dir, stamp);
+  if (entry)
     return entry;
 
   if (g_vfs_ftp_task_send (task,
@@ -202,7 +218,20 @@ g_vfs_ftp_dir_cache_lookup_file_internal (GVfsFtpDirCache *  cache,
   if (!g_vfs_ftp_file_is_root (file))
     {
       dir = g_vfs_ftp_file_new_parent (file);
-      entry = g_vfs_ftp_dir_cache_lookup_entry (cache, task, dir, stamp);
+      entry = g_vfs_ftp_dir_cache_lookup_cached_entry (cache, dir, stamp);
+      /* don't list a whole directory just to look at one file */
+      if (entry == NULL && cache->funcs->lookup_file)
+        {
+          info = cache->funcs->lookup_file (task, file);
+          if (info != NULL || !g_vfs_ftp_task_is_in_error (task))
+            {
+              g_vfs_ftp_file_free (dir);
+              return info;
+            }
+          g_vfs_ftp_task_clear_error (task);
+        }
+      if (entry == NULL)
+        entry = g_vfs_ftp_dir_cache_lookup_entry (cache, task, dir, stamp);
       g_vfs_ftp_file_free (dir);
       if (entry == NULL)
         return NULL;
@@ -256,12 +285,32 @@ g_vfs_ftp_dir_cache_resolve_symlink (GVfsFtpDirCache *  cache,
       target = g_file_info_get_symlink_target (info);
       if (target == NULL)
         {
-          /* This happens when bad servers don't report a symlink target.
-           * We now want to figure out if this is a directory or regular file,
-           * so we can at least report something useful.
+          /* This happens when bad servers don't report a symlink target,
+           * and with "type=OS.unix=symlink" in MLSD listings. Servers that
+           * follow links in MLST tell what the link points to, otherwise
+           * we want to figure out if this is a directory or regular file,
+           * so we can at least report something useful. If none of that
+           * works, the link can't be resolved and is reported as is.
            */
           g_object_unref (info);
-          info = cache->funcs->lookup_uncached (task, file);
+          info = NULL;
+          if (cache->funcs->lookup_file)
+            {
+              info = cache->funcs->lookup_file (task, link);
+              if (info != NULL && g_file_info_get_is_symlink (info))
+                g_clear_object (&info);
+              g_vfs_ftp_task_clear_error (task);
+            }
+          if (info == NULL)
+            {
+              info = cache->funcs->lookup_uncached (task, link);
+              g_vfs_ftp_task_clear_error (task);
+            }
+          if (info == NULL)
+            {
+              g_vfs_ftp_file_free (link);
+              return original;
+            }
           break;
         }
       tmp = link;
@@ -809,10 +858,366 @@ g_vfs_ftp_dir_cache_funcs_process_default (GInputStream *        stream,
   return g_vfs_ftp_dir_cache_funcs_process (stream, debug_id, dir, entry, FALSE, cancellable, error);
 }
 
+/* Parses the time format of RFC 3659, YYYYMMDDHHMMSS[.sss] in UTC */
+static gboolean
+g_vfs_ftp_parse_time_val (const char *value,
+                          GTimeVal   *tv)
+{
+  int year, month, day, hour, minute, second;
+  GDateTime *date;
+  glong usec, scale;
+
+  if (strlen (value) < 14 ||
+      sscanf (value, "%4d%2d%2d%2d%2d%2d", &year, &month, &day, &hour, &minute, &second) != 6)
+    return FALSE;
+
+  date = g_date_time_new_utc (year, month, day, hour, minute, second);
+  if (date == NULL)
+    return FALSE;
+
+  tv->tv_sec = g_date_time_to_unix (date);
+  g_date_time_unref (date);
+
+  usec = 0;
+  if (value[14] == '.')
+    {
+      value += 15;
+      for (scale = G_USEC_PER_SEC / 10; scale > 0 && g_ascii_isdigit (*value); scale /= 10)
+        usec += (*value++ - '0') * scale;
+    }
+  tv->tv_usec = usec;
+
+  return TRUE;
+}
+
+static void
+g_vfs_ftp_parse_perm (GFileInfo  *info,
+                      const char *perm,
+                      GFileType   file_type)
+{
+  gboolean is_dir = file_type == G_FILE_TYPE_DIRECTORY;
+
+  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ,
+                                     strpbrk (perm, is_dir ? "lL" : "rR") != NULL);
+  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE,
+                                     strpbrk (perm, is_dir ? "cCmM" : "wWaA") != NULL);
+  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_DELETE,
+                                     strpbrk (perm, "dD") != NULL);
+  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_RENAME,
+                                     strpbrk (perm, "fF") != NULL);
+  if (is_dir)
+    g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE,
+                                       strpbrk (perm, "eE") != NULL);
+}
+
+/* Parses the facts of a MLSD or MLST line as described in RFC 3659,
+ * section 7. If @skip_dirs is set, %NULL is returned for the entries of
+ * the listed directory itself and its parent.
+ */
+static GFileInfo *
+g_vfs_ftp_parse_facts (const char *       facts,
+                       const GVfsFtpFile *file,
+                       gboolean           is_unix,
+                       gboolean           skip_dirs)
+{
+  GFileType file_type = G_FILE_TYPE_UNKNOWN;
+  const char *link = NULL, *perm = NULL;
+  const char *owner = NULL, *group = NULL;
+  const char *owner_name = NULL, *group_name = NULL;
+  gboolean has_mode = FALSE, has_size = FALSE, has_time = FALSE;
+  GTimeVal tv = { 0, 0 };
+  guint64 size = 0;
+  guint32 mode = 0;
+  GFileInfo *info;
+  char **split, *name, *value, *s;
+  guint i;
+
+  split = g_strsplit (facts, ";", -1);
+  for (i = 0; split[i]; i++)
+    {
+      name = split[i];
+      value = strchr (name, '=');
+      if (value == NULL)
+        continue;
+      *value++ = '\0';
+
+      if (g_ascii_strcasecmp (name, "type") == 0)
+        {
+          if (g_ascii_strcasecmp (value, "file") == 0)
+            file_type = G_FILE_TYPE_REGULAR;
+          else if (g_ascii_strcasecmp (value, "dir") == 0)
+            file_type = G_FILE_TYPE_DIRECTORY;
+          else if (g_ascii_strcasecmp (value, "cdir") == 0 ||
+                   g_ascii_strcasecmp (value, "pdir") == 0)
+            {
+              if (skip_dirs)
+                {
+                  g_strfreev (split);
+                  return NULL;
+                }
+              file_type = G_FILE_TYPE_DIRECTORY;
+            }
+          else if (g_ascii_strncasecmp (value, "OS.unix=slink", 13) == 0)
+            {
+              /* "OS.unix=slink:target" as used by vsftpd and pure-ftpd */
+              file_type = G_FILE_TYPE_SYMBOLIC_LINK;
+              if (value[13] == ':' && value[14] != '\0')
+                link = value + 14;
+            }
+          else if (g_ascii_strcasecmp (value, "OS.unix=symlink") == 0)
+            {
+              /* no target, resolving looks the link itself up instead */
+              file_type = G_FILE_TYPE_SYMBOLIC_LINK;
+            }
+          else
+            file_type = G_FILE_TYPE_SPECIAL;
+        }
+      else if (g_ascii_strcasecmp (name, "size") == 0)
+        {
+          size = g_ascii_strtoull (value, NULL, 10);
+          has_size = TRUE;
+        }
+      else if (g_ascii_strcasecmp (name, "modify") == 0)
+        has_time = g_vfs_ftp_parse_time_val (value, &tv);
+      else if (g_ascii_strcasecmp (name, "perm") == 0)
+        perm = value;
+      else if (g_ascii_strcasecmp (name, "UNIX.mode") == 0)
+        {
+          mode = g_ascii_strtoull (value, NULL, 8) & 07777;
+          has_mode = TRUE;
+        }
+      else if (g_ascii_strcasecmp (name, "UNIX.owner") == 0)
+        owner = value;
+      else if (g_ascii_strcasecmp (name, "UNIX.group") == 0)
+        group = value;
+      else if (g_ascii_strcasecmp (name, "UNIX.ownername") == 0)
+        owner_name = value;
+      else if (g_ascii_strcasecmp (name, "UNIX.groupname") == 0)
+        group_name = value;
+    }
+
+  if (file_type == G_FILE_TYPE_UNKNOWN)
+    file_type = G_FILE_TYPE_REGULAR;
+
+  info = g_file_info_new ();
+
+  s = g_path_get_basename (g_vfs_ftp_file_get_gvfs_path (file));
+  g_file_info_set_name (info, s);
+  if (is_unix)
+    g_file_info_set_is_hidden (info, s[0] == '.');
+  g_free (s);
+
+  if (file_type == G_FILE_TYPE_SYMBOLIC_LINK)
+    {
+      g_file_info_set_is_symlink (info, TRUE);
+      if (link)
+        g_file_info_set_symlink_target (info, link);
+    }
+
+  if (has_size)
+    g_file_info_set_size (info, size);
+
+  if (has_mode)
+    {
+      switch (file_type)
+        {
+        case G_FILE_TYPE_REGULAR: mode |= S_IFREG; break;
+        case G_FILE_TYPE_DIRECTORY: mode |= S_IFDIR; break;
+        case G_FILE_TYPE_SYMBOLIC_LINK: mode |= S_IFLNK; break;
+        default: break;
+        }
+      g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_MODE, mode);
+    }
+
+  if (owner_name || owner)
+    g_file_info_set_attribute_string (info, G_FILE_ATTRIBUTE_OWNER_USER,
+                                      owner_name ? owner_name : owner);
+  if (group_name || group)
+    g_file_info_set_attribute_string (info, G_FILE_ATTRIBUTE_OWNER_GROUP,
+                                      group_name ? group_name : group);
+
+  gvfs_file_info_populate_default (info,
+                                   g_vfs_ftp_file_get_gvfs_path (file),
+                                   file_type);
+
+  if (perm)
+    g_vfs_ftp_parse_perm (info, perm, file_type);
+
+  if (has_time)
+    {
+      char *etag = g_strdup_printf ("%ld", tv.tv_sec);
+      g_file_info_set_attribute_string (info,
+                                        G_FILE_ATTRIBUTE_ETAG_VALUE,
+                                        etag);
+      g_free (etag);
+
+      g_file_info_set_modification_time (info, &tv);
+    }
+
+  g_strfreev (split);
+
+  return info;
+}
+
+static gboolean
+g_vfs_ftp_dir_cache_funcs_process_mlsd (GInputStream *        stream,
+                                        int                   debug_id,
+                                        const GVfsFtpFile *   dir,
+                                        GVfsFtpDirCacheEntry *entry,
+                                        gboolean              is_unix,
+                                        GCancellable *        cancellable,
+                                        GError **             error)
+{
+  GDataInputStream *data;
+  GFileInfo *info;
+  GVfsFtpFile *file;
+  char *line, *name;
+  gsize length;
+
+  /* protect against code reorg - in current code, error never is NULL */
+  g_assert (error != NULL);
+  g_assert (*error == NULL);
+
+  data = g_data_input_stream_new (stream);
+  g_data_input_stream_set_newline_type (data, G_DATA_STREAM_NEWLINE_TYPE_LF);
+  while ((line = g_data_input_stream_read_line (data, &length, cancellable, error)))
+    {
+      if (length > 0 && line[length - 1] == '\r')
+        line[--length] = '\0';
+
+      g_debug ("<<%2d <<  %s\n", debug_id, line);
+
+      /* the facts are separated from the name by a single space */
+      name = strchr (line, ' ');
+      if (name == NULL)
+        {
+          g_free (line);
+          continue;
+        }
+      *name++ = '\0';
+
+      if (name[0] == '\0' ||
+          strcmp (name, ".") == 0 ||
+          strcmp (name, "..") == 0)
+        {
+          g_free (line);
+          continue;
+        }
+
+      file = g_vfs_ftp_file_new_child (dir, name, NULL);
+      if (file == NULL)
+        {
+          g_debug ("# invalid filename, skipping");
+          g_free (line);
+          continue;
+        }
+
+      info = g_vfs_ftp_parse_facts (line, file, is_unix, TRUE);
+      if (info)
+        g_vfs_ftp_dir_cache_entry_add (entry, file, info);
+      else
+        g_vfs_ftp_file_free (file);
+      g_free (line);
+    }
+
+  g_object_unref (data);
+  return *error != NULL;
+}
+
+static GFileInfo *
+g_vfs_ftp_dir_cache_funcs_lookup_mlst (GVfsFtpTask *      task,
+                                       const GVfsFtpFile *file,
+                                       gboolean           is_unix)
+{
+  GFileInfo *info = NULL;
+  guint i, response;
+  char **reply;
+
+  if (g_vfs_ftp_file_is_root (file))
+    return create_root_file_info (task->backend);
+
+  response = g_vfs_ftp_task_send_and_check (task, G_VFS_FTP_PASS_500, NULL, NULL, &reply,
+                                            "MLST %s", g_vfs_ftp_file_get_ftp_path (file));
+  if (response == 0)
+    return NULL;
+
+  if (response == 550)
+    {
+      /* the file does not exist */
+      g_strfreev (reply);
+      return NULL;
+    }
+  else if (G_VFS_FTP_RESPONSE_GROUP (response) != 2)
+    {
+      g_vfs_ftp_task_set_error_from_response (task, response);
+      g_strfreev (reply);
+      return NULL;
+    }
+
+  /* the facts are on the continuation line, which starts with a space */
+  for (i = 1; reply[i] && info == NULL; i++)
+    {
+      char *name;
+
+      if (reply[i][0] != ' ')
+        continue;
+
+      name = strchr (reply[i] + 1, ' ');
+      if (name)
+        *name = '\0';
+      info = g_vfs_ftp_parse_facts (reply[i] + 1, file, is_unix, FALSE);
+    }
+  g_strfreev (reply);
+
+  if (info == NULL)
+    g_set_error_literal (&task->error,
+                         G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                         _("Invalid reply"));
+
+  return info;
+}
+
+static gboolean
+g_vfs_ftp_dir_cache_funcs_process_mlsd_unix (GInputStream *        stream,
+                                             int                   debug_id,
+                                             const GVfsFtpFile *   dir,
+                                             GVfsFtpDirCacheEntry *entry,
+                                             GCancellable *        cancellable,
+                                             GError **             error)
+{
+  return g_vfs_ftp_dir_cache_funcs_process_mlsd (stream, debug_id, dir, entry, TRUE, cancellable, error);
+}
+
+static gboolean
+g_vfs_ftp_dir_cache_funcs_process_mlsd_default (GInputStream *        stream,
+                                                int                   debug_id,
+                                                const GVfsFtpFile *   dir,
+                                                GVfsFtpDirCacheEntry *entry,
+                                                GCancellable *        cancellable,
+                                                GError **             error)
+{
+  return g_vfs_ftp_dir_cache_funcs_process_mlsd (stream, debug_id, dir, entry, FALSE, cancellable, error);
+}
+
+static GFileInfo *
+g_vfs_ftp_dir_cache_funcs_lookup_mlst_unix (GVfsFtpTask *      task,
+                                            const GVfsFtpFile *file)
+{
+  return g_vfs_ftp_dir_cache_funcs_lookup_mlst (task, file, TRUE);
+}
+
+static GFileInfo *
+g_vfs_ftp_dir_cache_funcs_lookup_mlst_default (GVfsFtpTask *      task,
+                                               const GVfsFtpFile *file)
+{
+  return g_vfs_ftp_dir_cache_funcs_lookup_mlst (task, file, FALSE);
+}
+
 const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_unix = {
   "LIST -a",
   g_vfs_ftp_dir_cache_funcs_process_unix,
   g_vfs_ftp_dir_cache_funcs_lookup_uncached,
+  NULL,
   g_vfs_ftp_dir_cache_funcs_resolve_default
 };
 
@@ -820,5 +1225,22 @@ const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_default = {
   "LIST",
   g_vfs_ftp_dir_cache_funcs_process_default,
   g_vfs_ftp_dir_cache_funcs_lookup_uncached,
+  NULL,
+  g_vfs_ftp_dir_cache_funcs_resolve_default
+};
+
+const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_mlsd_unix = {
+  "MLSD",
+  g_vfs_ftp_dir_cache_funcs_process_mlsd_unix,
+  g_vfs_ftp_dir_cache_funcs_lookup_uncached,
+  g_vfs_ftp_dir_cache_funcs_lookup_mlst_unix,
+  g_vfs_ftp_dir_cache_funcs_resolve_default
+};
+
+const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_mlsd_default = {
+  "MLSD",
+  g_vfs_ftp_dir_cache_funcs_process_mlsd_default,
+  g_vfs_ftp_dir_cache_funcs_lookup_uncached,
+  g_vfs_ftp_dir_cache_funcs_lookup_mlst_default,
   g_vfs_ftp_dir_cache_funcs_resolve_default
 };
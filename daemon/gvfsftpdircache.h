@@ -43,6 +43,11 @@ struct _GVfsFtpDirFuncs {
                                                                  GError **              error);
   GFileInfo *           (* lookup_uncached)                     (GVfsFtpTask *          task,
                                                                  const GVfsFtpFile *    file);
+  /* optional, queries a single file without listing its directory. Returns
+   * %NULL without an error if the file does not exist and %NULL with an
+   * error if the directory listing should be used instead */
+  GFileInfo *           (* lookup_file)                         (GVfsFtpTask *          task,
+                                                                 const GVfsFtpFile *    file);
   GVfsFtpFile *         (* resolve_symlink)                     (GVfsFtpTask *          task,
                                                                  const GVfsFtpFile *    file,
                                                                  const char *           target);
@@ -50,6 +55,8 @@ struct _GVfsFtpDirFuncs {
 
 extern const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_unix;
 extern const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_default;
+extern const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_mlsd_unix;
+extern const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_mlsd_default;
 
 GVfsFtpDirCache *       g_vfs_ftp_dir_cache_new                 (const GVfsFtpDirFuncs *funcs);
 void                    g_vfs_ftp_dir_cache_free                (GVfsFtpDirCache *      cache);
@@ -152,6 +152,16 @@ g_vfs_ftp_task_setup_connection (GVfsFtpTask *task)
       if (!g_vfs_ftp_task_send (task, 0, "OPTS UTF8 ON"))
         g_vfs_ftp_task_clear_error (task);
     }
+
+  /* ask for the facts we parse in MLSD and MLST replies, servers ignore
+   * the ones they don't know about */
+  if (g_vfs_backend_ftp_has_feature (task->backend, G_VFS_FTP_FEATURE_MLST))
+    {
+      if (!g_vfs_ftp_task_send (task, 0, "OPTS MLST type;size;modify;perm;"
+                                "UNIX.mode;UNIX.owner;UNIX.group;"
+                                "UNIX.ownername;UNIX.groupname;"))
+        g_vfs_ftp_task_clear_error (task);
+    }
 }
 
 
@@ -0,0 +1,558 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Streams over the sftp subsystem channel of an in-process libssh
+ * session, so the sftp backend can talk to the server without running
+ * ssh and copying every byte through its pipes.
+ *
+ * Both streams are pollable, which makes GIO do their async operations
+ * on the main loop instead of in threads; a libssh session must only be
+ * used from one thread at a time. The session is nonblocking once it is
+ * set up. Blocking reads and writes are only used while mounting, before
+ * any async operation is started, and switch it to blocking meanwhile. */
+
+#include <config.h>
+
+#include <errno.h>
+#include <glib/gi18n.h>
+#include <libssh/libssh.h>
+
+#include "gvfslibsshstream.h"
+
+typedef struct {
+  gint ref_count;
+  ssh_session session;
+  ssh_channel channel;
+} LibsshChannel;
+
+static LibsshChannel *
+libssh_channel_ref (LibsshChannel *channel)
+{
+  g_atomic_int_inc (&channel->ref_count);
+  return channel;
+}
+
+static void
+libssh_channel_unref (LibsshChannel *channel)
+{
+  if (!g_atomic_int_dec_and_test (&channel->ref_count))
+    return;
+
+  if (channel->channel)
+    {
+      ssh_channel_close (channel->channel);
+      ssh_channel_free (channel->channel);
+    }
+
+  ssh_disconnect (channel->session);
+  ssh_free (channel->session);
+  g_slice_free (LibsshChannel, channel);
+}
+
+static void
+set_error_from_session (GError **error, ssh_session session)
+{
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+               "%s", ssh_get_error (session));
+}
+
+/* Channel data can end up in the libssh buffers without the socket
+ * staying readable, e.g. when a write handled incoming packets, so the
+ * source asks libssh each main loop iteration. The socket is polled to
+ * wake up the loop when more arrives. */
+
+typedef struct {
+  GSource source;
+  LibsshChannel *channel;
+  GIOCondition condition;
+  gpointer fd_tag;
+} LibsshSource;
+
+static gboolean
+libssh_source_ready (LibsshSource *source)
+{
+  ssh_channel channel = source->channel->channel;
+  int res;
+
+  /* Processes any packets that arrived */
+  res = ssh_channel_poll (channel, 0);
+
+  if (source->condition & G_IO_IN)
+    return res != 0;
+
+  return ssh_channel_window_size (channel) > 0 || !ssh_channel_is_open (channel);
+}
+
+static gboolean
+libssh_source_prepare (GSource *source,
+                       gint *timeout)
+{
+  LibsshSource *libssh_source = (LibsshSource *)source;
+  GIOCondition fd_condition;
+
+  /* Window adjustments come in too, so wait for input either way,
+     and for the socket to take the data libssh couldn't send yet */
+  fd_condition = G_IO_IN | G_IO_ERR | G_IO_HUP;
+  if (ssh_get_poll_flags (libssh_source->channel->session) & SSH_WRITE_PENDING)
+    fd_condition |= G_IO_OUT;
+  g_source_modify_unix_fd (source, libssh_source->fd_tag, fd_condition);
+
+  *timeout = -1;
+  return libssh_source_ready (libssh_source);
+}
+
+static gboolean
+libssh_source_check (GSource *source)
+{
+  return libssh_source_ready ((LibsshSource *)source);
+}
+
+static gboolean
+libssh_source_dispatch (GSource *source,
+                        GSourceFunc callback,
+                        gpointer user_data)
+{
+  return callback ? callback (user_data) : TRUE;
+}
+
+static void
+libssh_source_finalize (GSource *source)
+{
+  libssh_channel_unref (((LibsshSource *)source)->channel);
+}
+
+static GSourceFuncs libssh_source_funcs = {
+  libssh_source_prepare,
+  libssh_source_check,
+  libssh_source_dispatch,
+  libssh_source_finalize
+};
+
+static GSource *
+libssh_source_new (GObject *stream,
+                   LibsshChannel *channel,
+                   GIOCondition condition,
+                   GCancellable *cancellable)
+{
+  GSource *source, *pollable_source;
+  LibsshSource *libssh_source;
+
+  source = g_source_new (&libssh_source_funcs, sizeof (LibsshSource));
+  g_source_set_name (source, "GVfsLibsshSource");
+  libssh_source = (LibsshSource *)source;
+  libssh_source->channel = libssh_channel_ref (channel);
+  libssh_source->condition = condition;
+
+  libssh_source->fd_tag = g_source_add_unix_fd (source, ssh_get_fd (channel->session),
+                                                G_IO_IN | G_IO_ERR | G_IO_HUP);
+
+  pollable_source = g_pollable_source_new_full (stream, source, cancellable);
+  g_source_unref (source);
+
+  return pollable_source;
+}
+
+/* Input stream */
+
+#define G_VFS_TYPE_LIBSSH_INPUT_STREAM (g_vfs_libssh_input_stream_get_type ())
+#define G_VFS_LIBSSH_INPUT_STREAM(o)   (G_TYPE_CHECK_INSTANCE_CAST ((o), G_VFS_TYPE_LIBSSH_INPUT_STREAM, GVfsLibsshInputStream))
+
+typedef struct {
+  GInputStream parent_instance;
+  LibsshChannel *channel;
+} GVfsLibsshInputStream;
+
+typedef struct {
+  GInputStreamClass parent_class;
+} GVfsLibsshInputStreamClass;
+
+static GType g_vfs_libssh_input_stream_get_type (void) G_GNUC_CONST;
+static void g_vfs_libssh_input_stream_pollable_iface_init (GPollableInputStreamInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (GVfsLibsshInputStream, g_vfs_libssh_input_stream, G_TYPE_INPUT_STREAM,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_POLLABLE_INPUT_STREAM,
+                                                g_vfs_libssh_input_stream_pollable_iface_init))
+
+static void
+g_vfs_libssh_input_stream_init (GVfsLibsshInputStream *stream)
+{
+}
+
+static void
+g_vfs_libssh_input_stream_finalize (GObject *object)
+{
+  GVfsLibsshInputStream *stream = G_VFS_LIBSSH_INPUT_STREAM (object);
+
+  libssh_channel_unref (stream->channel);
+
+  G_OBJECT_CLASS (g_vfs_libssh_input_stream_parent_class)->finalize (object);
+}
+
+static gssize
+g_vfs_libssh_input_stream_read (GInputStream *stream,
+                                void *buffer,
+                                gsize count,
+                                GCancellable *cancellable,
+                                GError **error)
+{
+  GVfsLibsshInputStream *self = G_VFS_LIBSSH_INPUT_STREAM (stream);
+  int res;
+
+  /* Returns 0 at EOF */
+  ssh_set_blocking (self->channel->session, 1);
+  res = ssh_channel_read (self->channel->channel, buffer, MIN (count, G_MAXINT32), 0);
+  ssh_set_blocking (self->channel->session, 0);
+  if (res == SSH_ERROR)
+    {
+      set_error_from_session (error, self->channel->session);
+      return -1;
+    }
+
+  return res;
+}
+
+static gssize
+g_vfs_libssh_input_stream_read_nonblocking (GPollableInputStream *stream,
+                                            void *buffer,
+                                            gsize count,
+                                            GError **error)
+{
+  GVfsLibsshInputStream *self = G_VFS_LIBSSH_INPUT_STREAM (stream);
+  int res;
+
+  res = ssh_channel_read_nonblocking (self->channel->channel, buffer,
+                                      MIN (count, G_MAXINT32), 0);
+  if (res == SSH_ERROR)
+    {
+      set_error_from_session (error, self->channel->session);
+      return -1;
+    }
+
+  if (res == SSH_AGAIN ||
+      (res == 0 && !ssh_channel_is_eof (self->channel->channel)))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
+                           g_strerror (EAGAIN));
+      return -1;
+    }
+
+  return res;
+}
+
+static gboolean
+g_vfs_libssh_input_stream_is_readable (GPollableInputStream *stream)
+{
+  GVfsLibsshInputStream *self = G_VFS_LIBSSH_INPUT_STREAM (stream);
+
+  return ssh_channel_poll (self->channel->channel, 0) != 0;
+}
+
+static GSource *
+g_vfs_libssh_input_stream_create_source (GPollableInputStream *stream,
+                                         GCancellable *cancellable)
+{
+  GVfsLibsshInputStream *self = G_VFS_LIBSSH_INPUT_STREAM (stream);
+
+  return libssh_source_new (G_OBJECT (stream), self->channel, G_IO_IN, cancellable);
+}
+
+static void
+g_vfs_libssh_input_stream_class_init (GVfsLibsshInputStreamClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  gobject_class->finalize = g_vfs_libssh_input_stream_finalize;
+  stream_class->read_fn = g_vfs_libssh_input_stream_read;
+}
+
+static void
+g_vfs_libssh_input_stream_pollable_iface_init (GPollableInputStreamInterface *iface)
+{
+  iface->is_readable = g_vfs_libssh_input_stream_is_readable;
+  iface->create_source = g_vfs_libssh_input_stream_create_source;
+  iface->read_nonblocking = g_vfs_libssh_input_stream_read_nonblocking;
+}
+
+/* Output stream */
+
+#define G_VFS_TYPE_LIBSSH_OUTPUT_STREAM (g_vfs_libssh_output_stream_get_type ())
+#define G_VFS_LIBSSH_OUTPUT_STREAM(o)   (G_TYPE_CHECK_INSTANCE_CAST ((o), G_VFS_TYPE_LIBSSH_OUTPUT_STREAM, GVfsLibsshOutputStream))
+
+typedef struct {
+  GOutputStream parent_instance;
+  LibsshChannel *channel;
+} GVfsLibsshOutputStream;
+
+typedef struct {
+  GOutputStreamClass parent_class;
+} GVfsLibsshOutputStreamClass;
+
+static GType g_vfs_libssh_output_stream_get_type (void) G_GNUC_CONST;
+static void g_vfs_libssh_output_stream_pollable_iface_init (GPollableOutputStreamInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (GVfsLibsshOutputStream, g_vfs_libssh_output_stream, G_TYPE_OUTPUT_STREAM,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_POLLABLE_OUTPUT_STREAM,
+                                                g_vfs_libssh_output_stream_pollable_iface_init))
+
+static void
+g_vfs_libssh_output_stream_init (GVfsLibsshOutputStream *stream)
+{
+}
+
+static void
+g_vfs_libssh_output_stream_finalize (GObject *object)
+{
+  GVfsLibsshOutputStream *stream = G_VFS_LIBSSH_OUTPUT_STREAM (object);
+
+  libssh_channel_unref (stream->channel);
+
+  G_OBJECT_CLASS (g_vfs_libssh_output_stream_parent_class)->finalize (object);
+}
+
+static gssize
+g_vfs_libssh_output_stream_write (GOutputStream *stream,
+                                  const void *buffer,
+                                  gsize count,
+                                  GCancellable *cancellable,
+                                  GError **error)
+{
+  GVfsLibsshOutputStream *self = G_VFS_LIBSSH_OUTPUT_STREAM (stream);
+  int res;
+
+  /* Waits for the window to open and the data to be sent */
+  ssh_set_blocking (self->channel->session, 1);
+  res = ssh_channel_write (self->channel->channel, buffer, MIN (count, G_MAXINT32));
+  ssh_set_blocking (self->channel->session, 0);
+  if (res == SSH_ERROR)
+    {
+      set_error_from_session (error, self->channel->session);
+      return -1;
+    }
+
+  return res;
+}
+
+static gssize
+g_vfs_libssh_output_stream_write_nonblocking (GPollableOutputStream *stream,
+                                              const void *buffer,
+                                              gsize count,
+                                              GError **error)
+{
+  GVfsLibsshOutputStream *self = G_VFS_LIBSSH_OUTPUT_STREAM (stream);
+  ssh_channel channel = self->channel->channel;
+  guint32 window;
+  int res;
+
+  window = ssh_channel_window_size (channel);
+  if (window == 0)
+    {
+      /* Look for a window adjustment */
+      ssh_channel_poll (channel, 0);
+      window = ssh_channel_window_size (channel);
+    }
+
+  if (window == 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
+                           g_strerror (EAGAIN));
+      return -1;
+    }
+
+  /* Writing no more than the window never waits for the server, and
+     the session being nonblocking keeps it from waiting for the socket.
+     What the socket doesn't take yet stays queued in libssh. */
+  res = ssh_channel_write (channel, buffer, MIN (count, window));
+  if (res == SSH_ERROR)
+    {
+      set_error_from_session (error, self->channel->session);
+      return -1;
+    }
+
+  if (res == SSH_AGAIN || res == 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
+                           g_strerror (EAGAIN));
+      return -1;
+    }
+
+  return res;
+}
+
+static gboolean
+g_vfs_libssh_output_stream_is_writable (GPollableOutputStream *stream)
+{
+  GVfsLibsshOutputStream *self = G_VFS_LIBSSH_OUTPUT_STREAM (stream);
+
+  return ssh_channel_window_size (self->channel->channel) > 0;
+}
+
+static GSource *
+g_vfs_libssh_output_stream_create_source (GPollableOutputStream *stream,
+                                          GCancellable *cancellable)
+{
+  GVfsLibsshOutputStream *self = G_VFS_LIBSSH_OUTPUT_STREAM (stream);
+
+  return libssh_source_new (G_OBJECT (stream), self->channel, G_IO_OUT, cancellable);
+}
+
+static void
+g_vfs_libssh_output_stream_class_init (GVfsLibsshOutputStreamClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GOutputStreamClass *stream_class = G_OUTPUT_STREAM_CLASS (klass);
+
+  gobject_class->finalize = g_vfs_libssh_output_stream_finalize;
+  stream_class->write_fn = g_vfs_libssh_output_stream_write;
+}
+
+static void
+g_vfs_libssh_output_stream_pollable_iface_init (GPollableOutputStreamInterface *iface)
+{
+  iface->is_writable = g_vfs_libssh_output_stream_is_writable;
+  iface->create_source = g_vfs_libssh_output_stream_create_source;
+  iface->write_nonblocking = g_vfs_libssh_output_stream_write_nonblocking;
+}
+
+/**
+ * g_vfs_libssh_stream_open:
+ * @host: the host to connect to
+ * @port: the port, or -1 for the default
+ * @user: the user to log in as, or %NULL for the configured one
+ * @password: a password to try, or %NULL
+ * @timeout: seconds to wait for the server
+ * @input: return location for the stream of sftp replies
+ * @output: return location for the stream of sftp commands
+ * @fall_back: set to %TRUE if the host key is unknown or the login
+ *   failed, which the ssh program may get past by asking the user
+ * @error: return location for a #GError
+ *
+ * Connects to @host and starts the sftp subsystem. Nothing is asked
+ * interactively: the host key has to be in the known hosts already and
+ * the login has to succeed with the ssh agent, the default keys or
+ * @password. ~/.ssh/config is read like the ssh program does.
+ *
+ * Returns: %TRUE if the streams were set up
+ */
+gboolean
+g_vfs_libssh_stream_open (const char     *host,
+                          int             port,
+                          const char     *user,
+                          const char     *password,
+                          int             timeout,
+                          GInputStream  **input,
+                          GOutputStream **output,
+                          gboolean       *fall_back,
+                          GError        **error)
+{
+  static gsize initialized = 0;
+  LibsshChannel *channel;
+  GVfsLibsshInputStream *input_stream;
+  GVfsLibsshOutputStream *output_stream;
+  unsigned int port_option;
+  long timeout_option;
+  int res;
+
+  *fall_back = FALSE;
+
+  if (g_once_init_enter (&initialized))
+    {
+      ssh_init ();
+      g_once_init_leave (&initialized, 1);
+    }
+
+  channel = g_slice_new0 (LibsshChannel);
+  channel->ref_count = 1;
+  channel->session = ssh_new ();
+  if (channel->session == NULL)
+    {
+      g_slice_free (LibsshChannel, channel);
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           _("Unable to create ssh session"));
+      return FALSE;
+    }
+
+  /* Explicit options win over the config file */
+  ssh_options_set (channel->session, SSH_OPTIONS_HOST, host);
+  ssh_options_parse_config (channel->session, NULL);
+
+  if (port != -1)
+    {
+      port_option = port;
+      ssh_options_set (channel->session, SSH_OPTIONS_PORT, &port_option);
+    }
+
+  if (user != NULL)
+    ssh_options_set (channel->session, SSH_OPTIONS_USER, user);
+
+  timeout_option = timeout;
+  ssh_options_set (channel->session, SSH_OPTIONS_TIMEOUT, &timeout_option);
+
+  if (ssh_connect (channel->session) != SSH_OK)
+    {
+      set_error_from_session (error, channel->session);
+      goto error;
+    }
+
+  if (ssh_session_is_known_server (channel->session) != SSH_KNOWN_HOSTS_OK)
+    {
+      *fall_back = TRUE;
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           _("Can't verify the identity of the host"));
+      goto error;
+    }
+
+  res = ssh_userauth_publickey_auto (channel->session, NULL, NULL);
+  if (res != SSH_AUTH_SUCCESS && password != NULL)
+    res = ssh_userauth_password (channel->session, NULL, password);
+
+  if (res != SSH_AUTH_SUCCESS)
+    {
+      *fall_back = TRUE;
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED,
+                           _("Permission denied"));
+      goto error;
+    }
+
+  channel->channel = ssh_channel_new (channel->session);
+  if (channel->channel == NULL ||
+      ssh_channel_open_session (channel->channel) != SSH_OK ||
+      ssh_channel_request_subsystem (channel->channel, "sftp") != SSH_OK)
+    {
+      set_error_from_session (error, channel->session);
+      goto error;
+    }
+
+  /* The streams must never block the main loop */
+  ssh_set_blocking (channel->session, 0);
+
+  input_stream = g_object_new (G_VFS_TYPE_LIBSSH_INPUT_STREAM, NULL);
+  input_stream->channel = libssh_channel_ref (channel);
+
+  output_stream = g_object_new (G_VFS_TYPE_LIBSSH_OUTPUT_STREAM, NULL);
+  output_stream->channel = channel;
+
+  *input = G_INPUT_STREAM (input_stream);
+  *output = G_OUTPUT_STREAM (output_stream);
+
+  return TRUE;
+
+ error:
+  libssh_channel_unref (channel);
+  return FALSE;
+}
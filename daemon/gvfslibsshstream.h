@@ -0,0 +1,38 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __G_VFS_LIBSSH_STREAM_H__
+#define __G_VFS_LIBSSH_STREAM_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+gboolean g_vfs_libssh_stream_open (const char     *host,
+                                   int             port,
+                                   const char     *user,
+                                   const char     *password,
+                                   int             timeout,
+                                   GInputStream  **input,
+                                   GOutputStream **output,
+                                   gboolean       *fall_back,
+                                   GError        **error);
+
+G_END_DECLS
+
+#endif /* __G_VFS_LIBSSH_STREAM_H__ */
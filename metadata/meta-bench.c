@@ -0,0 +1,470 @@
+#include "config.h"
+#include "metatree.h"
+#include <glib/gstdio.h>
+
+/* Synthesizes a metadata tree and times the common operations on it.
+ * The output is one line per operation so that it can be collected
+ * and compared between runs. */
+
+static int depth = 3;
+static int fanout = 10;
+static int keys = 4;
+static int journal_fill = 50;
+static int iterations = 100000;
+static int flushes = 10;
+static int seed = 0x6776;
+static char *bench_dir = NULL;
+static gboolean keep = FALSE;
+static GOptionEntry entries[] =
+{
+  { "depth", 'd', 0, G_OPTION_ARG_INT, &depth,
+    "Depth of the directory hierarchy", "N" },
+  { "fanout", 'f', 0, G_OPTION_ARG_INT, &fanout,
+    "Entries per directory", "N" },
+  { "keys", 'k', 0, G_OPTION_ARG_INT, &keys,
+    "Keys set on each file", "N" },
+  { "journal-fill", 'j', 0, G_OPTION_ARG_INT, &journal_fill,
+    "Journal fill in percent while timing", "PERCENT" },
+  { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+    "Operations per lookup and set test", "N" },
+  { "flushes", 'F', 0, G_OPTION_ARG_INT, &flushes,
+    "Number of timed flushes", "N" },
+  { "seed", 's', 0, G_OPTION_ARG_INT, &seed,
+    "Random seed", "N" },
+  { "dir", 0, 0, G_OPTION_ARG_FILENAME, &bench_dir,
+    "Directory for the tree (default: a new temporary one)", "DIR" },
+  { "keep", 0, 0, G_OPTION_ARG_NONE, &keep,
+    "Don't remove the tree when done", NULL },
+  { NULL }
+};
+
+static GRand *bench_rand;
+
+static void
+report (const char *name,
+	guint ops,
+	double elapsed)
+{
+  g_print ("%-16s %9u ops %9.3f s %10.0f ns/op %11.0f ops/s\n",
+	   name, ops, elapsed,
+	   ops > 0 ? elapsed * 1e9 / ops : 0,
+	   elapsed > 0 ? ops / elapsed : 0);
+}
+
+static char *
+leaf_path (guint index)
+{
+  GString *path;
+  guint leaf;
+  int i;
+
+  leaf = index % fanout;
+  index /= fanout;
+
+  path = g_string_new (NULL);
+  for (i = 0; i < depth - 1; i++)
+    {
+      g_string_append_printf (path, "/d%u", index % fanout);
+      index /= fanout;
+    }
+  g_string_append_printf (path, "/f%u", leaf);
+
+  return g_string_free (path, FALSE);
+}
+
+static char *
+random_leaf_path (void)
+{
+  GString *path;
+  int i;
+
+  path = g_string_new (NULL);
+  for (i = 0; i < depth - 1; i++)
+    g_string_append_printf (path, "/d%d",
+			    g_rand_int_range (bench_rand, 0, fanout));
+  g_string_append_printf (path, "/f%d",
+			  g_rand_int_range (bench_rand, 0, fanout));
+
+  return g_string_free (path, FALSE);
+}
+
+static char *
+random_dir_path (void)
+{
+  GString *path;
+  int i, levels;
+
+  path = g_string_new (NULL);
+  levels = g_rand_int_range (bench_rand, 0, depth);
+  for (i = 0; i < levels; i++)
+    g_string_append_printf (path, "/d%d",
+			    g_rand_int_range (bench_rand, 0, fanout));
+  if (path->len == 0)
+    g_string_append_c (path, '/');
+
+  return g_string_free (path, FALSE);
+}
+
+static char *
+random_key (void)
+{
+  return g_strdup_printf ("key-%d", g_rand_int_range (bench_rand, 0, keys));
+}
+
+static guint
+fill_percent (MetaTree *tree)
+{
+  gsize used, size;
+
+  if (!meta_tree_get_journal_fill (tree, &used, &size) || size == 0)
+    return 100;
+
+  return used * 100 / size;
+}
+
+/* Writes journal entries until the journal is filled to the requested level.
+ * Writing may trigger a rotation, so this is bounded by a number of sets. */
+static guint
+fill_journal (MetaTree *tree)
+{
+  char *path, *value;
+  guint sets;
+
+  for (sets = 0; sets < 10000000 && fill_percent (tree) < journal_fill; sets++)
+    {
+      path = random_leaf_path ();
+      value = g_strdup_printf ("fill-%u", sets);
+      meta_tree_set_string (tree, path, "fill", value);
+      g_free (value);
+      g_free (path);
+    }
+
+  return sets;
+}
+
+static gboolean
+count_entry (const char *entry,
+	     guint64 last_changed,
+	     gboolean has_children,
+	     gboolean has_data,
+	     gpointer user_data)
+{
+  guint *count = user_data;
+
+  (*count)++;
+  return TRUE;
+}
+
+static gboolean
+count_entry_key (const char *entry,
+		 const char *key,
+		 MetaKeyType type,
+		 gpointer value,
+		 gpointer user_data)
+{
+  guint *count = user_data;
+
+  (*count)++;
+  return TRUE;
+}
+
+static void
+bench_populate (MetaTree *tree,
+		guint n_leaves)
+{
+  MetaTreeBatch *batch;
+  GTimer *timer;
+  char *path, *key, *value;
+  guint i;
+  int k;
+
+  timer = g_timer_new ();
+  for (i = 0; i < n_leaves; i++)
+    {
+      path = leaf_path (i);
+      batch = meta_tree_batch_new ();
+      for (k = 0; k < keys; k++)
+	{
+	  key = g_strdup_printf ("key-%d", k);
+	  value = g_strdup_printf ("value-%u-%d", i, k);
+	  meta_tree_batch_set_string (batch, path, key, value);
+	  g_free (value);
+	  g_free (key);
+	}
+      meta_tree_apply_batch (tree, batch);
+      meta_tree_batch_free (batch);
+      g_free (path);
+    }
+  report ("populate", n_leaves, g_timer_elapsed (timer, NULL));
+
+  g_timer_start (timer);
+  meta_tree_flush (tree);
+  report ("initial-flush", 1, g_timer_elapsed (timer, NULL));
+  g_timer_destroy (timer);
+}
+
+static void
+bench_lookup (MetaTree *tree,
+	      const char *name,
+	      gboolean hit)
+{
+  GTimer *timer;
+  double elapsed;
+  char **paths, **lookup_keys, *value;
+  int i;
+
+  paths = g_new (char *, iterations);
+  lookup_keys = g_new (char *, iterations);
+  for (i = 0; i < iterations; i++)
+    {
+      paths[i] = random_leaf_path ();
+      lookup_keys[i] = hit ? random_key () : g_strdup ("no-such-key");
+    }
+
+  timer = g_timer_new ();
+  for (i = 0; i < iterations; i++)
+    {
+      value = meta_tree_lookup_string (tree, paths[i], lookup_keys[i]);
+      g_free (value);
+    }
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+  report (name, iterations, elapsed);
+
+  for (i = 0; i < iterations; i++)
+    {
+      g_free (paths[i]);
+      g_free (lookup_keys[i]);
+    }
+  g_free (paths);
+  g_free (lookup_keys);
+}
+
+static void
+bench_enumerate (MetaTree *tree)
+{
+  GTimer *timer;
+  char **paths;
+  guint count;
+  int i, n;
+
+  n = MAX (1, iterations / fanout);
+  paths = g_new (char *, n);
+  for (i = 0; i < n; i++)
+    paths[i] = random_dir_path ();
+
+  timer = g_timer_new ();
+  count = 0;
+  for (i = 0; i < n; i++)
+    meta_tree_enumerate_dir (tree, paths[i], count_entry, &count);
+  report ("enumerate-dir", n, g_timer_elapsed (timer, NULL));
+
+  g_timer_start (timer);
+  count = 0;
+  for (i = 0; i < n; i++)
+    meta_tree_enumerate_dir_keys (tree, paths[i], count_entry_key, &count);
+  report ("enumerate-keys", n, g_timer_elapsed (timer, NULL));
+  g_timer_destroy (timer);
+
+  for (i = 0; i < n; i++)
+    g_free (paths[i]);
+  g_free (paths);
+}
+
+static void
+bench_set (MetaTree *tree)
+{
+  GTimer *timer;
+  double elapsed;
+  char **paths, **set_keys, *value;
+  int i;
+
+  paths = g_new (char *, iterations);
+  set_keys = g_new (char *, iterations);
+  for (i = 0; i < iterations; i++)
+    {
+      paths[i] = random_leaf_path ();
+      set_keys[i] = random_key ();
+    }
+
+  /* Rotations triggered by a full journal are part of the cost */
+  timer = g_timer_new ();
+  for (i = 0; i < iterations; i++)
+    {
+      value = g_strdup_printf ("set-%d", i);
+      meta_tree_set_string (tree, paths[i], set_keys[i], value);
+      g_free (value);
+    }
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+  report ("set", iterations, elapsed);
+
+  for (i = 0; i < iterations; i++)
+    {
+      g_free (paths[i]);
+      g_free (set_keys[i]);
+    }
+  g_free (paths);
+  g_free (set_keys);
+}
+
+static void
+bench_flush (MetaTree *tree)
+{
+  GTimer *timer;
+  double elapsed, total, min, max;
+  int i;
+
+  timer = g_timer_new ();
+  total = max = 0;
+  min = G_MAXDOUBLE;
+  for (i = 0; i < flushes; i++)
+    {
+      fill_journal (tree);
+
+      g_timer_start (timer);
+      meta_tree_flush (tree);
+      elapsed = g_timer_elapsed (timer, NULL);
+
+      total += elapsed;
+      min = MIN (min, elapsed);
+      max = MAX (max, elapsed);
+    }
+  g_timer_destroy (timer);
+
+  report ("flush", flushes, total);
+  if (flushes > 0)
+    g_print ("%-16s min %.3f ms, max %.3f ms\n", "flush", min * 1e3, max * 1e3);
+}
+
+static void
+remove_tree_files (const char *dir,
+		   const char *basename)
+{
+  GDir *d;
+  const char *name;
+  char *path;
+
+  d = g_dir_open (dir, 0, NULL);
+  if (d == NULL)
+    return;
+
+  while ((name = g_dir_read_name (d)) != NULL)
+    {
+      if (g_str_has_prefix (name, basename))
+	{
+	  path = g_build_filename (dir, name, NULL);
+	  g_unlink (path);
+	  g_free (path);
+	}
+    }
+  g_dir_close (d);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  MetaTree *tree;
+  char *dir, *filename;
+  gboolean created_dir;
+  guint64 n_leaves, bytes_written;
+  guint journal_grows, fill_sets;
+  struct stat statbuf;
+  int i;
+
+  context = g_option_context_new ("- benchmark metadata tree operations");
+  g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("option parsing failed: %s\n", error->message);
+      return 1;
+    }
+
+  if (depth < 1 || fanout < 1 || keys < 1 || iterations < 1 || flushes < 0 ||
+      journal_fill < 0 || journal_fill > 95)
+    {
+      g_printerr ("invalid parameters\n");
+      return 1;
+    }
+
+  n_leaves = 1;
+  for (i = 0; i < depth; i++)
+    {
+      n_leaves *= fanout;
+      if (n_leaves > 10000000)
+	{
+	  g_printerr ("tree too large, reduce depth or fanout\n");
+	  return 1;
+	}
+    }
+
+  created_dir = FALSE;
+  if (bench_dir)
+    dir = g_strdup (bench_dir);
+  else
+    {
+      dir = g_dir_make_tmp ("meta-bench-XXXXXX", &error);
+      if (dir == NULL)
+	{
+	  g_printerr ("can't create temporary directory: %s\n", error->message);
+	  return 1;
+	}
+      created_dir = TRUE;
+    }
+
+  filename = g_build_filename (dir, "bench.tree", NULL);
+  remove_tree_files (dir, "bench.tree");
+
+  bench_rand = g_rand_new_with_seed (seed);
+
+  tree = meta_tree_open (filename, TRUE);
+  if (tree == NULL || !meta_tree_exists (tree))
+    {
+      g_printerr ("can't create metadata tree %s\n", filename);
+      return 1;
+    }
+
+  g_print ("depth %d, fanout %d, keys %d, %"G_GUINT64_FORMAT" files, "
+	   "journal fill %d%%\n",
+	   depth, fanout, keys, n_leaves, journal_fill);
+
+  bench_populate (tree, n_leaves);
+
+  if (g_stat (filename, &statbuf) == 0)
+    g_print ("%-16s %"G_GUINT64_FORMAT" bytes\n",
+	     "tree-size", (guint64) statbuf.st_size);
+
+  fill_sets = fill_journal (tree);
+  g_print ("%-16s %u sets, %u%% used\n",
+	   "journal", fill_sets, fill_percent (tree));
+
+  bench_lookup (tree, "lookup", TRUE);
+  bench_lookup (tree, "lookup-miss", FALSE);
+  bench_enumerate (tree);
+  bench_set (tree);
+  bench_flush (tree);
+
+  meta_tree_get_write_stats (tree, &bytes_written, &journal_grows);
+  g_print ("%-16s %"G_GUINT64_FORMAT" bytes, %u journal grows\n",
+	   "written", bytes_written, journal_grows);
+
+  meta_tree_unref (tree);
+  g_rand_free (bench_rand);
+
+  if (!keep)
+    {
+      remove_tree_files (dir, "bench.tree");
+      if (created_dir)
+	g_rmdir (dir);
+    }
+  else
+    g_print ("tree kept in %s\n", filename);
+
+  g_free (filename);
+  g_free (dir);
+
+  return 0;
+}
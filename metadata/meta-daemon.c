@@ -27,22 +27,116 @@
 #include <glib/gstdio.h>
 #include <locale.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include "metatree.h"
 #include "gvfsdaemonprotocol.h"
 #include "metadata-dbus.h"
 
 #define WRITEOUT_TIMEOUT_SECS 60
 #define WRITEOUT_TIMEOUT_SECS_NFS 15
+/* With --nfs-idle-writeout, trees on NFS are written out when there
+   were no changes for this long, or on exit */
+#define WRITEOUT_IDLE_SECS_NFS (10 * 60)
+
+/* A writeout is started right away once the journal is this full... */
+#define WRITEOUT_EARLY_FILL 0.5
+/* ...or when it would be full this soon at the current write rate */
+#define WRITEOUT_EARLY_SECS 10
+/* Write rates are averaged over windows of this length... */
+#define WRITE_RATE_WINDOW_USECS G_USEC_PER_SEC
+/* ...with this weight for the newest window */
+#define WRITE_RATE_WEIGHT 0.25
+
+/* Garbage collection walks the tree looking for entries of files
+   that were removed without GIO, stating at most GC_STATS_PER_STEP
+   files every GC_STEP_MSECS */
+#define GC_START_DELAY_SECS (5 * 60)
+#define GC_INTERVAL_SECS (24 * 60 * 60)
+#define GC_STEP_MSECS 100
+#define GC_STATS_PER_STEP 20
+
+/* A change that didn't fit into the journal while the tree was
+   written out. The caller gets its reply once it is applied. */
+typedef struct {
+  MetaTreeBatch *batch;
+  GDBusMethodInvocation *invocation;
+  const char *error_message;
+} DeferredChange;
 
 typedef struct {
   char *filename;
   MetaTree *tree;
   guint writeout_timeout;
+  gboolean writeout_queued;
+
+  /* Changes waiting for the running writeout, oldest first. Changes
+     go into the live journal while the tree is written out, these
+     are only the ones that don't fit into it anymore. */
+  GQueue *deferred;
+
+  /* Write rate, in journal bytes per second */
+  double write_rate;
+  gint64 window_start;
+  gsize window_bytes;
+
+  /* Statistics */
+  guint64 bytes_written;
+  guint num_writes;
+  guint num_deferred_writes;
+  guint num_writeouts;
+  guint num_early_writeouts;
+  guint num_failed_writeouts;
+  gint64 last_writeout_usecs;
+  gint64 total_writeout_usecs;
+  gboolean last_writeout_res; /* Set by the writeout thread */
+
+  /* Garbage collection, only for trees with a local root */
+  char *gc_root; /* Local path for the tree path "/" */
+  dev_t gc_dev;
+  guint gc_source;
+  GQueue *gc_dirs; /* Tree paths left to enumerate */
+  GQueue *gc_entries; /* GcEntry left to check */
+  GPtrArray *gc_dead; /* Tree paths to remove in the next writeout */
+  char **writeout_remove; /* Tree paths removed by the running writeout */
+  gsize writeout_reclaimed;
+  guint writeout_removed;
+
+  guint gc_walks;
+  guint gc_removed;
+  guint64 gc_reclaimed;
 } TreeInfo;
 
+typedef struct {
+  char *path;
+  gboolean has_children;
+} GcEntry;
+
 static GHashTable *tree_infos = NULL;
 static GVfsMetadata *skeleton = NULL;
 
+/* Writeouts run one at a time in this thread pool */
+static GThreadPool *writeout_pool = NULL;
+
+static gboolean nfs_idle_writeout = FALSE;
+
+static void
+gc_entry_free (GcEntry *entry)
+{
+  g_free (entry->path);
+  g_free (entry);
+}
+
+static void
+deferred_change_free (DeferredChange *change)
+{
+  meta_tree_batch_free (change->batch);
+  if (change->invocation)
+    g_object_unref (change->invocation);
+  g_free (change);
+}
+
 static void
 tree_info_free (TreeInfo *info)
 {
@@ -50,27 +144,193 @@ tree_info_free (TreeInfo *info)
   meta_tree_unref (info->tree);
   if (info->writeout_timeout)
     g_source_remove (info->writeout_timeout);
+  g_queue_free_full (info->deferred, (GDestroyNotify) deferred_change_free);
+
+  if (info->gc_source)
+    g_source_remove (info->gc_source);
+  g_free (info->gc_root);
+  if (info->gc_dirs)
+    g_queue_free_full (info->gc_dirs, g_free);
+  if (info->gc_entries)
+    g_queue_free_full (info->gc_entries, (GDestroyNotify) gc_entry_free);
+  if (info->gc_dead)
+    g_ptr_array_free (info->gc_dead, TRUE);
+  g_strfreev (info->writeout_remove);
 
   g_free (info);
 }
 
+/* Returns TRUE if the file for path was removed. Files that can't be
+   seen because something is mounted over them don't count, so the
+   parent must exist on the same device as the root. Called from the
+   writeout thread too, so only uses fields that never change. */
+static gboolean
+gc_path_is_dead (TreeInfo *info,
+                 const char *path)
+{
+  struct stat statbuf;
+  char *local, *parent;
+  gboolean res;
+
+  local = g_build_filename (info->gc_root, path, NULL);
+
+  res = FALSE;
+  if (g_lstat (local, &statbuf) != 0 &&
+      (errno == ENOENT || errno == ENOTDIR))
+    {
+      parent = g_path_get_dirname (local);
+      res = g_lstat (parent, &statbuf) == 0 &&
+        S_ISDIR (statbuf.st_mode) &&
+        statbuf.st_dev == info->gc_dev;
+      g_free (parent);
+    }
+
+  g_free (local);
+
+  return res;
+}
+
+static gboolean writeout_done (gpointer data);
+
+static void
+writeout_thread (gpointer data,
+                 gpointer user_data)
+{
+  TreeInfo *info = data;
+  char **remove;
+  gint64 start;
+  int i, j;
+
+  start = g_get_monotonic_time ();
+
+  info->writeout_reclaimed = 0;
+  info->writeout_removed = 0;
+
+  /* Files found dead by the GC could have been recreated since */
+  remove = info->writeout_remove;
+  for (i = 0, j = 0; remove != NULL && remove[i] != NULL; i++)
+    {
+      if (gc_path_is_dead (info, remove[i]))
+        remove[j++] = remove[i];
+      else
+        g_free (remove[i]);
+    }
+  if (remove != NULL)
+    remove[j] = NULL;
+
+  if (remove != NULL && j > 0)
+    {
+      info->last_writeout_res = meta_tree_compact (info->tree, remove,
+                                                   &info->writeout_reclaimed);
+      if (info->last_writeout_res)
+        info->writeout_removed = j;
+    }
+  else
+    info->last_writeout_res = meta_tree_flush (info->tree);
+
+  info->last_writeout_usecs = g_get_monotonic_time () - start;
+
+  g_idle_add (writeout_done, info);
+}
+
+static void
+tree_info_start_writeout (TreeInfo *info)
+{
+  if (info->writeout_timeout != 0)
+    {
+      g_source_remove (info->writeout_timeout);
+      info->writeout_timeout = 0;
+    }
+
+  if (info->writeout_queued)
+    return;
+
+  /* Hand the dead entries found so far to the writeout */
+  if (info->gc_dead != NULL && info->gc_dead->len > 0)
+    {
+      g_ptr_array_add (info->gc_dead, NULL);
+      info->writeout_remove = (char **) g_ptr_array_free (info->gc_dead, FALSE);
+      info->gc_dead = g_ptr_array_new_with_free_func (g_free);
+    }
+
+  info->writeout_queued = TRUE;
+  g_thread_pool_push (writeout_pool, info, NULL);
+}
+
 static gboolean
 writeout_timeout (gpointer data)
 {
   TreeInfo *info = data;
 
-  meta_tree_flush (info->tree);
   info->writeout_timeout = 0;
+  tree_info_start_writeout (info);
 
   return FALSE;
 }
 
+/* Returns FALSE if adding bytes would fill the journal. Changes
+   that don't fit even into an empty journal are set in fits_never,
+   applying them writes out the tree right away. */
+static gboolean
+tree_info_journal_has_room (TreeInfo *info,
+                            gsize bytes,
+                            gboolean *fits_never)
+{
+  gsize used, size;
+
+  *fits_never = FALSE;
+  if (!meta_tree_get_journal_fill (info->tree, &used, &size))
+    return TRUE;
+
+  *fits_never = bytes > size;
+  return used + bytes <= size;
+}
+
+/* Returns TRUE if the journal will be full soon, so that a writeout
+   should start now rather than on the timeout */
+static gboolean
+tree_info_needs_early_writeout (TreeInfo *info)
+{
+  gsize used, size;
+
+  /* Don't retry failing writeouts on every change */
+  if (info->num_writeouts > 0 && !info->last_writeout_res)
+    return FALSE;
+
+  if (!meta_tree_get_journal_fill (info->tree, &used, &size) ||
+      size == 0)
+    return FALSE;
+
+  if (used >= size * WRITEOUT_EARLY_FILL)
+    return TRUE;
+
+  return info->write_rate > 0 &&
+    (size - used) / info->write_rate < WRITEOUT_EARLY_SECS;
+}
+
 static void
 tree_info_schedule_writeout (TreeInfo *info)
 {
   gboolean on_nfs;
 
-  if (info->writeout_timeout == 0)
+  if (info->writeout_queued)
+    return;
+
+  if (tree_info_needs_early_writeout (info))
+    {
+      info->num_early_writeouts++;
+      tree_info_start_writeout (info);
+    }
+  else if (nfs_idle_writeout && meta_tree_is_on_nfs (info->tree))
+    {
+      /* Restart the timeout on each change, so that busy sessions
+         only write to the server when the journal fills up */
+      if (info->writeout_timeout != 0)
+        g_source_remove (info->writeout_timeout);
+      info->writeout_timeout =
+        g_timeout_add_seconds (WRITEOUT_IDLE_SECS_NFS, writeout_timeout, info);
+    }
+  else if (info->writeout_timeout == 0)
     {
       on_nfs = meta_tree_is_on_nfs (info->tree);
       info->writeout_timeout =
@@ -79,24 +339,344 @@ tree_info_schedule_writeout (TreeInfo *info)
     }
 }
 
+/* Applies batch and replies to invocation, only once the change is
+   in the journal */
+static void
+tree_info_complete_batch (TreeInfo *info,
+                          MetaTreeBatch *batch,
+                          GDBusMethodInvocation *invocation,
+                          const char *error_message)
+{
+  if (!meta_tree_apply_batch (info->tree, batch))
+    g_dbus_method_invocation_return_error_literal (invocation,
+                                                   G_IO_ERROR,
+                                                   G_IO_ERROR_FAILED,
+                                                   error_message);
+  else
+    g_dbus_method_invocation_return_value (invocation, NULL);
+}
+
+/* Applies the deferred changes that fit into the journal now, and
+   starts another writeout for the rest */
+static void
+tree_info_apply_deferred (TreeInfo *info)
+{
+  DeferredChange *change;
+  gboolean fits_never;
+
+  while (!info->writeout_queued &&
+         (change = g_queue_peek_head (info->deferred)) != NULL)
+    {
+      /* Apply (and fail) the change anyway if writing out failed */
+      if (!tree_info_journal_has_room (info,
+                                       meta_tree_batch_get_size (change->batch),
+                                       &fits_never) &&
+          !fits_never && info->last_writeout_res)
+        {
+          info->num_early_writeouts++;
+          tree_info_start_writeout (info);
+          break;
+        }
+
+      g_queue_pop_head (info->deferred);
+      tree_info_complete_batch (info, change->batch,
+                                change->invocation, change->error_message);
+      change->invocation = NULL;
+      deferred_change_free (change);
+    }
+
+  tree_info_schedule_writeout (info);
+}
+
+static gboolean
+writeout_done (gpointer data)
+{
+  TreeInfo *info = data;
+
+  info->writeout_queued = FALSE;
+  info->num_writeouts++;
+  info->total_writeout_usecs += info->last_writeout_usecs;
+  if (!info->last_writeout_res)
+    info->num_failed_writeouts++;
+
+  info->gc_removed += info->writeout_removed;
+  info->gc_reclaimed += info->writeout_reclaimed;
+  g_strfreev (info->writeout_remove);
+  info->writeout_remove = NULL;
+
+  tree_info_apply_deferred (info);
+
+  return FALSE;
+}
+
+static void
+tree_info_update_write_rate (TreeInfo *info,
+                             gsize bytes)
+{
+  gint64 now, elapsed;
+  double rate;
+
+  now = g_get_monotonic_time ();
+  if (info->window_start == 0)
+    info->window_start = now;
+
+  info->window_bytes += bytes;
+  elapsed = now - info->window_start;
+  if (elapsed >= WRITE_RATE_WINDOW_USECS)
+    {
+      rate = info->window_bytes * (double) G_USEC_PER_SEC / elapsed;
+      info->write_rate = WRITE_RATE_WEIGHT * rate +
+        (1 - WRITE_RATE_WEIGHT) * info->write_rate;
+      info->window_start = now;
+      info->window_bytes = 0;
+    }
+}
+
+/* Applies batch (taking it over) to the journal and replies to
+   invocation, with error_message if that fails. Writeouts don't keep
+   changes out of the journal, but if the batch doesn't fit it waits
+   for the writeout of this tree, so that the journal never gets
+   rewritten synchronously here. */
+static void
+tree_info_apply_batch (TreeInfo *info,
+                       MetaTreeBatch *batch,
+                       GDBusMethodInvocation *invocation,
+                       const char *error_message)
+{
+  DeferredChange *change;
+  gsize batch_size;
+  gboolean has_room, fits_never;
+
+  batch_size = meta_tree_batch_get_size (batch);
+
+  info->num_writes++;
+  info->bytes_written += batch_size;
+  tree_info_update_write_rate (info, batch_size);
+
+  has_room = tree_info_journal_has_room (info, batch_size, &fits_never);
+  if (!has_room && !fits_never && !info->writeout_queued)
+    {
+      info->num_early_writeouts++;
+      tree_info_start_writeout (info);
+    }
+
+  /* Keep the order of changes to this tree */
+  if (info->writeout_queued &&
+      (!has_room || !g_queue_is_empty (info->deferred)))
+    {
+      change = g_new0 (DeferredChange, 1);
+      change->batch = batch;
+      change->invocation = invocation;
+      change->error_message = error_message;
+      g_queue_push_tail (info->deferred, change);
+      info->num_deferred_writes++;
+      return;
+    }
+
+  tree_info_complete_batch (info, batch, invocation, error_message);
+  meta_tree_batch_free (batch);
+  tree_info_schedule_writeout (info);
+}
+
 static void
 flush_single (const gchar *filename,
               TreeInfo *info,
               gpointer user_data)
 {
+  DeferredChange *change;
+  gboolean needs_flush;
+
+  needs_flush = info->writeout_timeout != 0 || !g_queue_is_empty (info->deferred);
+
   if (info->writeout_timeout != 0)
     {
       g_source_remove (info->writeout_timeout);
-      writeout_timeout (info);
+      info->writeout_timeout = 0;
+    }
+
+  while ((change = g_queue_pop_head (info->deferred)) != NULL)
+    {
+      tree_info_complete_batch (info, change->batch,
+                                change->invocation, change->error_message);
+      change->invocation = NULL;
+      deferred_change_free (change);
     }
+
+  if (needs_flush)
+    meta_tree_flush (info->tree);
 }
 
 static void
 flush_all ()
 {
+  /* Let running writeouts finish, we're about to quit so their
+     completion callbacks won't run */
+  if (writeout_pool)
+    {
+      g_thread_pool_free (writeout_pool, FALSE, TRUE);
+      writeout_pool = NULL;
+    }
+
   g_hash_table_foreach (tree_infos, (GHFunc) flush_single, NULL);
 }
 
+static gboolean gc_start (gpointer data);
+
+static gboolean
+gc_enum_dir (const char *entry,
+             guint64 last_changed,
+             gboolean has_children,
+             gboolean has_data,
+             gpointer user_data)
+{
+  GQueue *children = user_data;
+  GcEntry *child;
+
+  child = g_new0 (GcEntry, 1);
+  child->path = g_strdup (entry);
+  child->has_children = has_children;
+  g_queue_push_tail (children, child);
+
+  return TRUE;
+}
+
+static void
+gc_enumerate_dir (TreeInfo *info,
+                  const char *dir)
+{
+  GQueue children = G_QUEUE_INIT;
+  GcEntry *child;
+  char *name;
+
+  meta_tree_enumerate_dir (info->tree, dir, gc_enum_dir, &children);
+
+  while ((child = g_queue_pop_head (&children)) != NULL)
+    {
+      name = child->path;
+      child->path = g_build_filename (dir, name, NULL);
+      g_free (name);
+      g_queue_push_tail (info->gc_entries, child);
+    }
+}
+
+static void
+gc_finish_walk (TreeInfo *info)
+{
+  info->gc_walks++;
+  info->gc_source = g_timeout_add_seconds (GC_INTERVAL_SECS, gc_start, info);
+
+  /* Remove the dead entries with the next writeout */
+  if (info->gc_dead->len > 0)
+    tree_info_schedule_writeout (info);
+}
+
+static gboolean
+gc_step (gpointer data)
+{
+  TreeInfo *info = data;
+  struct stat statbuf;
+  GcEntry *entry;
+  char *local, *dir;
+  int stats;
+
+  /* Wait for the writeout of this tree to install the new file */
+  if (info->writeout_queued)
+    return TRUE;
+
+  stats = 0;
+  while (stats < GC_STATS_PER_STEP)
+    {
+      entry = g_queue_pop_head (info->gc_entries);
+      if (entry == NULL)
+        {
+          dir = g_queue_pop_head (info->gc_dirs);
+          if (dir == NULL)
+            {
+              gc_finish_walk (info);
+              return FALSE;
+            }
+
+          gc_enumerate_dir (info, dir);
+          g_free (dir);
+          continue;
+        }
+
+      stats++;
+      if (gc_path_is_dead (info, entry->path))
+        {
+          /* Everything below goes with it */
+          g_ptr_array_add (info->gc_dead, entry->path);
+          entry->path = NULL;
+        }
+      else if (entry->has_children)
+        {
+          /* Don't look below mountpoints, as the files there are hidden */
+          local = g_build_filename (info->gc_root, entry->path, NULL);
+          if (g_lstat (local, &statbuf) == 0 &&
+              S_ISDIR (statbuf.st_mode) &&
+              statbuf.st_dev == info->gc_dev)
+            {
+              g_queue_push_tail (info->gc_dirs, entry->path);
+              entry->path = NULL;
+            }
+          g_free (local);
+        }
+
+      gc_entry_free (entry);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+gc_start (gpointer data)
+{
+  TreeInfo *info = data;
+
+  g_queue_push_tail (info->gc_dirs, g_strdup ("/"));
+  info->gc_source = g_timeout_add (GC_STEP_MSECS, gc_step, info);
+
+  return FALSE;
+}
+
+/* Sets up garbage collection for trees where we know which local
+   dir the tree paths are relative to. That is only the home tree,
+   the others can have files of filesystems that aren't mounted. */
+static void
+tree_info_init_gc (TreeInfo *info)
+{
+  struct stat statbuf;
+  char *basename;
+  char *root;
+
+  basename = g_path_get_basename (info->filename);
+  if (strcmp (basename, "home") != 0)
+    {
+      g_free (basename);
+      return;
+    }
+  g_free (basename);
+
+  /* Tree paths are relative to the home dir with symlinks expanded */
+  root = realpath (g_get_home_dir (), NULL);
+  if (root == NULL)
+    return;
+
+  if (g_lstat (root, &statbuf) != 0)
+    {
+      free (root);
+      return;
+    }
+
+  info->gc_root = g_strdup (root);
+  free (root);
+  info->gc_dev = statbuf.st_dev;
+  info->gc_dirs = g_queue_new ();
+  info->gc_entries = g_queue_new ();
+  info->gc_dead = g_ptr_array_new_with_free_func (g_free);
+  info->gc_source = g_timeout_add_seconds (GC_START_DELAY_SECS, gc_start, info);
+}
+
 static TreeInfo *
 tree_info_new (const char *filename)
 {
@@ -111,6 +691,9 @@ tree_info_new (const char *filename)
   info->filename = g_strdup (filename);
   info->tree = tree;
   info->writeout_timeout = 0;
+  info->deferred = g_queue_new ();
+
+  tree_info_init_gc (info);
 
   return info;
 }
@@ -132,86 +715,124 @@ tree_info_lookup (const char *filename)
   return info;
 }
 
+/* Adds the changes in data, as passed to Set, to batch. Returns
+   FALSE if all of them are unsets. */
 static gboolean
-handle_set (GVfsMetadata *object,
-            GDBusMethodInvocation *invocation,
-            const gchar *arg_treefile,
-            const gchar *arg_path,
-            GVariant *arg_data,
-            GVfsMetadata *daemon)
+add_data_to_batch (MetaTreeBatch *batch,
+                   const gchar *path,
+                   GVariant *data)
 {
-  TreeInfo *info;
   const gchar *str;
   const gchar **strv;
   const gchar *key;
-  GError *error;
   GVariantIter iter;
   GVariant *value;
+  gboolean has_set;
 
-  info = tree_info_lookup (arg_treefile);
-  if (info == NULL)
-    {
-      g_dbus_method_invocation_return_error (invocation,
-                                             G_IO_ERROR,
-                                             G_IO_ERROR_NOT_FOUND,
-                                             _("Can't find metadata file %s"),
-                                             arg_treefile);
-      return TRUE;
-    }
-
-  error = NULL;
+  has_set = FALSE;
 
-  g_variant_iter_init (&iter, arg_data);
+  g_variant_iter_init (&iter, data);
   while (g_variant_iter_next (&iter, "{&sv}", &key, &value))
     {
       if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING_ARRAY))
 	{
 	  /* stringv */
           strv = g_variant_get_strv (value, NULL);
-	  if (!meta_tree_set_stringv (info->tree, arg_path, key, (gchar **) strv))
-	    {
-	      g_set_error_literal (&error, G_IO_ERROR,
-                                   G_IO_ERROR_FAILED,
-                                  _("Unable to set metadata key"));
-	    }
+	  meta_tree_batch_set_stringv (batch, path, key, (gchar **) strv);
 	  g_free (strv);
+	  has_set = TRUE;
 	}
       else if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING))
 	{
 	  /* string */
           str = g_variant_get_string (value, NULL);
-	  if (!meta_tree_set_string (info->tree, arg_path, key, str))
-	    {
-              g_set_error_literal (&error, G_IO_ERROR,
-                                   G_IO_ERROR_FAILED,
-                                   _("Unable to set metadata key"));
-	    }
+	  meta_tree_batch_set_string (batch, path, key, str);
+	  has_set = TRUE;
 	}
       else if (g_variant_is_of_type (value, G_VARIANT_TYPE_BYTE))
 	{
 	  /* Unset */
-	  if (!meta_tree_unset (info->tree, arg_path, key))
-	    {
-              g_set_error_literal (&error, G_IO_ERROR,
-                                   G_IO_ERROR_FAILED,
-                                   _("Unable to unset metadata key"));
-	    }
+	  meta_tree_batch_unset (batch, path, key);
 	}
       g_variant_unref (value);
     }
 
-  tree_info_schedule_writeout (info);
+  return has_set;
+}
 
-  if (error)
+static gboolean
+handle_set (GVfsMetadata *object,
+            GDBusMethodInvocation *invocation,
+            const gchar *arg_treefile,
+            const gchar *arg_path,
+            GVariant *arg_data,
+            GVfsMetadata *daemon)
+{
+  TreeInfo *info;
+  MetaTreeBatch *batch;
+  gboolean has_set;
+
+  info = tree_info_lookup (arg_treefile);
+  if (info == NULL)
     {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      g_error_free (error);
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_IO_ERROR,
+                                             G_IO_ERROR_NOT_FOUND,
+                                             _("Can't find metadata file %s"),
+                                             arg_treefile);
+      return TRUE;
     }
-  else
+
+  batch = meta_tree_batch_new ();
+  has_set = add_data_to_batch (batch, arg_path, arg_data);
+  tree_info_apply_batch (info, batch, invocation,
+                         has_set ?
+                         _("Unable to set metadata key") :
+                         _("Unable to unset metadata key"));
+  
+  return TRUE;
+}
+
+static gboolean
+handle_set_batch (GVfsMetadata *object,
+                  GDBusMethodInvocation *invocation,
+                  const gchar *arg_treefile,
+                  GVariant *arg_entries,
+                  GVfsMetadata *daemon)
+{
+  TreeInfo *info;
+  MetaTreeBatch *batch;
+  const gchar *path;
+  GVariantIter iter;
+  GVariant *data;
+  gboolean has_set;
+
+  info = tree_info_lookup (arg_treefile);
+  if (info == NULL)
     {
-      gvfs_metadata_complete_set (object, invocation);
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_IO_ERROR,
+                                             G_IO_ERROR_NOT_FOUND,
+                                             _("Can't find metadata file %s"),
+                                             arg_treefile);
+      return TRUE;
     }
-  
+
+  /* All entries go into the journal together, with one writeout */
+  batch = meta_tree_batch_new ();
+  has_set = FALSE;
+  g_variant_iter_init (&iter, arg_entries);
+  while (g_variant_iter_next (&iter, "(^&ay@a{sv})", &path, &data))
+    {
+      if (add_data_to_batch (batch, path, data))
+        has_set = TRUE;
+      g_variant_unref (data);
+    }
+  tree_info_apply_batch (info, batch, invocation,
+                         has_set ?
+                         _("Unable to set metadata key") :
+                         _("Unable to unset metadata key"));
+
   return TRUE;
 }
 
@@ -316,6 +937,7 @@ handle_unset (GVfsMetadata *object,
               GVfsMetadata *daemon)
 {
   TreeInfo *info;
+  MetaTreeBatch *batch;
 
   info = tree_info_lookup (arg_treefile);
   if (info == NULL)
@@ -328,17 +950,10 @@ handle_unset (GVfsMetadata *object,
       return TRUE;
     }
 
-  if (!meta_tree_unset (info->tree, arg_path, arg_key))
-    {
-      g_dbus_method_invocation_return_error_literal (invocation,
-                                                     G_IO_ERROR,
-                                                     G_IO_ERROR_FAILED,
-                                                     _("Unable to unset metadata key"));
-      return TRUE;
-    }
-
-  tree_info_schedule_writeout (info);
-  gvfs_metadata_complete_unset (object, invocation);
+  batch = meta_tree_batch_new ();
+  meta_tree_batch_unset (batch, arg_path, arg_key);
+  tree_info_apply_batch (info, batch, invocation,
+                         _("Unable to unset metadata key"));
 
   return TRUE;
 }
@@ -351,6 +966,7 @@ handle_remove (GVfsMetadata *object,
                GVfsMetadata *daemon)
 {
   TreeInfo *info;
+  MetaTreeBatch *batch;
 
   info = tree_info_lookup (arg_treefile);
   if (info == NULL)
@@ -363,17 +979,10 @@ handle_remove (GVfsMetadata *object,
       return TRUE;
     }
 
-  if (!meta_tree_remove (info->tree, arg_path))
-    {
-      g_dbus_method_invocation_return_error_literal (invocation,
-                                                     G_IO_ERROR,
-                                                     G_IO_ERROR_FAILED,
-                                                     _("Unable to remove metadata keys"));
-      return TRUE;
-    }
-
-  tree_info_schedule_writeout (info);
-  gvfs_metadata_complete_remove (object, invocation);
+  batch = meta_tree_batch_new ();
+  meta_tree_batch_remove (batch, arg_path);
+  tree_info_apply_batch (info, batch, invocation,
+                         _("Unable to remove metadata keys"));
   
   return TRUE;
 }
@@ -387,6 +996,7 @@ handle_move (GVfsMetadata *object,
              GVfsMetadata *daemon)
 {
   TreeInfo *info;
+  MetaTreeBatch *batch;
 
   info = tree_info_lookup (arg_treefile);
   if (info == NULL)
@@ -399,22 +1009,69 @@ handle_move (GVfsMetadata *object,
       return TRUE;
     }
 
-  /* Overwrites any dest */
-  if (!meta_tree_copy (info->tree, arg_path, arg_dest_path))
+  /* Copy (overwriting any dest) and remove the source together */
+  batch = meta_tree_batch_new ();
+  meta_tree_batch_copy (batch, arg_path, arg_dest_path);
+  meta_tree_batch_remove (batch, arg_path);
+  tree_info_apply_batch (info, batch, invocation,
+                         _("Unable to move metadata keys"));
+  
+  return TRUE;
+}
+
+static gboolean
+handle_get_statistics (GVfsMetadata *object,
+                       GDBusMethodInvocation *invocation,
+                       const gchar *arg_treefile,
+                       GVfsMetadata *daemon)
+{
+  TreeInfo *info;
+  GVariantBuilder builder;
+  gsize used, size;
+  guint64 tree_bytes_written;
+  guint journal_grows;
+
+  info = tree_info_lookup (arg_treefile);
+  if (info == NULL)
     {
-      g_dbus_method_invocation_return_error_literal (invocation,
-                                                     G_IO_ERROR,
-                                                     G_IO_ERROR_FAILED,
-                                                     _("Unable to move metadata keys"));
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_IO_ERROR,
+                                             G_IO_ERROR_NOT_FOUND,
+                                             _("Can't find metadata file %s"),
+                                             arg_treefile);
       return TRUE;
     }
 
-  /* Remove source if copy succeeded (ignoring errors) */
-  meta_tree_remove (info->tree, arg_path);
+  meta_tree_get_journal_fill (info->tree, &used, &size);
+  meta_tree_get_write_stats (info->tree, &tree_bytes_written, &journal_grows);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}", "journal-used", g_variant_new_uint64 (used));
+  g_variant_builder_add (&builder, "{sv}", "journal-size", g_variant_new_uint64 (size));
+  g_variant_builder_add (&builder, "{sv}", "journal-grows", g_variant_new_uint32 (journal_grows));
+  g_variant_builder_add (&builder, "{sv}", "on-nfs", g_variant_new_boolean (meta_tree_is_on_nfs (info->tree)));
+  g_variant_builder_add (&builder, "{sv}", "tree-bytes-written", g_variant_new_uint64 (tree_bytes_written));
+  g_variant_builder_add (&builder, "{sv}", "write-rate", g_variant_new_double (info->write_rate));
+  g_variant_builder_add (&builder, "{sv}", "writes", g_variant_new_uint32 (info->num_writes));
+  g_variant_builder_add (&builder, "{sv}", "bytes-written", g_variant_new_uint64 (info->bytes_written));
+  g_variant_builder_add (&builder, "{sv}", "deferred-writes", g_variant_new_uint32 (info->num_deferred_writes));
+  g_variant_builder_add (&builder, "{sv}", "writeout-pending", g_variant_new_boolean (info->writeout_queued));
+  g_variant_builder_add (&builder, "{sv}", "writeouts", g_variant_new_uint32 (info->num_writeouts));
+  g_variant_builder_add (&builder, "{sv}", "early-writeouts", g_variant_new_uint32 (info->num_early_writeouts));
+  g_variant_builder_add (&builder, "{sv}", "failed-writeouts", g_variant_new_uint32 (info->num_failed_writeouts));
+  g_variant_builder_add (&builder, "{sv}", "last-writeout-usecs", g_variant_new_int64 (info->last_writeout_usecs));
+  g_variant_builder_add (&builder, "{sv}", "total-writeout-usecs", g_variant_new_int64 (info->total_writeout_usecs));
+  if (info->gc_root != NULL)
+    {
+      g_variant_builder_add (&builder, "{sv}", "gc-walks", g_variant_new_uint32 (info->gc_walks));
+      g_variant_builder_add (&builder, "{sv}", "gc-pending", g_variant_new_uint32 (info->gc_dead->len));
+      g_variant_builder_add (&builder, "{sv}", "gc-removed", g_variant_new_uint32 (info->gc_removed));
+      g_variant_builder_add (&builder, "{sv}", "gc-reclaimed-bytes", g_variant_new_uint64 (info->gc_reclaimed));
+    }
+
+  gvfs_metadata_complete_get_statistics (object, invocation,
+                                         g_variant_builder_end (&builder));
 
-  tree_info_schedule_writeout (info);
-  gvfs_metadata_complete_move (object, invocation);
-  
   return TRUE;
 }
 
@@ -428,10 +1085,12 @@ on_name_acquired (GDBusConnection *connection,
   skeleton = gvfs_metadata_skeleton_new ();
   
   g_signal_connect (skeleton, "handle-set", G_CALLBACK (handle_set), skeleton);
+  g_signal_connect (skeleton, "handle-set-batch", G_CALLBACK (handle_set_batch), skeleton);
   g_signal_connect (skeleton, "handle-unset", G_CALLBACK (handle_unset), skeleton);
   g_signal_connect (skeleton, "handle-get", G_CALLBACK (handle_get), skeleton);
   g_signal_connect (skeleton, "handle-remove", G_CALLBACK (handle_remove), skeleton);
   g_signal_connect (skeleton, "handle-move", G_CALLBACK (handle_move), skeleton);
+  g_signal_connect (skeleton, "handle-get-statistics", G_CALLBACK (handle_get_statistics), skeleton);
 
   error = NULL;
   if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (skeleton), connection,
@@ -478,8 +1137,12 @@ main (int argc, char *argv[])
   guint name_owner_id;
   GBusNameOwnerFlags flags;
   GOptionContext *context;
+  gint journal_size, max_journal_size;
   const GOptionEntry options[] = {
     { "replace", 'r', 0, G_OPTION_ARG_NONE, &replace,  N_("Replace old daemon."), NULL },
+    { "journal-size", 0, 0, G_OPTION_ARG_INT, &journal_size, N_("Size of new journals in KiB"), N_("SIZE") },
+    { "max-journal-size", 0, 0, G_OPTION_ARG_INT, &max_journal_size, N_("Grow journals up to this size in KiB before writing out"), N_("SIZE") },
+    { "nfs-idle-writeout", 0, 0, G_OPTION_ARG_NONE, &nfs_idle_writeout, N_("Only write trees on NFS when idle or on exit"), NULL },
     { NULL }
   };
 
@@ -497,6 +1160,8 @@ main (int argc, char *argv[])
   g_option_context_add_main_entries (context, options, GETTEXT_PACKAGE);
 
   replace = FALSE;
+  journal_size = 0;
+  max_journal_size = 0;
   name_owner_id = 0;
 
   error = NULL;
@@ -516,6 +1181,10 @@ main (int argc, char *argv[])
 
   g_option_context_free (context);
 
+  if (journal_size > 0 || max_journal_size > 0)
+    meta_tree_set_journal_size (MAX (journal_size, 0) * (gsize) 1024,
+                                MAX (max_journal_size, 0) * (gsize) 1024);
+
   loop = g_main_loop_new (NULL, FALSE);
 
   error = NULL;
@@ -533,6 +1202,8 @@ main (int argc, char *argv[])
 				      NULL,
 				      (GDestroyNotify)tree_info_free);
 
+  writeout_pool = g_thread_pool_new (writeout_thread, NULL, 1, TRUE, NULL);
+
   g_dbus_connection_set_exit_on_close (conn, FALSE);
   g_signal_connect (conn, "closed", G_CALLBACK (on_connection_closed), loop);
 
@@ -0,0 +1,293 @@
+#include "config.h"
+#include "metatree.h"
+#include "metabuilder.h"
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+/* Fuzz target for the tree and journal verification in meta_tree_init()
+ * and meta_journal_open().
+ *
+ * An input is a 32-bit big endian length, followed by that many bytes of
+ * tree file and the rest as its journal. The journal is stored under the
+ * name derived from the tag in the tree header, so mutations of a valid
+ * tree and journal pair reach the journal validation code.
+ *
+ * When built with -DMETA_FUZZ_LIBFUZZER (meta-fuzz-libfuzzer, with
+ * --enable-libfuzzer) only LLVMFuzzerTestOneInput() is provided.
+ * Otherwise main() runs every file given on the command line, or with
+ * --make-seed writes an input from an existing tree and journal. */
+
+#define MAX_VISITED 1000
+#define MAX_DEPTH 8
+
+int LLVMFuzzerTestOneInput (const guint8 *data, gsize size);
+
+static char *fuzz_dir = NULL;
+static char *tree_filename = NULL;
+
+static gboolean
+collect_child (const char *entry,
+	       guint64 last_changed,
+	       gboolean has_children,
+	       gboolean has_data,
+	       gpointer user_data)
+{
+  GPtrArray *children = user_data;
+
+  if (children->len < MAX_VISITED)
+    g_ptr_array_add (children, g_strdup (entry));
+  return TRUE;
+}
+
+static gboolean
+visit_key (const char *key,
+	   MetaKeyType type,
+	   gpointer value,
+	   gpointer user_data)
+{
+  guint *visited = user_data;
+
+  (*visited)++;
+  return *visited < MAX_VISITED;
+}
+
+static gboolean
+visit_dir_key (const char *entry,
+	       const char *key,
+	       MetaKeyType type,
+	       gpointer value,
+	       gpointer user_data)
+{
+  guint *visited = user_data;
+
+  (*visited)++;
+  return *visited < MAX_VISITED;
+}
+
+/* The enumeration callbacks run with the tree lock held, so children are
+   collected first and visited afterwards */
+static void
+visit (MetaTree *tree,
+       const char *path,
+       int depth,
+       guint *visited)
+{
+  GPtrArray *children;
+  char *child, *value, **values;
+  guint i;
+
+  if (depth > MAX_DEPTH || *visited >= MAX_VISITED)
+    return;
+  (*visited)++;
+
+  meta_tree_get_last_changed (tree, path);
+  meta_tree_lookup_key_type (tree, path, "custom-icon");
+  value = meta_tree_lookup_string (tree, path, "custom-icon");
+  g_free (value);
+  values = meta_tree_lookup_stringv (tree, path, "emblems");
+  g_strfreev (values);
+
+  meta_tree_enumerate_keys (tree, path, visit_key, visited);
+  meta_tree_enumerate_dir_keys (tree, path, visit_dir_key, visited);
+
+  children = g_ptr_array_new_with_free_func (g_free);
+  meta_tree_enumerate_dir (tree, path, collect_child, children);
+  for (i = 0; i < children->len; i++)
+    {
+      if (strcmp (path, "/") == 0)
+	child = g_strconcat ("/", children->pdata[i], NULL);
+      else
+	child = g_strconcat (path, "/", children->pdata[i], NULL);
+      visit (tree, child, depth + 1, visited);
+      g_free (child);
+    }
+  g_ptr_array_free (children, TRUE);
+}
+
+static void
+remove_fuzz_files (void)
+{
+  GDir *dir;
+  const char *name;
+  char *path;
+
+  dir = g_dir_open (fuzz_dir, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      path = g_build_filename (fuzz_dir, name, NULL);
+      g_unlink (path);
+      g_free (path);
+    }
+  g_dir_close (dir);
+}
+
+/* libFuzzer never returns to us, so clean up on exit */
+static void
+remove_fuzz_dir (void)
+{
+  remove_fuzz_files ();
+  g_rmdir (fuzz_dir);
+}
+
+int
+LLVMFuzzerTestOneInput (const guint8 *data,
+			gsize size)
+{
+  MetaTree *tree;
+  char *journal_filename;
+  guint32 tree_len, tag;
+  guint visited;
+
+  if (size < 4)
+    return 0;
+
+  if (fuzz_dir == NULL)
+    {
+      fuzz_dir = g_dir_make_tmp ("meta-fuzz-XXXXXX", NULL);
+      if (fuzz_dir == NULL)
+	abort ();
+      tree_filename = g_build_filename (fuzz_dir, "fuzz.tree", NULL);
+      atexit (remove_fuzz_dir);
+    }
+
+  memcpy (&tree_len, data, 4);
+  tree_len = GUINT32_FROM_BE (tree_len);
+  data += 4;
+  size -= 4;
+  tree_len = MIN (tree_len, size);
+
+  if (!g_file_set_contents (tree_filename, (const char *)data, tree_len, NULL))
+    abort ();
+
+  /* The random tag is at offset 12 of the tree header */
+  if (tree_len >= 16 && size > tree_len)
+    {
+      memcpy (&tag, data + 12, 4);
+      tag = GUINT32_FROM_BE (tag);
+      journal_filename = meta_builder_get_journal_filename (tree_filename, tag);
+      g_file_set_contents (journal_filename, (const char *)data + tree_len,
+			   size - tree_len, NULL);
+      g_free (journal_filename);
+    }
+
+  tree = meta_tree_open (tree_filename, FALSE);
+  if (meta_tree_exists (tree))
+    {
+      visited = 0;
+      visit (tree, "/", 0, &visited);
+      meta_tree_refresh (tree);
+    }
+  meta_tree_unref (tree);
+
+  remove_fuzz_files ();
+
+  return 0;
+}
+
+#ifndef META_FUZZ_LIBFUZZER
+
+static char *make_seed = NULL;
+static GOptionEntry entries[] =
+{
+  { "make-seed", 's', 0, G_OPTION_ARG_FILENAME, &make_seed,
+    "Write an input made from the tree file given as argument", "OUTPUT" },
+  { NULL }
+};
+
+static gboolean
+write_seed (const char *filename,
+	    const char *output)
+{
+  GError *error = NULL;
+  char *tree_data, *journal_data, *journal_filename;
+  gsize tree_len, journal_len;
+  guint32 len, tag;
+  GString *seed;
+  gboolean res;
+
+  if (!g_file_get_contents (filename, &tree_data, &tree_len, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  journal_data = NULL;
+  journal_len = 0;
+  if (tree_len >= 16)
+    {
+      memcpy (&tag, tree_data + 12, 4);
+      tag = GUINT32_FROM_BE (tag);
+      journal_filename = meta_builder_get_journal_filename (filename, tag);
+      g_file_get_contents (journal_filename, &journal_data, &journal_len, NULL);
+      g_free (journal_filename);
+    }
+
+  len = GUINT32_TO_BE (tree_len);
+  seed = g_string_new_len ((char *)&len, 4);
+  g_string_append_len (seed, tree_data, tree_len);
+  if (journal_data)
+    g_string_append_len (seed, journal_data, journal_len);
+
+  res = g_file_set_contents (output, seed->str, seed->len, &error);
+  if (!res)
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+    }
+
+  g_string_free (seed, TRUE);
+  g_free (journal_data);
+  g_free (tree_data);
+
+  return res;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  char *contents;
+  gsize len;
+  int i;
+
+  context = g_option_context_new ("<input>... - run metadata fuzz inputs");
+  g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("option parsing failed: %s\n", error->message);
+      return 1;
+    }
+
+  if (argc < 2)
+    {
+      g_printerr ("No input specified\n");
+      return 1;
+    }
+
+  if (make_seed)
+    return write_seed (argv[1], make_seed) ? 0 : 1;
+
+  for (i = 1; i < argc; i++)
+    {
+      if (!g_file_get_contents (argv[i], &contents, &len, &error))
+	{
+	  g_printerr ("%s\n", error->message);
+	  g_clear_error (&error);
+	  continue;
+	}
+
+      LLVMFuzzerTestOneInput ((const guint8 *)contents, len);
+      g_free (contents);
+    }
+
+  return 0;
+}
+
+#endif
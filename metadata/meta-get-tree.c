@@ -5,13 +5,40 @@
 /*static gboolean recursive = FALSE;*/
 static gboolean verbose = FALSE;
 static gboolean pause = FALSE;
+static int bench_iterations = 0;
+static char *bench_key = "custom-icon";
 static GOptionEntry entries[] =
 {
   { "verbose", 'l', 0, G_OPTION_ARG_NONE, &verbose, "Verbose", NULL },
   { "pause", 'p', 0, G_OPTION_ARG_NONE, &pause, "Pause", NULL },
+  { "bench", 'b', 0, G_OPTION_ARG_INT, &bench_iterations, "Time N lookups of the key for each file", "N" },
+  { "key", 'k', 0, G_OPTION_ARG_STRING, &bench_key, "Key to look up when benchmarking", "KEY" },
   { NULL }
 };
 
+static void
+bench_lookups (MetaTree *tree,
+	       const char *tree_path)
+{
+  GTimer *timer;
+  char *value;
+  double elapsed;
+  int i;
+
+  timer = g_timer_new ();
+  for (i = 0; i < bench_iterations; i++)
+    {
+      value = meta_tree_lookup_string (tree, tree_path, bench_key);
+      g_free (value);
+    }
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  g_print ("%d lookups of %s in %.3f s (%.0f ns per lookup)\n",
+	   bench_iterations, bench_key, elapsed,
+	   elapsed * 1e9 / bench_iterations);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -47,6 +74,8 @@ main (int argc,
       tree = meta_lookup_cache_lookup_path (cache, argv[i], statbuf.st_dev,
 					    FALSE, &tree_path);
       g_print ("tree: %s (exists: %d), tree path: %s\n", meta_tree_get_filename (tree), meta_tree_exists (tree), tree_path);
+      if (bench_iterations > 0)
+	bench_lookups (tree, tree_path);
       if (pause)
 	{
 	  char buffer[1000];
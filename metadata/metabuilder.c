@@ -48,16 +48,22 @@
 
 
 #define MAJOR_VERSION 1
-#define MINOR_VERSION 0
+#define MINOR_VERSION 2
 #define MAJOR_JOURNAL_VERSION 1
-#define MINOR_JOURNAL_VERSION 0
+#define MINOR_JOURNAL_VERSION 1
 #define NEW_JOURNAL_SIZE (32*1024)
+#define MIN_JOURNAL_SIZE (4*1024)
 
 #define RANDOM_TAG_OFFSET 12
 #define ROTATED_OFFSET 8
+#define ROOT_OFFSET 16
+#define SEGMENT_INFO_OFFSET 32
 
 #define KEY_IS_LIST_MASK (1<<31)
 
+#define HASH_EMPTY 0xffffffff
+#define MAX_HASH_SEEDS 64
+
 MetaBuilder *
 meta_builder_new (void)
 {
@@ -262,6 +268,7 @@ meta_builder_remove (MetaBuilder *builder,
       /* Removing root not allowed, just remove children */
       g_list_free_full (f->children, (GDestroyNotify)metafile_free);
       f->children = NULL;
+      f->old_children = 0;
       if (mtime)
 	f->last_changed = mtime;
     }
@@ -463,6 +470,46 @@ meta_builder_print (MetaBuilder *builder)
   metafile_print (builder->root, 0, NULL);
 }
 
+/* The hash used for the index tables, see file-format.txt. This is
+   stored in the file, so it must never change for a given version. */
+guint32
+meta_builder_hash_name (const char *name,
+			guint32     seed)
+{
+  const guchar *p;
+  guint32 h;
+
+  /* FNV-1a */
+  h = 2166136261U ^ seed;
+  for (p = (const guchar *)name; *p != 0; p++)
+    {
+      h ^= *p;
+      h *= 16777619U;
+    }
+
+  /* Mix the high bits into the low bits used for the bucket */
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+
+  return h;
+}
+
+static guint32
+hash_table_size (guint32 num_entries)
+{
+  guint32 size;
+
+  /* Power of two, at most half full */
+  size = 1;
+  while (size < num_entries * 2)
+    size <<= 1;
+
+  return size;
+}
+
 static void
 set_uint32 (GString *s, guint32 offset, guint32 val)
 {
@@ -602,6 +649,7 @@ append_string (GString *out,
 
 static void
 string_block_end (GString *out,
+		  MetaBuilder *builder,
 		  GHashTable *string_block)
 {
   char *string;
@@ -614,7 +662,7 @@ string_block_end (GString *out,
 				 (gpointer *)&string,
 				 (gpointer *)&offsets))
     {
-      string_offset = out->len;
+      string_offset = builder->offset_base + out->len;
       g_string_append_len (out, string, strlen (string) + 1);
       for (l = offsets; l != NULL; l = l->next)
 	{
@@ -663,6 +711,7 @@ append_stringv (GString *out,
 
 static void
 stringv_block_end (GString *out,
+		   MetaBuilder *builder,
 		   GHashTable *string_block,
 		   GList *stringv_block)
 {
@@ -675,7 +724,7 @@ stringv_block_end (GString *out,
     {
       info = l->data;
 
-      table_offset = out->len;
+      table_offset = builder->offset_base + out->len;
 
       append_uint32 (out, g_list_length (info->strings), NULL);
       for (s = info->strings; s != NULL; s = s->next)
@@ -693,6 +742,68 @@ stringv_block_end (GString *out,
     g_string_append_c (out, 0);
 }
 
+/* Children that need to be in the file, in sorted order */
+static GList *
+collect_children_to_write (MetaFile *file)
+{
+  MetaFile *child;
+  GList *l, *children;
+
+  children = NULL;
+  for (l = file->children; l != NULL; l = l->next)
+    {
+      child = l->data;
+
+      /* No mtime, children or metadata, no need for this
+	 to be in the file */
+      if (child->last_changed == 0 &&
+	  child->children == NULL &&
+	  child->data == NULL &&
+	  child->old_children == 0 &&
+	  child->old_metadata == 0)
+	continue;
+
+      children = g_list_prepend (children, child);
+    }
+
+  return g_list_reverse (children);
+}
+
+/* Open addressed hash table of (hash, index + 1) pairs, with linear
+   probing. Follows the children array of a dir. */
+static void
+write_children_hash (GString *out,
+		     GList *children)
+{
+  guint32 size, mask, bucket, hash, i;
+  guint32 *table;
+  MetaFile *child;
+  GList *l;
+
+  size = hash_table_size (g_list_length (children));
+  mask = size - 1;
+  table = g_new0 (guint32, size * 2);
+
+  for (l = children, i = 0; l != NULL; l = l->next, i++)
+    {
+      child = l->data;
+      hash = meta_builder_hash_name (child->name, 0);
+
+      bucket = hash & mask;
+      while (table[bucket * 2 + 1] != 0)
+	bucket = (bucket + 1) & mask;
+
+      table[bucket * 2] = hash;
+      table[bucket * 2 + 1] = i + 1;
+    }
+
+  append_uint32 (out, size, NULL);
+  for (i = 0; i < size * 2; i++)
+    append_uint32 (out, table[i], NULL);
+
+  g_free (table);
+}
+
 static void
 write_children (GString *out,
 		MetaBuilder *builder)
@@ -700,7 +811,7 @@ write_children (GString *out,
   GHashTable *strings;
   MetaFile *child, *file;
   GList *l;
-  GList *files;
+  GList *files, *children;
 
   files = g_list_prepend (NULL, builder->root);
 
@@ -715,36 +826,34 @@ write_children (GString *out,
       strings = string_block_begin ();
 
       if (file->children_pointer != 0)
-	set_uint32 (out, file->children_pointer, out->len);
+	set_uint32 (out, file->children_pointer,
+		    builder->offset_base + out->len);
 
-      append_uint32 (out, g_list_length (file->children), NULL);
+      children = collect_children_to_write (file);
+      append_uint32 (out, g_list_length (children), NULL);
 
-      for (l = file->children; l != NULL; l = l->next)
+      for (l = children; l != NULL; l = l->next)
 	{
 	  child = l->data;
 
-	  /* No mtime, children or metadata, no need for this
-	     to be in the file */
-	  if (child->last_changed == 0 &&
-	      child->children == NULL &&
-	      child->data == NULL)
-	    continue;
-
 	  append_string (out, child->name, strings);
-	  append_uint32 (out, 0, &child->children_pointer);
-	  append_uint32 (out, 0, &child->metadata_pointer);
+	  append_uint32 (out, child->old_children, &child->children_pointer);
+	  append_uint32 (out, child->old_metadata, &child->metadata_pointer);
 	  append_time_t (out, child->last_changed, builder);
 
-	  if (file->children)
-	    files = g_list_append (files, child);
+	  files = g_list_append (files, child);
 	}
 
-      string_block_end (out, strings);
+      write_children_hash (out, children);
+      g_list_free (children);
+
+      string_block_end (out, builder, strings);
     }
 }
 
 static void
 write_metadata_for_file (GString *out,
+			 MetaBuilder *builder,
 			 MetaFile *file,
 			 GList **stringvs,
 			 GHashTable *strings,
@@ -755,7 +864,7 @@ write_metadata_for_file (GString *out,
   guint32 key;
 
   g_assert (file->metadata_pointer != 0);
-  set_uint32 (out, file->metadata_pointer, out->len);
+  set_uint32 (out, file->metadata_pointer, builder->offset_base + out->len);
 
   append_uint32 (out, g_list_length (file->data), NULL);
 
@@ -790,10 +899,10 @@ write_metadata (GString *out,
     {
       strings = string_block_begin ();
       stringvs = stringv_block_begin ();
-      write_metadata_for_file (out, builder->root,
+      write_metadata_for_file (out, builder, builder->root,
 			       &stringvs, strings, key_hash);
-      stringv_block_end (out, strings, stringvs);
-      string_block_end (out, strings);
+      stringv_block_end (out, builder, strings, stringvs);
+      string_block_end (out, builder, strings);
     }
 
   /* the rest, breadth first with all files in one
@@ -815,15 +924,15 @@ write_metadata (GString *out,
 	  child = l->data;
 
 	  if (child->data != NULL)
-	    write_metadata_for_file (out, child,
+	    write_metadata_for_file (out, builder, child,
 				     &stringvs, strings, key_hash);
 
 	  if (child->children != NULL)
 	    files = g_list_append (files, child);
 	}
 
-      stringv_block_end (out, strings, stringvs);
-      string_block_end (out, strings);
+      stringv_block_end (out, builder, strings, stringvs);
+      string_block_end (out, builder, strings);
     }
 }
 
@@ -970,13 +1079,29 @@ meta_builder_get_journal_filename (const char *tree_filename, guint32 random_tag
   return ret;
 }
 
-gboolean
-meta_builder_create_new_journal (const char *filename, guint32 random_tag)
+static gsize new_journal_size = NEW_JOURNAL_SIZE;
+
+/* Sets the size of journals created from now on */
+void
+meta_builder_set_new_journal_size (gsize size)
+{
+  new_journal_size = CLAMP (size, MIN_JOURNAL_SIZE, G_MAXUINT32);
+  new_journal_size &= ~(gsize)3; /* Keep entries 32bit aligned */
+}
+
+/* Creates the journal for random_tag, starting out with the
+   num_entries complete entries stored in entries */
+static gboolean
+create_journal (const char *filename,
+		guint32 random_tag,
+		const char *entries,
+		gsize entries_len,
+		guint32 num_entries)
 {
   char *journal_name;
   guint32 size_offset;
   GString *out;
-  gsize pos;
+  gsize pos, size;
   gboolean res;
 
   journal_name = meta_builder_get_journal_filename (filename, random_tag);
@@ -997,11 +1122,18 @@ meta_builder_create_new_journal (const char *filename, guint32 random_tag)
 
   append_uint32 (out, random_tag, NULL);
   append_uint32 (out, 0, &size_offset);
-  append_uint32 (out, 0, NULL); /* Num entries, none so far */
+  append_uint32 (out, num_entries, NULL);
 
+  if (entries_len > 0)
+    g_string_append_len (out, entries, entries_len);
   pos = out->len;
 
-  g_string_set_size (out, NEW_JOURNAL_SIZE);
+  /* Leave at least as much room as the entries take */
+  size = new_journal_size;
+  while (size < pos * 2 && size < G_MAXUINT32 / 2)
+    size *= 2;
+
+  g_string_set_size (out, size);
   memset (out->str + pos, 0, out->len - pos);
 
   set_uint32 (out, size_offset, out->len);
@@ -1016,6 +1148,59 @@ meta_builder_create_new_journal (const char *filename, guint32 random_tag)
   return res;
 }
 
+gboolean
+meta_builder_create_new_journal (const char *filename, guint32 random_tag)
+{
+  return create_journal (filename, random_tag, NULL, 0, 0);
+}
+
+/* Collision free hash table of keyword ids, following the
+   keyword array */
+static void
+write_keywords_hash (GString *out,
+		     GList *keys)
+{
+  guint32 size, mask, bucket, seed, i;
+  guint32 *table;
+  gboolean collision;
+  GList *l;
+
+  size = hash_table_size (g_list_length (keys));
+  table = g_new (guint32, size);
+
+  seed = 0;
+  do
+    {
+      mask = size - 1;
+      for (i = 0; i < size; i++)
+	table[i] = HASH_EMPTY;
+
+      collision = FALSE;
+      for (l = keys, i = 0; l != NULL && !collision; l = l->next, i++)
+	{
+	  bucket = meta_builder_hash_name (l->data, seed) & mask;
+	  if (table[bucket] != HASH_EMPTY)
+	    collision = TRUE;
+	  table[bucket] = i;
+	}
+
+      if (collision && ++seed % MAX_HASH_SEEDS == 0)
+	{
+	  /* Hard to find a seed at this size, give it more room */
+	  size <<= 1;
+	  table = g_renew (guint32, table, size);
+	}
+    }
+  while (collision);
+
+  append_uint32 (out, seed, NULL);
+  append_uint32 (out, size, NULL);
+  for (i = 0; i < size; i++)
+    append_uint32 (out, table[i], NULL);
+
+  g_free (table);
+}
+
 static GString *
 metadata_create_static (MetaBuilder *builder,
 			guint32 *random_tag_out)
@@ -1030,8 +1215,9 @@ metadata_create_static (MetaBuilder *builder,
   guint32 attributes_pointer;
   gint64 time_t_min;
   gint64 time_t_max;
-  guint32 random_tag, root_name;
+  guint32 random_tag, root_name, base_size;
 
+  builder->offset_base = 0;
   out = g_string_new (NULL);
 
   /* HEADER */
@@ -1069,6 +1255,10 @@ metadata_create_static (MetaBuilder *builder,
   builder->time_t_base = time_t_min;
   append_int64 (out, builder->time_t_base);
 
+  /* Segment info, no segments yet */
+  append_uint32 (out, 0, &base_size);
+  append_uint32 (out, 0, NULL);
+
   /* Collect and sort all used keys */
   hash = g_hash_table_new (g_str_hash, g_str_equal);
   metafile_collect_keywords (builder->root, hash);
@@ -1090,7 +1280,8 @@ metadata_create_static (MetaBuilder *builder,
       append_string (out, key, strings);
       g_hash_table_insert (key_hash, key, GUINT_TO_POINTER (index));
     }
-  string_block_end (out, strings);
+  write_keywords_hash (out, keys);
+  string_block_end (out, builder, strings);
 
   /* update root pointer */
   set_uint32 (out, builder->root_pointer, out->len);
@@ -1118,33 +1309,32 @@ metadata_create_static (MetaBuilder *builder,
   write_children (out, builder);
   write_metadata (out, builder, key_hash);
 
+  set_uint32 (out, base_size, out->len);
+
   g_hash_table_destroy (key_hash);
   g_list_free (keys);
 
   return out;
 }
 
+/* Replaces filename with the fully written tmp_name, see
+   "Updates to stable" in file-format.txt. The new journal starts
+   out with the num_entries entries in journal_entries, which are
+   changes made after the contents of tmp_name were collected. */
 gboolean
-meta_builder_write (MetaBuilder *builder,
-		    const char *filename)
+meta_builder_install (const char *filename,
+		      const char *tmp_name,
+		      guint32     random_tag,
+		      const char *journal_entries,
+		      gsize       journal_len,
+		      guint32     num_entries)
 {
-  GString *out;
-  guint32 random_tag;
-  int fd, fd2, fd_dir;
-  char *tmp_name, *dirname;
-
-  out = metadata_create_static (builder, &random_tag);
-
-  tmp_name = g_strdup_printf ("%s.XXXXXX", filename);
-  fd = g_mkstemp (tmp_name);
-  if (fd == -1)
-    goto out;
+  int fd2, fd_dir;
+  char *dirname;
 
-  if (!write_all_data_and_close (fd, out->str, out->len))
-    goto out;
-
-  if (!meta_builder_create_new_journal (filename, random_tag))
-    goto out;
+  if (!create_journal (filename, random_tag,
+		       journal_entries, journal_len, num_entries))
+    return FALSE;
 
   /* Open old file so we can set it rotated */
   fd2 = open (filename, O_RDWR);
@@ -1152,7 +1342,7 @@ meta_builder_write (MetaBuilder *builder,
     {
       if (fd2 != -1)
 	close (fd2);
-      goto out;
+      return FALSE;
     }
 
   /* Sync the directory to make sure that the entry in the directory containing
@@ -1188,14 +1378,277 @@ meta_builder_write (MetaBuilder *builder,
 	}
     }
 
-  g_string_free (out, TRUE);
-  g_free (tmp_name);
   return TRUE;
+}
+
+/* Writes the tree to a temporary file next to filename and returns
+   its name, for installing with meta_builder_install() */
+char *
+meta_builder_write_tmp (MetaBuilder *builder,
+			const char  *filename,
+			guint32     *random_tag)
+{
+  GString *out;
+  int fd;
+  char *tmp_name;
+
+  out = metadata_create_static (builder, random_tag);
+
+  tmp_name = g_strdup_printf ("%s.XXXXXX", filename);
+  fd = g_mkstemp (tmp_name);
+  if (fd == -1)
+    goto out;
+
+  if (!write_all_data_and_close (fd, out->str, out->len))
+    goto out;
+
+  g_string_free (out, TRUE);
+  return tmp_name;
 
  out:
   if (fd != -1)
     g_unlink (tmp_name);
   g_string_free (out, TRUE);
   g_free (tmp_name);
-  return FALSE;
+  return NULL;
+}
+
+gboolean
+meta_builder_write (MetaBuilder *builder,
+		    const char *filename)
+{
+  guint32 random_tag;
+  char *tmp_name;
+  gboolean res;
+
+  tmp_name = meta_builder_write_tmp (builder, filename, &random_tag);
+  if (tmp_name == NULL)
+    return FALSE;
+
+  res = meta_builder_install (filename, tmp_name, random_tag, NULL, 0, 0);
+  if (!res)
+    g_unlink (tmp_name);
+  g_free (tmp_name);
+
+  return res;
+}
+
+/* Rough size of the blocks written for file and its descendants */
+static gsize
+estimate_segment_size (MetaFile *file)
+{
+  MetaFile *child;
+  MetaData *data;
+  GList *l, *v;
+  gsize size;
+
+  size = 0;
+
+  if (file->data != NULL)
+    size += 4;
+  for (l = file->data; l != NULL; l = l->next)
+    {
+      data = l->data;
+      size += 8;
+      if (data->is_list)
+	{
+	  size += 4;
+	  for (v = data->values; v != NULL; v = v->next)
+	    size += 4 + strlen (v->data) + 1;
+	}
+      else
+	size += strlen (data->value) + 1;
+    }
+
+  if (file->children != NULL)
+    size += 8;
+  for (l = file->children; l != NULL; l = l->next)
+    {
+      child = l->data;
+      /* dirent, name and hash table entries */
+      size += 16 + strlen (child->name) + 1 + 16;
+      size += estimate_segment_size (child);
+    }
+
+  return size;
+}
+
+static GString *
+metadata_create_segment (MetaBuilder *builder,
+			 gsize start,
+			 GHashTable *key_hash)
+{
+  GString *out;
+  guint32 root_name;
+
+  /* Offsets in the segment are relative to the start of the file,
+     where the segment will be written at start */
+  builder->offset_base = start;
+  out = g_string_sized_new (estimate_segment_size (builder->root));
+
+  /* Root dirent */
+  builder->root_pointer = start + out->len;
+  append_uint32 (out, 0, &root_name);
+  append_uint32 (out, builder->root->old_children,
+		 &builder->root->children_pointer);
+  append_uint32 (out, builder->root->old_metadata,
+		 &builder->root->metadata_pointer);
+  append_time_t (out, builder->root->last_changed, builder);
+
+  set_uint32 (out, root_name, start + out->len);
+  g_string_append_len (out, "/", 2);
+
+  /* Pad to 32bit */
+  while (out->len % 4 != 0)
+    g_string_append_c (out, 0);
+
+  write_children (out, builder);
+  write_metadata (out, builder, key_hash);
+
+  return out;
+}
+
+/* Writes all of data at offset in fd */
+static gboolean
+pwrite_all (int fd, const char *data, gsize len, off_t offset)
+{
+  gssize written;
+
+  while (len > 0)
+    {
+      written = pwrite (fd, data, len, offset);
+
+      if (written < 0)
+	{
+	  if (errno == EINTR || errno == EAGAIN)
+	    continue;
+	  return FALSE;
+	}
+      else if (written == 0)
+	return FALSE;
+
+      len -= written;
+      data += written;
+      offset += written;
+    }
+
+  return TRUE;
+}
+
+/* Appends a segment with the blocks of all files that are not
+   unchanged to the tree file open as fd, behind the old_len bytes of
+   the current tree, and syncs it. Readers don't see the segment until
+   it is published with meta_builder_publish_segment(). Returns FALSE
+   if this is not possible, in which case a full write is needed. */
+gboolean
+meta_builder_append_segment (MetaBuilder *builder,
+			     int          fd,
+			     gsize        old_len,
+			     char       **attributes,
+			     int          num_attributes,
+			     gint64       time_t_base,
+			     guint32     *root_pointer)
+{
+  GHashTable *key_hash, *keywords;
+  GHashTableIter iter;
+  GString *out;
+  char *key;
+  int i;
+  gboolean res;
+
+  if (old_len % 4 != 0 ||
+      old_len >= G_MAXUINT32)
+    return FALSE;
+
+  /* The existing blocks refer to keywords by index, so they
+     can only be reused as long as no new keywords are added */
+  key_hash = g_hash_table_new (g_str_hash, g_str_equal);
+  for (i = 0; i < num_attributes; i++)
+    if (attributes[i] != NULL)
+      g_hash_table_insert (key_hash, attributes[i], GUINT_TO_POINTER (i));
+
+  keywords = g_hash_table_new (g_str_hash, g_str_equal);
+  metafile_collect_keywords (builder->root, keywords);
+  res = TRUE;
+  g_hash_table_iter_init (&iter, keywords);
+  while (res && g_hash_table_iter_next (&iter, (gpointer *)&key, NULL))
+    res = g_hash_table_contains (key_hash, key);
+  g_hash_table_destroy (keywords);
+
+  if (!res)
+    {
+      g_hash_table_destroy (key_hash);
+      return FALSE;
+    }
+
+  /* The existing dirents store times relative to this */
+  builder->time_t_base = time_t_base;
+
+  out = metadata_create_segment (builder, old_len, key_hash);
+  g_hash_table_destroy (key_hash);
+
+  /* Anything behind old_len is left over from a failed append */
+  res = old_len + out->len < G_MAXUINT32 &&
+    pwrite_all (fd, out->str, out->len, old_len) &&
+    ftruncate (fd, old_len + out->len) == 0 &&
+    fsync (fd) == 0;
+
+  *root_pointer = builder->root_pointer;
+  g_string_free (out, TRUE);
+
+  return res;
+}
+
+/* Makes the segment appended with meta_builder_append_segment() the
+   current tree, see "Updates to stable" in file-format.txt. Like
+   with meta_builder_install(), the new journal starts out with the
+   num_entries entries in journal_entries. The random tag is written
+   last, readers reread the tree once it changed. */
+gboolean
+meta_builder_publish_segment (const char  *filename,
+			      int          fd,
+			      guint32      old_tag,
+			      guint32      random_tag,
+			      guint32      root_pointer,
+			      guint32      base_size,
+			      guint32      num_segments,
+			      const char  *journal_entries,
+			      gsize        journal_len,
+			      guint32      num_entries)
+{
+  GString *root, *info, *tag;
+  char *journal_name;
+  gboolean res;
+
+  if (!create_journal (filename, random_tag,
+		       journal_entries, journal_len, num_entries))
+    return FALSE;
+
+  root = g_string_new (NULL);
+  append_uint32 (root, root_pointer, NULL);
+  info = g_string_new (NULL);
+  append_uint32 (info, base_size, NULL);
+  append_uint32 (info, num_segments, NULL);
+  tag = g_string_new (NULL);
+  append_uint32 (tag, random_tag, NULL);
+
+  /* Once the tag is written the segment is in use */
+  res =
+    pwrite_all (fd, root->str, root->len, ROOT_OFFSET) &&
+    pwrite_all (fd, info->str, info->len, SEGMENT_INFO_OFFSET) &&
+    pwrite_all (fd, tag->str, tag->len, RANDOM_TAG_OFFSET);
+  if (res)
+    fsync (fd);
+
+  g_string_free (root, TRUE);
+  g_string_free (info, TRUE);
+  g_string_free (tag, TRUE);
+
+  /* Remove the journal that is not in use */
+  journal_name = meta_builder_get_journal_filename (filename,
+						     res ? old_tag : random_tag);
+  g_unlink (journal_name);
+  g_free (journal_name);
+
+  return res;
 }
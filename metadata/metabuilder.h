@@ -34,6 +34,10 @@ struct _MetaBuilder {
 
   guint32 root_pointer;
   gint64 time_t_base;
+
+  /* File offset of the start of the data being built, non-zero
+     when building a segment that is appended to an existing file */
+  guint32 offset_base;
 };
 
 struct _MetaFile {
@@ -44,6 +48,12 @@ struct _MetaFile {
 
   guint32 metadata_pointer;
   guint32 children_pointer;
+
+  /* When writing a segment with meta_builder_append_segment(),
+     non-zero if the children or metadata of this file are unchanged
+     and still at these offsets in the existing file */
+  guint32 old_children;
+  guint32 old_metadata;
 };
 
 struct _MetaData {
@@ -68,11 +78,40 @@ void         meta_builder_copy      (MetaBuilder *builder,
 				     guint64      mtime);
 gboolean     meta_builder_write     (MetaBuilder *builder,
 				     const char  *filename);
+char *       meta_builder_write_tmp (MetaBuilder *builder,
+				     const char  *filename,
+				     guint32     *random_tag);
+gboolean     meta_builder_append_segment (MetaBuilder *builder,
+				     int          fd,
+				     gsize        old_len,
+				     char       **attributes,
+				     int          num_attributes,
+				     gint64       time_t_base,
+				     guint32     *root_pointer);
+gboolean     meta_builder_publish_segment (const char  *filename,
+				     int          fd,
+				     guint32      old_tag,
+				     guint32      random_tag,
+				     guint32      root_pointer,
+				     guint32      base_size,
+				     guint32      num_segments,
+				     const char  *journal_entries,
+				     gsize        journal_len,
+				     guint32      num_entries);
+gboolean     meta_builder_install   (const char  *filename,
+				     const char  *tmp_name,
+				     guint32      random_tag,
+				     const char  *journal_entries,
+				     gsize        journal_len,
+				     guint32      num_entries);
 gboolean     meta_builder_create_new_journal (const char *filename,
 				     guint32      random_tag);
+void         meta_builder_set_new_journal_size (gsize size);
 char *       meta_builder_get_journal_filename (const char *tree_filename,
 				     guint32      random_tag);
 gboolean     meta_builder_is_on_nfs (const char  *filename);
+guint32      meta_builder_hash_name (const char  *name,
+				     guint32      seed);
 MetaFile *   metafile_new           (const char  *name,
 				     MetaFile    *parent);
 void         metafile_free          (MetaFile    *file);
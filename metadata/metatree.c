@@ -22,16 +22,20 @@
 
 #define MAGIC "\xda\x1ameta"
 #define MAGIC_LEN 6
+#define MAX_SEGMENTS 32
 #define MAJOR_VERSION 1
-#define MINOR_VERSION 0
+#define MINOR_VERSION 2
 #define JOURNAL_MAGIC "\xda\x1ajour"
 #define JOURNAL_MAGIC_LEN 6
 #define JOURNAL_MAJOR_VERSION 1
-#define JOURNAL_MINOR_VERSION 0
+#define JOURNAL_MINOR_VERSION 1
 
 #define KEY_IS_LIST_MASK (1<<31)
+#define HASH_EMPTY 0xffffffff
 
 static GRWLock metatree_lock;
+/* Held while a segment is appended to a tree file, before metatree_lock */
+static GMutex append_lock;
 
 typedef enum {
   JOURNAL_OP_SET_KEY,
@@ -52,6 +56,12 @@ typedef struct {
   guint64 time_t_base;
 } MetaFileHeader;
 
+/* Follows the header in files of minor version 2 and later */
+typedef struct {
+  guint32 base_size;
+  guint32 num_segments;
+} MetaFileSegmentInfo;
+
 typedef struct {
   guint32 name;
   guint32 children;
@@ -101,6 +111,7 @@ typedef struct {
   int fd;
   char *data;
   gsize len;
+  gboolean for_write;
 
   MetaJournalHeader *header;
   MetaJournalEntry *first_entry;
@@ -108,6 +119,12 @@ typedef struct {
   MetaJournalEntry *last_entry;
 
   gboolean journal_valid; /* True if all entries validated on open */
+
+  /* Index of the validated entries, see meta_journal_index_entry() */
+  GPtrArray *entries;
+  GHashTable *key_index;
+  GHashTable *path_op_index;
+  GHashTable *child_index;
 } MetaJournal;
 
 struct _MetaTree {
@@ -129,6 +146,16 @@ struct _MetaTree {
   int num_attributes;
   char **attributes;
 
+  /* Write statistics, kept over re-reads */
+  guint64 bytes_written;
+  guint journal_grows;
+
+  /* Hash index, for files of MINOR_VERSION 1 and newer */
+  gboolean has_index;
+  guint32 attributes_hash_seed;
+  guint32 attributes_hash_size;
+  guint32 *attributes_hash;
+
   MetaJournal *journal;
 };
 
@@ -221,6 +248,10 @@ meta_tree_clear (MetaTree *tree)
   tree->num_attributes = 0;
   tree->attributes = NULL;
 
+  tree->has_index = FALSE;
+  tree->attributes_hash = NULL;
+  tree->attributes_hash_size = 0;
+
   tree->tag = 0;
   tree->time_t_base = 0;
   tree->header = NULL;
@@ -338,6 +369,38 @@ safe_open (MetaTree *tree,
 
 }
 
+/* The keyword hash follows the keyword array */
+static gboolean
+meta_tree_init_index (MetaTree *tree,
+		      guint32 *keywords_hash)
+{
+  guint32 pos, size, id, i;
+
+  pos = (char *)keywords_hash - tree->data;
+  if (verify_block_pointer (tree, GUINT32_TO_BE (pos), 2 * sizeof (guint32)) == NULL)
+    return FALSE;
+
+  size = GUINT32_FROM_BE (keywords_hash[1]);
+  if (size == 0 || (size & (size - 1)) != 0 ||
+      size > tree->len / sizeof (guint32) ||
+      verify_block_pointer (tree, GUINT32_TO_BE (pos), (2 + size) * sizeof (guint32)) == NULL)
+    return FALSE;
+
+  for (i = 0; i < size; i++)
+    {
+      id = GUINT32_FROM_BE (keywords_hash[2 + i]);
+      if (id != HASH_EMPTY && id >= tree->num_attributes)
+	return FALSE;
+    }
+
+  tree->attributes_hash_seed = GUINT32_FROM_BE (keywords_hash[0]);
+  tree->attributes_hash_size = size;
+  tree->attributes_hash = keywords_hash + 2;
+  tree->has_index = TRUE;
+
+  return TRUE;
+}
+
 static gboolean
 meta_tree_init (MetaTree *tree)
 {
@@ -420,6 +483,10 @@ meta_tree_init (MetaTree *tree)
 	goto err;
     }
 
+  if (tree->header->minor >= 1 &&
+      !meta_tree_init_index (tree, attributes + tree->num_attributes))
+    goto err;
+
   tree->tag = GUINT32_FROM_BE (tree->header->random_tag);
   tree->time_t_base = GINT64_FROM_BE (tree->header->time_t_base);
 
@@ -547,6 +614,10 @@ meta_tree_needs_rereading (MetaTree *tree)
   if (tree->fd == -1)
     return TRUE;
 
+  if (tree->header != NULL &&
+      GUINT32_FROM_BE (tree->header->random_tag) != tree->tag)
+    return TRUE; /* A segment was appended to the file */
+
   if (tree->header != NULL &&
       GUINT32_FROM_BE (tree->header->rotated) == 0)
     return FALSE; /* Got a valid tree and its not rotated */
@@ -634,6 +705,53 @@ find_dir_element (const void *_key, const void *_dirent)
   return strcmp (key->name, dirent_name);
 }
 
+/* Looks up name in the hash table following the children
+   array of dir, see file-format.txt */
+static MetaFileDirEnt *
+dir_lookup_child_hashed (MetaTree *tree,
+			 MetaFileDir *dir,
+			 const char *name)
+{
+  guint32 num_children, pos, size, mask, bucket, hash, index, i;
+  guint32 *table;
+  char *dirent_name;
+
+  num_children = GUINT32_FROM_BE (dir->num_children);
+  table = (guint32 *)&dir->children[num_children];
+
+  pos = (char *)table - tree->data;
+  if (verify_block_pointer (tree, GUINT32_TO_BE (pos), sizeof (guint32)) == NULL)
+    return NULL;
+
+  size = GUINT32_FROM_BE (table[0]);
+  if (size == 0 || (size & (size - 1)) != 0 ||
+      size > tree->len / (2 * sizeof (guint32)) ||
+      verify_block_pointer (tree, GUINT32_TO_BE (pos), (1 + 2 * size) * sizeof (guint32)) == NULL)
+    return NULL;
+  table++;
+
+  mask = size - 1;
+  hash = meta_builder_hash_name (name, 0);
+  bucket = hash & mask;
+  for (i = 0; i < size; i++)
+    {
+      index = GUINT32_FROM_BE (table[bucket * 2 + 1]);
+      if (index == 0 || index > num_children)
+	break;
+
+      if (GUINT32_FROM_BE (table[bucket * 2]) == hash)
+	{
+	  dirent_name = verify_string (tree, dir->children[index - 1].name);
+	  if (dirent_name != NULL && strcmp (name, dirent_name) == 0)
+	    return &dir->children[index - 1];
+	}
+
+      bucket = (bucket + 1) & mask;
+    }
+
+  return NULL;
+}
+
 /* modifies path!!! */
 static MetaFileDirEnt *
 dir_lookup_path (MetaTree *tree,
@@ -665,11 +783,16 @@ dir_lookup_path (MetaTree *tree,
   if (*end_path != 0)
     *end_path++ = 0;
 
-  key.name = path;
-  key.tree = tree;
-  dirent = bsearch (&key, &dir->children[0],
-		    GUINT32_FROM_BE (dir->num_children), sizeof (MetaFileDirEnt),
-		    find_dir_element);
+  if (tree->has_index)
+    dirent = dir_lookup_child_hashed (tree, dir, path);
+  else
+    {
+      key.name = path;
+      key.tree = tree;
+      dirent = bsearch (&key, &dir->children[0],
+			GUINT32_FROM_BE (dir->num_children), sizeof (MetaFileDirEnt),
+			find_dir_element);
+    }
 
   if (dirent == NULL)
     return NULL;
@@ -725,6 +848,18 @@ get_id_for_key (MetaTree *tree,
 		const char *attribute)
 {
   char **attribute_ptr;
+  guint32 id;
+
+  if (tree->attributes_hash != NULL)
+    {
+      id = meta_builder_hash_name (attribute, tree->attributes_hash_seed);
+      id = GUINT32_FROM_BE (tree->attributes_hash[id & (tree->attributes_hash_size - 1)]);
+
+      /* The table has no collisions, so this is the only candidate */
+      if (id == HASH_EMPTY || strcmp (tree->attributes[id], attribute) != 0)
+	return NO_KEY;
+      return id;
+    }
 
   attribute_ptr = bsearch (attribute, tree->attributes,
 			   tree->num_attributes, sizeof (char *),
@@ -773,6 +908,10 @@ meta_data_get_key (MetaTree *tree,
 static void
 meta_journal_free (MetaJournal *journal)
 {
+  g_ptr_array_free (journal->entries, TRUE);
+  g_hash_table_destroy (journal->key_index);
+  g_hash_table_destroy (journal->path_op_index);
+  g_hash_table_destroy (journal->child_index);
   g_free (journal->filename);
   munmap(journal->data, journal->len);
   close (journal->fd);
@@ -826,16 +965,205 @@ verify_journal_entry (MetaJournal *journal,
   return (MetaJournalEntry *)(journal->data + offset + entry_len);
 }
 
+static gboolean
+journal_entry_is_key_type (MetaJournalEntry *entry);
+static gboolean
+journal_entry_is_path_type (MetaJournalEntry *entry);
+
+/* Calls func for each prefix of path that get_prefix_match() can
+   match, without trailing slashes. This includes path itself, and
+   "" for the root. */
+static void
+journal_path_foreach_prefix (const char *path,
+			     void (*func) (const char *path,
+					   gsize len,
+					   gpointer user_data),
+			     gpointer user_data)
+{
+  gsize i;
+
+  for (i = 0; ; i++)
+    {
+      if ((path[i] == '/' || path[i] == 0) &&
+	  (i == 0 || path[i-1] != '/'))
+	func (path, i, user_data);
+
+      if (path[i] == 0)
+	break;
+    }
+}
+
+static void
+journal_index_add (GHashTable *index,
+		   char *key,
+		   guint32 entry_num)
+{
+  GArray *nums;
+
+  nums = g_hash_table_lookup (index, key);
+  if (nums == NULL)
+    {
+      nums = g_array_new (FALSE, FALSE, sizeof (guint32));
+      g_hash_table_insert (index, key, nums);
+    }
+  else
+    g_free (key);
+
+  g_array_append_val (nums, entry_num);
+}
+
+struct IndexChild {
+  MetaJournal *journal;
+  guint32 entry_num;
+};
+
+static void
+index_child_for_prefix (const char *path,
+			gsize len,
+			gpointer user_data)
+{
+  struct IndexChild *data = user_data;
+
+  journal_index_add (data->journal->child_index,
+		     g_strndup (path, len),
+		     data->entry_num);
+}
+
+/* The index is only a filter on which entries may affect a path,
+   the journal iterator callbacks still do the real matching. */
+static void
+meta_journal_index_entry (MetaJournal *journal,
+			  MetaJournalEntry *entry,
+			  guint32 entry_num)
+{
+  struct IndexChild data;
+  const char *path;
+  gsize len;
+
+  g_ptr_array_add (journal->entries, entry);
+
+  path = &entry->path[0];
+
+  if (journal_entry_is_key_type (entry))
+    journal_index_add (journal->key_index, g_strdup (path), entry_num);
+  else if (journal_entry_is_path_type (entry))
+    {
+      len = strlen (path);
+      while (len > 0 && path[len-1] == '/')
+	len--;
+      journal_index_add (journal->path_op_index, g_strndup (path, len), entry_num);
+    }
+
+  /* For enumerating directories, index the entry under all its parents */
+  data.journal = journal;
+  data.entry_num = entry_num;
+  journal_path_foreach_prefix (path, index_child_for_prefix, &data);
+}
+
+/* Maps the first len bytes of the journal file instead of the current
+   mapping, call with writer lock */
+static gboolean
+meta_journal_remap (MetaJournal *journal,
+		    gsize len)
+{
+  char *data;
+  int prot;
+  guint i;
+
+  prot = PROT_READ;
+  if (journal->for_write)
+    prot |= PROT_WRITE;
+  data = mmap (NULL, len, prot, MAP_SHARED, journal->fd, 0);
+  if (data == MAP_FAILED)
+    return FALSE;
+
+#define REBASE(ptr) ((gpointer)(data + ((char *)(ptr) - journal->data)))
+  for (i = 0; i < journal->entries->len; i++)
+    journal->entries->pdata[i] = REBASE (journal->entries->pdata[i]);
+  journal->header = (MetaJournalHeader *)data;
+  journal->first_entry = REBASE (journal->first_entry);
+  journal->last_entry = REBASE (journal->last_entry);
+#undef REBASE
+
+  munmap (journal->data, journal->len);
+  journal->data = data;
+  journal->len = len;
+
+  return TRUE;
+}
+
+/* Journals are grown up to this size before the tree is written out,
+   see meta_tree_set_journal_size() */
+static gsize journal_max_size = 0;
+
+/* Grows the journal so that needed more bytes fit, if that is allowed.
+   Call with writer lock. */
+static gboolean
+meta_journal_grow (MetaJournal *journal,
+		   gsize needed)
+{
+  gsize used, new_len;
+
+  if (!journal->for_write || !journal->journal_valid)
+    return FALSE;
+
+  /* Readers of older journals don't remap when the file grows */
+  if (journal->header->minor < JOURNAL_MINOR_VERSION)
+    return FALSE;
+
+  used = (char *)journal->last_entry - journal->data;
+  new_len = journal->len;
+  while (new_len - used < needed && new_len < journal_max_size)
+    new_len *= 2;
+  new_len = MIN (new_len, journal_max_size);
+  new_len &= ~(gsize)3;
+
+  if (new_len <= journal->len ||
+      new_len - used < needed ||
+      new_len > G_MAXUINT32)
+    return FALSE;
+
+  /* Readers remap when they see the new size in the header, so
+     only set it once the file is that large */
+  if (ftruncate (journal->fd, new_len) != 0)
+    return FALSE;
+
+  if (!meta_journal_remap (journal, new_len))
+    {
+      if (ftruncate (journal->fd, journal->len) != 0)
+	journal->journal_valid = FALSE;
+      return FALSE;
+    }
+
+  journal->header->file_size = GUINT32_TO_BE (new_len);
+
+  return TRUE;
+}
+
 /* Try to validate more entries, call with writer lock */
 static void
 meta_journal_validate_more (MetaJournal *journal)
 {
-  guint32 num_entries, i;
+  guint32 num_entries, file_size, i;
   MetaJournalEntry *entry, *next_entry;
+  struct stat statbuf;
 
   if (!journal->journal_valid)
     return; /* Once we've seen a failure, never look for more */
 
+  /* The writer grows the file before adding entries past the old end */
+  file_size = GUINT32_FROM_BE (*(volatile guint32 *)&journal->header->file_size);
+  if (file_size > journal->len)
+    {
+      if (fstat (journal->fd, &statbuf) != 0 ||
+	  statbuf.st_size < file_size ||
+	  !meta_journal_remap (journal, file_size))
+	{
+	  journal->journal_valid = FALSE;
+	  return;
+	}
+    }
+
   /* TODO: Use atomic read here? */
   num_entries = GUINT32_FROM_BE (*(volatile guint32 *)&journal->header->num_entries);
 
@@ -851,6 +1179,8 @@ meta_journal_validate_more (MetaJournal *journal)
 	  break;
 	}
 
+      meta_journal_index_entry (journal, entry, i);
+
       entry = next_entry;
       i++;
     }
@@ -1019,9 +1349,13 @@ meta_journal_entry_new_unset (guint64 mtime,
 
 
 /* Call with writer lock held */
+/* Appends num_entries complete entries, stored after each other in
+   entries, so that readers see them all at once */
 static gboolean
-meta_journal_add_entry (MetaJournal *journal,
-			GString *entry)
+meta_journal_add_entries (MetaJournal *journal,
+			  const char *entries,
+			  gsize len,
+			  guint32 num_entries)
 {
   char *ptr;
   guint32 offset;
@@ -1031,19 +1365,26 @@ meta_journal_add_entry (MetaJournal *journal,
   ptr = (char *)journal->last_entry;
   offset =  ptr - journal->data;
 
-  /* Does the entry fit? */
-  if (entry->len > journal->len - offset)
+  /* Do the entries fit? */
+  if (len > journal->len - offset)
     return FALSE;
 
-  memcpy (ptr, entry->str, entry->len);
+  memcpy (ptr, entries, len);
 
-  journal->header->num_entries = GUINT_TO_BE (journal->last_entry_num + 1);
+  journal->header->num_entries = GUINT_TO_BE (journal->last_entry_num + num_entries);
   meta_journal_validate_more (journal);
   g_assert (journal->journal_valid);
 
   return TRUE;
 }
 
+static gboolean
+meta_journal_add_entry (MetaJournal *journal,
+			GString *entry)
+{
+  return meta_journal_add_entries (journal, entry->str, entry->len, 1);
+}
+
 static MetaJournal *
 meta_journal_open (MetaTree *tree, const char *filename, gboolean for_write, guint32 tag)
 {
@@ -1099,11 +1440,19 @@ meta_journal_open (MetaTree *tree, const char *filename, gboolean for_write, gui
   journal->filename = g_strdup (filename);
   journal->fd = fd;
   journal->len = statbuf.st_size;
+  journal->for_write = for_write;
   journal->data = data;
   journal->header = (MetaJournalHeader *)data;
   journal->first_entry = (MetaJournalEntry *)(data + sizeof (MetaJournalHeader));
   journal->last_entry = journal->first_entry;
   journal->last_entry_num = 0;
+  journal->entries = g_ptr_array_new ();
+  journal->key_index = g_hash_table_new_full (g_str_hash, g_str_equal,
+					      g_free, (GDestroyNotify)g_array_unref);
+  journal->path_op_index = g_hash_table_new_full (g_str_hash, g_str_equal,
+						  g_free, (GDestroyNotify)g_array_unref);
+  journal->child_index = g_hash_table_new_full (g_str_hash, g_str_equal,
+						g_free, (GDestroyNotify)g_array_unref);
 
   if (memcmp (journal->header->magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0)
     goto err;
@@ -1111,8 +1460,15 @@ meta_journal_open (MetaTree *tree, const char *filename, gboolean for_write, gui
   if (journal->header->major != JOURNAL_MAJOR_VERSION)
     goto err;
 
+  /* The file can be larger if we crashed while growing it,
+     see meta_journal_grow() */
   if (journal->len != GUINT32_FROM_BE (journal->header->file_size))
-    goto err;
+    {
+      if (GUINT32_FROM_BE (journal->header->file_size) > journal->len ||
+	  GUINT32_FROM_BE (journal->header->file_size) < sizeof (MetaJournalHeader) ||
+	  !meta_journal_remap (journal, GUINT32_FROM_BE (journal->header->file_size)))
+	goto err;
+    }
 
   if (tag != GUINT32_FROM_BE (journal->header->random_tag))
     goto err;
@@ -1197,38 +1553,125 @@ typedef gboolean (*journal_path_callback) (MetaJournal *journal,
 					   char **iter_path,
 					   gpointer user_data);
 
+/* Returns the number of the newest entry in nums that is older
+   than before, or -1 if there is none */
+static gint64
+journal_index_find_before (GArray *nums,
+			   guint32 before)
+{
+  guint lo, hi, mid;
+
+  if (nums == NULL)
+    return -1;
+
+  /* nums is sorted, find the first element >= before */
+  lo = 0;
+  hi = nums->len;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (g_array_index (nums, guint32, mid) < before)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  if (lo == 0)
+    return -1;
+
+  return g_array_index (nums, guint32, lo - 1);
+}
+
+struct FindCandidate {
+  MetaJournal *journal;
+  guint32 before;
+  gint64 found;
+};
+
+static void
+find_path_op_for_prefix (const char *path,
+			 gsize len,
+			 gpointer user_data)
+{
+  struct FindCandidate *data = user_data;
+  char *prefix;
+  gint64 num;
+
+  prefix = g_strndup (path, len);
+  num = journal_index_find_before (g_hash_table_lookup (data->journal->path_op_index, prefix),
+				   data->before);
+  g_free (prefix);
+
+  data->found = MAX (data->found, num);
+}
+
+/* Finds the newest entry older than entry number before that may
+   affect path: key operations on the path itself, copy and remove
+   operations on the path or any of its parents, and if
+   include_children is set, any operation on a child. */
+static gint64
+meta_journal_find_candidate (MetaJournal *journal,
+			     const char *path,
+			     gboolean include_children,
+			     guint32 before)
+{
+  struct FindCandidate data;
+  char *key;
+  gsize len;
+  gint64 num;
+
+  data.journal = journal;
+  data.before = before;
+  data.found = journal_index_find_before (g_hash_table_lookup (journal->key_index, path),
+					  before);
+
+  journal_path_foreach_prefix (path, find_path_op_for_prefix, &data);
+
+  if (include_children)
+    {
+      len = strlen (path);
+      while (len > 0 && path[len-1] == '/')
+	len--;
+      key = g_strndup (path, len);
+      num = journal_index_find_before (g_hash_table_lookup (journal->child_index, key),
+				       before);
+      g_free (key);
+
+      data.found = MAX (data.found, num);
+    }
+
+  return data.found;
+}
+
+/* Calls the callbacks for journal entries that may affect path (and
+   if include_children is set, its children), from newest to oldest.
+   Returns the path in the stable tree that the remaining data for
+   path is at, or NULL if a callback stopped the iteration. */
 static char *
 meta_journal_iterate (MetaJournal *journal,
 		      const char *path,
+		      gboolean include_children,
 		      journal_key_callback key_callback,
 		      journal_path_callback path_callback,
 		      gpointer user_data)
 {
   MetaJournalEntry *entry;
-  guint32 *sizep, size;
   char *journal_path, *journal_key, *source_path;
   char *path_copy, *value;
   gboolean res;
   guint64 mtime;
+  gint64 num;
 
   path_copy = g_strdup (path);
 
   if (journal == NULL)
     return path_copy;
 
-  entry = journal->last_entry;
-  while (entry > journal->first_entry)
+  num = journal->entries->len;
+  while ((num = meta_journal_find_candidate (journal, path_copy,
+					     include_children, num)) >= 0)
     {
-      sizep = (guint32 *)entry;
-      size = GUINT32_FROM_BE (*(sizep-1));
-      entry = (MetaJournalEntry *)((char *)entry - size);
-      if (size < sizeof (MetaJournalEntry) ||
-	  entry < journal->first_entry ||
-	  entry >= journal->last_entry)
-        {
-          g_warning ("meta_journal_iterate: found wrong sized entry, possible journal corruption\n");
-          break;
-        }
+      entry = g_ptr_array_index (journal->entries, num);
 
       mtime = GUINT64_FROM_BE (entry->mtime);
       journal_path = &entry->path[0];
@@ -1266,7 +1709,8 @@ meta_journal_iterate (MetaJournal *journal,
 	      return NULL;
 	    }
 	}
-      else
+      else if (!journal_entry_is_key_type (entry) &&
+	       !journal_entry_is_path_type (entry))
 	g_warning ("Unknown journal entry type %d\n", entry->entry_type);
     }
 
@@ -1377,6 +1821,7 @@ meta_journal_reverse_map_path_and_key (MetaJournal *journal,
   data.key = key;
   res_path = meta_journal_iterate (journal,
 				   path,
+				   FALSE,
 				   journal_iter_key,
 				   journal_iter_path,
 				   &data);
@@ -1817,6 +2262,7 @@ meta_tree_enumerate_dir (MetaTree                         *tree,
 
   res_path = meta_journal_iterate (tree->journal,
 				   path,
+				   TRUE,
 				   enum_dir_iter_key,
 				   enum_dir_iter_path,
 				   &data);
@@ -1893,6 +2339,26 @@ get_key_info (EnumKeysData *data,
   return info;
 }
 
+/* The journal is iterated from newest to oldest entry, so only
+   the first operation seen on a key counts */
+static void
+key_info_set_from_journal (EnumKeysInfo *info,
+			   MetaJournalEntryType entry_type,
+			   gpointer value)
+{
+  if (info->seen)
+    return;
+
+  info->seen = TRUE;
+  if (entry_type == JOURNAL_OP_UNSET_KEY)
+    info->type = META_KEY_TYPE_NONE;
+  else if (entry_type == JOURNAL_OP_SET_KEY)
+    info->type = META_KEY_TYPE_STRING;
+  else
+    info->type = META_KEY_TYPE_STRINGV;
+  info->value = value;
+}
+
 static gboolean
 enum_keys_iter_key (MetaJournal *journal,
 		    MetaJournalEntryType entry_type,
@@ -1909,18 +2375,7 @@ enum_keys_iter_key (MetaJournal *journal,
   if (strcmp (path, *iter_path) == 0)
     {
       info = get_key_info (data, key);
-
-      if (!info->seen)
-	{
-	  info->seen = TRUE;
-	  if (entry_type == JOURNAL_OP_UNSET_KEY)
-	    info->type = META_KEY_TYPE_NONE;
-	  else if (entry_type == JOURNAL_OP_SET_KEY)
-	    info->type = META_KEY_TYPE_STRING;
-	  else
-	    info->type = META_KEY_TYPE_STRINGV;
-	  info->value = value;
-	}
+      key_info_set_from_journal (info, entry_type, value);
     }
 
   return TRUE; /* continue */
@@ -2033,20 +2488,57 @@ enumerate_data (MetaTree *tree,
   return TRUE;
 }
 
-void
-meta_tree_enumerate_keys (MetaTree                         *tree,
-			  const char                       *path,
-			  meta_tree_keys_enumerate_callback callback,
-			  gpointer                          user_data)
+static gboolean
+enumerate_journal_keys (GHashTable *keys,
+			meta_tree_keys_enumerate_callback callback,
+			gpointer user_data)
+{
+  GHashTableIter iter;
+  EnumKeysInfo *info;
+  gpointer value;
+  gboolean res;
+
+  g_hash_table_iter_init (&iter, keys);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer  *)&info))
+    {
+      if (info->type == META_KEY_TYPE_NONE)
+	continue;
+
+      if (info->type == META_KEY_TYPE_STRING)
+	value = info->value;
+      else
+	{
+	  g_assert (info->type == META_KEY_TYPE_STRINGV);
+	  value = get_stringv_from_journal (info->value, FALSE);
+	}
+
+      res = callback (info->key,
+		      info->type,
+		      value,
+		      user_data);
+
+      if (info->type == META_KEY_TYPE_STRINGV)
+	g_free (value);
+
+      if (!res)
+	return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Call with read lock held */
+static gboolean
+enumerate_keys_locked (MetaTree                         *tree,
+		       const char                       *path,
+		       meta_tree_keys_enumerate_callback callback,
+		       gpointer                          user_data)
 {
   EnumKeysData keydata;
   GHashTable *keys;
-  EnumKeysInfo *info;
   MetaFileData *data;
-  GHashTableIter iter;
   char *res_path;
-
-  g_rw_lock_reader_lock (&metatree_lock);
+  gboolean res;
 
   keydata.keys = keys =
     g_hash_table_new_full (g_str_hash,
@@ -2057,122 +2549,398 @@ meta_tree_enumerate_keys (MetaTree                         *tree,
 
   res_path = meta_journal_iterate (tree->journal,
 				   path,
+				   FALSE,
 				   enum_keys_iter_key,
 				   enum_keys_iter_path,
 				   &keydata);
 
+  res = TRUE;
   if (res_path != NULL)
     {
       data = meta_tree_lookup_data (tree, res_path);
       if (data != NULL)
-	{
-	  if (!enumerate_data (tree, data, keys, callback, user_data))
-	    goto out;
-	}
+	res = enumerate_data (tree, data, keys, callback, user_data);
     }
 
-  g_hash_table_iter_init (&iter, keys);
-  while (g_hash_table_iter_next (&iter, NULL, (gpointer  *)&info))
-    {
-      gpointer value;
+  if (res)
+    res = enumerate_journal_keys (keys, callback, user_data);
 
-      if (info->type == META_KEY_TYPE_NONE)
-	continue;
+  g_free (res_path);
+  g_hash_table_destroy (keys);
 
-      if (info->type == META_KEY_TYPE_STRING)
-	value = info->value;
-      else
+  return res;
+}
+
+void
+meta_tree_enumerate_keys (MetaTree                         *tree,
+			  const char                       *path,
+			  meta_tree_keys_enumerate_callback callback,
+			  gpointer                          user_data)
+{
+  g_rw_lock_reader_lock (&metatree_lock);
+  enumerate_keys_locked (tree, path, callback, user_data);
+  g_rw_lock_reader_unlock (&metatree_lock);
+}
+
+typedef struct {
+  char *name;
+  GHashTable *keys; /* EnumKeysInfo for the keys seen in the journal */
+  gboolean removed; /* Was removed at some point, ignore everything before */
+  gboolean copied; /* Was copied over at some point, look up separately */
+
+  gboolean reported; /* Set to true when reported to user */
+} EnumDirKeysChildInfo;
+
+typedef struct {
+  GHashTable *children;
+} EnumDirKeysData;
+
+typedef struct {
+  const char *name;
+  meta_tree_dir_keys_enumerate_callback callback;
+  gpointer user_data;
+} EnumDirKeysCallbackData;
+
+static void
+dir_keys_child_info_free (EnumDirKeysChildInfo *info)
+{
+  g_free (info->name);
+  g_hash_table_destroy (info->keys);
+  g_free (info);
+}
+
+/* Returns the info for the child of iter_path that path refers to,
+   or NULL if path is not a direct child of iter_path */
+static EnumDirKeysChildInfo *
+get_dir_keys_child_info (EnumDirKeysData *data,
+			 const char *path,
+			 const char *iter_path,
+			 gboolean allow_trailing_slash)
+{
+  EnumDirKeysChildInfo *info;
+  const char *remainder, *end;
+  char *name;
+
+  remainder = get_prefix_match (path, iter_path);
+  if (remainder == NULL || *remainder == 0)
+    return NULL;
+
+  end = strchr (remainder, '/');
+  if (end != NULL)
+    {
+      if (!allow_trailing_slash ||
+	  end[strspn (end, "/")] != 0)
+	return NULL;
+      name = g_strndup (remainder, end - remainder);
+    }
+  else
+    name = g_strdup (remainder);
+
+  info = g_hash_table_lookup (data->children, name);
+  if (info == NULL)
+    {
+      info = g_new0 (EnumDirKeysChildInfo, 1);
+      info->name = name;
+      info->keys = g_hash_table_new_full (g_str_hash,
+					  g_str_equal,
+					  NULL,
+					  (GDestroyNotify)key_info_free);
+      g_hash_table_insert (data->children, info->name, info);
+    }
+  else
+    g_free (name);
+
+  return info;
+}
+
+static gboolean
+enum_dir_keys_iter_key (MetaJournal *journal,
+			MetaJournalEntryType entry_type,
+			const char *path,
+			guint64 mtime,
+			const char *key,
+			gpointer value,
+			char **iter_path,
+			gpointer user_data)
+{
+  EnumDirKeysData *data = user_data;
+  EnumDirKeysChildInfo *info;
+  EnumKeysData keydata;
+
+  info = get_dir_keys_child_info (data, path, *iter_path, FALSE);
+  if (info != NULL &&
+      !info->removed && !info->copied)
+    {
+      keydata.keys = info->keys;
+      key_info_set_from_journal (get_key_info (&keydata, key),
+				 entry_type, value);
+    }
+
+  return TRUE; /* continue */
+}
+
+static gboolean
+enum_dir_keys_iter_path (MetaJournal *journal,
+			 MetaJournalEntryType entry_type,
+			 const char *path,
+			 guint64 mtime,
+			 const char *source_path,
+			 char **iter_path,
+			 gpointer user_data)
+{
+  EnumDirKeysData *data = user_data;
+  EnumDirKeysChildInfo *info;
+
+  info = get_dir_keys_child_info (data, path, *iter_path, TRUE);
+  if (info != NULL)
+    {
+      if (!info->removed && !info->copied)
 	{
-	  g_assert (info->type == META_KEY_TYPE_STRINGV);
-	  value = get_stringv_from_journal (info->value, FALSE);
+	  if (entry_type == JOURNAL_OP_REMOVE_PATH)
+	    info->removed = TRUE;
+	  else if (entry_type == JOURNAL_OP_COPY_PATH)
+	    info->copied = TRUE;
 	}
+      return TRUE; /* continue */
+    }
 
-      if (!callback (info->key,
-		     info->type,
-		     value,
-		     user_data))
-	break;
+  /* Operations on the directory itself or one of its parents */
+  return enum_keys_iter_path (journal, entry_type, path, mtime,
+			      source_path, iter_path, NULL);
+}
 
-      if (info->type == META_KEY_TYPE_STRINGV)
-	g_free (value);
+static gboolean
+dir_keys_callback (const char *key,
+		   MetaKeyType type,
+		   gpointer value,
+		   gpointer user_data)
+{
+  EnumDirKeysCallbackData *cb_data = user_data;
+
+  return cb_data->callback (cb_data->name, key, type, value,
+			    cb_data->user_data);
+}
+
+static gboolean
+enumerate_dir_keys (MetaTree *tree,
+		    MetaFileDir *dir,
+		    GHashTable *children,
+		    meta_tree_dir_keys_enumerate_callback callback,
+		    gpointer user_data)
+{
+  EnumDirKeysCallbackData cb_data;
+  EnumDirKeysChildInfo *info;
+  guint32 i, num_children;
+  MetaFileDirEnt *dirent;
+  MetaFileData *data;
+  GHashTable *no_keys;
+  char *dirent_name;
+  gboolean res;
+
+  no_keys = g_hash_table_new (g_str_hash, g_str_equal);
+  cb_data.callback = callback;
+  cb_data.user_data = user_data;
+
+  res = TRUE;
+  num_children = GUINT32_FROM_BE (dir->num_children);
+  for (i = 0; res && i < num_children; i++)
+    {
+      dirent = &dir->children[i];
+      dirent_name = verify_string (tree, dirent->name);
+      if (dirent_name == NULL)
+	continue;
+
+      info = g_hash_table_lookup (children, dirent_name);
+      if (info != NULL &&
+	  (info->removed || info->copied))
+	continue; /* Handled later */
+
+      cb_data.name = dirent_name;
+
+      if (dirent->metadata != 0)
+	{
+	  data = verify_metadata_block (tree, dirent->metadata);
+	  if (data != NULL)
+	    res = enumerate_data (tree, data,
+				  info ? info->keys : no_keys,
+				  dir_keys_callback, &cb_data);
+	}
+
+      if (res && info != NULL)
+	{
+	  info->reported = TRUE;
+	  res = enumerate_journal_keys (info->keys,
+					dir_keys_callback, &cb_data);
+	}
+    }
+
+  g_hash_table_destroy (no_keys);
+
+  return res;
+}
+
+/* Enumerates the keys of all the children of path in one pass over
+   the directory and the journal, rather than looking up each child
+   separately with meta_tree_enumerate_keys() */
+void
+meta_tree_enumerate_dir_keys (MetaTree                             *tree,
+			      const char                           *path,
+			      meta_tree_dir_keys_enumerate_callback callback,
+			      gpointer                              user_data)
+{
+  EnumDirKeysCallbackData cb_data;
+  EnumDirKeysData data;
+  GHashTable *children;
+  EnumDirKeysChildInfo *info;
+  MetaFileDirEnt *dirent;
+  GHashTableIter iter;
+  MetaFileDir *dir;
+  char *res_path, *child_path;
+  gboolean res;
+
+  g_rw_lock_reader_lock (&metatree_lock);
+
+  data.children = children =
+    g_hash_table_new_full (g_str_hash,
+			   g_str_equal,
+			   NULL,
+			   (GDestroyNotify)dir_keys_child_info_free);
+
+  res_path = meta_journal_iterate (tree->journal,
+				   path,
+				   TRUE,
+				   enum_dir_keys_iter_key,
+				   enum_dir_keys_iter_path,
+				   &data);
+
+  if (res_path != NULL)
+    {
+      dirent = meta_tree_lookup (tree, res_path);
+      if (dirent != NULL &&
+	  dirent->children != 0)
+	{
+	  dir = verify_children_block (tree, dirent->children);
+	  if (dir)
+	    {
+	      if (!enumerate_dir_keys (tree, dir, children, callback, user_data))
+		goto out;
+	    }
+	}
+    }
 
+  cb_data.callback = callback;
+  cb_data.user_data = user_data;
+
+  g_hash_table_iter_init (&iter, children);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer  *)&info))
+    {
+      if (info->reported)
+	continue;
+
+      cb_data.name = info->name;
+
+      if (info->copied)
+	{
+	  /* The older data comes from the copy source, which may be
+	     anywhere, so fall back to a full lookup of this child */
+	  child_path = g_build_filename (path, info->name, NULL);
+	  res = enumerate_keys_locked (tree, child_path,
+				       dir_keys_callback, &cb_data);
+	  g_free (child_path);
+	}
+      else
+	res = enumerate_journal_keys (info->keys,
+				      dir_keys_callback, &cb_data);
+
+      if (!res)
+	break;
     }
+
  out:
   g_free (res_path);
-  g_hash_table_destroy (keys);
+  g_hash_table_destroy (children);
   g_rw_lock_reader_unlock (&metatree_lock);
 }
 
 
 static void
-copy_tree_to_builder (MetaTree *tree,
-		      MetaFileDirEnt *dirent,
+copy_data_to_builder (MetaTree *tree,
+		      MetaFileData *data,
 		      MetaFile *builder_file)
 {
-  MetaFile *builder_child;
-  MetaFileData *data;
   MetaFileDataEnt *ent;
-  MetaFileDir *dir;
-  MetaFileDirEnt *child_dirent;
   MetaKeyType type;
-  char *child_name, *key_name, *value;
-  guint32 i, num_keys, num_children, j;
+  char *key_name, *value;
+  guint32 i, num_keys, j;
   guint32 key_id;
 
-  /* Copy metadata */
-  data = verify_metadata_block (tree, dirent->metadata);
-  if (data)
+  num_keys = GUINT32_FROM_BE (data->num_keys);
+  for (i = 0; i < num_keys; i++)
     {
-      num_keys = GUINT32_FROM_BE (data->num_keys);
-      for (i = 0; i < num_keys; i++)
-	{
-	  ent = &data->keys[i];
+      ent = &data->keys[i];
 
-	  key_id = GUINT32_FROM_BE (ent->key) & ~KEY_IS_LIST_MASK;
-	  if (GUINT32_FROM_BE (ent->key) & KEY_IS_LIST_MASK)
-	    type = META_KEY_TYPE_STRINGV;
-	  else
-	    type = META_KEY_TYPE_STRING;
+      key_id = GUINT32_FROM_BE (ent->key) & ~KEY_IS_LIST_MASK;
+      if (GUINT32_FROM_BE (ent->key) & KEY_IS_LIST_MASK)
+	type = META_KEY_TYPE_STRINGV;
+      else
+	type = META_KEY_TYPE_STRING;
 
-	  if (key_id >= tree->num_attributes)
-	    continue;
+      if (key_id >= tree->num_attributes)
+	continue;
 
-	  key_name = tree->attributes[key_id];
-	  if (key_name == NULL)
-	    continue;
+      key_name = tree->attributes[key_id];
+      if (key_name == NULL)
+	continue;
 
-	  if (type == META_KEY_TYPE_STRING)
-	    {
-	      value = verify_string (tree, ent->value);
-	      if (value)
-		metafile_key_set_value (builder_file,
-					key_name, value);
-	    }
-	  else
-	    {
-	      MetaFileStringv *stringv;
-	      guint32 num_strings;
-	      char *str;
+      if (type == META_KEY_TYPE_STRING)
+	{
+	  value = verify_string (tree, ent->value);
+	  if (value)
+	    metafile_key_set_value (builder_file,
+				    key_name, value);
+	}
+      else
+	{
+	  MetaFileStringv *stringv;
+	  guint32 num_strings;
+	  char *str;
 
-	      stringv = verify_array_block (tree, ent->value,
-					    sizeof (guint32));
+	  stringv = verify_array_block (tree, ent->value,
+					sizeof (guint32));
 
-	      if (stringv)
+	  if (stringv)
+	    {
+	      metafile_key_list_set (builder_file, key_name);
+
+	      num_strings = GUINT32_FROM_BE (stringv->num_strings);
+	      for (j = 0; j < num_strings; j++)
 		{
-		  metafile_key_list_set (builder_file, key_name);
-
-		  num_strings = GUINT32_FROM_BE (stringv->num_strings);
-		  for (j = 0; j < num_strings; j++)
-		    {
-		      str = verify_string (tree, stringv->strings[j]);
-		      if (str)
-			metafile_key_list_add (builder_file,
-					       key_name, str);
-		    }
+		  str = verify_string (tree, stringv->strings[j]);
+		  if (str)
+		    metafile_key_list_add (builder_file,
+					   key_name, str);
 		}
 	    }
 	}
     }
+}
+
+static void
+copy_tree_to_builder (MetaTree *tree,
+		      MetaFileDirEnt *dirent,
+		      MetaFile *builder_file)
+{
+  MetaFile *builder_child;
+  MetaFileData *data;
+  MetaFileDir *dir;
+  MetaFileDirEnt *child_dirent;
+  char *child_name;
+  guint32 i, num_children;
+
+  /* Copy metadata */
+  data = verify_metadata_block (tree, dirent->metadata);
+  if (data)
+    copy_data_to_builder (tree, data, builder_file);
 
   /* Copy last changed time */
   builder_file->last_changed = get_time_t (tree, dirent->last_changed);
@@ -2195,6 +2963,112 @@ copy_tree_to_builder (MetaTree *tree,
     }
 }
 
+/* For incremental writes the builder only contains the files touched
+   by the journal. Files that are not loaded refer to their children
+   and metadata blocks in the tree (old_children/old_metadata), and
+   have to be loaded before they are modified. */
+
+static void
+load_builder_children (MetaTree *tree,
+		       MetaFile *builder_file)
+{
+  MetaFile *builder_child;
+  MetaFileDir *dir;
+  MetaFileDirEnt *child_dirent;
+  GList *children;
+  char *child_name;
+  guint32 i, num_children;
+
+  if (builder_file->old_children == 0)
+    return;
+
+  dir = verify_children_block (tree, GUINT32_TO_BE (builder_file->old_children));
+  builder_file->old_children = 0;
+  if (dir == NULL)
+    return;
+
+  /* Children are stored sorted, so no need for sorted inserts */
+  children = NULL;
+  num_children = GUINT32_FROM_BE (dir->num_children);
+  for (i = 0; i < num_children; i++)
+    {
+      child_dirent = &dir->children[i];
+      child_name = verify_string (tree, child_dirent->name);
+      if (child_name == NULL)
+	continue;
+
+      builder_child = metafile_new (child_name, NULL);
+      builder_child->last_changed = get_time_t (tree, child_dirent->last_changed);
+      builder_child->old_children = GUINT32_FROM_BE (child_dirent->children);
+      builder_child->old_metadata = GUINT32_FROM_BE (child_dirent->metadata);
+      children = g_list_prepend (children, builder_child);
+    }
+  builder_file->children = g_list_reverse (children);
+}
+
+static void
+load_builder_data (MetaTree *tree,
+		   MetaFile *builder_file)
+{
+  MetaFileData *data;
+
+  if (builder_file->old_metadata == 0)
+    return;
+
+  data = verify_metadata_block (tree, GUINT32_TO_BE (builder_file->old_metadata));
+  builder_file->old_metadata = 0;
+  if (data)
+    copy_data_to_builder (tree, data, builder_file);
+}
+
+static void
+load_builder_subtree (MetaTree *tree,
+		      MetaFile *builder_file)
+{
+  GList *l;
+
+  load_builder_data (tree, builder_file);
+  load_builder_children (tree, builder_file);
+
+  for (l = builder_file->children; l != NULL; l = l->next)
+    load_builder_subtree (tree, l->data);
+}
+
+/* Loads the parents of path and the data of path itself */
+static MetaFile *
+load_builder_path (MetaTree *tree,
+		   MetaBuilder *builder,
+		   const char *path)
+{
+  MetaFile *f;
+  const char *element_start;
+  char *element;
+
+  f = builder->root;
+  while (f)
+    {
+      while (*path == '/')
+	path++;
+
+      if (*path == 0)
+	break;
+
+      element_start = path;
+      while (*path != 0 && *path != '/')
+	path++;
+      element = g_strndup (element_start, path - element_start);
+
+      load_builder_children (tree, f);
+      f = metafile_lookup_child (f, element, FALSE);
+      g_free (element);
+    }
+
+  if (f)
+    load_builder_data (tree, f);
+
+  return f;
+}
+
 static void
 apply_journal_to_builder (MetaTree *tree,
 			  MetaBuilder *builder)
@@ -2217,6 +3091,9 @@ apply_journal_to_builder (MetaTree *tree,
       mtime = GUINT64_FROM_BE (entry->mtime);
       journal_path = &entry->path[0];
 
+      /* Nothing to load if the whole tree was copied to the builder */
+      load_builder_path (tree, builder, journal_path);
+
       switch (entry->entry_type)
 	{
 	case JOURNAL_OP_SET_KEY:
@@ -2234,89 +3111,529 @@ apply_journal_to_builder (MetaTree *tree,
 	  strv = get_stringv_from_journal (value, FALSE);
 	  file = meta_builder_lookup (builder, journal_path, TRUE);
 
-	  metafile_key_list_set (file, journal_key);
-	  for (i = 0; strv[i] != NULL; i++)
-	    metafile_key_list_add (file, journal_key, strv[i]);
+	  metafile_key_list_set (file, journal_key);
+	  for (i = 0; strv[i] != NULL; i++)
+	    metafile_key_list_add (file, journal_key, strv[i]);
+
+	  g_free (strv);
+	  metafile_set_mtime (file, mtime);
+	  break;
+	case JOURNAL_OP_UNSET_KEY:
+	  journal_key = get_next_arg (journal_path);
+	  file = meta_builder_lookup (builder, journal_path, FALSE);
+	  if (file)
+	    {
+	      metafile_key_unset (file, journal_key);
+	      metafile_set_mtime (file, mtime);
+	    }
+	  break;
+	case JOURNAL_OP_COPY_PATH:
+	  source_path = get_next_arg (journal_path);
+	  file = load_builder_path (tree, builder, source_path);
+	  if (file)
+	    load_builder_subtree (tree, file);
+	  meta_builder_copy (builder,
+			     source_path,
+			     journal_path,
+			     mtime);
+	  break;
+	case JOURNAL_OP_REMOVE_PATH:
+	  meta_builder_remove (builder,
+			       journal_path,
+			       mtime);
+	  break;
+	default:
+	  break;
+	}
+
+      sizep = (guint32 *)entry;
+      entry = (MetaJournalEntry *)((char *)entry + GUINT32_FROM_BE (*(sizep)));
+      if (GUINT32_FROM_BE (*(sizep)) < sizeof (MetaJournalEntry) ||
+	  entry < journal->first_entry ||
+	  entry > journal->last_entry)
+        {
+          /* This shouldn't happen, we found an entry that is shorter than its data */
+          /* See https://bugzilla.gnome.org/show_bug.cgi?id=637095 for discussion */
+          g_warning ("apply_journal_to_builder: found wrong sized entry, possible journal corruption\n");
+          break;
+        }
+    }
+}
+
+
+/* The tree file is the result of the last full write followed by
+   segments with the changes written since, see file-format.txt.
+   Returns the size of the file as fully written and the number of
+   segments appended to it. */
+static void
+meta_tree_get_segment_info (MetaTree *tree,
+			    guint32 *base_size,
+			    guint32 *num_segments)
+{
+  MetaFileSegmentInfo *info;
+
+  *base_size = tree->len;
+  *num_segments = 0;
+
+  if (tree->header->minor < 2 ||
+      tree->len < sizeof (MetaFileHeader) + sizeof (MetaFileSegmentInfo))
+    return;
+
+  info = (MetaFileSegmentInfo *)(tree->data + sizeof (MetaFileHeader));
+  *base_size = GUINT32_FROM_BE (info->base_size);
+  *num_segments = GUINT32_FROM_BE (info->num_segments);
+}
+
+/* Needs write lock. Returns a builder with the changes in the journal,
+   for writing a segment, or NULL if a full write is needed. */
+static MetaBuilder *
+meta_tree_new_incremental_builder_locked (MetaTree *tree,
+					  guint32  *base_size,
+					  guint32  *num_segments)
+{
+  MetaBuilder *builder;
+
+  if (tree->root == NULL || tree->journal == NULL)
+    return NULL;
+
+  /* Merge all segments with a full rewrite once they make
+     up more than half the file. Older files are rewritten
+     to get the hash index and segment info, which segments
+     rely on. */
+  meta_tree_get_segment_info (tree, base_size, num_segments);
+  if (tree->header->minor < MINOR_VERSION ||
+      *num_segments >= MAX_SEGMENTS ||
+      tree->len > (gsize)*base_size * 2)
+    return NULL;
+
+  builder = meta_builder_new ();
+
+  builder->root->last_changed = get_time_t (tree, tree->root->last_changed);
+  builder->root->old_children = GUINT32_FROM_BE (tree->root->children);
+  builder->root->old_metadata = GUINT32_FROM_BE (tree->root->metadata);
+
+  apply_journal_to_builder (tree, builder);
+
+  return builder;
+}
+
+/* Needs write lock. Returns a builder with the whole tree and the
+   journal applied, without remove_paths. */
+static MetaBuilder *
+meta_tree_new_full_builder_locked (MetaTree *tree,
+				   char    **remove_paths)
+{
+  MetaBuilder *builder;
+  int i;
+
+  builder = meta_builder_new ();
+
+  copy_tree_to_builder (tree, tree->root, builder->root);
+
+  if (tree->journal)
+    apply_journal_to_builder (tree, builder);
+
+  /* Not a change to the files, so don't touch the parent mtimes */
+  for (i = 0; remove_paths != NULL && remove_paths[i] != NULL; i++)
+    meta_builder_remove (builder, remove_paths[i], 0);
+
+  return builder;
+}
+
+/* Opens the tree file for appending a segment, if it is still the
+   file with the given inode */
+static int
+meta_tree_open_for_append (MetaTree *tree,
+			   ino_t     inode)
+{
+  struct stat statbuf;
+  int fd;
+
+  fd = safe_open (tree, tree->filename, O_RDWR);
+  if (fd == -1)
+    return -1;
+
+  if (fstat (fd, &statbuf) != 0 ||
+      statbuf.st_ino != inode)
+    {
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+/* Needs write lock. Returns FALSE if a full write is needed. */
+static gboolean
+meta_tree_flush_incremental_locked (MetaTree *tree)
+{
+  MetaBuilder *builder;
+  guint32 base_size, num_segments, root;
+  gboolean res;
+  int fd;
+
+  /* A segment being appended by meta_tree_write_out() would be
+     overwritten */
+  if (!g_mutex_trylock (&append_lock))
+    return FALSE;
+
+  res = FALSE;
+  builder = meta_tree_new_incremental_builder_locked (tree, &base_size,
+						      &num_segments);
+  fd = -1;
+  if (builder != NULL)
+    fd = meta_tree_open_for_append (tree, tree->inode);
+
+  if (fd != -1)
+    {
+      res = meta_builder_append_segment (builder, fd, tree->len,
+					 tree->attributes,
+					 tree->num_attributes,
+					 tree->time_t_base,
+					 &root) &&
+	meta_builder_publish_segment (meta_tree_get_filename (tree), fd,
+				      tree->tag, g_random_int (), root,
+				      base_size, num_segments + 1,
+				      NULL, 0, 0);
+      close (fd);
+    }
+
+  if (builder != NULL)
+    meta_builder_free (builder);
+
+  g_mutex_unlock (&append_lock);
+
+  return res;
+}
+
+/* Needs write lock */
+static gboolean
+meta_tree_flush_full_locked (MetaTree *tree,
+			     char    **remove_paths)
+{
+  MetaBuilder *builder;
+  gboolean res;
+
+  builder = meta_tree_new_full_builder_locked (tree, remove_paths);
+
+  res = meta_builder_write (builder,
+			    meta_tree_get_filename (tree));
+  if (res)
+    {
+      /* Force re-read since we wrote a new file */
+      meta_tree_refresh_locked (tree, TRUE);
+      tree->bytes_written += tree->len;
+    }
+
+  meta_builder_free (builder);
+
+  return res;
+}
+
+/* Needs write lock */
+static gboolean
+meta_tree_flush_locked (MetaTree *tree)
+{
+  gsize old_len;
+
+  old_len = tree->len;
+  if (meta_tree_flush_incremental_locked (tree))
+    {
+      /* Force re-read since we wrote a new file */
+      meta_tree_refresh_locked (tree, TRUE);
+      if (tree->len > old_len)
+	tree->bytes_written += tree->len - old_len;
+      return TRUE;
+    }
+
+  return meta_tree_flush_full_locked (tree, NULL);
+}
+
+/* Needs write lock. Makes room for len more bytes in the journal,
+   by growing it if allowed, otherwise by writing out the tree. */
+static gboolean
+meta_tree_make_room_locked (MetaTree *tree,
+			    gsize len)
+{
+  if (tree->journal != NULL &&
+      meta_journal_grow (tree->journal, len))
+    {
+      tree->journal_grows++;
+      return TRUE;
+    }
+
+  return meta_tree_flush_locked (tree);
+}
+
+/* Sets the size of new journals (0 for the default), and how large
+   they may grow before the tree is written out. Only matters for the
+   writer. */
+void
+meta_tree_set_journal_size (gsize initial_size,
+			    gsize max_size)
+{
+  if (initial_size > 0)
+    meta_builder_set_new_journal_size (initial_size);
+  journal_max_size = max_size;
+}
+
+/* Bytes written to the tree file and times the journal was grown,
+   since the tree was opened */
+void
+meta_tree_get_write_stats (MetaTree *tree,
+			   guint64  *bytes_written,
+			   guint    *journal_grows)
+{
+  g_rw_lock_reader_lock (&metatree_lock);
+  *bytes_written = tree->bytes_written;
+  *journal_grows = tree->journal_grows;
+  g_rw_lock_reader_unlock (&metatree_lock);
+}
+
+/* Appends the changes in the journal to the tree file as a segment,
+   only holding the lock while collecting them and while publishing
+   the segment. Changes added to the journal meanwhile are carried
+   over into the new journal. Returns FALSE if a full write is
+   needed. */
+static gboolean
+meta_tree_write_out_segment (MetaTree *tree)
+{
+  MetaBuilder *builder;
+  MetaJournal *journal;
+  guint32 base_size, num_segments, tag, root;
+  guint32 journal_entries, num_entries;
+  gsize journal_offset, old_len;
+  gint64 time_t_base;
+  ino_t inode;
+  char **attributes;
+  char *entries;
+  int fd, num_attributes, i;
+  gboolean res;
+
+  g_mutex_lock (&append_lock);
+  g_rw_lock_writer_lock (&metatree_lock);
+
+  builder = meta_tree_new_incremental_builder_locked (tree, &base_size,
+						      &num_segments);
+  if (builder == NULL)
+    {
+      g_rw_lock_writer_unlock (&metatree_lock);
+      g_mutex_unlock (&append_lock);
+      return FALSE;
+    }
+
+  /* Where the entries added from now on start */
+  tag = tree->tag;
+  journal_entries = tree->journal->last_entry_num;
+  journal_offset = (char *)tree->journal->last_entry - tree->journal->data;
+
+  /* The tree may be reread once the lock is dropped */
+  time_t_base = tree->time_t_base;
+  num_attributes = tree->num_attributes;
+  attributes = g_new0 (char *, num_attributes + 1);
+  for (i = 0; i < num_attributes; i++)
+    attributes[i] = g_strdup (tree->attributes[i]);
+  old_len = tree->len;
+  inode = tree->inode;
+
+  g_rw_lock_writer_unlock (&metatree_lock);
+
+  res = FALSE;
+  fd = meta_tree_open_for_append (tree, inode);
+  if (fd != -1)
+    res = meta_builder_append_segment (builder, fd, old_len,
+				       attributes, num_attributes,
+				       time_t_base, &root);
+  g_strfreev (attributes);
+  meta_builder_free (builder);
+
+  if (res)
+    {
+      g_rw_lock_writer_lock (&metatree_lock);
+
+      /* Someone else wrote out the tree meanwhile */
+      journal = tree->journal;
+      res = tree->tag == tag &&
+	journal != NULL &&
+	journal->last_entry_num >= journal_entries;
 
-	  g_free (strv);
-	  metafile_set_mtime (file, mtime);
-	  break;
-	case JOURNAL_OP_UNSET_KEY:
-	  journal_key = get_next_arg (journal_path);
-	  file = meta_builder_lookup (builder, journal_path, FALSE);
-	  if (file)
-	    {
-	      metafile_key_unset (file, journal_key);
-	      metafile_set_mtime (file, mtime);
-	    }
-	  break;
-	case JOURNAL_OP_COPY_PATH:
-	  source_path = get_next_arg (journal_path);
-	  meta_builder_copy (builder,
-			     source_path,
-			     journal_path,
-			     mtime);
-	  break;
-	case JOURNAL_OP_REMOVE_PATH:
-	  meta_builder_remove (builder,
-			       journal_path,
-			       mtime);
-	  break;
-	default:
-	  break;
+      if (res)
+	{
+	  entries = journal->data + journal_offset;
+	  num_entries = journal->last_entry_num - journal_entries;
+
+	  res = meta_builder_publish_segment (meta_tree_get_filename (tree),
+					      fd, tag, g_random_int (), root,
+					      base_size, num_segments + 1,
+					      entries,
+					      (char *)journal->last_entry - entries,
+					      num_entries);
 	}
 
-      sizep = (guint32 *)entry;
-      entry = (MetaJournalEntry *)((char *)entry + GUINT32_FROM_BE (*(sizep)));
-      if (GUINT32_FROM_BE (*(sizep)) < sizeof (MetaJournalEntry) ||
-	  entry < journal->first_entry ||
-	  entry > journal->last_entry)
-        {
-          /* This shouldn't happen, we found an entry that is shorter than its data */
-          /* See https://bugzilla.gnome.org/show_bug.cgi?id=637095 for discussion */
-          g_warning ("apply_journal_to_builder: found wrong sized entry, possible journal corruption\n");
-          break;
-        }
+      if (res)
+	{
+	  old_len = tree->len;
+	  /* Force re-read since the file changed */
+	  meta_tree_refresh_locked (tree, TRUE);
+	  tree->bytes_written += tree->len > old_len ? tree->len - old_len : 0;
+	}
+
+      g_rw_lock_writer_unlock (&metatree_lock);
     }
-}
 
+  if (fd != -1)
+    close (fd);
 
-/* Needs write lock */
+  g_mutex_unlock (&append_lock);
+
+  return res;
+}
+
+/* Writes out the tree like meta_tree_flush_locked(), but only holds
+   the lock while collecting the changes and while installing the new
+   file, not while it is written. Changes can still be added to the
+   journal meanwhile, they are carried over into the new journal. */
 static gboolean
-meta_tree_flush_locked (MetaTree *tree)
+meta_tree_write_out (MetaTree *tree,
+		     char    **remove_paths,
+		     gsize    *reclaimed)
 {
   MetaBuilder *builder;
+  MetaJournal *journal;
+  guint32 tag, random_tag;
+  guint32 journal_entries, num_entries;
+  gsize journal_offset, old_len;
+  char *tmp_name, *entries;
   gboolean res;
 
-  builder = meta_builder_new ();
+  /* Full rewrites are only needed to compact the tree */
+  if (remove_paths == NULL &&
+      meta_tree_write_out_segment (tree))
+    return TRUE;
 
-  copy_tree_to_builder (tree, tree->root, builder->root);
+  g_rw_lock_writer_lock (&metatree_lock);
+
+  builder = meta_tree_new_full_builder_locked (tree, remove_paths);
 
+  /* Where the entries added from now on start */
+  tag = tree->tag;
+  journal_entries = 0;
+  journal_offset = 0;
   if (tree->journal)
-    apply_journal_to_builder (tree, builder);
+    {
+      journal_entries = tree->journal->last_entry_num;
+      journal_offset = (char *)tree->journal->last_entry - tree->journal->data;
+    }
 
-  res = meta_builder_write (builder,
-			    meta_tree_get_filename (tree));
-  if (res)
-    /* Force re-read since we wrote a new file */
-    meta_tree_refresh_locked (tree, TRUE);
+  g_rw_lock_writer_unlock (&metatree_lock);
 
+  tmp_name = meta_builder_write_tmp (builder,
+				     meta_tree_get_filename (tree),
+				     &random_tag);
   meta_builder_free (builder);
 
+  if (tmp_name == NULL)
+    return FALSE;
+
+  g_rw_lock_writer_lock (&metatree_lock);
+
+  /* Someone else wrote out the tree meanwhile */
+  journal = tree->journal;
+  res = tree->tag == tag &&
+    (journal != NULL || journal_entries == 0) &&
+    (journal == NULL || journal->last_entry_num >= journal_entries);
+
+  if (res)
+    {
+      entries = NULL;
+      num_entries = 0;
+      if (journal)
+	{
+	  entries = journal->data + journal_offset;
+	  num_entries = journal->last_entry_num - journal_entries;
+	}
+
+      res = meta_builder_install (meta_tree_get_filename (tree),
+				  tmp_name, random_tag,
+				  entries,
+				  entries ? (char *)journal->last_entry - entries : 0,
+				  num_entries);
+    }
+
+  if (res)
+    {
+      old_len = tree->len;
+      /* Force re-read since we wrote a new file */
+      meta_tree_refresh_locked (tree, TRUE);
+      tree->bytes_written += tree->len;
+      if (reclaimed)
+	*reclaimed = tree->len < old_len ? old_len - tree->len : 0;
+    }
+  else
+    g_unlink (tmp_name);
+
+  g_rw_lock_writer_unlock (&metatree_lock);
+
+  g_free (tmp_name);
+
   return res;
 }
 
+/* Writes out the tree in full, merging any segments, and removes
+   remove_paths (with everything below them) from it. reclaimed
+   is set to the number of bytes the tree file shrank by. */
 gboolean
-meta_tree_flush (MetaTree *tree)
+meta_tree_compact (MetaTree *tree,
+		   char    **remove_paths,
+		   gsize    *reclaimed)
+{
+  static char *no_paths[] = { NULL };
+
+  if (reclaimed)
+    *reclaimed = 0;
+
+  /* A non-NULL remove_paths forces a full write */
+  return meta_tree_write_out (tree,
+			      remove_paths ? remove_paths : no_paths,
+			      reclaimed);
+}
+
+/* Returns the bytes used by entries in the journal, and the space
+   for entries in total, including what the journal may grow to */
+gboolean
+meta_tree_get_journal_fill (MetaTree *tree,
+			    gsize    *used,
+			    gsize    *size)
 {
+  MetaJournal *journal;
   gboolean res;
 
-  g_rw_lock_writer_lock (&metatree_lock);
-  res = meta_tree_flush_locked (tree);
-  g_rw_lock_writer_unlock (&metatree_lock);
+  g_rw_lock_reader_lock (&metatree_lock);
+
+  journal = tree->journal;
+  res = journal != NULL && journal->journal_valid;
+  if (res)
+    {
+      *used = (char *)journal->last_entry - (char *)journal->first_entry;
+      *size = journal->len;
+      if (journal->header->minor >= JOURNAL_MINOR_VERSION)
+	*size = MAX (journal->len, journal_max_size);
+      *size -= (char *)journal->first_entry - journal->data;
+    }
+  else
+    *used = *size = 0;
+
+  g_rw_lock_reader_unlock (&metatree_lock);
+
   return res;
 }
 
+gboolean
+meta_tree_flush (MetaTree *tree)
+{
+  return meta_tree_write_out (tree, NULL, NULL);
+}
+
 gboolean
 meta_tree_unset (MetaTree                         *tree,
 		 const char                       *path,
@@ -2343,7 +3660,7 @@ meta_tree_unset (MetaTree                         *tree,
  retry:
   if (!meta_journal_add_entry (tree->journal, entry))
     {
-      if (meta_tree_flush_locked (tree))
+      if (meta_tree_make_room_locked (tree, entry->len))
 	goto retry;
 
       res = FALSE;
@@ -2383,7 +3700,7 @@ meta_tree_set_string (MetaTree                         *tree,
  retry:
   if (!meta_journal_add_entry (tree->journal, entry))
     {
-      if (meta_tree_flush_locked (tree))
+      if (meta_tree_make_room_locked (tree, entry->len))
 	goto retry;
 
       res = FALSE;
@@ -2423,7 +3740,7 @@ meta_tree_set_stringv (MetaTree                         *tree,
  retry:
   if (!meta_journal_add_entry (tree->journal, entry))
     {
-      if (meta_tree_flush_locked (tree))
+      if (meta_tree_make_room_locked (tree, entry->len))
 	goto retry;
 
       res = FALSE;
@@ -2436,6 +3753,180 @@ meta_tree_set_stringv (MetaTree                         *tree,
   return res;
 }
 
+struct _MetaTreeBatch {
+  GString *entries;
+  guint32 num_entries;
+};
+
+MetaTreeBatch *
+meta_tree_batch_new (void)
+{
+  MetaTreeBatch *batch;
+
+  batch = g_new0 (MetaTreeBatch, 1);
+  batch->entries = g_string_new (NULL);
+
+  return batch;
+}
+
+void
+meta_tree_batch_free (MetaTreeBatch *batch)
+{
+  g_string_free (batch->entries, TRUE);
+  g_free (batch);
+}
+
+static void
+meta_tree_batch_add (MetaTreeBatch *batch,
+		     GString *entry)
+{
+  g_string_append_len (batch->entries, entry->str, entry->len);
+  batch->num_entries++;
+  g_string_free (entry, TRUE);
+}
+
+void
+meta_tree_batch_set_string (MetaTreeBatch *batch,
+			    const char    *path,
+			    const char    *key,
+			    const char    *value)
+{
+  meta_tree_batch_add (batch,
+		       meta_journal_entry_new_set (time (NULL), path, key, value));
+}
+
+void
+meta_tree_batch_set_stringv (MetaTreeBatch *batch,
+			     const char    *path,
+			     const char    *key,
+			     char         **value)
+{
+  meta_tree_batch_add (batch,
+		       meta_journal_entry_new_setv (time (NULL), path, key, value));
+}
+
+void
+meta_tree_batch_unset (MetaTreeBatch *batch,
+		       const char    *path,
+		       const char    *key)
+{
+  meta_tree_batch_add (batch,
+		       meta_journal_entry_new_unset (time (NULL), path, key));
+}
+
+void
+meta_tree_batch_remove (MetaTreeBatch *batch,
+			const char    *path)
+{
+  meta_tree_batch_add (batch,
+		       meta_journal_entry_new_remove (time (NULL), path));
+}
+
+void
+meta_tree_batch_copy (MetaTreeBatch *batch,
+		      const char    *src,
+		      const char    *dest)
+{
+  meta_tree_batch_add (batch,
+		       meta_journal_entry_new_copy (time (NULL), src, dest));
+}
+
+/* Adds all operations in other to the end of batch */
+void
+meta_tree_batch_append (MetaTreeBatch *batch,
+			MetaTreeBatch *other)
+{
+  g_string_append_len (batch->entries, other->entries->str, other->entries->len);
+  batch->num_entries += other->num_entries;
+}
+
+/* The number of journal bytes the batch needs */
+gsize
+meta_tree_batch_get_size (MetaTreeBatch *batch)
+{
+  return batch->entries->len;
+}
+
+/* Applies all operations in the batch, appending them to the
+   journal together where they fit. */
+gboolean
+meta_tree_apply_batch (MetaTree      *tree,
+		       MetaTreeBatch *batch)
+{
+  MetaJournal *journal;
+  const char *entries;
+  gsize len, fit_len, space, entry_len;
+  guint32 num, fit_num;
+  gboolean res;
+
+  g_rw_lock_writer_lock (&metatree_lock);
+
+  entries = batch->entries->str;
+  len = batch->entries->len;
+  num = batch->num_entries;
+
+  res = TRUE;
+  while (num > 0)
+    {
+      journal = tree->journal;
+      if (journal == NULL ||
+	  !journal->journal_valid)
+	{
+	  res = FALSE;
+	  break;
+	}
+
+      if (meta_journal_add_entries (journal, entries, len, num))
+	break;
+
+      if (meta_journal_grow (journal, len))
+	{
+	  tree->journal_grows++;
+	  continue;
+	}
+
+      /* Doesn't all fit, add what does before starting a new journal */
+      space = journal->len - ((char *)journal->last_entry - journal->data);
+      fit_len = 0;
+      fit_num = 0;
+      while (fit_num < num)
+	{
+	  entry_len = GUINT32_FROM_BE (*(guint32 *)(entries + fit_len));
+	  if (fit_len + entry_len > space)
+	    break;
+	  fit_len += entry_len;
+	  fit_num++;
+	}
+
+      if (fit_num > 0)
+	{
+	  meta_journal_add_entries (journal, entries, fit_len, fit_num);
+	  entries += fit_len;
+	  len -= fit_len;
+	  num -= fit_num;
+	}
+
+      if (num == 0)
+	break;
+
+      if (journal->last_entry_num == 0)
+	{
+	  /* Too large for an empty journal */
+	  res = FALSE;
+	  break;
+	}
+
+      if (!meta_tree_flush_locked (tree))
+	{
+	  res = FALSE;
+	  break;
+	}
+    }
+
+  g_rw_lock_writer_unlock (&metatree_lock);
+  return res;
+}
+
 gboolean
 meta_tree_remove (MetaTree *tree,
 		  const char *path)
@@ -2461,7 +3952,7 @@ meta_tree_remove (MetaTree *tree,
  retry:
   if (!meta_journal_add_entry (tree->journal, entry))
     {
-      if (meta_tree_flush_locked (tree))
+      if (meta_tree_make_room_locked (tree, entry->len))
 	goto retry;
 
       res = FALSE;
@@ -2500,7 +3991,7 @@ meta_tree_copy (MetaTree                         *tree,
  retry:
   if (!meta_journal_add_entry (tree->journal, entry))
     {
-      if (meta_tree_flush_locked (tree))
+      if (meta_tree_make_room_locked (tree, entry->len))
 	goto retry;
 
       res = FALSE;
@@ -2686,17 +4177,44 @@ follow_symlink_recursively (char **path,
   *path_dev = path_stat.st_dev;
 }
 
+/* Upper bound on the parents remembered by a MetaLookupCache */
+#define MAX_CACHED_PARENTS 256
+
+typedef struct {
+  char *expanded;
+  dev_t dev;
+  char *mountpoint; /* NULL until looked up */
+  char *mountpoint_extra_prefix;
+
+  /* lstat() and stat() of the unexpanded parent when this was created,
+     to notice renamed or replaced directories and symlinks along its
+     path and in the symlinks it points to */
+  gboolean stat_valid;
+  dev_t stat_dev;
+  ino_t stat_ino;
+  time_t stat_mtime;
+  dev_t target_dev;
+  ino_t target_ino;
+} MetaLookupParent;
+
 struct _MetaLookupCache {
-  char *last_parent;
-  char *last_parent_expanded;
-  dev_t last_parent_dev;
-  char *last_parent_mountpoint;
-  char *last_parent_mountpoint_extra_prefix;
-
-  dev_t last_device;
-  char *last_device_tree;
+  GMutex lock;
+
+  /* Everything below is dropped when the mounts change */
+  guint mountinfo_generation;
+  GHashTable *parents; /* parent dir -> MetaLookupParent */
+  GHashTable *device_trees; /* dev_t -> tree name or NULL */
 };
 
+static void
+meta_lookup_parent_free (MetaLookupParent *parent)
+{
+  g_free (parent->expanded);
+  g_free (parent->mountpoint);
+  g_free (parent->mountpoint_extra_prefix);
+  g_free (parent);
+}
+
 #ifdef HAVE_LIBUDEV
 
 static struct udev *udev;
@@ -2744,14 +4262,20 @@ get_tree_for_device (MetaLookupCache *cache,
 		     dev_t device)
 {
 #ifdef HAVE_LIBUDEV
-  if (device != cache->last_device)
+  gint64 key, *new_key;
+  char *tree;
+
+  key = device;
+  if (!g_hash_table_lookup_extended (cache->device_trees, &key,
+				     NULL, (gpointer *)&tree))
     {
-      cache->last_device = device;
-      g_free (cache->last_device_tree);
-      cache->last_device_tree = get_tree_from_udev (cache, device);
+      tree = get_tree_from_udev (cache, device);
+      new_key = g_new (gint64, 1);
+      *new_key = key;
+      g_hash_table_insert (cache->device_trees, new_key, tree);
     }
 
-  return cache->last_device_tree;
+  return tree;
 #endif
   return NULL;
 }
@@ -2767,6 +4291,7 @@ typedef struct {
 static gboolean mountinfo_initialized = FALSE;
 static int mountinfo_fd = -1;
 static MountinfoEntry *mountinfo_roots = NULL;
+static guint mountinfo_generation = 0;
 G_LOCK_DEFINE_STATIC (mountinfo);
 
 /* We want to avoid mmap and stat as these are not ideal
@@ -2950,6 +4475,7 @@ update_mountinfo (void)
     }
 
   free_mountinfo ();
+  mountinfo_generation++;
   contents = read_contents (mountinfo_fd);
   lseek (mountinfo_fd, SEEK_SET, 0);
   if (contents)
@@ -2988,6 +4514,21 @@ find_mountinfo_root_for_mountpoint (const char *mountpoint)
   return res;
 }
 
+/* Changes whenever /proc/self/mountinfo changes. This only polls
+   the fd, the file is not re-read unless it changed. */
+static guint
+get_mountinfo_generation (void)
+{
+  guint generation;
+
+  G_LOCK (mountinfo);
+  update_mountinfo ();
+  generation = mountinfo_generation;
+  G_UNLOCK (mountinfo);
+
+  return generation;
+}
+
 #endif
 
 
@@ -3015,7 +4556,7 @@ get_devnum (const char *path)
  * file is symlink expanded and canonical
  */
 static const char *
-find_mountpoint_for (MetaLookupCache *cache,
+find_mountpoint_for (MetaLookupParent *parent,
 		     const char *file,
 		     dev_t       dev,
 		     char      **prefix_out)
@@ -3031,10 +4572,10 @@ find_mountpoint_for (MetaLookupCache *cache,
       return "/";
     }
 
-  g_assert (cache->last_parent_expanded != NULL);
-  g_assert (strcmp (cache->last_parent_expanded, first_dir) == 0);
+  g_assert (parent != NULL);
+  g_assert (strcmp (parent->expanded, first_dir) == 0);
 
-  if (cache->last_parent_mountpoint != NULL)
+  if (parent->mountpoint != NULL)
     goto out; /* Cache hit! */
 
   dir = g_strdup (first_dir);
@@ -3046,8 +4587,8 @@ find_mountpoint_for (MetaLookupCache *cache,
       if (dir == NULL || dev != dir_dev)
 	{
 	  g_free (dir);
-	  cache->last_parent_mountpoint = last;
-	  cache->last_parent_mountpoint_extra_prefix = get_extra_prefix_for_mount (last);
+	  parent->mountpoint = last;
+	  parent->mountpoint_extra_prefix = get_extra_prefix_for_mount (last);
 	  break;
 	}
 
@@ -3059,16 +4600,16 @@ find_mountpoint_for (MetaLookupCache *cache,
  out:
   g_free (first_dir);
 
-  prefix = file + strlen (cache->last_parent_mountpoint);
+  prefix = file + strlen (parent->mountpoint);
   if (*prefix == 0)
     prefix = "/";
 
-  if (cache->last_parent_mountpoint_extra_prefix)
-    *prefix_out = g_build_filename (cache->last_parent_mountpoint_extra_prefix, prefix, NULL);
+  if (parent->mountpoint_extra_prefix)
+    *prefix_out = g_build_filename (parent->mountpoint_extra_prefix, prefix, NULL);
   else
     *prefix_out = g_strdup (prefix);
 
-  return cache->last_parent_mountpoint;
+  return parent->mountpoint;
 }
 
 /* Resolves all symlinks, including the ones for basename.
@@ -3111,6 +4652,12 @@ meta_lookup_cache_new (void)
   MetaLookupCache *cache;
 
   cache = g_new0 (MetaLookupCache, 1);
+  g_mutex_init (&cache->lock);
+  cache->parents = g_hash_table_new_full (g_str_hash, g_str_equal,
+					  g_free,
+					  (GDestroyNotify)meta_lookup_parent_free);
+  cache->device_trees = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+					       g_free, g_free);
 
   return cache;
 }
@@ -3118,14 +4665,44 @@ meta_lookup_cache_new (void)
 void
 meta_lookup_cache_free (MetaLookupCache *cache)
 {
-  g_free (cache->last_parent);
-  g_free (cache->last_parent_expanded);
-  g_free (cache->last_parent_mountpoint);
-  g_free (cache->last_parent_mountpoint_extra_prefix);
-  g_free (cache->last_device_tree);
+  g_hash_table_destroy (cache->parents);
+  g_hash_table_destroy (cache->device_trees);
+  g_mutex_clear (&cache->lock);
   g_free (cache);
 }
 
+/* A cache shared by the whole process, which is never freed. Unlike
+   the ones from meta_lookup_cache_new() it stays valid between calls,
+   so the mountinfo parsing and symlink expansion of earlier lookups
+   is reused. */
+MetaLookupCache *
+meta_lookup_cache_get_default (void)
+{
+  static gsize cache = 0;
+
+  if (g_once_init_enter (&cache))
+    g_once_init_leave (&cache, (gsize)meta_lookup_cache_new ());
+
+  return (MetaLookupCache *)cache;
+}
+
+/* Drops everything that depends on the mounts if they changed */
+static void
+meta_lookup_cache_check_mounts (MetaLookupCache *cache)
+{
+#ifdef __linux__
+  guint generation;
+
+  generation = get_mountinfo_generation ();
+  if (generation != cache->mountinfo_generation)
+    {
+      cache->mountinfo_generation = generation;
+      g_hash_table_remove_all (cache->parents);
+      g_hash_table_remove_all (cache->device_trees);
+    }
+#endif
+}
+
 static gboolean
 path_has_prefix (const char *path,
 		 const char *prefix)
@@ -3152,44 +4729,96 @@ struct HomedirData {
   char *expanded_path;
 };
 
+static void
+meta_lookup_parent_stat (MetaLookupParent *parent_info,
+			 const char *parent)
+{
+  struct stat parent_stat, target_stat;
+
+  parent_info->stat_valid =
+    g_lstat (parent, &parent_stat) == 0 &&
+    g_stat (parent, &target_stat) == 0;
+  if (parent_info->stat_valid)
+    {
+      parent_info->stat_dev = parent_stat.st_dev;
+      parent_info->stat_ino = parent_stat.st_ino;
+      parent_info->stat_mtime = parent_stat.st_mtime;
+      parent_info->target_dev = target_stat.st_dev;
+      parent_info->target_ino = target_stat.st_ino;
+    }
+}
+
+/* Checks that parent still resolves to the same file as when
+   parent_info was created */
+static gboolean
+meta_lookup_parent_is_valid (MetaLookupParent *parent_info,
+			     const char *parent)
+{
+  struct stat parent_stat, target_stat;
+
+  if (!parent_info->stat_valid ||
+      g_lstat (parent, &parent_stat) != 0)
+    return FALSE;
+
+  if (parent_stat.st_dev != parent_info->stat_dev ||
+      parent_stat.st_ino != parent_info->stat_ino ||
+      parent_stat.st_mtime != parent_info->stat_mtime)
+    return FALSE;
+
+  /* Only symlinks can point somewhere else with the same lstat() */
+  if (!S_ISLNK (parent_stat.st_mode))
+    return TRUE;
+
+  return g_stat (parent, &target_stat) == 0 &&
+    target_stat.st_dev == parent_info->target_dev &&
+    target_stat.st_ino == parent_info->target_ino;
+}
+
 static char *
 expand_parents (MetaLookupCache *cache,
 		const char *path,
-		dev_t *parent_dev_out)
+		MetaLookupParent **parent_out)
 {
+  MetaLookupParent *parent_info;
   char *parent;
   char *basename, *res;
   char *path_copy;
-  dev_t parent_dev;
 
   path_copy = canonicalize_filename (path);
   parent = get_dirname (path_copy);
   if (parent == NULL)
     {
-      *parent_dev_out = 0;
+      *parent_out = NULL;
       return path_copy;
     }
 
-  if (cache->last_parent == NULL ||
-      strcmp (cache->last_parent, parent) != 0)
+  parent_info = g_hash_table_lookup (cache->parents, parent);
+  if (parent_info != NULL &&
+      !meta_lookup_parent_is_valid (parent_info, parent))
+    {
+      g_hash_table_remove (cache->parents, parent);
+      parent_info = NULL;
+    }
+
+  if (parent_info == NULL)
     {
-      g_free (cache->last_parent);
-      g_free (cache->last_parent_expanded);
-      cache->last_parent = parent;
-      cache->last_parent_expanded = expand_all_symlinks (parent, &parent_dev);
-      cache->last_parent_dev = parent_dev;
-      g_free (cache->last_parent_mountpoint);
-      cache->last_parent_mountpoint = NULL;
-      g_free (cache->last_parent_mountpoint_extra_prefix);
-      cache->last_parent_mountpoint_extra_prefix = NULL;
-   }
+      if (g_hash_table_size (cache->parents) >= MAX_CACHED_PARENTS)
+	g_hash_table_remove_all (cache->parents);
+
+      parent_info = g_new0 (MetaLookupParent, 1);
+      /* Stat before expanding, so that a change in between makes
+	 the entry invalid rather than stale */
+      meta_lookup_parent_stat (parent_info, parent);
+      parent_info->expanded = expand_all_symlinks (parent, &parent_info->dev);
+      g_hash_table_insert (cache->parents, parent, parent_info);
+    }
   else
     g_free (parent);
 
-  *parent_dev_out = cache->last_parent_dev;
+  *parent_out = parent_info;
   basename = g_path_get_basename (path_copy);
   g_free (path_copy);
-  res = g_build_filename (cache->last_parent_expanded, basename, NULL);
+  res = g_build_filename (parent_info->expanded, basename, NULL);
   g_free (basename);
 
   return res;
@@ -3209,8 +4838,8 @@ meta_lookup_cache_lookup_path (MetaLookupCache *cache,
   static struct HomedirData homedir_data_storage;
   static gsize homedir_datap = 0;
   struct HomedirData *homedir_data;
+  MetaLookupParent *parent;
   MetaTree *tree;
-  dev_t parent_dev;
 
   if (g_once_init_enter (&homedir_datap))
     {
@@ -3226,11 +4855,15 @@ meta_lookup_cache_lookup_path (MetaLookupCache *cache,
     }
   homedir_data = (struct HomedirData *)homedir_datap;
 
+  g_mutex_lock (&cache->lock);
+
+  meta_lookup_cache_check_mounts (cache);
+
   /* Canonicalized form with all symlinks expanded in parents */
-  expanded = expand_parents (cache, filename, &parent_dev);
+  expanded = expand_parents (cache, filename, &parent);
 
   if (device == 0) /* Unknown, use same as parent */
-    device = parent_dev;
+    device = parent ? parent->dev : 0;
 
   if (homedir_data->device == device &&
       path_has_prefix (expanded, homedir_data->expanded_path))
@@ -3248,7 +4881,7 @@ meta_lookup_cache_lookup_path (MetaLookupCache *cache,
 
   if (treename)
     {
-      mountpoint = find_mountpoint_for (cache,
+      mountpoint = find_mountpoint_for (parent,
 					expanded,
 					device,
 					&prefix);
@@ -3271,6 +4904,7 @@ meta_lookup_cache_lookup_path (MetaLookupCache *cache,
  found:
   g_free (expanded);
   tree = meta_tree_lookup_by_name (treename, for_write);
+  g_mutex_unlock (&cache->lock);
   if (tree)
     {
       *tree_path = prefix;
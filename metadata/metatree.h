@@ -26,6 +26,7 @@
 #include <glib.h>
 
 typedef struct _MetaTree MetaTree;
+typedef struct _MetaTreeBatch MetaTreeBatch;
 typedef struct _MetaLookupCache MetaLookupCache;
 
 typedef enum {
@@ -47,8 +48,15 @@ typedef gboolean (*meta_tree_keys_enumerate_callback) (const char *key,
 						       gpointer value,
 						       gpointer user_data);
 
-/* MetaLookupCache is not threadsafe */
+typedef gboolean (*meta_tree_dir_keys_enumerate_callback) (const char *entry,
+							   const char *key,
+							   MetaKeyType type,
+							   gpointer value,
+							   gpointer user_data);
+
+/* MetaLookupCache is threadsafe */
 MetaLookupCache *meta_lookup_cache_new         (void);
+MetaLookupCache *meta_lookup_cache_get_default (void);
 void             meta_lookup_cache_free        (MetaLookupCache *cache);
 MetaTree        *meta_lookup_cache_lookup_path (MetaLookupCache *cache,
 						const char *filename,
@@ -87,7 +95,22 @@ void        meta_tree_enumerate_keys   (MetaTree                         *tree,
 					const char                       *path,
 					meta_tree_keys_enumerate_callback callback,
 					gpointer                          user_data);
+void        meta_tree_enumerate_dir_keys (MetaTree                             *tree,
+					  const char                           *path,
+					  meta_tree_dir_keys_enumerate_callback callback,
+					  gpointer                              user_data);
 gboolean    meta_tree_flush            (MetaTree                         *tree);
+gboolean    meta_tree_compact          (MetaTree                         *tree,
+					char                            **remove_paths,
+					gsize                            *reclaimed);
+gboolean    meta_tree_get_journal_fill (MetaTree                         *tree,
+					gsize                            *used,
+					gsize                            *size);
+void        meta_tree_get_write_stats  (MetaTree                         *tree,
+					guint64                          *bytes_written,
+					guint                            *journal_grows);
+void        meta_tree_set_journal_size (gsize                             initial_size,
+					gsize                             max_size);
 gboolean    meta_tree_unset            (MetaTree                         *tree,
 					const char                       *path,
 					const char                       *key);
@@ -104,4 +127,29 @@ gboolean    meta_tree_remove           (MetaTree                         *tree,
 gboolean    meta_tree_copy             (MetaTree                         *tree,
 					const char                       *src,
 					const char                       *dest);
+
+/* A batch of changes applied with meta_tree_apply_batch() */
+MetaTreeBatch *meta_tree_batch_new         (void);
+void           meta_tree_batch_free        (MetaTreeBatch  *batch);
+void           meta_tree_batch_set_string  (MetaTreeBatch  *batch,
+					    const char     *path,
+					    const char     *key,
+					    const char     *value);
+void           meta_tree_batch_set_stringv (MetaTreeBatch  *batch,
+					    const char     *path,
+					    const char     *key,
+					    char          **value);
+void           meta_tree_batch_unset       (MetaTreeBatch  *batch,
+					    const char     *path,
+					    const char     *key);
+void           meta_tree_batch_remove      (MetaTreeBatch  *batch,
+					    const char     *path);
+void           meta_tree_batch_copy        (MetaTreeBatch  *batch,
+					    const char     *src,
+					    const char     *dest);
+void           meta_tree_batch_append      (MetaTreeBatch  *batch,
+					    MetaTreeBatch  *other);
+gsize          meta_tree_batch_get_size    (MetaTreeBatch  *batch);
+gboolean       meta_tree_apply_batch       (MetaTree       *tree,
+					    MetaTreeBatch  *batch);
 #endif /* __META_TREE_H__ */